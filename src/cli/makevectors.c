@@ -21,6 +21,30 @@ void enhash_vector(FILE *fp, uint8_t *input)
 	fwrite( "\r\n", 1, 2, fp );
 }
 
+// scrypt at EnScrypt's r and p, from libsodium's reference implementation
+void scrypt_vector(FILE *fp, uint8_t nFactor)
+{
+	uint8_t password[64], salt[64], output[32];
+	size_t password_len = 1 + randombytes_uniform( sizeof( password ));
+	size_t salt_len = 1 + randombytes_uniform( sizeof( salt ));
+	UT_string *buf;
+	utstring_new( buf );
+
+	randombytes_buf( password, password_len );
+	randombytes_buf( salt, salt_len );
+	crypto_pwhash_scryptsalsa208sha256_ll( password, password_len, salt, salt_len,
+		(uint64_t)1 << nFactor, ENSCRYPT_R, ENSCRYPT_P, output, sizeof( output ));
+	utstring_printf( buf, "%d ", nFactor );
+	sqrl_b64u_encode_append( buf, password, password_len );
+	utstring_printf( buf, " " );
+	sqrl_b64u_encode_append( buf, salt, salt_len );
+	utstring_printf( buf, " " );
+	sqrl_b64u_encode_append( buf, output, sizeof( output ));
+	fwrite( utstring_body(buf), 1, utstring_len(buf), fp );
+	fwrite( "\r\n", 1, 2, fp );
+	utstring_free( buf );
+}
+
 int main()
 {
 	sqrl_init();
@@ -54,4 +78,14 @@ int main()
 	}
 	fclose(fp);
 
-}
\ No newline at end of file
+	fp = fopen( "vectors/scrypt-vectors.txt", "wb" );
+	if( !fp ) {
+        printf( "Failed to open file: vectors/scrypt-vectors.txt\n" );
+		return -1;
+	}
+	for( i = 0; i < 36; i++ ) {
+		scrypt_vector( fp, 1 + i % 9 );
+	}
+	fclose(fp);
+
+}
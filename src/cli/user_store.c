@@ -0,0 +1,55 @@
+/** @file user_store.c
+
+@author Adam Comley
+
+This file is part of libsqrl.  It is released under the MIT license.
+For more details, see the LICENSE file included with this package.
+
+A stand-in user store for servers using sqrl_scb_user_remote().  Users
+are held in memory by sqrl_scb_user_default, and are lost on exit.
+
+ **/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include "../sqrl_internal.h"
+
+char help[] = "\
+     Usage: sqrl_user_store [address]\n\
+            sqrl_user_store -h\n\
+\n\
+Option            Description\n\
+----------------  -------------------------------------------------------\n\
+address           \"unix:/path/to/socket\" or \"host:port\".\n\
+                  Defaults to unix:/tmp/sqrl_user_store.sock\n\
+-h                Help.  Displays usage information.";
+
+static void onSignal( int sig )
+{
+	sqrl_server_store_stop();
+}
+
+int main( int argc, char *argv[] )
+{
+	char *address = "unix:/tmp/sqrl_user_store.sock";
+	if( argc > 1 ) {
+		if( 0 == strcmp( argv[1], "-h" )) {
+			printf( "%s\n", help );
+			exit(0);
+		}
+		address = argv[1];
+	}
+
+	sqrl_init();
+	signal( SIGINT, onSignal );
+	signal( SIGTERM, onSignal );
+	printf( "Serving users on %s\n", address );
+	fflush( stdout );
+	if( !sqrl_server_store_serve( address, NULL )) {
+		fprintf( stderr, "Unable to listen on %s\n", address );
+		exit(1);
+	}
+	return sqrl_stop();
+}
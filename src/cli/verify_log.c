@@ -0,0 +1,309 @@
+/** @file verify_log.c
+
+@author Adam Comley
+
+This file is part of libsqrl.  It is released under the MIT license.
+For more details, see the LICENSE file included with this package.
+
+Re-checks captured server traffic offline.  Each line of a log file
+describes one request:
+
+    <client ip> <timestamp> <query body>
+
+where the client ip is the 32 bit value passed to sqrl_server_handle_query(),
+and the timestamp is the server's sqrl_get_timestamp() when the request
+was received.  Lines starting with '#' are ignored.
+
+ **/
+
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "../sqrl_internal.h"
+
+#define VERIFY_BATCH_SIZE 256
+#define VERIFY_LINE_MAX 8192
+#define VERIFY_MAX_THREADS 256
+
+typedef enum {
+	VERDICT_OK = 0,
+	VERDICT_MALFORMED,
+	VERDICT_BAD_MAC,
+	VERDICT_STALE_NUT,
+	VERDICT_BAD_CLIENT,
+	VERDICT_BAD_SIGNATURE,
+	VERDICT_COUNT
+} Verdict;
+
+static const char *verdict_strings[VERDICT_COUNT] = {
+	"ok", "malformed", "bad-mac", "stale-nut", "bad-client", "bad-signature"
+};
+
+typedef struct Log_Line {
+	int file;
+	unsigned long line;
+	char text[VERIFY_LINE_MAX];
+} Log_Line;
+
+static Sqrl_Server *server = NULL;
+static char **files = NULL;
+static int file_count = 0;
+
+// Shared reader state, protected by reader_mutex
+static SqrlMutex reader_mutex;
+static int current_file = -1;
+static FILE *current_fp = NULL;
+static unsigned long current_line = 0;
+
+static SqrlMutex output_mutex;
+static uint32_t counts[VERDICT_COUNT];
+static uint32_t ip_mismatches = 0;
+static bool failuresOnly = false;
+
+char help[] = "\
+     Usage: sqrl_verify_log -u uri -p passcode [-P previous [-r rotated]] [-n nut_life]\n\
+                            [-t threads] [-q] file...\n\
+            sqrl_verify_log -h\n\
+\n\
+Option            Description\n\
+----------------  -------------------------------------------------------\n\
+-u uri            The SQRL URI the server was created with.\n\
+-p passcode       The server passcode in effect when the log was captured.\n\
+-P previous       The passcode in effect before the last rekey, if the log\n\
+                  spans a rotation.\n\
+-r rotated        Timestamp of the rekey.  The previous key is accepted for\n\
+                  one nut lifetime after it (default: always accepted).\n\
+-n nut_life       Nut lifetime in seconds (default 600).\n\
+-t threads        Worker threads (default: one per core).\n\
+-q                Quiet.  Only report requests that fail verification.\n\
+-h                Help.  Displays usage information.\n\
+file              Log files, one request per line:\n\
+                  <client ip> <timestamp> <query body>\n\
+                  Use - to read from stdin.";
+
+// Fills batch with up to VERIFY_BATCH_SIZE lines.  Returns the number read.
+static int read_batch( Log_Line *batch )
+{
+	int count = 0;
+	sqrl_mutex_enter( reader_mutex );
+	while( count < VERIFY_BATCH_SIZE ) {
+		if( !current_fp ) {
+			if( ++current_file >= file_count ) break;
+			current_line = 0;
+			if( 0 == strcmp( files[current_file], "-" )) {
+				current_fp = stdin;
+			} else {
+				current_fp = fopen( files[current_file], "r" );
+			}
+			if( !current_fp ) {
+				fprintf( stderr, "Unable to open %s\n", files[current_file] );
+			}
+			continue;
+		}
+		if( !fgets( batch[count].text, VERIFY_LINE_MAX, current_fp )) {
+			if( current_fp != stdin ) fclose( current_fp );
+			current_fp = NULL;
+			continue;
+		}
+		current_line++;
+		if( batch[count].text[0] == '#' || batch[count].text[0] == '\n' ) continue;
+		batch[count].file = current_file;
+		batch[count].line = current_line;
+		count++;
+	}
+	sqrl_mutex_leave( reader_mutex );
+	return count;
+}
+
+static Verdict verify_line( char *text, bool *ip_match )
+{
+	char *query, *end;
+	uint32_t ip;
+	uint64_t timestamp;
+
+	*ip_match = false;
+	ip = (uint32_t)strtoul( text, &end, 10 );
+	if( end == text ) return VERDICT_MALFORMED;
+	query = end;
+	timestamp = strtoull( query, &end, 10 );
+	if( end == query || timestamp == 0 ) return VERDICT_MALFORMED;
+	query = end + strspn( end, " \t" );
+	size_t query_len = strcspn( query, "\r\n" );
+	if( query_len == 0 ) return VERDICT_MALFORMED;
+
+	Sqrl_Server_Context *context = sqrl_server_context_create( server );
+	if( !context ) return VERDICT_MALFORMED;
+	context->timestamp = timestamp;
+	sqrl_server_parse_query( context, ip, query, query_len );
+
+	Verdict retVal;
+	if( FLAG_CHECK( context->flags, SQRL_SERVER_CONTEXT_FLAG_VALID_QUERY )) {
+		retVal = VERDICT_OK;
+	} else if( !FLAG_CHECK( context->flags, SQRL_SERVER_CONTEXT_FLAG_VALID_SERVER_STRING )) {
+		if( !context->tif ) {
+			retVal = VERDICT_MALFORMED;
+		} else if( FLAG_CHECK( context->tif, SQRL_TIF_TRANSIENT_ERROR )) {
+			retVal = VERDICT_STALE_NUT;
+		} else {
+			retVal = VERDICT_BAD_MAC;
+		}
+	} else if( !FLAG_CHECK( context->flags, SQRL_SERVER_CONTEXT_FLAG_VALID_CLIENT_STRING )) {
+		retVal = VERDICT_BAD_CLIENT;
+	} else {
+		retVal = VERDICT_BAD_SIGNATURE;
+	}
+	*ip_match = FLAG_CHECK( context->tif, SQRL_TIF_IP_MATCH );
+	sqrl_server_context_destroy( context );
+	return retVal;
+}
+
+static SQRL_THREAD_FUNCTION_RETURN_TYPE verify_thread( SQRL_THREAD_FUNCTION_INPUT_TYPE input )
+{
+	Log_Line *batch = malloc( VERIFY_BATCH_SIZE * sizeof( Log_Line ));
+	UT_string *out;
+	utstring_new( out );
+	int i, count;
+	bool ip_match;
+	Verdict v;
+
+	while( (count = read_batch( batch )) > 0 ) {
+		utstring_clear( out );
+		for( i = 0; i < count; i++ ) {
+			v = verify_line( batch[i].text, &ip_match );
+			SQRL_ATOMIC_INC( &counts[v] );
+			if( v == VERDICT_OK && !ip_match ) {
+				SQRL_ATOMIC_INC( &ip_mismatches );
+			}
+			if( failuresOnly && v == VERDICT_OK ) continue;
+			utstring_printf( out, "%s:%lu %s%s\n",
+				files[batch[i].file], batch[i].line,
+				verdict_strings[v],
+				(v == VERDICT_OK && !ip_match) ? " ip-mismatch" : "" );
+		}
+		if( utstring_len( out )) {
+			sqrl_mutex_enter( output_mutex );
+			fwrite( utstring_body( out ), 1, utstring_len( out ), stdout );
+			sqrl_mutex_leave( output_mutex );
+		}
+	}
+	utstring_free( out );
+	free( batch );
+#ifdef UNIX
+	return NULL;
+#else
+	return 0;
+#endif
+}
+
+int main( int argc, char *argv[] )
+{
+	char *uri = NULL;
+	char *passcode = NULL;
+	char *previous = NULL;
+	uint64_t rotated = 0;
+	int nut_life = 600;
+	int thread_count = 0;
+	bool showHelp = false;
+	int i;
+
+	files = calloc( argc, sizeof( char* ));
+	for( i = 1; i < argc; i++ ) {
+		if( argv[i][0] == '-' && argv[i][1] && !argv[i][2] ) {
+			switch( argv[i][1] ) {
+			case 'h':
+				showHelp = true;
+				continue;
+			case 'q':
+				failuresOnly = true;
+				continue;
+			}
+			if( i + 1 < argc ) {
+				switch( argv[i][1] ) {
+				case 'u':
+					uri = argv[++i];
+					continue;
+				case 'p':
+					passcode = argv[++i];
+					continue;
+				case 'P':
+					previous = argv[++i];
+					continue;
+				case 'r':
+					rotated = strtoull( argv[++i], NULL, 10 );
+					continue;
+				case 'n':
+					nut_life = atoi( argv[++i] );
+					continue;
+				case 't':
+					thread_count = atoi( argv[++i] );
+					continue;
+				}
+			}
+		}
+		files[file_count++] = argv[i];
+	}
+
+	if( showHelp || !uri || !passcode || file_count == 0 ) {
+		printf( "%s\n", help );
+		exit( showHelp ? 0 : 1 );
+	}
+
+	sqrl_init();
+	server = sqrl_server_create( uri, passcode, strlen( passcode ), NULL, NULL, nut_life );
+	if( !server ) {
+		fprintf( stderr, "Invalid SQRL URI: %s\n", uri );
+		exit(1);
+	}
+	if( previous ) {
+		// Check the previous key against each entry's own timestamp, so
+		// that old logs verify the same way every time they are replayed.
+		uint64_t expires = rotated ? rotated + (uint64_t)nut_life * 1000000 : UINT64_MAX;
+		sqrl_server_set_previous_key( server, previous, strlen( previous ), expires );
+	}
+
+	if( thread_count <= 0 ) thread_count = sqrl_cpu_count();
+	if( thread_count > VERIFY_MAX_THREADS ) thread_count = VERIFY_MAX_THREADS;
+	reader_mutex = sqrl_mutex_create();
+	output_mutex = sqrl_mutex_create();
+
+	double startTime = sqrl_get_real_time();
+	SqrlThread threads[VERIFY_MAX_THREADS];
+	int started = 0;
+	for( i = 0; i < thread_count; i++ ) {
+		threads[started] = sqrl_thread_create( verify_thread, NULL );
+		if( threads[started] ) started++;
+	}
+	if( started == 0 ) {
+		// No workers; verify on this thread instead
+		verify_thread( NULL );
+	}
+	for( i = 0; i < started; i++ ) {
+		sqrl_thread_join( threads[i] );
+	}
+	thread_count = started ? started : 1;
+	double elapsed = sqrl_get_real_time() - startTime;
+	fflush( stdout );
+
+	uint32_t total = 0;
+	for( i = 0; i < VERDICT_COUNT; i++ ) total += counts[i];
+	fprintf( stderr, "\n%10s: %u\n", "requests", total );
+	for( i = 0; i < VERDICT_COUNT; i++ ) {
+		fprintf( stderr, "%10s: %u\n", verdict_strings[i], counts[i] );
+	}
+	fprintf( stderr, "%10s: %u\n", "ip-mismatch", ip_mismatches );
+	fprintf( stderr, "%10s: %.2fs (%.0f/s, %d threads)\n", "elapsed",
+		elapsed, elapsed > 0 ? total / elapsed : 0.0, thread_count );
+
+	sqrl_mutex_destroy( reader_mutex );
+	sqrl_mutex_destroy( output_mutex );
+	sqrl_server_destroy( server );
+	free( files );
+	sqrl_stop();
+	return total == counts[VERDICT_OK] ? 0 : 2;
+}
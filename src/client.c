@@ -53,7 +53,7 @@ void sqrl_client_set_callbacks( Sqrl_Client_Callbacks *callbacks )
 Sqrl_User sqrl_client_call_select_user( Sqrl_Transaction t )
 {
 	if( SQRL_CLIENT_CALLBACKS && SQRL_CLIENT_CALLBACKS->onSelectUser ) {
-		Sqrl_User user = (SQRL_CLIENT_CALLBACKS->onSelectUser)( t );
+		Sqrl_User user = (SQRL_CLIENT_CALLBACKS->onSelectUser)( sqrl_transaction_handle( t ));
 		if( user ) {
 			sqrl_transaction_set_user( t, user );
     		return user;
@@ -82,6 +82,28 @@ void sqrl_client_transaction_set_alternate_identity(
 	}
 }
 
+/**
+Cancels a \p Sqrl_Transaction that is running on another thread.  Its
+EnScrypt stops at the next progress report, no more credentials are asked
+for, and it finishes with \p SQRL_TRANSACTION_STATUS_CANCELLED.
+
+@param t The \p Sqrl_Transaction
+*/
+DLL_PUBLIC
+void sqrl_client_transaction_cancel( Sqrl_Transaction t )
+{
+	SQRL_CAST_TRANSACTION(transaction,t);
+	if( transaction ) {
+		SQRL_ATOMIC_STORE( &transaction->cancelled, 1 );
+	}
+}
+
+bool sqrl_client_transaction_cancelled( Sqrl_Transaction t )
+{
+	SQRL_CAST_TRANSACTION(transaction,t);
+	return transaction && SQRL_ATOMIC_LOAD( &transaction->cancelled );
+}
+
 void sqrl_client_call_select_alternate_identity( Sqrl_Transaction t )
 {
 	WITH_TRANSACTION(transaction,t);
@@ -91,7 +113,7 @@ void sqrl_client_call_select_alternate_identity( Sqrl_Transaction t )
 		transaction->altIdentity = NULL;
 	}
 	if( SQRL_CLIENT_CALLBACKS && SQRL_CLIENT_CALLBACKS->onSelectAlternateIdentity ) {
-		(SQRL_CLIENT_CALLBACKS->onSelectAlternateIdentity)( t );
+		(SQRL_CLIENT_CALLBACKS->onSelectAlternateIdentity)( sqrl_transaction_handle( t ));
 	}
 	END_WITH_TRANSACTION(transaction);
 }
@@ -99,8 +121,9 @@ void sqrl_client_call_select_alternate_identity( Sqrl_Transaction t )
 bool sqrl_client_call_authentication_required( Sqrl_Transaction t, Sqrl_Credential_Type credentialType )
 {
 	bool retVal = false;
+	if( sqrl_client_transaction_cancelled( t )) return false;
 	if( SQRL_CLIENT_CALLBACKS && SQRL_CLIENT_CALLBACKS->onAuthenticationRequired ) {
-		retVal = (SQRL_CLIENT_CALLBACKS->onAuthenticationRequired)( t, credentialType );
+		retVal = (SQRL_CLIENT_CALLBACKS->onAuthenticationRequired)( sqrl_transaction_handle( t ), credentialType );
 	}
 	return retVal;
 }
@@ -112,7 +135,7 @@ void sqrl_client_call_ask(
 	const char *secondButton, size_t secondButton_len )
 {
 	if( SQRL_CLIENT_CALLBACKS && SQRL_CLIENT_CALLBACKS->onAsk ) {
-		(SQRL_CLIENT_CALLBACKS->onAsk)( t, message, message_len,
+		(SQRL_CLIENT_CALLBACKS->onAsk)( sqrl_transaction_handle( t ), message, message_len,
 			firstButton, firstButton_len, secondButton, secondButton_len );
 	}
 }
@@ -123,7 +146,7 @@ void sqrl_client_call_send(
 	const char *payload, size_t payload_len )
 {
 	if( SQRL_CLIENT_CALLBACKS && SQRL_CLIENT_CALLBACKS->onSend ) {
-		(SQRL_CLIENT_CALLBACKS->onSend)( t, url, url_len, payload, payload_len );
+		(SQRL_CLIENT_CALLBACKS->onSend)( sqrl_transaction_handle( t ), url, url_len, payload, payload_len );
 	}
 }
 
@@ -132,8 +155,9 @@ int sqrl_client_call_progress(
 	int progress )
 {
 	int retVal = 1;
+	if( sqrl_client_transaction_cancelled( t )) return 0;
 	if( SQRL_CLIENT_CALLBACKS && SQRL_CLIENT_CALLBACKS->onProgress ) {
-		retVal = (SQRL_CLIENT_CALLBACKS->onProgress)( t, progress );
+		retVal = (SQRL_CLIENT_CALLBACKS->onProgress)( sqrl_transaction_handle( t ), progress );
 	}
 	return retVal;
 
@@ -151,7 +175,7 @@ void sqrl_client_call_transaction_complete(
 	Sqrl_Transaction t )
 {
 	if( SQRL_CLIENT_CALLBACKS && SQRL_CLIENT_CALLBACKS->onTransactionComplete ) {
-		(SQRL_CLIENT_CALLBACKS->onTransactionComplete)(t);
+		(SQRL_CLIENT_CALLBACKS->onTransactionComplete)( sqrl_transaction_handle( t ));
 	}
 }
 
@@ -197,8 +221,13 @@ void sqrl_client_authenticate(
 		break;
 	case SQRL_CREDENTIAL_NEW_PASSWORD:
 		if( transaction->type == SQRL_TRANSACTION_IDENTITY_CHANGE_PASSWORD ) {
-			sqrl_user_set_password( transaction->user, credential, credentialLength );
-			sqrl_client_call_save_suggested( transaction->user );
+			if( sqrl_user_set_password( transaction->user, credential, credentialLength ) &&
+				sqrl_cpu_count() > 1 ) {
+				// Start the new password's EnScrypt for the next save
+				sqrl_user_kdf_start( transaction->user, SQRL_BLOCK_USER,
+					user->keys->password, user->keys->password_len,
+					user->options.enscryptSeconds * SQRL_MILLIS_PER_SECOND );
+			}
 		}
 		break;
 	}
@@ -239,6 +268,59 @@ DONE:
 	return retVal;
 }
 
+/*
+Changing the password decrypts block 1 with the old password, and the
+next save encrypts it with the new one.  The new password's EnScrypt
+doesn't depend on the old one's, so with more than one CPU both passwords
+are asked for first, and the new one's EnScrypt (started when it is
+entered) runs while the old one decrypts.  On a single CPU the order is
+unchanged: the new password's chain is timed, and sharing the CPU would
+cost it iterations.
+*/
+static bool sqrl_client_change_password( struct Sqrl_Transaction *transaction )
+{
+	bool retVal = false;
+	SQRL_CAST_USER(user,transaction->user);
+	uint8_t *oldPassword = NULL, *newPassword;
+	size_t oldLen, newLen;
+	bool t1Changed;
+
+	if( sqrl_cpu_count() < 2 || sqrl_user_is_hintlocked( transaction->user ) ||
+		sqrl_user_has_key( transaction->user, KEY_MK )) {
+		retVal = sqrl_user_force_decrypt( transaction ) &&
+			sqrl_client_require_new_password( transaction );
+		goto DONE;
+	}
+	if( !sqrl_client_require_password( transaction )) {
+		goto DONE;
+	}
+	// Both passwords, so the old one can be put back for the decrypt
+	oldPassword = sqrl_scratch_push( 2 * KEY_PASSWORD_MAX_LEN );
+	if( !oldPassword ) goto DONE;
+	newPassword = oldPassword + KEY_PASSWORD_MAX_LEN;
+	oldLen = user->keys->password_len;
+	t1Changed = (user->flags & USER_FLAG_T1_CHANGED) == USER_FLAG_T1_CHANGED;
+	memcpy( oldPassword, user->keys->password, oldLen );
+	if( sqrl_client_require_new_password( transaction )) {
+		newLen = user->keys->password_len;
+		memcpy( newPassword, user->keys->password, newLen );
+		sqrl_user_set_password( transaction->user, (char*)oldPassword, oldLen );
+		if( sqrl_user_force_decrypt( transaction )) {
+			sqrl_user_set_password( transaction->user, (char*)newPassword, newLen );
+			retVal = true;
+		} else {
+			sqrl_user_kdf_discard( transaction->user, SQRL_BLOCK_USER );
+			if( !t1Changed ) BIT_UNSET( user->flags, USER_FLAG_T1_CHANGED );
+		}
+	}
+	sqrl_scratch_pop( oldPassword );
+
+DONE:
+	// Only once the old password has unlocked the identity
+	if( retVal ) sqrl_client_call_save_suggested( transaction->user );
+	return retVal;
+}
+
 bool sqrl_client_require_password( Sqrl_Transaction t )
 {
 	bool retVal = true;
@@ -303,6 +385,7 @@ Sqrl_Transaction_Status sqrl_client_export_user(
 	Sqrl_Transaction_Status status = SQRL_TRANSACTION_STATUS_WORKING;
 	Sqrl_Transaction t = sqrl_transaction_create( SQRL_TRANSACTION_IDENTITY_SAVE );
 	SQRL_CAST_TRANSACTION(transaction,t);
+	if( !transaction ) return SQRL_TRANSACTION_STATUS_FAILED;
 	sqrl_transaction_set_user( t, user );
 	transaction->status = status;
 	transaction->exportType = exportType;
@@ -366,11 +449,33 @@ Sqrl_Transaction_Status sqrl_client_transact (
 	size_t string_len,
 	void *tag )
 {
-	Sqrl_Transaction_Status retVal = SQRL_TRANSACTION_STATUS_WORKING;
-	Sqrl_User tmpUser;
 	Sqrl_Transaction t = sqrl_transaction_create( type );
 	SQRL_CAST_TRANSACTION(transaction,t);
+	if( !transaction ) return SQRL_TRANSACTION_STATUS_FAILED;
 	transaction->tag = tag;
+	return sqrl_client_run_transaction( t, user, string, string_len );
+}
+
+/**
+Runs a transaction made by \p sqrl_client_transact() or a
+\p Sqrl_Client_Executor, and releases it.
+
+@param t A new \p Sqrl_Transaction
+@param user A \p Sqrl_User, or NULL
+@param string A uri or an imported identity, or NULL
+@param string_len Length of \p string
+@return \p Sqrl_Transaction_Status
+*/
+Sqrl_Transaction_Status sqrl_client_run_transaction(
+	Sqrl_Transaction t,
+	Sqrl_User user,
+	const char *string,
+	size_t string_len )
+{
+	Sqrl_Transaction_Status retVal = SQRL_TRANSACTION_STATUS_WORKING;
+	Sqrl_User tmpUser;
+	SQRL_CAST_TRANSACTION(transaction,t);
+	Sqrl_Transaction_Type type = transaction->type;
 	transaction->status = retVal;
 
 	if( string ) {
@@ -424,12 +529,12 @@ Sqrl_Transaction_Status sqrl_client_transact (
 		if( transaction->user ) goto ERROR;
 		if( transaction->uri ) {
 			if( transaction->uri->scheme != SQRL_SCHEME_FILE ) goto ERROR;
-			transaction->user = sqrl_user_create_from_file( transaction->uri->challenge );
+			sqrl_transaction_swap_user( transaction, sqrl_user_create_from_file( transaction->uri->challenge ));
 			if( transaction->user ) {
 				goto SUCCESS;
 			}
 		} else {
-			transaction->user = sqrl_user_create_from_buffer( string, string_len );
+			sqrl_transaction_swap_user( transaction, sqrl_user_create_from_buffer( string, string_len ));
 			if( transaction->user ) {
 				goto SUCCESS;
 			}
@@ -447,10 +552,8 @@ Sqrl_Transaction_Status sqrl_client_transact (
 		goto ERROR;
 	case SQRL_TRANSACTION_IDENTITY_CHANGE_PASSWORD:
 		if( !transaction->user ) goto ERROR;
-		if( sqrl_user_force_decrypt( transaction )) {
-			if( sqrl_client_require_new_password( transaction )) {
-				goto SUCCESS;
-			}
+		if( sqrl_client_change_password( transaction )) {
+			goto SUCCESS;
 		}
 		goto ERROR;
 	default:
@@ -467,9 +570,13 @@ ERROR:
 	goto DONE;
 
 DONE:
+	if( retVal != SQRL_TRANSACTION_STATUS_SUCCESS && SQRL_ATOMIC_LOAD( &transaction->cancelled )) {
+		retVal = SQRL_TRANSACTION_STATUS_CANCELLED;
+	}
 	transaction->status = retVal;
 	sqrl_client_call_transaction_complete( t );
 
+	sqrl_client_site_release( transaction );
 	sqrl_transaction_release( t );
 	sqrl_client_site_maintenance( false );
 
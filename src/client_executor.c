@@ -0,0 +1,406 @@
+/** @file client_executor.c
+
+@author Adam Comley
+
+This file is part of libsqrl.  It is released under the MIT license.
+For more details, see the LICENSE file included with this package.
+
+Runs client transactions on a pool of worker threads, so the long EnScrypt
+steps of unlocking, saving and rescuing never block the caller.
+
+Transactions for the same user run one at a time, in the order they were
+submitted; transactions for different users (or for no user yet) run side
+by side.  Each submission returns a \p Sqrl_Client_Job, which can be
+waited on, polled, or cancelled, and which reports through an optional
+completion callback.  The usual \p Sqrl_Client_Callbacks are called on the
+worker running the transaction.
+*/
+
+#include "sqrl_internal.h"
+
+#define JOB_QUEUED 0
+#define JOB_RUNNING 1
+#define JOB_DONE 2
+
+struct Sqrl_Client_Job {
+	Sqrl_Client_Executor *executor;
+	Sqrl_Transaction_Type type;
+	Sqrl_User user;
+	char *string;
+	size_t string_len;
+	void *tag;
+	sqrl_ccb_job_complete *onComplete;
+	void *data;
+	Sqrl_Transaction transaction;
+	Sqrl_Transaction_Status status;
+	int state;
+	bool cancelled;
+	int referenceCount;
+	struct Sqrl_Client_Job *next;
+};
+
+struct Sqrl_Client_Executor {
+	int workerCount;
+	SqrlThread *workers;
+	SqrlMutex mutex;
+	SqrlCondition ready;	// A job was queued, or a user became free
+	SqrlCondition done;		// A job finished
+	bool stopping;
+	int referenceCount;		// The owner's, plus one per unreleased job
+	struct Sqrl_Client_Job *head;
+	struct Sqrl_Client_Job *tail;
+	struct Sqrl_Client_Job *running;
+};
+
+static void sqrl_executor_release( Sqrl_Client_Executor *executor )
+{
+	if( SQRL_ATOMIC_DEC( &executor->referenceCount ) > 0 ) return;
+	sqrl_cond_destroy( executor->done );
+	sqrl_cond_destroy( executor->ready );
+	sqrl_mutex_destroy( executor->mutex );
+	free( executor->mutex );
+	free( executor );
+}
+
+static bool sqrl_executor_user_busy( Sqrl_Client_Executor *executor, Sqrl_User user )
+{
+	struct Sqrl_Client_Job *job;
+	for( job = executor->running; job; job = job->next ) {
+		if( job->user == user ) return true;
+	}
+	return false;
+}
+
+// Takes the oldest queued job whose user isn't busy.  Holds the mutex.
+static struct Sqrl_Client_Job *sqrl_executor_take( Sqrl_Client_Executor *executor )
+{
+	struct Sqrl_Client_Job *job, *prev = NULL;
+	for( job = executor->head; job; prev = job, job = job->next ) {
+		if( job->user && sqrl_executor_user_busy( executor, job->user )) continue;
+		if( prev ) prev->next = job->next;
+		else executor->head = job->next;
+		if( executor->tail == job ) executor->tail = prev;
+		job->next = executor->running;
+		executor->running = job;
+		job->state = JOB_RUNNING;
+		return job;
+	}
+	return NULL;
+}
+
+// Takes a job off the running list.  Holds the mutex.
+static void sqrl_executor_unlink_running( Sqrl_Client_Executor *executor, struct Sqrl_Client_Job *job )
+{
+	struct Sqrl_Client_Job **pp;
+	for( pp = &executor->running; *pp; pp = &(*pp)->next ) {
+		if( *pp == job ) {
+			*pp = job->next;
+			break;
+		}
+	}
+	job->next = NULL;
+}
+
+// Takes a job off the queue.  Holds the mutex.
+static bool sqrl_executor_unlink_queued( Sqrl_Client_Executor *executor, struct Sqrl_Client_Job *job )
+{
+	struct Sqrl_Client_Job *it, *prev = NULL;
+	for( it = executor->head; it; prev = it, it = it->next ) {
+		if( it != job ) continue;
+		if( prev ) prev->next = job->next;
+		else executor->head = job->next;
+		if( executor->tail == job ) executor->tail = prev;
+		job->next = NULL;
+		return true;
+	}
+	return false;
+}
+
+// Reports a finished job, and drops the executor's reference to it.
+static void sqrl_executor_finish( Sqrl_Client_Executor *executor, struct Sqrl_Client_Job *job, Sqrl_Transaction_Status status )
+{
+	sqrl_mutex_enter( executor->mutex );
+	job->status = status;
+	job->state = JOB_DONE;
+	sqrl_cond_broadcast( executor->done );
+	sqrl_mutex_leave( executor->mutex );
+	if( job->onComplete ) {
+		(job->onComplete)( job, status, job->data );
+	}
+	sqrl_client_job_release( job );
+}
+
+static SQRL_THREAD_FUNCTION_RETURN_TYPE sqrl_executor_worker( SQRL_THREAD_FUNCTION_INPUT_TYPE input )
+{
+	Sqrl_Client_Executor *executor = (Sqrl_Client_Executor*)input;
+	struct Sqrl_Client_Job *job;
+	Sqrl_Transaction t;
+	Sqrl_Transaction_Status status;
+	bool cancelled;
+
+	sqrl_mutex_enter( executor->mutex );
+	for( ;; ) {
+		job = NULL;
+		while( !executor->stopping && !(job = sqrl_executor_take( executor ))) {
+			sqrl_cond_wait( executor->ready, executor->mutex );
+		}
+		if( !job ) break;
+		sqrl_mutex_leave( executor->mutex );
+
+		t = sqrl_transaction_create( job->type );
+		SQRL_CAST_TRANSACTION(transaction,t);
+		if( transaction ) transaction->tag = job->tag;
+		sqrl_mutex_enter( executor->mutex );
+		job->transaction = t;
+		cancelled = job->cancelled;
+		sqrl_mutex_leave( executor->mutex );
+
+		if( !transaction ) {
+			status = SQRL_TRANSACTION_STATUS_FAILED;
+		} else if( cancelled ) {
+			sqrl_transaction_release( t );
+			status = SQRL_TRANSACTION_STATUS_CANCELLED;
+		} else {
+			status = sqrl_client_run_transaction( t, job->user, job->string, job->string_len );
+		}
+
+		sqrl_mutex_enter( executor->mutex );
+		sqrl_executor_unlink_running( executor, job );
+		job->transaction = NULL;
+		// The job's user may be free for the next of its jobs
+		sqrl_cond_broadcast( executor->ready );
+		sqrl_mutex_leave( executor->mutex );
+		sqrl_executor_finish( executor, job, status );
+		sqrl_mutex_enter( executor->mutex );
+	}
+	sqrl_mutex_leave( executor->mutex );
+	SQRL_THREAD_LEAVE;
+}
+
+/**
+Creates a \p Sqrl_Client_Executor, which runs transactions on its own
+worker threads.
+
+@param workers Number of worker threads, or 0 for one per CPU
+@return A new \p Sqrl_Client_Executor, or NULL if no worker could be started
+*/
+DLL_PUBLIC
+Sqrl_Client_Executor *sqrl_client_executor_create( int workers )
+{
+	if( workers < 1 ) workers = sqrl_cpu_count();
+	Sqrl_Client_Executor *executor = calloc( 1, sizeof( Sqrl_Client_Executor ));
+	if( !executor ) return NULL;
+	executor->workers = calloc( workers, sizeof( SqrlThread ));
+	if( !executor->workers ) {
+		free( executor );
+		return NULL;
+	}
+	executor->referenceCount = 1;
+	executor->mutex = sqrl_mutex_create();
+	executor->ready = sqrl_cond_create();
+	executor->done = sqrl_cond_create();
+	int i;
+	SqrlThread thread;
+	// Only workers that started are kept, and later joined
+	for( i = 0; i < workers; i++ ) {
+		thread = sqrl_thread_create( sqrl_executor_worker, executor );
+		if( thread ) executor->workers[executor->workerCount++] = thread;
+	}
+	if( executor->workerCount == 0 ) {
+		return sqrl_client_executor_destroy( executor );
+	}
+	return executor;
+}
+
+/**
+Stops a \p Sqrl_Client_Executor.  Jobs still queued are cancelled; running
+jobs are allowed to finish.  Jobs not yet released stay valid.
+
+@param executor The \p Sqrl_Client_Executor
+@return NULL
+*/
+DLL_PUBLIC
+Sqrl_Client_Executor *sqrl_client_executor_destroy( Sqrl_Client_Executor *executor )
+{
+	if( !executor ) return NULL;
+	struct Sqrl_Client_Job *queued, *job;
+	int i;
+	sqrl_mutex_enter( executor->mutex );
+	executor->stopping = true;
+	queued = executor->head;
+	executor->head = executor->tail = NULL;
+	sqrl_cond_broadcast( executor->ready );
+	sqrl_mutex_leave( executor->mutex );
+	while( queued ) {
+		job = queued;
+		queued = job->next;
+		job->next = NULL;
+		sqrl_executor_finish( executor, job, SQRL_TRANSACTION_STATUS_CANCELLED );
+	}
+	for( i = 0; i < executor->workerCount; i++ ) {
+		sqrl_thread_join( executor->workers[i] );
+	}
+	free( executor->workers );
+	executor->workers = NULL;
+	sqrl_executor_release( executor );
+	return NULL;
+}
+
+/**
+Queues a transaction, as \p sqrl_client_transact() would run it, and
+returns at once.
+
+@param executor The \p Sqrl_Client_Executor
+@param type \p Sqrl_Transaction_Type of transaction
+@param user A \p Sqrl_User, or NULL
+@param string A uri or an imported identity, or NULL.  It is copied.
+@param string_len Length of \p string
+@param tag Pointer to Tag
+@param onComplete Optional; called when the job finishes or is cancelled
+@param data Passed to \p onComplete
+@return The \p Sqrl_Client_Job, to be released with \p sqrl_client_job_release(); or NULL
+*/
+DLL_PUBLIC
+Sqrl_Client_Job *sqrl_client_submit(
+	Sqrl_Client_Executor *executor,
+	Sqrl_Transaction_Type type,
+	Sqrl_User user,
+	const char *string,
+	size_t string_len,
+	void *tag,
+	sqrl_ccb_job_complete *onComplete,
+	void *data )
+{
+	if( !executor ) return NULL;
+	struct Sqrl_Client_Job *job = calloc( 1, sizeof( struct Sqrl_Client_Job ));
+	if( !job ) return NULL;
+	if( string ) {
+		job->string = malloc( string_len + 1 );
+		if( !job->string ) {
+			free( job );
+			return NULL;
+		}
+		memcpy( job->string, string, string_len );
+		job->string[string_len] = 0;
+		job->string_len = string_len;
+	}
+	job->executor = executor;
+	job->type = type;
+	job->user = sqrl_user_hold( user );
+	job->tag = tag;
+	job->onComplete = onComplete;
+	job->data = data;
+	job->status = SQRL_TRANSACTION_STATUS_WORKING;
+	// The caller's, and the executor's until the job is done
+	job->referenceCount = 2;
+
+	sqrl_mutex_enter( executor->mutex );
+	if( executor->stopping ) {
+		sqrl_mutex_leave( executor->mutex );
+		sqrl_user_release( job->user );
+		if( job->string ) free( job->string );
+		free( job );
+		return NULL;
+	}
+	SQRL_ATOMIC_INC( &executor->referenceCount );
+	if( executor->tail ) executor->tail->next = job;
+	else executor->head = job;
+	executor->tail = job;
+	sqrl_cond_signal( executor->ready );
+	sqrl_mutex_leave( executor->mutex );
+	return job;
+}
+
+/**
+Cancels a \p Sqrl_Client_Job.  A queued job finishes at once; a running
+job finishes as soon as its transaction notices, as with
+\p sqrl_client_transaction_cancel().
+
+@param job The \p Sqrl_Client_Job
+@return true if the job had not already finished
+*/
+DLL_PUBLIC
+bool sqrl_client_job_cancel( Sqrl_Client_Job *job )
+{
+	if( !job ) return false;
+	Sqrl_Client_Executor *executor = job->executor;
+	Sqrl_Transaction t = NULL;
+	bool queued = false, retVal = false;
+	sqrl_mutex_enter( executor->mutex );
+	if( job->state == JOB_QUEUED ) {
+		queued = sqrl_executor_unlink_queued( executor, job );
+		retVal = true;
+	} else if( job->state == JOB_RUNNING ) {
+		job->cancelled = true;
+		t = job->transaction;
+		if( t ) sqrl_client_transaction_cancel( t );
+		retVal = true;
+	}
+	sqrl_mutex_leave( executor->mutex );
+	if( queued ) {
+		sqrl_executor_finish( executor, job, SQRL_TRANSACTION_STATUS_CANCELLED );
+	}
+	return retVal;
+}
+
+/**
+Checks whether a \p Sqrl_Client_Job has finished.
+
+@param job The \p Sqrl_Client_Job
+@param status Optional; receives its status
+@return true if it has finished
+*/
+DLL_PUBLIC
+bool sqrl_client_job_done( Sqrl_Client_Job *job, Sqrl_Transaction_Status *status )
+{
+	if( !job ) return false;
+	sqrl_mutex_enter( job->executor->mutex );
+	bool retVal = job->state == JOB_DONE;
+	if( status ) *status = job->status;
+	sqrl_mutex_leave( job->executor->mutex );
+	return retVal;
+}
+
+/**
+Waits for a \p Sqrl_Client_Job to finish.  Don't call this from one of
+the executor's callbacks.
+
+@param job The \p Sqrl_Client_Job
+@return Its \p Sqrl_Transaction_Status
+*/
+DLL_PUBLIC
+Sqrl_Transaction_Status sqrl_client_job_wait( Sqrl_Client_Job *job )
+{
+	if( !job ) return SQRL_TRANSACTION_STATUS_FAILED;
+	Sqrl_Client_Executor *executor = job->executor;
+	sqrl_mutex_enter( executor->mutex );
+	while( job->state != JOB_DONE ) {
+		sqrl_cond_wait( executor->done, executor->mutex );
+	}
+	Sqrl_Transaction_Status retVal = job->status;
+	sqrl_mutex_leave( executor->mutex );
+	return retVal;
+}
+
+/**
+Releases a \p Sqrl_Client_Job returned by \p sqrl_client_submit().  The
+job still runs; only the caller's interest in it ends.
+
+@param job The \p Sqrl_Client_Job
+@return NULL
+*/
+DLL_PUBLIC
+Sqrl_Client_Job *sqrl_client_job_release( Sqrl_Client_Job *job )
+{
+	if( !job ) return NULL;
+	if( SQRL_ATOMIC_DEC( &job->referenceCount ) > 0 ) return NULL;
+	Sqrl_Client_Executor *executor = job->executor;
+	sqrl_user_release( job->user );
+	if( job->string ) {
+		sodium_memzero( job->string, job->string_len );
+		free( job->string );
+	}
+	free( job );
+	sqrl_executor_release( executor );
+	return NULL;
+}
@@ -29,18 +29,280 @@ static char kv_strings[SITE_KV_COUNT][SITE_KV_LENGTH+1] = {
 static int previousKeys[] = {KEY_PIUK0, KEY_PIUK1, KEY_PIUK2, KEY_PIUK3};
 static uint8_t emptyKey[SQRL_KEY_SIZE] = {0};
 
+// Builds the host string that site keys are derived from.
+static void sqrl_site_host( struct Sqrl_Transaction *transaction, UT_string *host )
+{
+	if( transaction->altIdentity ) {
+		utstring_printf( host, "%s+%s", transaction->uri->host, transaction->altIdentity );
+	} else {
+		utstring_printf( host, "%s", transaction->uri->host );
+	}
+}
+
+// Derives a site's keys from the host string, the MK and, if there is a
+// previous identity, its PIUK.
+static bool sqrl_site_derive_keys( Sqrl_Site_Keys *keys, const char *host, size_t host_len, const uint8_t *mk, const uint8_t *piuk )
+{
+	bool retVal = false;
+	uint8_t *tmp = sqrl_scratch_push( 2 * SQRL_KEY_SIZE );
+	if( !tmp ) return false;
+
+	// Generate site private key
+	if( 0 != crypto_auth_hmacsha256(
+		keys->sec,
+		(unsigned char*)host,
+		host_len,
+		mk )) {
+		goto DONE;
+	}
+
+	// Generate site public key, and the expanded key to sign with
+	if( !sqrl_sign_key_expand( &keys->sign, keys->sec, NULL )) goto DONE;
+
+	keys->hasPrevious = false;
+	if( piuk ) {
+		// Regenerate old MK
+		memcpy( tmp + SQRL_KEY_SIZE, piuk, SQRL_KEY_SIZE );
+		Sqrl_EnHash(
+			(uint64_t*)tmp,
+			(uint64_t*)(tmp + SQRL_KEY_SIZE) );
+		if( 0 != crypto_auth_hmacsha256(
+			keys->psec,
+			(unsigned char*)host,
+			host_len,
+			tmp )) {
+			goto DONE;
+		}
+		if( !sqrl_sign_key_expand( &keys->psign, keys->psec, NULL )) goto DONE;
+		keys->hasPrevious = true;
+	}
+	retVal = true;
+
+DONE:
+	sqrl_scratch_pop( tmp );
+	return retVal;
+}
+
+// Makes a new random rlk, and the SUK and VUK that go with it.
+static bool sqrl_site_make_unlock_keys( uint8_t *suk, uint8_t *vuk, const uint8_t *ilk )
+{
+	bool retVal = false;
+	uint8_t *rlk = sqrl_scratch_push( SQRL_KEY_SIZE );
+	if( !rlk ) return false;
+	if( sqrl_gen_rlk( rlk ) && sqrl_curve_private_key( rlk )) {
+		sqrl_gen_suk( suk, rlk );
+		retVal = sqrl_gen_vuk( vuk, ilk, rlk );
+	}
+	sqrl_scratch_pop( rlk );
+	return retVal;
+}
+
+/*
+While a query is out, the client is only waiting on the network, and the
+keys its next request needs are already known.  If the query doesn't
+match, the next one is for the next previous identity; if an ident makes
+a new account, it needs a fresh rlk with its SUK and VUK.  So a thread
+derives those as soon as a query is sent, and the next request uses them
+if it gets that far.  If it doesn't, they are wiped with the site.
+
+The thread gets copies of the keys it needs, and only of keys which are
+loaded already, so it never prompts for a password.  The URSK needs the
+SUK from the server's reply, so it can't be started before that.
+*/
+struct Sqrl_Site_Speculation {
+	SqrlThread thread;
+	int cancelled;
+	bool joined;
+	bool wantKeys;		// Set before the thread starts
+	bool wantUnlock;
+	bool keysReady;		// Set by the thread
+	bool unlockReady;
+	bool usePiuk;
+	int first;			// The previous_identity that keys are for
+	size_t host_len;
+	char *host;
+	uint8_t mk[SQRL_KEY_SIZE];
+	uint8_t piuk[SQRL_KEY_SIZE];
+	uint8_t ilk[SQRL_KEY_SIZE];
+	uint8_t suk[SQRL_KEY_SIZE];
+	uint8_t vuk[SQRL_KEY_SIZE];
+	Sqrl_Site_Keys keys;
+};
+
+static SQRL_THREAD_FUNCTION_RETURN_TYPE sqrl_site_speculation_thread( SQRL_THREAD_FUNCTION_INPUT_TYPE input )
+{
+	struct Sqrl_Site_Speculation *spec = (struct Sqrl_Site_Speculation*)input;
+	// Site keys first; a second query comes sooner than an ident
+	if( spec->wantKeys && !SQRL_ATOMIC_LOAD( &spec->cancelled )) {
+		spec->keysReady = sqrl_site_derive_keys( &spec->keys, spec->host, spec->host_len,
+			spec->mk, spec->usePiuk ? spec->piuk : NULL );
+	}
+	sodium_memzero( spec->piuk, SQRL_KEY_SIZE );
+	if( spec->wantUnlock && !SQRL_ATOMIC_LOAD( &spec->cancelled )) {
+		spec->unlockReady = sqrl_site_make_unlock_keys( spec->suk, spec->vuk, spec->ilk );
+	}
+	SQRL_THREAD_LEAVE;
+}
+
+// Waits for a site's speculation to finish, and gets it.
+static struct Sqrl_Site_Speculation *sqrl_site_speculation_join( Sqrl_Site *site )
+{
+	struct Sqrl_Site_Speculation *spec = site->speculation;
+	if( spec && !spec->joined ) {
+		sqrl_thread_join( spec->thread );
+		spec->joined = true;
+	}
+	return spec;
+}
+
+static void sqrl_site_speculation_discard( Sqrl_Site *site )
+{
+	struct Sqrl_Site_Speculation *spec = site->speculation;
+	if( !spec ) return;
+	site->speculation = NULL;
+	SQRL_ATOMIC_STORE( &spec->cancelled, 1 );
+	if( !spec->joined ) sqrl_thread_join( spec->thread );
+	if( spec->host ) free( spec->host );
+	// sodium_free() wipes it
+	sodium_free( spec );
+}
+
+// Starts deriving the keys that the request after a query may need.  The
+// user's keys must be open.  With one CPU the thread would only compete
+// with the client, so the keys are left to be derived inline.
+void sqrl_site_speculate( Sqrl_Site *site )
+{
+	struct Sqrl_Site_Speculation *spec;
+	UT_string *host;
+	uint8_t *key = NULL;
+	int previous;
+
+	sqrl_site_speculation_discard( site );
+	if( site->currentTransaction != SQRL_TRANSACTION_AUTH_QUERY ) return;
+	if( sqrl_cpu_count() < 2 ) return;
+	SQRL_CAST_TRANSACTION(transaction,site->transaction);
+	if( !transaction || !transaction->uri ) return;
+	Sqrl_User user = transaction->user;
+
+	spec = sodium_malloc( sizeof( struct Sqrl_Site_Speculation ));
+	if( !spec ) return;
+	sodium_memzero( spec, sizeof( struct Sqrl_Site_Speculation ));
+
+	// Site keys for the next previous identity, unless they're cached
+	utstring_new( host );
+	sqrl_site_host( transaction, host );
+	if( site->previous_identity < 3 && sqrl_user_has_key( user, KEY_MK ) &&
+		!sqrl_user_site_cache_get( user, utstring_body( host ), utstring_len( host ),
+			site->previous_identity + 1, &spec->keys )) {
+		spec->first = previous = site->previous_identity + 1;
+		spec->wantKeys = true;
+		// Skip empty PIUKs, as sqrl_site_set_user_keys() would
+		while( previous <= 3 ) {
+			if( !sqrl_user_has_key( user, previousKeys[previous] )) {
+				spec->wantKeys = false;
+				break;
+			}
+			key = sqrl_user_key( site->transaction, previousKeys[previous] );
+			if( key && 0 != sodium_memcmp( key, emptyKey, SQRL_KEY_SIZE )) {
+				memcpy( spec->piuk, key, SQRL_KEY_SIZE );
+				spec->usePiuk = true;
+				break;
+			}
+			previous++;
+		}
+		if( spec->wantKeys ) {
+			key = sqrl_user_key( site->transaction, KEY_MK );
+			if( key ) {
+				memcpy( spec->mk, key, SQRL_KEY_SIZE );
+				spec->keys.previous = previous > 3 ? 3 : previous;
+				spec->host_len = utstring_len( host );
+				spec->host = strdup( utstring_body( host ));
+			}
+			if( !key || !spec->host ) spec->wantKeys = false;
+		}
+	}
+	utstring_free( host );
+	if( !spec->wantKeys ) {
+		sodium_memzero( &spec->keys, sizeof( Sqrl_Site_Keys ));
+	}
+
+	// Unlock keys, for an ident that makes a new account
+	if( transaction->type == SQRL_TRANSACTION_AUTH_IDENT && sqrl_user_has_key( user, KEY_ILK )) {
+		key = sqrl_user_key( site->transaction, KEY_ILK );
+		if( key ) {
+			memcpy( spec->ilk, key, SQRL_KEY_SIZE );
+			spec->wantUnlock = true;
+		}
+	}
+
+	if( !spec->wantKeys && !spec->wantUnlock ) {
+		if( spec->host ) free( spec->host );
+		sodium_free( spec );
+		return;
+	}
+	spec->thread = sqrl_thread_create( sqrl_site_speculation_thread, (SQRL_THREAD_FUNCTION_INPUT_TYPE)spec );
+	if( !spec->thread ) {
+		// The next request derives its keys inline
+		if( spec->host ) free( spec->host );
+		sodium_free( spec );
+		return;
+	}
+	site->speculation = spec;
+}
+
+// Uses speculated site keys, if they are for this host, identity and MK.
+bool sqrl_site_speculation_keys( Sqrl_Site *site, const char *host, size_t host_len, int first, const uint8_t *mk, Sqrl_Site_Keys *keys )
+{
+	struct Sqrl_Site_Speculation *spec = site->speculation;
+	if( !spec || !spec->wantKeys ) return false;
+	if( spec->first != first || spec->host_len != host_len ||
+		0 != memcmp( spec->host, host, host_len )) {
+		// Won't be used; the unlock keys may still be
+		if( !spec->wantUnlock ) SQRL_ATOMIC_STORE( &spec->cancelled, 1 );
+		return false;
+	}
+	sqrl_site_speculation_join( site );
+	bool retVal = spec->keysReady && 0 == sodium_memcmp( spec->mk, mk, SQRL_KEY_SIZE );
+	if( retVal ) {
+		memcpy( keys, &spec->keys, sizeof( Sqrl_Site_Keys ));
+	}
+	spec->wantKeys = spec->keysReady = false;
+	sodium_memzero( spec->mk, SQRL_KEY_SIZE );
+	sodium_memzero( &spec->keys, sizeof( Sqrl_Site_Keys ));
+	return retVal;
+}
+
+// Uses a speculated SUK and VUK, if they were made from this ILK.
+bool sqrl_site_speculation_unlock( Sqrl_Site *site, const uint8_t *ilk )
+{
+	struct Sqrl_Site_Speculation *spec = site->speculation;
+	if( !spec || !spec->wantUnlock || !ilk ) return false;
+	sqrl_site_speculation_join( site );
+	bool retVal = spec->unlockReady && 0 == sodium_memcmp( spec->ilk, ilk, SQRL_KEY_SIZE );
+	if( retVal ) {
+		memcpy( site->keys[SITE_KEY_SUK], spec->suk, SQRL_KEY_SIZE );
+		memcpy( site->keys[SITE_KEY_VUK], spec->vuk, SQRL_KEY_SIZE );
+	}
+	spec->wantUnlock = spec->unlockReady = false;
+	sodium_memzero( spec->ilk, SQRL_KEY_SIZE );
+	sodium_memzero( spec->suk, SQRL_KEY_SIZE );
+	sodium_memzero( spec->vuk, SQRL_KEY_SIZE );
+	return retVal;
+}
+
 bool sqrl_site_set_user_keys( Sqrl_Site *site )
 {
 	if( !site ) return false;
 	SQRL_CAST_TRANSACTION(transaction,site->transaction);
 	bool retVal = true;
-	UT_string *uid;
 	UT_string *host;
 	uint8_t *mk, *piuk;
-	uint8_t tmp[SQRL_KEY_SIZE];
+	Sqrl_Site_Keys *keys;
+	int first = site->previous_identity;
 
-	utstring_new( uid );
 	utstring_new( host );
+	keys = (Sqrl_Site_Keys*)sqrl_scratch_push( sizeof( Sqrl_Site_Keys ));
+	if( !keys ) goto ERROR;
 
 	mk = sqrl_user_key( transaction, KEY_MK );
 	if( !mk ) goto ERROR;
@@ -50,32 +312,19 @@ bool sqrl_site_set_user_keys( Sqrl_Site *site )
 	}
 
 	// Create host string...
-	if( transaction->altIdentity ) {
-		utstring_printf( host, "%s+%s", transaction->uri->host, transaction->altIdentity );
-	} else {
-		utstring_printf( host, "%s", transaction->uri->host );
-	}
-
-	// Generate site private key
-	if( 0 != crypto_auth_hmacsha256(
-		site->keys[SITE_KEY_SEC],
-		(unsigned char*)(utstring_body( host )),
-		utstring_len( host ),
-		mk )) {
-		goto ERROR;
-	}
-	site->keys[SITE_KEY_LOOKUP][SITE_KEY_SEC] = 1;
-
-	// Generate site public key
-	sqrl_ed_public_key(
-		site->keys[SITE_KEY_PUB],
-		site->keys[SITE_KEY_SEC] );
-	site->keys[SITE_KEY_LOOKUP][SITE_KEY_PUB] = 1;
+	sqrl_site_host( transaction, host );
 
 	// Copy User Option Flags
 	site->userOptFlags = sqrl_user_get_flags( transaction->user );
 
-	// Generate previous keys
+	if( sqrl_user_site_cache_get( transaction->user, utstring_body( host ), utstring_len( host ), first, keys )) {
+		goto FOUND;
+	}
+	if( sqrl_site_speculation_keys( site, utstring_body( host ), utstring_len( host ), first, mk, keys )) {
+		goto CACHE;
+	}
+
+	// Find the previous identity
 	piuk = sqrl_user_key( site->transaction, previousKeys[ site->previous_identity ]);
 	while( piuk && (0 == sodium_memcmp( piuk, emptyKey, SQRL_KEY_SIZE ))) {
 		site->previous_identity++;
@@ -86,27 +335,29 @@ bool sqrl_site_set_user_keys( Sqrl_Site *site )
 		}
 		piuk = sqrl_user_key( site->transaction, previousKeys[ site->previous_identity ]);
 	}
+	keys->previous = site->previous_identity;
 
-	if( piuk ) {
-		// Regenerate old MK
-		Sqrl_EnHash(
-			(uint64_t*)tmp,
-			(uint64_t*)piuk );
-		if( 0 != crypto_auth_hmacsha256(
-			site->keys[SITE_KEY_PSEC],
-			(unsigned char*)(utstring_body( host )),
-			utstring_len( host ),
-			tmp )) {
-			goto ERROR;
-		}
-		site->keys[SITE_KEY_LOOKUP][SITE_KEY_PSEC] = 1;
-		sqrl_ed_public_key(
-			site->keys[SITE_KEY_PPUB],
-			site->keys[SITE_KEY_PSEC] );
-		site->keys[SITE_KEY_LOOKUP][SITE_KEY_PPUB] = 1;
+	if( !sqrl_site_derive_keys( keys, utstring_body( host ), utstring_len( host ), mk, piuk )) {
+		goto ERROR;
 	}
 
+CACHE:
+	sqrl_user_site_cache_put( transaction->user, utstring_body( host ), utstring_len( host ), first, keys );
 
+FOUND:
+	memcpy( site->keys[SITE_KEY_SEC], keys->sec, SQRL_KEY_SIZE );
+	site->keys[SITE_KEY_LOOKUP][SITE_KEY_SEC] = 1;
+	memcpy( site->keys[SITE_KEY_PUB], keys->sign.pub, SQRL_KEY_SIZE );
+	site->keys[SITE_KEY_LOOKUP][SITE_KEY_PUB] = 1;
+	memcpy( &site->signKeys[SITE_SIGN_IDS], &keys->sign, sizeof( Sqrl_Sign_Key ));
+	site->previous_identity = keys->previous;
+	if( keys->hasPrevious ) {
+		memcpy( site->keys[SITE_KEY_PSEC], keys->psec, SQRL_KEY_SIZE );
+		site->keys[SITE_KEY_LOOKUP][SITE_KEY_PSEC] = 1;
+		memcpy( site->keys[SITE_KEY_PPUB], keys->psign.pub, SQRL_KEY_SIZE );
+		site->keys[SITE_KEY_LOOKUP][SITE_KEY_PPUB] = 1;
+		memcpy( &site->signKeys[SITE_SIGN_PIDS], &keys->psign, sizeof( Sqrl_Sign_Key ));
+	}
 	goto DONE;
 
 ERROR:
@@ -114,9 +365,8 @@ ERROR:
 
 
 DONE:
-	// Unlock and zero user credentials
-	sodium_memzero( tmp, SQRL_KEY_SIZE );
-	utstring_free( uid );
+	// Zero user credentials
+	sqrl_scratch_pop( (uint8_t*)keys );
 	utstring_free( host );
 	return retVal;
 }
@@ -384,19 +634,14 @@ void sqrl_site_generate_opts( struct Sqrl_Site *site, UT_string *qry ) {
 
 void sqrl_site_create_unlock_keys( struct Sqrl_Site *site ) {
 	if( !site ) return;
-	uint8_t scratch[64];
-
 	uint8_t *ilk = sqrl_user_key( site->transaction, KEY_ILK );
-	sodium_mlock( scratch, 64 );
-	uint8_t rlk[SQRL_KEY_SIZE];
-	sqrl_gen_rlk( rlk );
-	sqrl_curve_private_key( rlk );
-	sqrl_gen_suk( site->keys[SITE_KEY_SUK], rlk );
-	sqrl_gen_vuk( site->keys[SITE_KEY_VUK], ilk, rlk );
+	if( !sqrl_site_speculation_unlock( site, ilk ) &&
+		!sqrl_site_make_unlock_keys( site->keys[SITE_KEY_SUK], site->keys[SITE_KEY_VUK], ilk )) {
+		return;
+	}
 
 	site->keys[SITE_KEY_LOOKUP][SITE_KEY_SUK] = 1;
 	site->keys[SITE_KEY_LOOKUP][SITE_KEY_VUK] = 1;
-	sodium_munlock( scratch, 64 );
 }
 
 void sqrl_site_generate_keys( struct Sqrl_Site *site, UT_string *clientString )
@@ -404,37 +649,40 @@ void sqrl_site_generate_keys( struct Sqrl_Site *site, UT_string *clientString )
 	if( !site || !clientString ) return;
 	sqrl_site_add_key_value( clientString, "idk", NULL );
 	sqrl_b64u_encode_append( clientString, site->keys[SITE_KEY_PUB], SQRL_KEY_SIZE );
-	uint8_t ins[SQRL_KEY_SIZE], tmp[SQRL_KEY_SIZE];
+	uint8_t ins[SQRL_KEY_SIZE], tmp[2][SQRL_KEY_SIZE];
+	bool previous = site->keys[SITE_KEY_LOOKUP][SITE_KEY_PPUB] != 0;
 
 	if( site->sin ) {
-		Sqrl_EnHash( (uint64_t*)tmp, (uint64_t*)site->keys[SITE_KEY_SEC] );
+		// ins and pins: both EnHashes at once
+		const uint8_t *secrets[2] = { site->keys[SITE_KEY_SEC], site->keys[SITE_KEY_PSEC] };
+		uint8_t *hashes[2] = { tmp[0], tmp[1] };
+		sqrl_enhash_multi( hashes, secrets, previous ? 2 : 1 );
 		if( 0 == crypto_auth_hmacsha256(
 			ins,
 			(unsigned char*)site->sin,
 			strlen( site->sin ),
-			tmp )) {
+			tmp[0] )) {
 				sqrl_site_add_key_value( clientString, "ins", NULL );
 				sqrl_b64u_encode_append( clientString, ins, SQRL_KEY_SIZE );
 		}
 		sodium_memzero( ins, SQRL_KEY_SIZE );
-		sodium_memzero( tmp, SQRL_KEY_SIZE );
+		sodium_memzero( tmp[0], SQRL_KEY_SIZE );
 	}
 
-	if( site->keys[SITE_KEY_LOOKUP][SITE_KEY_PPUB] ) {
+	if( previous ) {
 		sqrl_site_add_key_value( clientString, "pidk", NULL );
 		sqrl_b64u_encode_append( clientString, site->keys[SITE_KEY_PPUB], SQRL_KEY_SIZE );
 		if( site->sin ) {
-			Sqrl_EnHash( (uint64_t*)tmp, (uint64_t*)site->keys[SITE_KEY_PSEC] );
 			if( 0 == crypto_auth_hmacsha256(
 				ins,
 				(unsigned char*)site->sin,
 				strlen( site->sin ),
-				tmp )) {
+				tmp[1] )) {
 					sqrl_site_add_key_value( clientString, "pins", NULL );
 					sqrl_b64u_encode_append( clientString, ins, SQRL_KEY_SIZE );
 			}
 			sodium_memzero( ins, SQRL_KEY_SIZE );
-			sodium_memzero( tmp, SQRL_KEY_SIZE );
+			sodium_memzero( tmp[1], SQRL_KEY_SIZE );
 		}
 	}
 
@@ -461,16 +709,14 @@ void sqrl_site_generate_keys( struct Sqrl_Site *site, UT_string *clientString )
 		} else if( FLAG_CHECK( site->tif, SQRL_TIF_ID_MATCH )) {
 			tiuk = sqrl_user_key( site->transaction, KEY_IUK );
 		}
-		if( tiuk ) {
-			site->keys[SITE_KEY_LOOKUP][SITE_KEY_URSK] = 1;
+		if( tiuk &&
 			sqrl_gen_ursk( site->keys[SITE_KEY_URSK],
 				site->keys[SITE_KEY_SUK],
-				tiuk );
-
+				tiuk ) &&
+			sqrl_sign_key_expand( &site->signKeys[SITE_SIGN_URS], site->keys[SITE_KEY_URSK], NULL )) {
+			site->keys[SITE_KEY_LOOKUP][SITE_KEY_URSK] = 1;
 			site->keys[SITE_KEY_LOOKUP][SITE_KEY_URPK] = 1;
-			sqrl_ed_public_key(
-				site->keys[SITE_KEY_URPK],
-				site->keys[SITE_KEY_URSK] );
+			memcpy( site->keys[SITE_KEY_URPK], site->signKeys[SITE_SIGN_URS].pub, SQRL_KEY_SIZE );
 			if( site->currentTransaction == SQRL_TRANSACTION_AUTH_IDENT ) {
 				sqrl_site_create_unlock_keys( site );
 				sqrl_site_add_key_value( clientString, "suk", NULL );
@@ -571,7 +817,10 @@ UT_string *sqrl_site_client_body( Sqrl_Site *site )
 {
 	if( !site ) return NULL;
 	UT_string *result, *buffer;
-	uint8_t binSig[64];
+	uint8_t binSig[SITE_SIGN_COUNT][SQRL_SIG_SIZE];
+	const Sqrl_Sign_Key *keys[SITE_SIGN_COUNT];
+	const char *names[SITE_SIGN_COUNT];
+	int i, count = 0;
 
 	if( ! FLAG_CHECK( site->flags, SITE_FLAG_VALID_CLIENT_STRING )) {
 		return NULL;
@@ -590,35 +839,132 @@ UT_string *sqrl_site_client_body( Sqrl_Site *site )
 		utstring_concat( result, site->serverString );
 		utstring_concat( buffer, site->serverString );
 	}
-	utstring_bincpy( result, "&ids=", 5 );
-	sqrl_sign( buffer, site->keys[SITE_KEY_SEC], site->keys[SITE_KEY_PUB], binSig );
-	sqrl_b64u_encode_append( result, binSig, SQRL_SIG_SIZE );
+	// ids, and pids and urs if we have those keys
+	keys[count] = &site->signKeys[SITE_SIGN_IDS];
+	names[count++] = "&ids=";
 	if( site->keys[SITE_KEY_LOOKUP][SITE_KEY_PSEC] ) {
-		utstring_bincpy( result, "&pids=", 6 );
-		sqrl_sign( buffer, site->keys[SITE_KEY_PSEC], site->keys[SITE_KEY_PPUB], binSig );
-		sqrl_b64u_encode_append( result, binSig, SQRL_SIG_SIZE );
+		keys[count] = &site->signKeys[SITE_SIGN_PIDS];
+		names[count++] = "&pids=";
 	}
 	if( site->keys[SITE_KEY_LOOKUP][SITE_KEY_URSK] ) {
-		utstring_bincpy( result, "&urs=", 5 );
-		sqrl_sign( buffer, site->keys[SITE_KEY_URSK], site->keys[SITE_KEY_URPK], binSig );
-		sqrl_b64u_encode_append( result, binSig, SQRL_SIG_SIZE );
+		keys[count] = &site->signKeys[SITE_SIGN_URS];
+		names[count++] = "&urs=";
+	}
+	if( !sqrl_sign_multi( buffer, keys, count, binSig )) {
+		utstring_free( buffer );
+		utstring_free( result );
+		return NULL;
+	}
+	for( i = 0; i < count; i++ ) {
+		utstring_bincpy( result, names[i], strlen( names[i] ));
+		sqrl_b64u_encode_append( result, binSig[i], SQRL_SIG_SIZE );
 	}
 
 	utstring_free( buffer );
 	return result;
 }
 
-static struct Sqrl_Site_List *SQRL_SITE_LIST = NULL;
+/*
+Sites are found by their transaction through a small hash table, and
+expire through a hashed timer wheel: each site waits in the slot for the
+tick in which it times out.  Touching a site only updates lastAction; a
+site which is found in its slot too early is moved to a later slot.
+*/
+#define SQRL_SITE_BUCKETS     256
+#define SQRL_SITE_WHEEL_SLOTS 64
+#define SQRL_SITE_WHEEL_TICK  (SQRL_CLIENT_SITE_TIMEOUT / SQRL_SITE_WHEEL_SLOTS + 1)
+
+static Sqrl_Site *SQRL_SITE_TABLE[SQRL_SITE_BUCKETS];
+static Sqrl_Site *SQRL_SITE_WHEEL[SQRL_SITE_WHEEL_SLOTS];
+static long sqrl_site_wheel_tick = -1;
+static int sqrl_site_total = 0;
+
+static uint32_t sqrl_site_bucket( const void *transaction )
+{
+	uintptr_t h = (uintptr_t)transaction;
+	h ^= h >> 7;
+	h ^= h >> 15;
+	return (uint32_t)h & (SQRL_SITE_BUCKETS - 1);
+}
+
+// The following require SQRL_GLOBAL_MUTICES.site
+
+static void sqrl_site_wheel_insert( Sqrl_Site *site )
+{
+	long tick = (long)((site->lastAction + SQRL_CLIENT_SITE_TIMEOUT) / SQRL_SITE_WHEEL_TICK);
+	if( sqrl_site_wheel_tick < 0 ) {
+		sqrl_site_wheel_tick = (long)(sqrl_get_real_time() / SQRL_SITE_WHEEL_TICK);
+	}
+	if( tick <= sqrl_site_wheel_tick ) tick = sqrl_site_wheel_tick + 1;
+	Sqrl_Site **slot = &SQRL_SITE_WHEEL[tick % SQRL_SITE_WHEEL_SLOTS];
+	site->wheelNext = *slot;
+	site->wheelPrev = slot;
+	if( *slot ) (*slot)->wheelPrev = &site->wheelNext;
+	*slot = site;
+}
+
+static void sqrl_site_wheel_remove( Sqrl_Site *site )
+{
+	if( site->wheelPrev ) {
+		*site->wheelPrev = site->wheelNext;
+		if( site->wheelNext ) site->wheelNext->wheelPrev = site->wheelPrev;
+	}
+	site->wheelNext = NULL;
+	site->wheelPrev = NULL;
+}
+
+// Sites are keyed by the transaction's struct, so a handle is resolved first.
+static Sqrl_Site *sqrl_site_find( Sqrl_Transaction t )
+{
+	const void *transaction = sqrl_transaction_resolve( t );
+	if( !transaction ) return NULL;
+	Sqrl_Site *site = SQRL_SITE_TABLE[sqrl_site_bucket( transaction )];
+	while( site && (const void*)site->transaction != transaction ) {
+		site = site->hashNext;
+	}
+	return site;
+}
+
+static void sqrl_site_unlink( Sqrl_Site *site )
+{
+	Sqrl_Site **pp = &SQRL_SITE_TABLE[sqrl_site_bucket( site->transaction )];
+	while( *pp ) {
+		if( *pp == site ) {
+			*pp = site->hashNext;
+			break;
+		}
+		pp = &(*pp)->hashNext;
+	}
+	site->hashNext = NULL;
+	sqrl_site_wheel_remove( site );
+	sqrl_site_total--;
+}
+
+// Frees a site which has already been unlinked.
+static void sqrl_site_free( Sqrl_Site *site )
+{
+	// Wait for anyone still using it
+	sqrl_mutex_enter( site->mutex );
+	sqrl_mutex_leave( site->mutex );
+	sqrl_site_speculation_discard( site );
+	site->transaction = sqrl_transaction_release( site->transaction );
+	if( site->serverString ) {
+		utstring_free( site->serverString );
+	}
+	if( site->clientString ) {
+		utstring_free( site->clientString );
+	}
+	sqrl_mutex_destroy( site->mutex );
+	sodium_memzero( site->keys, sizeof( site->keys ));
+	sodium_free( site->signKeys );
+	if( site->sin ) free( site->sin );
+	free( site );
+}
 
 int sqrl_site_count()
 {
     sqrl_mutex_enter( SQRL_GLOBAL_MUTICES.site );
-    int i = 0;
-    struct Sqrl_Site_List *list = SQRL_SITE_LIST;
-    while( list ) {
-        i++;
-        list = list->next;
-    }
+    int i = sqrl_site_total;
     sqrl_mutex_leave( SQRL_GLOBAL_MUTICES.site );
     return i;
 }
@@ -632,6 +978,9 @@ Sqrl_Site *sqrl_client_site_create( Sqrl_Transaction t )
 	site->currentTransaction = SQRL_TRANSACTION_AUTH_QUERY;
 	site->previous_identity = 0;
 	site->mutex = sqrl_mutex_create();
+	site->lastAction = sqrl_get_real_time();
+	site->signKeys = sodium_malloc( SITE_SIGN_COUNT * sizeof( Sqrl_Sign_Key ));
+	sodium_memzero( site->signKeys, SITE_SIGN_COUNT * sizeof( Sqrl_Sign_Key ));
 
 	if( transaction->uri ) {
 		utstring_new( site->serverString );
@@ -639,65 +988,83 @@ Sqrl_Site *sqrl_client_site_create( Sqrl_Transaction t )
 		FLAG_SET( site->flags, SITE_FLAG_VALID_SERVER_STRING );
 	}
 	sqrl_mutex_enter( SQRL_GLOBAL_MUTICES.site );
-	struct Sqrl_Site_List *item = calloc( 1, sizeof( struct Sqrl_Site_List ));
-	struct Sqrl_Site_List *list = SQRL_SITE_LIST;
-	item->site = site;
-	if( ! SQRL_SITE_LIST ) {
-		SQRL_SITE_LIST = item;
-	} else {
-		while( list->next ) {
-			list = list->next;
-		}
-		list->next = item;
-	}
+	Sqrl_Site **bucket = &SQRL_SITE_TABLE[sqrl_site_bucket( site->transaction )];
+	site->hashNext = *bucket;
+	*bucket = site;
+	sqrl_site_wheel_insert( site );
+	sqrl_site_total++;
 	sqrl_mutex_leave( SQRL_GLOBAL_MUTICES.site );
 	END_WITH_TRANSACTION(transaction);
 	return site;
 }
 
-static struct Sqrl_Site_List *_scsm( struct Sqrl_Site_List *cur, double now, bool forceDeleteAll )
-{
-	if( cur == NULL ) {
-		// End of list
-		return NULL;
-	}
-
-	sqrl_mutex_enter( cur->site->mutex );
-	int refs = 0;
-	if( cur->site->transaction ) {
-		refs = ((struct Sqrl_Transaction*)cur->site->transaction)->referenceCount;
-	}
-	if( forceDeleteAll || (now - cur->site->lastAction) > SQRL_CLIENT_SITE_TIMEOUT || refs == 1 ) {
-		// Delete this one
-		struct Sqrl_Site_List *next = cur->next;
-
-		cur->site->transaction = sqrl_transaction_release( cur->site->transaction );
-		if( cur->site->serverString ) {
-			utstring_free( cur->site->serverString );
-		}
-		if( cur->site->clientString ) {
-			utstring_free( cur->site->clientString );
-		}
-		sqrl_mutex_destroy( cur->site->mutex );
-		sodium_memzero( cur->site->keys, sizeof( cur->site->keys ));
-		if( cur->site->sin ) free( cur->site->sin );
-		free( cur->site );
+/**
+Frees the \p Sqrl_Site of a transaction which is about to be released, if
+the site and the caller hold the only references to it.  Call this before
+releasing the caller's reference, while \p transaction is still valid.
 
-		return _scsm( next, now, forceDeleteAll );
+@param transaction The transaction about to be released
+*/
+void sqrl_client_site_release( Sqrl_Transaction transaction )
+{
+	if( !transaction ) return;
+	sqrl_mutex_enter( SQRL_GLOBAL_MUTICES.site );
+	Sqrl_Site *site = sqrl_site_find( transaction );
+	if( site && SQRL_ATOMIC_LOAD( &((struct Sqrl_Transaction*)site->transaction)->referenceCount ) == 2 ) {
+		sqrl_site_unlink( site );
+	} else {
+		site = NULL;
 	}
-	sqrl_mutex_leave( cur->site->mutex );
-
-	// Continue checking list
-	cur->next = _scsm( cur->next, now, forceDeleteAll );
-	return cur;
+	sqrl_mutex_leave( SQRL_GLOBAL_MUTICES.site );
+	if( site ) sqrl_site_free( site );
 }
 
 void sqrl_client_site_maintenance( bool forceDeleteAll )
 {
-	sqrl_mutex_enter( SQRL_GLOBAL_MUTICES.site );
+	Sqrl_Site *expired = NULL, *site, *next;
 	double now = sqrl_get_real_time();
-	SQRL_SITE_LIST = _scsm( SQRL_SITE_LIST, now, forceDeleteAll );
+	long tick = (long)(now / SQRL_SITE_WHEEL_TICK);
+	int i;
+
+	sqrl_mutex_enter( SQRL_GLOBAL_MUTICES.site );
+	if( forceDeleteAll ) {
+		for( i = 0; i < SQRL_SITE_BUCKETS; i++ ) {
+			while( (site = SQRL_SITE_TABLE[i]) ) {
+				sqrl_site_unlink( site );
+				site->wheelNext = expired;
+				expired = site;
+			}
+		}
+	} else if( sqrl_site_wheel_tick >= 0 ) {
+		// Visit each slot at most once, however long it has been
+		if( tick - sqrl_site_wheel_tick > SQRL_SITE_WHEEL_SLOTS ) {
+			sqrl_site_wheel_tick = tick - SQRL_SITE_WHEEL_SLOTS;
+		}
+		while( sqrl_site_wheel_tick < tick ) {
+			sqrl_site_wheel_tick++;
+			Sqrl_Site **slot = &SQRL_SITE_WHEEL[sqrl_site_wheel_tick % SQRL_SITE_WHEEL_SLOTS];
+			site = *slot;
+			*slot = NULL;
+			for( ; site; site = next ) {
+				next = site->wheelNext;
+				site->wheelNext = NULL;
+				site->wheelPrev = NULL;
+				if( (now - site->lastAction) > SQRL_CLIENT_SITE_TIMEOUT ) {
+					sqrl_site_unlink( site );
+					site->wheelNext = expired;
+					expired = site;
+				} else {
+					sqrl_site_wheel_insert( site );
+				}
+			}
+		}
+	}
 	sqrl_mutex_leave( SQRL_GLOBAL_MUTICES.site );
+
+	for( site = expired; site; site = next ) {
+		next = site->wheelNext;
+		sqrl_site_free( site );
+	}
 }
 
 Sqrl_Transaction_Status sqrl_client_do_loop( Sqrl_Site *site )
@@ -707,6 +1074,7 @@ Sqrl_Transaction_Status sqrl_client_do_loop( Sqrl_Site *site )
 		UT_string *bdy;
 		bdy = sqrl_site_client_body( site );
 		SQRL_CAST_TRANSACTION(transaction,site->transaction);
+		sqrl_site_speculate( site );
 		sqrl_client_call_send(
 			site->transaction, transaction->uri->url, strlen( transaction->uri->url ),
 			utstring_body( bdy ), utstring_len( bdy ));
@@ -720,17 +1088,12 @@ Sqrl_Transaction_Status sqrl_client_resume_transaction( Sqrl_Transaction t, cons
 	WITH_TRANSACTION(transaction,t);
 	if( !transaction ) return SQRL_TRANSACTION_STATUS_FAILED;
 	Sqrl_Site *site = NULL;
+	// Keep the user's keys readable for the whole step
+	struct Sqrl_User *keySession = sqrl_user_keys_open( transaction->user );
 
 	// Retrieve an existing Sqrl_Site (if available)
 	sqrl_mutex_enter( SQRL_GLOBAL_MUTICES.site );
-	struct Sqrl_Site_List *list = SQRL_SITE_LIST;
-	while( list ) {
-		if( list->site->transaction == t ) {
-			site = list->site;
-			break;
-		}
-		list = list->next;
-	}
+	site = sqrl_site_find( transaction );
 	if( site ) {
 		site->lastAction = sqrl_get_real_time();
 	}
@@ -828,6 +1191,7 @@ ERROR:
 	transaction->status = SQRL_TRANSACTION_STATUS_FAILED;
 
 DONE:
+	keySession = sqrl_user_keys_close( keySession );
 	END_WITH_TRANSACTION(transaction);
 	return transaction->status;
 }
@@ -11,10 +11,251 @@ For more details, see the LICENSE file included with this package.
 
 #include "../sqrl_internal.h"
 
-#define ENSCRYPT_R 256
-#define ENSCRYPT_P 1
+#ifdef UNIX
+#include <sys/mman.h>
+#endif
+
 #define SODIUM_SCRYPT crypto_pwhash_scryptsalsa208sha256_ll
 
+#define ENSCRYPT_HUGE_PAGE (2 * 1024 * 1024)
+
+/*
+Each thread keeps one scrypt workspace for its lifetime, rather than
+allocating and faulting in 16 MiB (at the default nFactor) on every call.
+The workspace is allocated the same way escrypt_kdf() would allocate it,
+so escrypt can still replace it if a larger N is requested.  It is backed
+by huge pages where possible, locked in memory where allowed, and wiped
+after each use.
+*/
+
+// Matches the region size escrypt_kdf() requires for N
+static size_t sqrl_scrypt_region_size( uint64_t N )
+{
+	return (size_t)128 * ENSCRYPT_R * ENSCRYPT_P +
+		(size_t)128 * ENSCRYPT_R * N +
+		(size_t)256 * ENSCRYPT_R + 64;
+}
+
+static bool sqrl_scrypt_region_alloc( escrypt_local_t *local, size_t need )
+{
+#if defined(UNIX) && defined(MAP_ANON)
+	size_t size = (need + ENSCRYPT_HUGE_PAGE - 1) & ~((size_t)ENSCRYPT_HUGE_PAGE - 1);
+	void *base = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	base = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE | MAP_HUGETLB, -1, 0 );
+#endif
+	if( base == MAP_FAILED ) {
+		base = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0 );
+		if( base == MAP_FAILED ) return false;
+#ifdef MADV_HUGEPAGE
+		madvise( base, size, MADV_HUGEPAGE );
+#endif
+	}
+	local->base = local->aligned = base;
+	local->size = size;
+#else
+	uint8_t *base = malloc( need + 63 );
+	if( !base ) return false;
+	local->base = base;
+	local->aligned = (uint8_t*)(((uintptr_t)base + 63) & ~(uintptr_t)63);
+	local->size = need;
+#endif
+	// Fault it in now, rather than during the first iteration
+	memset( local->aligned, 0, local->size );
+	sodium_mlock( local->aligned, local->size );
+	return true;
+}
+
+static void sqrl_scrypt_region_free( escrypt_local_t *local )
+{
+	if( local->aligned ) {
+		// Wipes and unlocks
+		sodium_munlock( local->aligned, local->size );
+	}
+	escrypt_free_local( local );
+	escrypt_init_local( local );
+}
+
+static void sqrl_scrypt_workspace_free( void *data )
+{
+	escrypt_local_t *local = (escrypt_local_t*)data;
+	if( !local ) return;
+	sqrl_scrypt_region_free( local );
+	free( local );
+}
+
+#ifdef UNIX
+static pthread_key_t sqrl_scrypt_key;
+static pthread_once_t sqrl_scrypt_key_once = PTHREAD_ONCE_INIT;
+
+static void sqrl_scrypt_key_create()
+{
+	pthread_key_create( &sqrl_scrypt_key, sqrl_scrypt_workspace_free );
+}
+#else
+static DWORD sqrl_scrypt_key = FLS_OUT_OF_INDEXES;
+static INIT_ONCE sqrl_scrypt_key_once = INIT_ONCE_STATIC_INIT;
+
+static VOID WINAPI sqrl_scrypt_fls_free( PVOID data )
+{
+	sqrl_scrypt_workspace_free( data );
+}
+
+static BOOL CALLBACK sqrl_scrypt_key_create( PINIT_ONCE once, PVOID param, PVOID *context )
+{
+	sqrl_scrypt_key = FlsAlloc( sqrl_scrypt_fls_free );
+	return TRUE;
+}
+#endif
+
+// Gets this thread's workspace, sized for N.
+static escrypt_local_t *sqrl_scrypt_workspace( uint64_t N )
+{
+	escrypt_local_t *local;
+#ifdef UNIX
+	pthread_once( &sqrl_scrypt_key_once, sqrl_scrypt_key_create );
+	local = pthread_getspecific( sqrl_scrypt_key );
+#else
+	InitOnceExecuteOnce( &sqrl_scrypt_key_once, sqrl_scrypt_key_create, NULL, NULL );
+	local = FlsGetValue( sqrl_scrypt_key );
+#endif
+	if( !local ) {
+		local = calloc( 1, sizeof( escrypt_local_t ));
+		if( !local ) return NULL;
+		escrypt_init_local( local );
+#ifdef UNIX
+		pthread_setspecific( sqrl_scrypt_key, local );
+#else
+		FlsSetValue( sqrl_scrypt_key, local );
+#endif
+	}
+	size_t need = sqrl_scrypt_region_size( N );
+	if( local->size < need ) {
+		sqrl_scrypt_region_free( local );
+		// If this fails, escrypt_kdf() allocates the region itself
+		sqrl_scrypt_region_alloc( local, need );
+	}
+	return local;
+}
+
+// Leaves no password-derived state in the workspace between uses.
+static void sqrl_scrypt_workspace_wipe( escrypt_local_t *local )
+{
+	if( local->aligned ) {
+		sodium_memzero( local->aligned, local->size );
+	}
+}
+
+// Runs one scrypt in the workspace, or through escrypt if the workspace
+// could not be allocated.
+static int sqrl_enscrypt_kdf(
+	escrypt_local_t *local,
+	const char *password,
+	size_t password_len,
+	const uint8_t *salt,
+	size_t salt_len,
+	uint64_t N,
+	uint8_t out[32] )
+{
+	if( local->aligned && local->size >= sqrl_scrypt_workspace_size( N )) {
+		return sqrl_scrypt( local->aligned, local->size, (const uint8_t*)password, password_len, salt, salt_len, N, out );
+	}
+	escrypt_kdf_t escrypt_kdf = sodium_runtime_has_sse2() ? escrypt_kdf_sse : escrypt_kdf_nosse;
+	return escrypt_kdf( local, (const uint8_t*)password, password_len, salt, salt_len, N, ENSCRYPT_R, ENSCRYPT_P, out, 32 );
+}
+
+/*
+An iteration's cost depends only on nFactor and the machine, so it is
+measured once per nFactor, the first time it's needed, and afterwards
+kept current from the runs themselves.  A timed EnScrypt uses it to plan
+its iteration count before it starts.  Then it only needs the clock once
+the plan is done, and its progress is by iteration rather than by time.
+*/
+
+#define ENSCRYPT_N_FACTORS 32
+#define ENSCRYPT_CALIBRATE_ITERATIONS 4
+
+// N = 1<<nFactor must be a power of two above 1, and the shift must fit an int
+#define ENSCRYPT_N_FACTOR_VALID(n) ((n) >= 1 && (n) <= 30)
+
+// Nanoseconds per iteration for each nFactor; 0 until measured
+static uint32_t sqrl_enscrypt_ns[ENSCRYPT_N_FACTORS];
+
+// Folds a run's cost into the model.
+static void sqrl_enscrypt_observe( uint8_t nFactor, uint32_t iterations, double millis )
+{
+	if( nFactor >= ENSCRYPT_N_FACTORS || iterations < ENSCRYPT_CALIBRATE_ITERATIONS ) return;
+	double ns = millis * 1000000.0 / iterations;
+	double old = (double)(uint32_t)SQRL_ATOMIC_LOAD( &sqrl_enscrypt_ns[nFactor] );
+	if( old > 0 ) ns = (old * 3 + ns) / 4;
+	if( ns < 1 ) ns = 1;
+	if( ns > 4000000000.0 ) ns = 4000000000.0;
+	SQRL_ATOMIC_STORE( &sqrl_enscrypt_ns[nFactor], (uint32_t)ns );
+}
+
+/**
+Measures the cost of one EnScrypt iteration on this machine, replacing
+what was known about it.
+
+@param nFactor The scrypt N factor
+@return Milliseconds per iteration, or -1 on failure
+*/
+double sqrl_enscrypt_calibrate( uint8_t nFactor )
+{
+	if( nFactor >= ENSCRYPT_N_FACTORS ) return -1;
+	uint64_t N = (uint64_t)1 << nFactor;
+	uint8_t t[2][32] = {{0},{0}};
+	double startTime = 0, millis;
+	int i;
+	escrypt_local_t *local = sqrl_scrypt_workspace( N );
+	if( !local ) return -1;
+	// The first iteration faults the workspace in, so it isn't counted
+	for( i = 0; i <= ENSCRYPT_CALIBRATE_ITERATIONS; i++ ) {
+		if( i == 1 ) startTime = sqrl_get_real_time();
+		if( 0 != sqrl_enscrypt_kdf( local, NULL, 0, t[i & 1], 32, N, t[(i + 1) & 1] )) {
+			sqrl_scrypt_workspace_wipe( local );
+			return -1;
+		}
+	}
+	millis = (sqrl_get_real_time() - startTime) * 1000;
+	sqrl_scrypt_workspace_wipe( local );
+	SQRL_ATOMIC_STORE( &sqrl_enscrypt_ns[nFactor], 0 );
+	sqrl_enscrypt_observe( nFactor, ENSCRYPT_CALIBRATE_ITERATIONS, millis );
+	return millis / ENSCRYPT_CALIBRATE_ITERATIONS;
+}
+
+/**
+Gets the predicted cost of one EnScrypt iteration on this machine,
+calibrating first if it hasn't been measured.
+
+@param nFactor The scrypt N factor
+@return Milliseconds per iteration, or -1 on failure
+*/
+double sqrl_enscrypt_cost( uint8_t nFactor )
+{
+	if( nFactor >= ENSCRYPT_N_FACTORS ) return -1;
+	uint32_t ns = (uint32_t)SQRL_ATOMIC_LOAD( &sqrl_enscrypt_ns[nFactor] );
+	if( ns == 0 ) return sqrl_enscrypt_calibrate( nFactor );
+	return ns / 1000000.0;
+}
+
+/**
+Plans how many EnScrypt iterations fill a time budget on this machine.
+
+@param nFactor The scrypt N factor
+@param millis The time budget
+@return The iteration count, at least 1; 0 on failure
+*/
+uint32_t sqrl_enscrypt_plan( uint8_t nFactor, int millis )
+{
+	double cost = sqrl_enscrypt_cost( nFactor );
+	if( cost <= 0 ) return 0;
+	double planned = ceil( millis / cost );
+	if( planned < 1 ) return 1;
+	if( planned > UINT32_MAX ) return UINT32_MAX;
+	return (uint32_t)planned;
+}
+
 int sqrl_enscrypt( 
 	uint8_t *buf, 
 	const char *password, 
@@ -26,24 +267,22 @@ int sqrl_enscrypt(
 	enscrypt_progress_fn cb_ptr, 
 	void *cb_data )
 {
-	if( !buf ) return -1;
+	if( !buf || !ENSCRYPT_N_FACTOR_VALID( nFactor )) return -1;
 	uint64_t N = (1<<nFactor);
 	uint8_t t[2][32] = {{0},{0}};
 	double startTime, endTime;
 	int i = 1, p = 0, lp = -1;
 	
-	escrypt_kdf_t   escrypt_kdf;
-    escrypt_local_t local;
+    escrypt_local_t *local = sqrl_scrypt_workspace( N );
     int             retVal;
 
-    if (escrypt_init_local(&local)) {
+    if( !local ) {
         return -1; /* LCOV_EXCL_LINE */
     }
-    escrypt_kdf = sodium_runtime_has_sse2() ? escrypt_kdf_sse : escrypt_kdf_nosse;
 
 	startTime = sqrl_get_real_time();
 
-    retVal = escrypt_kdf( &local, (uint8_t*)password, password_len, salt, salt_len, N, ENSCRYPT_R, ENSCRYPT_P, t[1], 32 );
+    retVal = sqrl_enscrypt_kdf( local, password, password_len, salt, salt_len, N, t[1] );
     if( retVal != 0 ) {
     	goto DONE;
     }
@@ -59,13 +298,13 @@ int sqrl_enscrypt(
 			}
 		}
 		if( i & 1 ) {
-			retVal = escrypt_kdf( &local, (uint8_t*)password, password_len, t[1], 32, N, ENSCRYPT_R, ENSCRYPT_P, t[0], 32 );
+			retVal = sqrl_enscrypt_kdf( local, password, password_len, t[1], 32, N, t[0] );
 			((uint64_t*)buf)[0] ^= ((uint64_t*)t[0])[0];
 			((uint64_t*)buf)[1] ^= ((uint64_t*)t[0])[1];
 			((uint64_t*)buf)[2] ^= ((uint64_t*)t[0])[2];
 			((uint64_t*)buf)[3] ^= ((uint64_t*)t[0])[3];
 		} else {
-			retVal = escrypt_kdf( &local, (uint8_t*)password, password_len, t[0], 32, N, ENSCRYPT_R, ENSCRYPT_P, t[1], 32 );
+			retVal = sqrl_enscrypt_kdf( local, password, password_len, t[0], 32, N, t[1] );
 			((uint64_t*)buf)[0] ^= ((uint64_t*)t[1])[0];
 			((uint64_t*)buf)[1] ^= ((uint64_t*)t[1])[1];
 			((uint64_t*)buf)[2] ^= ((uint64_t*)t[1])[2];
@@ -81,10 +320,10 @@ DONE:
 	
     if( retVal != 0 ) {
     	sodium_memzero( buf, 32 );
+    } else {
+    	sqrl_enscrypt_observe( nFactor, i, endTime );
     }
-    if (escrypt_free_local(&local)) {
-        return -1; /* LCOV_EXCL_LINE */
-    }
+    sqrl_scrypt_workspace_wipe( local );
     return retVal == 0 ? (int)endTime : -1;
 }
 
@@ -99,31 +338,230 @@ int sqrl_enscrypt_ms(
 	enscrypt_progress_fn cb_ptr, 
 	void *cb_data )
 {
-	if( !buf ) return -1;
+	if( !buf || !ENSCRYPT_N_FACTOR_VALID( nFactor )) return -1;
 	uint64_t N = (1<<nFactor);
 	uint8_t t[2][32] = {{0},{0}};
-	int i = 1;
+	uint32_t i = 1, planned;
 	int p = 0, lp = -1;
 	double startTime, elapsed = 0.0;
 	
-	escrypt_kdf_t   escrypt_kdf;
-    escrypt_local_t local;
+    escrypt_local_t *local = sqrl_scrypt_workspace( N );
     int             retVal;
 
-    if (escrypt_init_local(&local)) {
+    if( !local ) {
         return -1; /* LCOV_EXCL_LINE */
     }
-    escrypt_kdf = sodium_runtime_has_sse2() ? escrypt_kdf_sse : escrypt_kdf_nosse;
 
+	planned = sqrl_enscrypt_plan( nFactor, millis );
 	startTime = sqrl_get_real_time();
-    retVal = escrypt_kdf( &local, (uint8_t*)password, password_len, salt, salt_len, N, ENSCRYPT_R, ENSCRYPT_P, t[1], 32 );
+    retVal = sqrl_enscrypt_kdf( local, password, password_len, salt, salt_len, N, t[1] );
     if( retVal != 0 ) {
     	goto DONE;
     }
 	memcpy( buf, t[1], 32 );
-	while( elapsed < millis ) {
+	for( ;; ) {
+		while( i < planned ) {
+			if( cb_ptr ) {
+				// Never backwards, if the plan grows
+				if( lp < (p= (int)((double)i / planned * 100))) {
+					if( 0 == (*cb_ptr)( p, cb_data )) {
+						retVal = -1;
+						goto DONE;
+					}
+					lp = p;
+				}
+			}
+			if( 0 != ( ((int)i) & 1) ) {
+				retVal = sqrl_enscrypt_kdf( local, password, password_len, t[1], 32, N, t[0] );
+				((uint64_t*)buf)[0] ^= ((uint64_t*)t[0])[0];
+				((uint64_t*)buf)[1] ^= ((uint64_t*)t[0])[1];
+				((uint64_t*)buf)[2] ^= ((uint64_t*)t[0])[2];
+				((uint64_t*)buf)[3] ^= ((uint64_t*)t[0])[3];
+			} else {
+				retVal = sqrl_enscrypt_kdf( local, password, password_len, t[0], 32, N, t[1] );
+				((uint64_t*)buf)[0] ^= ((uint64_t*)t[1])[0];
+				((uint64_t*)buf)[1] ^= ((uint64_t*)t[1])[1];
+				((uint64_t*)buf)[2] ^= ((uint64_t*)t[1])[2];
+				((uint64_t*)buf)[3] ^= ((uint64_t*)t[1])[3];
+			}
+			if( retVal != 0 ) goto DONE;
+			i++;
+		}
+		elapsed = (sqrl_get_real_time() - startTime) * 1000;
+		if( elapsed >= millis ) break;
+		// Slower than planned; plan the rest at this run's own pace
+		planned = elapsed > 0 ? i + (uint32_t)ceil( (millis - elapsed) * i / elapsed ) : i * 2;
+	}
+	sqrl_enscrypt_observe( nFactor, i, elapsed );
+
+DONE:
+	if( cb_ptr ) (*cb_ptr)( 100, cb_data );
+
+    if( retVal != 0 ) {
+    	sodium_memzero( buf, 32 );
+    }
+    sodium_memzero( t, sizeof( t ));
+    sqrl_scrypt_workspace_wipe( local );
+    return retVal == 0 ? (int)i : -1;
+}
+
+/*
+A rescue code's EnScrypt runs for a minute, and much longer on a slow
+device, so losing it to a cancel or a restart is expensive.  A resumable
+chain keeps everything it needs to carry on in a \p Sqrl_Enscrypt_State:
+the last output, which salts the next iteration, the XOR of the outputs
+so far, and the iteration count.  The state lives in locked memory, and
+can be sealed under a local key to be kept on disk.
+
+Nothing in the state tests a password faster than running the chain up
+to where it stopped, so it does not know which password it belongs to.
+A caller that resumes checks the final key, and starts over if it is
+wrong.
+*/
+
+/**
+Creates an empty \p Sqrl_Enscrypt_State in locked memory.
+
+@return The state, or NULL if it could not be allocated
+*/
+Sqrl_Enscrypt_State *sqrl_enscrypt_state_create()
+{
+	Sqrl_Enscrypt_State *state = sodium_malloc( sizeof( Sqrl_Enscrypt_State ));
+	if( state ) sqrl_enscrypt_state_reset( state );
+	return state;
+}
+
+/**
+Wipes and frees a \p Sqrl_Enscrypt_State.
+
+@param state The state; NULL is ignored
+@return NULL
+*/
+Sqrl_Enscrypt_State *sqrl_enscrypt_state_destroy( Sqrl_Enscrypt_State *state )
+{
+	// sodium_free() wipes it
+	if( state ) sodium_free( state );
+	return NULL;
+}
+
+/**
+Forgets a chain's progress, wiping its state.
+
+@param state The state
+*/
+void sqrl_enscrypt_state_reset( Sqrl_Enscrypt_State *state )
+{
+	if( state ) sodium_memzero( state, sizeof( Sqrl_Enscrypt_State ));
+}
+
+/**
+Checks whether \p state holds part of the chain with these parameters.
+The password is not kept, so a chain for another password with the same
+salt looks the same; its result is simply wrong.
+
+@param state The state
+@param salt The salt
+@param salt_len Length of \p salt
+@param nFactor The scrypt N factor
+@param flags \p SQRL_ITERATIONS or \p SQRL_MILLIS
+@param target Iterations, or milliseconds with \p SQRL_MILLIS
+@return true if \p sqrl_enscrypt_resume() would carry on from \p state
+*/
+bool sqrl_enscrypt_state_continues(
+	const Sqrl_Enscrypt_State *state,
+	const uint8_t *salt,
+	uint8_t salt_len,
+	uint8_t nFactor,
+	uint8_t flags,
+	uint32_t target )
+{
+	if( !state || state->index == 0 || !salt || salt_len == 0 ) return false;
+	return state->flags == (flags & SQRL_MILLIS) && state->target == target &&
+		state->nFactor == nFactor && state->salt_len == salt_len &&
+		0 == sodium_memcmp( state->salt, salt, salt_len );
+}
+
+/**
+Runs an EnScrypt chain, carrying on from \p state if it holds part of a
+chain with the same salt and parameters; see
+\p sqrl_enscrypt_state_continues().  Otherwise \p state is started over.
+\p state is brought up to date after every iteration, so if \p cb_ptr
+cancels, calling this again with the same arguments continues where it
+stopped.
+
+The result is the same as \p sqrl_enscrypt() for the same iteration count,
+if \p state was started with the same password.
+
+@param state Progress of the chain
+@param buf Receives the 32 byte result
+@param password The password
+@param password_len Length of \p password
+@param salt The salt
+@param salt_len Length of \p salt
+@param nFactor The scrypt N factor
+@param flags \p SQRL_ITERATIONS or \p SQRL_MILLIS
+@param target Iterations, or milliseconds with \p SQRL_MILLIS
+@param cb_ptr Optional progress callback; returning 0 cancels
+@param cb_data Data passed to \p cb_ptr
+@return The iteration count, or -1 on failure or cancellation
+*/
+int sqrl_enscrypt_resume(
+	Sqrl_Enscrypt_State *state,
+	uint8_t *buf,
+	const char *password,
+	size_t password_len,
+	const uint8_t *salt,
+	uint8_t salt_len,
+	uint8_t nFactor,
+	uint8_t flags,
+	uint32_t target,
+	enscrypt_progress_fn cb_ptr,
+	void *cb_data )
+{
+	if( !buf || !state || !ENSCRYPT_N_FACTOR_VALID( nFactor )) return -1;
+	// A longer salt couldn't be kept, so the chain could never be resumed
+	if( salt_len > sizeof( state->salt )) return -1;
+	uint64_t N = (1<<nFactor);
+	uint8_t t[32];
+	int i, p = 0, lp = -1;
+	double startTime, spent, elapsed;
+
+	escrypt_local_t *local = sqrl_scrypt_workspace( N );
+	int retVal;
+
+	if( !local ) {
+		return -1; /* LCOV_EXCL_LINE */
+	}
+
+	flags &= SQRL_MILLIS;
+	startTime = sqrl_get_real_time();
+	if( !sqrl_enscrypt_state_continues( state, salt, salt_len, nFactor, flags, target )) {
+		sqrl_enscrypt_state_reset( state );
+		retVal = sqrl_enscrypt_kdf( local, password, password_len, salt, salt_len, N, t );
+		if( retVal != 0 ) {
+			goto DONE;
+		}
+		state->flags = flags;
+		state->target = target;
+		state->nFactor = nFactor;
+		if( salt ) {
+			state->salt_len = salt_len;
+			memcpy( state->salt, salt, salt_len );
+		}
+		memcpy( state->last, t, 32 );
+		memcpy( state->acc, t, 32 );
+		state->index = 1;
+		state->elapsed = (uint32_t)((sqrl_get_real_time() - startTime) * 1000);
+	}
+	retVal = 0;
+	spent = elapsed = state->elapsed;
+	startTime = sqrl_get_real_time();
+	while( flags == SQRL_MILLIS ? elapsed < target : state->index < target ) {
 		if( cb_ptr ) {
-			if( lp != (p= (int)(elapsed / millis * 100))) {
+			p = flags == SQRL_MILLIS ? 
+				(int)(elapsed / target * 100) : 
+				(int)((double)state->index / target * 100);
+			if( lp != p ) {
 				if( 0 == (*cb_ptr)( p, cb_data )) {
 					retVal = -1;
 					break;
@@ -131,44 +569,181 @@ int sqrl_enscrypt_ms(
 				lp = p;
 			}
 		}
-		if( 0 != ( ((int)i) & 1) ) {
-			retVal = escrypt_kdf( &local, (uint8_t*)password, password_len, t[1], 32, N, ENSCRYPT_R, ENSCRYPT_P, t[0], 32 );
-			((uint64_t*)buf)[0] ^= ((uint64_t*)t[0])[0];
-			((uint64_t*)buf)[1] ^= ((uint64_t*)t[0])[1];
-			((uint64_t*)buf)[2] ^= ((uint64_t*)t[0])[2];
-			((uint64_t*)buf)[3] ^= ((uint64_t*)t[0])[3];
-		} else {
-			retVal = escrypt_kdf( &local, (uint8_t*)password, password_len, t[0], 32, N, ENSCRYPT_R, ENSCRYPT_P, t[1], 32 );
-			((uint64_t*)buf)[0] ^= ((uint64_t*)t[1])[0];
-			((uint64_t*)buf)[1] ^= ((uint64_t*)t[1])[1];
-			((uint64_t*)buf)[2] ^= ((uint64_t*)t[1])[2];
-			((uint64_t*)buf)[3] ^= ((uint64_t*)t[1])[3];
-		}
+		retVal = sqrl_enscrypt_kdf( local, password, password_len, state->last, 32, N, t );
 		if( retVal != 0 ) goto DONE;
-		i++;
-		elapsed = (sqrl_get_real_time() - startTime) * 1000;
+		// state is caller memory and may not be aligned for uint64_t
+		for( i = 0; i < 32; i++ ) state->acc[i] ^= t[i];
+		memcpy( state->last, t, 32 );
+		state->index++;
+		elapsed = spent + (sqrl_get_real_time() - startTime) * 1000;
+		state->elapsed = (uint32_t)elapsed;
 	}
 
 DONE:
 	if( cb_ptr ) (*cb_ptr)( 100, cb_data );
 
-    if( retVal != 0 ) {
-    	sodium_memzero( buf, 32 );
-    }
-    if (escrypt_free_local(&local)) {
-        return -1; /* LCOV_EXCL_LINE */
-    }
-    return retVal == 0 ? i : -1;
+	if( retVal == 0 ) {
+		memcpy( buf, state->acc, 32 );
+		retVal = (int)state->index;
+		// Finished; nothing is left to resume
+		sqrl_enscrypt_state_reset( state );
+	} else {
+		sodium_memzero( buf, 32 );
+		retVal = -1;
+	}
+	sodium_memzero( t, sizeof( t ));
+	sqrl_scrypt_workspace_wipe( local );
+	return retVal;
 }
 
-void sqrl_gen_ilk( uint8_t ilk[SQRL_KEY_SIZE], const uint8_t iuk[SQRL_KEY_SIZE] )
+/**
+Runs several independent EnScrypt chains at once.  Chains with the same
+\p nFactor are interleaved in one ROMix, \p sqrl_scrypt_lanes() at a time,
+so on a wide enough CPU they cost little more than one chain.  As a chain
+finishes, the next waiting chain takes its lane.
+
+@param jobs The chains.  Each result is written to its \p result.
+@param count Number of \p jobs
+@param cb_ptr Optional progress callback, over all chains
+@param cb_data Data passed to \p cb_ptr
+@return Elapsed milliseconds, or -1 on failure or cancellation
+*/
+int sqrl_enscrypt_multi(
+	Sqrl_Enscrypt_Job *jobs,
+	int count,
+	enscrypt_progress_fn cb_ptr,
+	void *cb_data )
 {
-	uint8_t tmp[SQRL_KEY_SIZE];
-	sodium_mlock( tmp, SQRL_KEY_SIZE );
+	if( !jobs || count < 1 ) return -1;
+	int width = sqrl_scrypt_lanes();
+	int retVal = 0, i, j, k, l, qn, qpos, active, p = 0, lp = -1;
+	int slot[4];
+	uint8_t out[4][32];
+	uint64_t N, total = 0, completed = 0;
+	Sqrl_Scrypt_Lane lanes[4];
+	escrypt_local_t local;
+	double startTime, endTime;
+
+	// Each chain's previous output, which salts its next iteration
+	uint8_t *prev = sodium_malloc( count * 32 );
+	int *done = calloc( count, sizeof( int ));
+	int *queue = calloc( count, sizeof( int ));
+	escrypt_init_local( &local );
+	if( !prev || !done || !queue ) {
+		retVal = -1;
+		goto DONE;
+	}
+	for( i = 0; i < count; i++ ) {
+		if( !ENSCRYPT_N_FACTOR_VALID( jobs[i].nFactor )) {
+			retVal = -1;
+			goto DONE;
+		}
+		total += jobs[i].iterations > 1 ? jobs[i].iterations : 1;
+	}
+
+	startTime = sqrl_get_real_time();
+	for( i = 0; i < count; i++ ) {
+		if( done[i] ) continue;
+		N = (uint64_t)1 << jobs[i].nFactor;
+		size_t need = width * sqrl_scrypt_workspace_size( N );
+		if( local.size < need ) {
+			sqrl_scrypt_region_free( &local );
+			if( !sqrl_scrypt_region_alloc( &local, need )) {
+				retVal = -1;
+				goto DONE;
+			}
+		}
+		qn = 0;
+		for( j = i; j < count; j++ ) {
+			if( !done[j] && jobs[j].nFactor == jobs[i].nFactor ) {
+				queue[qn++] = j;
+			}
+		}
+		qpos = 0;
+		active = 0;
+		while( active > 0 || qpos < qn ) {
+			while( active < width && qpos < qn ) {
+				slot[active++] = queue[qpos++];
+			}
+			for( l = 0; l < active; l++ ) {
+				j = slot[l];
+				lanes[l].password = (const uint8_t*)jobs[j].password;
+				lanes[l].password_len = jobs[j].password_len;
+				if( done[j] ) {
+					lanes[l].salt = prev + j * 32;
+					lanes[l].salt_len = 32;
+				} else {
+					lanes[l].salt = jobs[j].salt;
+					lanes[l].salt_len = jobs[j].salt_len;
+				}
+				lanes[l].out = out[l];
+			}
+			if( 0 != sqrl_scrypt_multi( local.aligned, local.size, lanes, active, N )) {
+				retVal = -1;
+				goto DONE;
+			}
+			for( l = 0; l < active; l++ ) {
+				j = slot[l];
+				if( done[j] ) {
+					for( k = 0; k < 32; k++ ) jobs[j].result[k] ^= out[l][k];
+				} else {
+					memcpy( jobs[j].result, out[l], 32 );
+				}
+				memcpy( prev + j * 32, out[l], 32 );
+				done[j]++;
+				completed++;
+			}
+			// Free the lanes of finished chains
+			for( l = 0; l < active; ) {
+				j = slot[l];
+				if( done[j] >= jobs[j].iterations ) {
+					slot[l] = slot[--active];
+				} else {
+					l++;
+				}
+			}
+			if( cb_ptr ) {
+				if( lp != (p = (int)(completed * 100 / total))) {
+					if( 0 == (*cb_ptr)( p, cb_data )) {
+						retVal = -1;
+						goto DONE;
+					}
+					lp = p;
+				}
+			}
+		}
+	}
+
+DONE:
+	endTime = retVal == 0 ? (sqrl_get_real_time() - startTime) * 1000 : 0;
+	if( cb_ptr ) (*cb_ptr)( 100, cb_data );
+	if( retVal != 0 ) {
+		for( i = 0; i < count; i++ ) {
+			sodium_memzero( jobs[i].result, 32 );
+		}
+	}
+	sodium_memzero( out, sizeof( out ));
+	sqrl_scrypt_region_free( &local );
+	if( prev ) sodium_free( prev );
+	free( done );
+	free( queue );
+	return retVal == 0 ? (int)endTime : -1;
+}
+
+bool sqrl_gen_ilk( uint8_t ilk[SQRL_KEY_SIZE], const uint8_t iuk[SQRL_KEY_SIZE] )
+{
+	bool retVal = false;
+	uint8_t *tmp = sqrl_scratch_push( SQRL_KEY_SIZE );
+	if( !tmp ) goto DONE;
 	memcpy( tmp, iuk, SQRL_KEY_SIZE );
-	sqrl_curve_private_key( tmp );
+	if( !sqrl_curve_private_key( tmp )) goto DONE;
 	sqrl_curve_public_key( ilk, tmp );
-	sodium_munlock( tmp, SQRL_KEY_SIZE );
+	retVal = true;
+
+DONE:
+	if( !retVal ) sodium_memzero( ilk, SQRL_KEY_SIZE );
+	sqrl_scratch_pop( tmp );
+	return retVal;
 }
 
 void sqrl_gen_local( uint8_t local[SQRL_KEY_SIZE], const uint8_t mk[SQRL_KEY_SIZE] )
@@ -181,10 +756,10 @@ void sqrl_gen_mk( uint8_t mk[SQRL_KEY_SIZE], const uint8_t iuk[SQRL_KEY_SIZE] )
 	Sqrl_EnHash( (uint64_t*)mk, (uint64_t*)iuk );
 }
 
-void sqrl_gen_rlk( uint8_t rlk[SQRL_KEY_SIZE] )
+bool sqrl_gen_rlk( uint8_t rlk[SQRL_KEY_SIZE] )
 {
 	sqrl_entropy_bytes( rlk, SQRL_KEY_SIZE );
-	sqrl_curve_private_key( rlk );
+	return sqrl_curve_private_key( rlk );
 }
 
 void sqrl_gen_suk( uint8_t suk[SQRL_KEY_SIZE], const uint8_t rlk[SQRL_KEY_SIZE] )
@@ -192,23 +767,34 @@ void sqrl_gen_suk( uint8_t suk[SQRL_KEY_SIZE], const uint8_t rlk[SQRL_KEY_SIZE]
 	sqrl_curve_public_key( suk, rlk );
 }
 
-void sqrl_gen_vuk( uint8_t vuk[SQRL_KEY_SIZE], const uint8_t ilk[SQRL_KEY_SIZE], const uint8_t rlk[SQRL_KEY_SIZE] )
+bool sqrl_gen_vuk( uint8_t vuk[SQRL_KEY_SIZE], const uint8_t ilk[SQRL_KEY_SIZE], const uint8_t rlk[SQRL_KEY_SIZE] )
 {
-	uint8_t tmp[SQRL_KEY_SIZE];
-	sodium_mlock( tmp, SQRL_KEY_SIZE );
-	sqrl_make_shared_secret( tmp, ilk, rlk );
-	sqrl_ed_public_key( vuk, tmp );
-	sodium_munlock( tmp, SQRL_KEY_SIZE );
+	bool retVal = false;
+	uint8_t *tmp = sqrl_scratch_push( SQRL_KEY_SIZE );
+	if( tmp ) {
+		sqrl_make_shared_secret( tmp, ilk, rlk );
+		retVal = sqrl_ed_public_key( vuk, tmp );
+		sqrl_scratch_pop( tmp );
+	} else {
+		sodium_memzero( vuk, SQRL_KEY_SIZE );
+	}
+	return retVal;
 }
 
-void sqrl_gen_ursk( uint8_t ursk[SQRL_KEY_SIZE], const uint8_t suk[SQRL_KEY_SIZE], const uint8_t iuk[SQRL_KEY_SIZE] )
+bool sqrl_gen_ursk( uint8_t ursk[SQRL_KEY_SIZE], const uint8_t suk[SQRL_KEY_SIZE], const uint8_t iuk[SQRL_KEY_SIZE] )
 {
-	uint8_t tmp[SQRL_KEY_SIZE];
-	sodium_mlock( tmp, SQRL_KEY_SIZE );
+	bool retVal = false;
+	uint8_t *tmp = sqrl_scratch_push( SQRL_KEY_SIZE );
+	if( !tmp ) goto DONE;
 	memcpy( tmp, iuk, SQRL_KEY_SIZE );
-	sqrl_curve_private_key( tmp );
+	if( !sqrl_curve_private_key( tmp )) goto DONE;
 	sqrl_make_shared_secret( ursk, suk, tmp );
-	sodium_munlock( tmp, SQRL_KEY_SIZE );
+	retVal = true;
+
+DONE:
+	if( !retVal ) sodium_memzero( ursk, SQRL_KEY_SIZE );
+	sqrl_scratch_pop( tmp );
+	return retVal;
 }
 
 DLL_PUBLIC
@@ -224,38 +810,158 @@ bool sqrl_user_decrypt( Sqrl_User u, UT_string *text )
 }
 
 DLL_PUBLIC
-void sqrl_ed_public_key( uint8_t *puk, const uint8_t *prk )
+bool sqrl_ed_public_key( uint8_t *puk, const uint8_t *prk )
 {
-	uint8_t sk[crypto_sign_SECRETKEYBYTES];
-	sodium_mlock( sk, crypto_sign_SECRETKEYBYTES );
-	crypto_sign_seed_keypair( puk, sk, prk );
-	sodium_munlock( sk, crypto_sign_SECRETKEYBYTES );
+	bool retVal = false;
+	Sqrl_Sign_Key *key = (Sqrl_Sign_Key*)sqrl_scratch_push( sizeof( Sqrl_Sign_Key ));
+	if( key && sqrl_sign_key_expand( key, prk, NULL )) {
+		memcpy( puk, key->pub, 32 );
+		retVal = true;
+	} else {
+		sodium_memzero( puk, 32 );
+	}
+	sqrl_scratch_pop( (uint8_t*)key );
+	return retVal;
 //	ed25519_publickey( prk, puk );
 }
 
-DLL_PUBLIC
-void sqrl_sign( const UT_string *msg, const uint8_t sk[32], const uint8_t pk[32], uint8_t sig[64] )
+/*
+Ed25519 signing, with the seed hashed once per key rather than once per
+signature.  A Sqrl_Sign_Key holds what crypto_sign_detached() would
+derive from the 64 byte secret key each time: the clamped scalar (reduced
+mod L, which gives the same point and signature), the nonce prefix and the
+public key.  Signatures are identical to crypto_sign_detached()'s.
+*/
+
+/**
+Expands an Ed25519 seed into a signing key.
+
+@param key Receives the expanded key; keep it in locked memory
+@param seed The 32 byte private key (seed)
+@param pk The matching public key, or NULL to compute it
+@return true on success
+*/
+bool sqrl_sign_key_expand( Sqrl_Sign_Key *key, const uint8_t seed[32], const uint8_t *pk )
 {
-	uint8_t secret[crypto_sign_SECRETKEYBYTES];
-	sodium_mlock( secret, crypto_sign_SECRETKEYBYTES );
-	memcpy( secret, sk, 32 );
-	memcpy( secret+32, pk, 32 );
-	crypto_sign_detached( 
-		sig, NULL,
-		(unsigned char*)utstring_body(msg),	utstring_len( msg ),
-		secret );
-	sodium_munlock( secret, crypto_sign_SECRETKEYBYTES );
-//	ed25519_sign(
-//		(unsigned char*)utstring_body(msg), 
-//		utstring_len(msg), 
-//		sk, pk, sig );
+	bool retVal = true;
+	if( !key ) return false;
+	uint8_t *az = sqrl_scratch_push( 128 );
+	if( !az ) return false;
+	uint8_t *wide = az + 64;
 
+	crypto_hash_sha512( az, seed, 32 );
+	az[0] &= 248;
+	az[31] &= 127;
+	az[31] |= 64;
+	memcpy( wide, az, 32 );
+	crypto_core_ed25519_scalar_reduce( key->scalar, wide );
+	memcpy( key->prefix, az + 32, 32 );
+	if( pk ) {
+		memcpy( key->pub, pk, 32 );
+	} else if( 0 != sqrl_curve_ed25519_base( key->pub, key->scalar )) {
+		sodium_memzero( key, sizeof( Sqrl_Sign_Key ));
+		retVal = false;
+	}
+	sqrl_scratch_pop( az );
+	return retVal;
+}
+
+#define SQRL_SIGN_SCRATCH_SIZE (sizeof( crypto_hash_sha512_state ) + 192)
+
+// Signs msg with key, working in SQRL_SIGN_SCRATCH_SIZE bytes of scratch.
+static void sqrl_sign_with_scratch( const UT_string *msg, const Sqrl_Sign_Key *key, uint8_t sig[64], uint8_t *scratch )
+{
+	crypto_hash_sha512_state *hs;
+	uint8_t *nonce, *r, *hram, *h;
+	hs = (crypto_hash_sha512_state*)scratch;
+	nonce = scratch + sizeof( crypto_hash_sha512_state );
+	hram = nonce + 64;
+	r = hram + 64;
+	h = r + 32;
+
+	// r = H( prefix || M ), R = rB
+	crypto_hash_sha512_init( hs );
+	crypto_hash_sha512_update( hs, key->prefix, 32 );
+	crypto_hash_sha512_update( hs, (unsigned char*)utstring_body( msg ), utstring_len( msg ));
+	crypto_hash_sha512_final( hs, nonce );
+	crypto_core_ed25519_scalar_reduce( r, nonce );
+	sqrl_curve_ed25519_base( sig, r );
+
+	// S = r + H( R || A || M ) a
+	crypto_hash_sha512_init( hs );
+	crypto_hash_sha512_update( hs, sig, 32 );
+	crypto_hash_sha512_update( hs, key->pub, 32 );
+	crypto_hash_sha512_update( hs, (unsigned char*)utstring_body( msg ), utstring_len( msg ));
+	crypto_hash_sha512_final( hs, hram );
+	crypto_core_ed25519_scalar_reduce( h, hram );
+	crypto_core_ed25519_scalar_mul( h, h, key->scalar );
+	crypto_core_ed25519_scalar_add( sig + 32, h, r );
+}
+
+/**
+Signs a message with an expanded key.
+
+@param msg The message
+@param key The \p Sqrl_Sign_Key
+@param sig Receives the 64 byte signature; zeroed on failure
+@return true on success
+*/
+bool sqrl_sign_expanded( const UT_string *msg, const Sqrl_Sign_Key *key, uint8_t sig[64] )
+{
+	uint8_t *scratch = sqrl_scratch_push( SQRL_SIGN_SCRATCH_SIZE );
+	if( !scratch ) {
+		sodium_memzero( sig, 64 );
+		return false;
+	}
+	sqrl_sign_with_scratch( msg, key, sig, scratch );
+	sqrl_scratch_pop( scratch );
+	return true;
+}
+
+/**
+Signs one message with several keys.  Ed25519 hashes each key's prefix
+ahead of the message, so no hash state can be shared between keys; this
+saves re-expanding the keys and taking scratch memory for each signature.
+
+@param msg The message
+@param keys The \p Sqrl_Sign_Keys
+@param count Number of \p keys
+@param sigs Receives a 64 byte signature for each key; zeroed on failure
+@return true on success
+*/
+bool sqrl_sign_multi( const UT_string *msg, const Sqrl_Sign_Key *const *keys, int count, uint8_t (*sigs)[64] )
+{
+	int i;
+	uint8_t *scratch = sqrl_scratch_push( SQRL_SIGN_SCRATCH_SIZE );
+	if( !scratch ) {
+		if( count > 0 ) sodium_memzero( sigs, (size_t)count * 64 );
+		return false;
+	}
+	for( i = 0; i < count; i++ ) {
+		sqrl_sign_with_scratch( msg, keys[i], sigs[i], scratch );
+	}
+	sqrl_scratch_pop( scratch );
+	return true;
+}
+
+DLL_PUBLIC
+bool sqrl_sign( const UT_string *msg, const uint8_t sk[32], const uint8_t pk[32], uint8_t sig[64] )
+{
+	bool retVal = false;
+	Sqrl_Sign_Key *key = (Sqrl_Sign_Key*)sqrl_scratch_push( sizeof( Sqrl_Sign_Key ));
+	if( key && sqrl_sign_key_expand( key, sk, pk )) {
+		retVal = sqrl_sign_expanded( msg, key, sig );
+	} else {
+		sodium_memzero( sig, 64 );
+	}
+	sqrl_scratch_pop( (uint8_t*)key );
+	return retVal;
 }
 
 DLL_PUBLIC
 bool sqrl_verify_sig( const UT_string *msg, const uint8_t *sig, const uint8_t *pub )
 {
-	if( crypto_sign_verify_detached( sig, (unsigned char *)(utstring_body(msg)), utstring_len(msg), pub ) == 0 ) {
+	if( sqrl_curve_ed25519_verify( sig, (unsigned char *)(utstring_body(msg)), utstring_len(msg), pub ) == 0 ) {
 		return true;
 	}
 //	if( ed25519_sign_open( 
@@ -267,22 +973,26 @@ bool sqrl_verify_sig( const UT_string *msg, const uint8_t *sig, const uint8_t *p
 }
 
 DLL_PUBLIC
-void sqrl_curve_private_key( uint8_t *key )
+bool sqrl_curve_private_key( uint8_t *key )
 {
 //	key[0]  &= 248;
 //	key[31] &= 127;
 //	key[31] |=  64;
-	unsigned char tmp[32];
-	sodium_mlock( tmp, SQRL_KEY_SIZE );
+	uint8_t *tmp = sqrl_scratch_push( SQRL_KEY_SIZE );
+	if( !tmp ) {
+		sodium_memzero( key, 32 );
+		return false;
+	}
 	crypto_sign_ed25519_sk_to_curve25519( tmp, key );
 	memcpy( key, tmp, 32 );
-	sodium_munlock( tmp, SQRL_KEY_SIZE );
+	sqrl_scratch_pop( tmp );
+	return true;
 }
 
 DLL_PUBLIC
 void sqrl_curve_public_key( uint8_t *puk, const uint8_t *prk )
 {
-	crypto_scalarmult_base( puk, prk );
+	sqrl_curve_x25519_base( puk, prk );
 //	static const uint8_t basepoint[SQRL_KEY_SIZE] = {9};
 //	curve25519_donna( puk, prk, basepoint );
 	/*
@@ -299,7 +1009,7 @@ void sqrl_curve_public_key( uint8_t *puk, const uint8_t *prk )
 DLL_PUBLIC
 int sqrl_make_shared_secret( uint8_t *shared, const uint8_t *puk, const uint8_t *prk )
 {
-	return crypto_scalarmult( shared, prk, puk );
+	return sqrl_curve_x25519( shared, prk, puk );
 //	return( curve25519_donna( shared, prk, puk ));
 	/*
 	uint8_t sec[SQRL_KEY_SIZE];
@@ -312,28 +1022,6 @@ int sqrl_make_shared_secret( uint8_t *shared, const uint8_t *puk, const uint8_t
 	*/
 }
 
-int Sqrl_EnHash( uint64_t *out, uint64_t *in )
-{
-	uint64_t trans[4];
-	uint64_t tmp[4];
-	sodium_mlock( trans, 32 );
-	sodium_mlock( tmp, 32 );
-	memset( out, 0, 32 );
-	memcpy( tmp, in, 32 );
-	int i;
-	for( i = 0; i < 16; i++ ) {
-		crypto_hash_sha256((unsigned char*)trans, (unsigned char*)tmp, 32 );
-		out[0] ^= trans[0];
-		out[1] ^= trans[1];
-		out[2] ^= trans[2];
-		out[3] ^= trans[3];
-		memcpy( tmp, trans, 32 );
-	}
-	sodium_munlock( trans, 32 );
-	sodium_munlock( tmp, 32 );
-	return 0;
-}
-
 static int sqrl_gcm_encrypt( 
 	uint8_t *output, uint8_t *key, uint8_t *iv, 
 	uint8_t *add, size_t add_len, uint8_t *tag,
@@ -400,6 +1088,122 @@ uint32_t sqrl_crypt_enscrypt( Sqrl_Crypt_Context *sctx, uint8_t *key, const char
 	return sctx->count;
 }
 
+uint32_t sqrl_crypt_enscrypt_resume( Sqrl_Crypt_Context *sctx, Sqrl_Enscrypt_State *state, uint8_t *key, const char *password, size_t password_len, enscrypt_progress_fn callback, void * callback_data ) 
+{
+	if( !state ) {
+		return sqrl_crypt_enscrypt( sctx, key, password, password_len, callback, callback_data );
+	}
+	size_t salt_len = sctx->salt ? 16 : 0;
+	uint8_t mode = sctx->flags & SQRL_MILLIS;
+	// A timed encryption is free to pick its salt, so it takes the one
+	// the interrupted chain was using
+	if( (sctx->flags & SQRL_ENCRYPT) && mode == SQRL_MILLIS && salt_len &&
+		state->index > 0 && state->flags == SQRL_MILLIS && 
+		state->target == sctx->count && state->salt_len == salt_len ) {
+		memcpy( sctx->salt, state->salt, salt_len );
+	}
+	int newCount = sqrl_enscrypt_resume( state, key, password, password_len, sctx->salt, salt_len, 
+		sctx->nFactor, mode, sctx->count, callback, callback_data );
+	if( newCount < 1 ) return 0;
+	if( mode == SQRL_MILLIS ) {
+		sctx->count = newCount;
+		sctx->flags &= ~SQRL_MILLIS;
+		sctx->flags |= SQRL_ITERATIONS;
+	}
+	return sctx->count;
+}
+
+#define ENSCRYPT_STATE_VERSION 2
+#define ENSCRYPT_STATE_PLAIN_LEN (SQRL_CHECKPOINT_LENGTH - 12 - 16)
+
+static void sqrl_enscrypt_state_put32( uint8_t *p, uint32_t x )
+{
+	p[0] = x & 0xff;
+	p[1] = (x >> 8) & 0xff;
+	p[2] = (x >> 16) & 0xff;
+	p[3] = (x >> 24) & 0xff;
+}
+
+static uint32_t sqrl_enscrypt_state_get32( const uint8_t *p )
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | 
+		((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/**
+Seals a chain's progress for storage, with AES-GCM under \p key.  The
+sealed state is \p SQRL_CHECKPOINT_LENGTH bytes: a 12 byte IV, the state,
+and a 16 byte tag.
+
+@param state The state; it must be part way through a chain
+@param key 32 byte key, kept by the caller
+@param sealed Receives \p SQRL_CHECKPOINT_LENGTH bytes
+@return true on success
+*/
+bool sqrl_enscrypt_state_seal( const Sqrl_Enscrypt_State *state, const uint8_t *key, uint8_t *sealed )
+{
+	if( !state || !key || !sealed || state->index == 0 ) return false;
+	uint8_t *plain = sqrl_scratch_push( ENSCRYPT_STATE_PLAIN_LEN );
+	if( !plain ) return false;
+	uint8_t *p = plain;
+	*p++ = ENSCRYPT_STATE_VERSION;
+	sqrl_enscrypt_state_put32( p, state->index ); p += 4;
+	sqrl_enscrypt_state_put32( p, state->elapsed ); p += 4;
+	sqrl_enscrypt_state_put32( p, state->target ); p += 4;
+	*p++ = state->flags;
+	*p++ = state->nFactor;
+	*p++ = state->salt_len;
+	memcpy( p, state->salt, 32 ); p += 32;
+	memcpy( p, state->last, 32 ); p += 32;
+	memcpy( p, state->acc, 32 );
+
+	sqrl_entropy_bytes( sealed, 12 );
+	sqrl_gcm_encrypt( sealed + 12, (uint8_t*)key, sealed, NULL, 0,
+		sealed + 12 + ENSCRYPT_STATE_PLAIN_LEN, plain, ENSCRYPT_STATE_PLAIN_LEN );
+	sqrl_scratch_pop( plain );
+	return true;
+}
+
+/**
+Opens a state sealed by \p sqrl_enscrypt_state_seal().
+
+@param state Receives the state; left alone on failure
+@param key The 32 byte key it was sealed with
+@param sealed \p SQRL_CHECKPOINT_LENGTH bytes
+@return true if \p sealed was intact and sealed under \p key
+*/
+bool sqrl_enscrypt_state_open( Sqrl_Enscrypt_State *state, const uint8_t *key, const uint8_t *sealed )
+{
+	if( !state || !key || !sealed ) return false;
+	bool retVal = false;
+	uint8_t *plain = sqrl_scratch_push( ENSCRYPT_STATE_PLAIN_LEN + sizeof( Sqrl_Enscrypt_State ));
+	if( !plain ) return false;
+	Sqrl_Enscrypt_State *tmp = (Sqrl_Enscrypt_State*)(plain + ENSCRYPT_STATE_PLAIN_LEN);
+	if( sqrl_gcm_decrypt( plain, (uint8_t*)key, (uint8_t*)sealed, NULL, 0,
+			(uint8_t*)sealed + 12 + ENSCRYPT_STATE_PLAIN_LEN, 
+			(uint8_t*)sealed + 12, ENSCRYPT_STATE_PLAIN_LEN )) {
+		goto DONE;
+	}
+	const uint8_t *p = plain;
+	if( *p++ != ENSCRYPT_STATE_VERSION ) goto DONE;
+	tmp->index = sqrl_enscrypt_state_get32( p ); p += 4;
+	tmp->elapsed = sqrl_enscrypt_state_get32( p ); p += 4;
+	tmp->target = sqrl_enscrypt_state_get32( p ); p += 4;
+	tmp->flags = *p++;
+	tmp->nFactor = *p++;
+	tmp->salt_len = *p++;
+	memcpy( tmp->salt, p, 32 ); p += 32;
+	memcpy( tmp->last, p, 32 ); p += 32;
+	memcpy( tmp->acc, p, 32 );
+	if( tmp->index == 0 || tmp->salt_len > sizeof( tmp->salt )) goto DONE;
+	memcpy( state, tmp, sizeof( Sqrl_Enscrypt_State ));
+	retVal = true;
+
+DONE:
+	sqrl_scratch_pop( plain );
+	return retVal;
+}
+
 bool sqrl_crypt_gcm( Sqrl_Crypt_Context *sctx, uint8_t *key ) 
 {
 	if( sctx->flags & SQRL_ENCRYPT ) {
@@ -418,13 +1222,13 @@ bool sqrl_crypt_gcm( Sqrl_Crypt_Context *sctx, uint8_t *key )
 bool sqrl_crypt( Sqrl_Crypt_Context *sctx, const char *password, size_t password_len, enscrypt_progress_fn callback, void * callback_data )
 {
 	bool retVal = true;
-	uint8_t key[32] = {0};
+	uint8_t *key = sqrl_scratch_push( 32 );
+	if( !key ) return false;
 
-	sodium_mlock( &key, 32 );
 	sqrl_crypt_enscrypt( sctx, key, password, password_len, callback, callback_data );
 	retVal = sqrl_crypt_gcm( sctx, key );
 
-	sodium_munlock( &key, 32 );
+	sqrl_scratch_pop( key );
 	return retVal;
 }
 
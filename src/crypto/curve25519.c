@@ -0,0 +1,1063 @@
+/** @file curve25519.c Internal Ed25519 and X25519 backend
+
+@author Adam Comley
+
+This file is part of libsqrl.  It is released under the MIT license.
+For more details, see the LICENSE file included with this package.
+
+Field elements are five 51-bit limbs, multiplied with 128-bit products.
+Points use the extended coordinates of ref10, and the same formulas.  What
+differs from libsodium is how the work is arranged:
+
+- Fixed-base multiplication reads a table of 64 rows (one per 4-bit digit),
+  so it needs no doublings at all.  The table is built on first use.
+- Verification is a wNAF double-scalar multiplication, with 64 odd
+  multiples of the base point (window 8) instead of 8.
+- X25519 public keys are computed on the Edwards curve with the fixed-base
+  table, then mapped to Montgomery form, rather than with a ladder.
+
+Every operation returns exactly what the libsodium function it replaces
+would, including which inputs are rejected.  Secret scalars are only used
+with constant-time table lookups and conditional swaps.
+
+The backend needs 128-bit integers; without them libsodium is always used.
+**/
+
+#include "../sqrl_internal.h"
+
+#if defined(__SIZEOF_INT128__)
+#define SQRL_CURVE_FE51
+#endif
+
+static const char *sqrl_curve_backend_names[SQRL_CURVE_BACKEND_COUNT] = {
+	"auto", "sodium", "fe51"
+};
+
+static int sqrl_curve_active = SQRL_CURVE_BACKEND_AUTO;
+
+#ifdef SQRL_CURVE_FE51
+
+typedef unsigned __int128 uint128_t;
+typedef uint64_t fe[5];
+
+#define FE_MASK 0x7ffffffffffffULL
+
+typedef struct { fe X, Y, Z; } ge_p2;
+typedef struct { fe X, Y, Z, T; } ge_p3;
+typedef struct { fe X, Y, Z, T; } ge_p1p1;
+typedef struct { fe yplusx, yminusx, xy2d; } ge_precomp;
+typedef struct { fe YplusX, YminusX, Z, T2d; } ge_cached;
+
+#define BASE_ROWS 64
+#define BASE_COLS 8
+#define VERIFY_WINDOW 8
+#define VERIFY_POINTS (1 << (VERIFY_WINDOW - 2))
+
+static fe fe_d, fe_d2, fe_sqrtm1;
+static uint8_t small_order_y[2][32];
+static ge_precomp base_table[BASE_ROWS][BASE_COLS];
+static ge_precomp base_odd[VERIFY_POINTS];
+static bool sqrl_curve_ready = false;
+
+/* Field arithmetic mod 2^255 - 19 */
+
+static void fe_0( fe h ) { memset( h, 0, sizeof( fe )); }
+static void fe_1( fe h ) { fe_0( h ); h[0] = 1; }
+static void fe_copy( fe h, const fe f ) { memcpy( h, f, sizeof( fe )); }
+
+static void fe_carry( fe h )
+{
+	uint64_t c;
+	c = h[0] >> 51; h[0] &= FE_MASK; h[1] += c;
+	c = h[1] >> 51; h[1] &= FE_MASK; h[2] += c;
+	c = h[2] >> 51; h[2] &= FE_MASK; h[3] += c;
+	c = h[3] >> 51; h[3] &= FE_MASK; h[4] += c;
+	c = h[4] >> 51; h[4] &= FE_MASK; h[0] += c * 19;
+}
+
+// Not carried: sums of carried values (limbs up to 2^53) are fine for
+// fe_mul(), fe_sq() and fe_sub(), and nothing adds sums together.
+static void fe_add( fe h, const fe f, const fe g )
+{
+	int i;
+	for( i = 0; i < 5; i++ ) h[i] = f[i] + g[i];
+}
+
+// f - g + 4p, so limbs never go negative
+static void fe_sub( fe h, const fe f, const fe g )
+{
+	h[0] = f[0] + 0x1fffffffffffb4ULL - g[0];
+	h[1] = f[1] + 0x1ffffffffffffcULL - g[1];
+	h[2] = f[2] + 0x1ffffffffffffcULL - g[2];
+	h[3] = f[3] + 0x1ffffffffffffcULL - g[3];
+	h[4] = f[4] + 0x1ffffffffffffcULL - g[4];
+	fe_carry( h );
+}
+
+static void fe_neg( fe h, const fe f )
+{
+	fe zero;
+	fe_0( zero );
+	fe_sub( h, zero, f );
+}
+
+static void fe_mul( fe h, const fe f, const fe g )
+{
+	uint128_t r0, r1, r2, r3, r4;
+	uint64_t f0 = f[0], f1 = f[1], f2 = f[2], f3 = f[3], f4 = f[4];
+	uint64_t g0 = g[0], g1 = g[1], g2 = g[2], g3 = g[3], g4 = g[4];
+	uint64_t g1_19 = 19 * g1, g2_19 = 19 * g2, g3_19 = 19 * g3, g4_19 = 19 * g4;
+	uint64_t c;
+
+	r0 = (uint128_t)f0 * g0 + (uint128_t)f1 * g4_19 + (uint128_t)f2 * g3_19 + (uint128_t)f3 * g2_19 + (uint128_t)f4 * g1_19;
+	r1 = (uint128_t)f0 * g1 + (uint128_t)f1 * g0 + (uint128_t)f2 * g4_19 + (uint128_t)f3 * g3_19 + (uint128_t)f4 * g2_19;
+	r2 = (uint128_t)f0 * g2 + (uint128_t)f1 * g1 + (uint128_t)f2 * g0 + (uint128_t)f3 * g4_19 + (uint128_t)f4 * g3_19;
+	r3 = (uint128_t)f0 * g3 + (uint128_t)f1 * g2 + (uint128_t)f2 * g1 + (uint128_t)f3 * g0 + (uint128_t)f4 * g4_19;
+	r4 = (uint128_t)f0 * g4 + (uint128_t)f1 * g3 + (uint128_t)f2 * g2 + (uint128_t)f3 * g1 + (uint128_t)f4 * g0;
+
+	r1 += (uint64_t)(r0 >> 51); h[0] = (uint64_t)r0 & FE_MASK;
+	r2 += (uint64_t)(r1 >> 51); h[1] = (uint64_t)r1 & FE_MASK;
+	r3 += (uint64_t)(r2 >> 51); h[2] = (uint64_t)r2 & FE_MASK;
+	r4 += (uint64_t)(r3 >> 51); h[3] = (uint64_t)r3 & FE_MASK;
+	c = (uint64_t)(r4 >> 51);   h[4] = (uint64_t)r4 & FE_MASK;
+	h[0] += c * 19;
+	c = h[0] >> 51; h[0] &= FE_MASK; h[1] += c;
+}
+
+static void fe_sq( fe h, const fe f )
+{
+	uint128_t r0, r1, r2, r3, r4;
+	uint64_t f0 = f[0], f1 = f[1], f2 = f[2], f3 = f[3], f4 = f[4];
+	uint64_t f0_2 = 2 * f0, f1_2 = 2 * f1;
+	uint64_t f1_38 = 38 * f1, f2_38 = 38 * f2, f3_38 = 38 * f3;
+	uint64_t f3_19 = 19 * f3, f4_19 = 19 * f4;
+	uint64_t c;
+
+	r0 = (uint128_t)f0 * f0 + (uint128_t)f1_38 * f4 + (uint128_t)f2_38 * f3;
+	r1 = (uint128_t)f0_2 * f1 + (uint128_t)f2_38 * f4 + (uint128_t)f3_19 * f3;
+	r2 = (uint128_t)f0_2 * f2 + (uint128_t)f1 * f1 + (uint128_t)f3_38 * f4;
+	r3 = (uint128_t)f0_2 * f3 + (uint128_t)f1_2 * f2 + (uint128_t)f4_19 * f4;
+	r4 = (uint128_t)f0_2 * f4 + (uint128_t)f1_2 * f3 + (uint128_t)f2 * f2;
+
+	r1 += (uint64_t)(r0 >> 51); h[0] = (uint64_t)r0 & FE_MASK;
+	r2 += (uint64_t)(r1 >> 51); h[1] = (uint64_t)r1 & FE_MASK;
+	r3 += (uint64_t)(r2 >> 51); h[2] = (uint64_t)r2 & FE_MASK;
+	r4 += (uint64_t)(r3 >> 51); h[3] = (uint64_t)r3 & FE_MASK;
+	c = (uint64_t)(r4 >> 51);   h[4] = (uint64_t)r4 & FE_MASK;
+	h[0] += c * 19;
+	c = h[0] >> 51; h[0] &= FE_MASK; h[1] += c;
+}
+
+static void fe_sqn( fe h, const fe f, int n )
+{
+	fe_sq( h, f );
+	while( --n > 0 ) fe_sq( h, h );
+}
+
+static void fe_mul_small( fe h, const fe f, uint32_t n )
+{
+	uint128_t r;
+	uint64_t c = 0;
+	int i;
+	for( i = 0; i < 5; i++ ) {
+		r = (uint128_t)f[i] * n + c;
+		h[i] = (uint64_t)r & FE_MASK;
+		c = (uint64_t)(r >> 51);
+	}
+	h[0] += c * 19;
+	c = h[0] >> 51; h[0] &= FE_MASK; h[1] += c;
+}
+
+// z^(2^250 - 1), and z^11 in z11
+static void fe_pow2_250( fe out, fe z11, const fe z )
+{
+	fe t0, t1, t2;
+	fe_sq( t0, z );						// 2
+	fe_sqn( t1, t0, 2 );				// 8
+	fe_mul( t1, z, t1 );				// 9
+	fe_mul( z11, t0, t1 );				// 11
+	fe_sq( t0, z11 );					// 22
+	fe_mul( t0, t1, t0 );				// 2^5 - 1
+	fe_sqn( t1, t0, 5 );
+	fe_mul( t0, t1, t0 );				// 2^10 - 1
+	fe_sqn( t1, t0, 10 );
+	fe_mul( t1, t1, t0 );				// 2^20 - 1
+	fe_sqn( t2, t1, 20 );
+	fe_mul( t1, t2, t1 );				// 2^40 - 1
+	fe_sqn( t1, t1, 10 );
+	fe_mul( t0, t1, t0 );				// 2^50 - 1
+	fe_sqn( t1, t0, 50 );
+	fe_mul( t1, t1, t0 );				// 2^100 - 1
+	fe_sqn( t2, t1, 100 );
+	fe_mul( t1, t2, t1 );				// 2^200 - 1
+	fe_sqn( t1, t1, 50 );
+	fe_mul( out, t1, t0 );				// 2^250 - 1
+}
+
+// z^(p - 2)
+static void fe_invert( fe out, const fe z )
+{
+	fe t, z11;
+	fe_pow2_250( t, z11, z );
+	fe_sqn( t, t, 5 );
+	fe_mul( out, t, z11 );
+}
+
+// z^((p - 5) / 8)
+static void fe_pow22523( fe out, const fe z )
+{
+	fe t, z11;
+	fe_pow2_250( t, z11, z );
+	fe_sqn( t, t, 2 );
+	fe_mul( out, t, z );
+}
+
+static uint64_t fe_load64( const uint8_t *s )
+{
+	uint64_t r = 0;
+	int i;
+	for( i = 7; i >= 0; i-- ) r = (r << 8) | s[i];
+	return r;
+}
+
+static void fe_frombytes( fe h, const uint8_t s[32] )
+{
+	h[0] = fe_load64( s ) & FE_MASK;
+	h[1] = (fe_load64( s + 6 ) >> 3) & FE_MASK;
+	h[2] = (fe_load64( s + 12 ) >> 6) & FE_MASK;
+	h[3] = (fe_load64( s + 19 ) >> 1) & FE_MASK;
+	h[4] = (fe_load64( s + 24 ) >> 12) & FE_MASK;
+}
+
+static void fe_tobytes( uint8_t s[32], const fe h )
+{
+	fe t;
+	uint64_t w[4];
+	int i, k;
+	fe_copy( t, h );
+	fe_carry( t );
+	fe_carry( t );
+	// t < 2^255; adding 19 carries out of 2^255 exactly when t >= p
+	t[0] += 19;
+	fe_carry( t );
+	t[0] += 0x8000000000000ULL - 19;
+	for( i = 1; i < 5; i++ ) t[i] += 0x8000000000000ULL - 1;
+	for( i = 0; i < 4; i++ ) {
+		t[i + 1] += t[i] >> 51;
+		t[i] &= FE_MASK;
+	}
+	t[4] &= FE_MASK;
+	w[0] = t[0] | (t[1] << 51);
+	w[1] = (t[1] >> 13) | (t[2] << 38);
+	w[2] = (t[2] >> 26) | (t[3] << 25);
+	w[3] = (t[3] >> 39) | (t[4] << 12);
+	for( i = 0; i < 4; i++ ) {
+		for( k = 0; k < 8; k++ ) s[i * 8 + k] = (uint8_t)(w[i] >> (8 * k));
+	}
+}
+
+static int fe_isnegative( const fe f )
+{
+	uint8_t s[32];
+	fe_tobytes( s, f );
+	return s[0] & 1;
+}
+
+static int fe_iszero( const fe f )
+{
+	uint8_t s[32], d = 0;
+	int i;
+	fe_tobytes( s, f );
+	for( i = 0; i < 32; i++ ) d |= s[i];
+	return d == 0;
+}
+
+static void fe_cmov( fe f, const fe g, unsigned int b )
+{
+	uint64_t mask = (uint64_t)0 - (uint64_t)b;
+	int i;
+	for( i = 0; i < 5; i++ ) f[i] ^= mask & (f[i] ^ g[i]);
+}
+
+static void fe_cswap( fe f, fe g, unsigned int b )
+{
+	uint64_t mask = (uint64_t)0 - (uint64_t)b, x;
+	int i;
+	for( i = 0; i < 5; i++ ) {
+		x = mask & (f[i] ^ g[i]);
+		f[i] ^= x;
+		g[i] ^= x;
+	}
+}
+
+// Sets h to a square root of a, if there is one.
+static bool fe_sqrt( fe h, const fe a )
+{
+	fe t, check;
+	fe_pow22523( t, a );
+	fe_mul( h, t, a );		// a^((p + 3) / 8)
+	fe_sq( check, h );
+	fe_sub( check, check, a );
+	if( fe_iszero( check )) return true;
+	fe_mul( h, h, fe_sqrtm1 );
+	fe_sq( check, h );
+	fe_sub( check, check, a );
+	return fe_iszero( check );
+}
+
+/* Group operations, as in ref10 */
+
+static void ge_p3_0( ge_p3 *h )
+{
+	fe_0( h->X );
+	fe_1( h->Y );
+	fe_1( h->Z );
+	fe_0( h->T );
+}
+
+static void ge_precomp_0( ge_precomp *h )
+{
+	fe_1( h->yplusx );
+	fe_1( h->yminusx );
+	fe_0( h->xy2d );
+}
+
+static void ge_p1p1_to_p2( ge_p2 *r, const ge_p1p1 *p )
+{
+	fe_mul( r->X, p->X, p->T );
+	fe_mul( r->Y, p->Y, p->Z );
+	fe_mul( r->Z, p->Z, p->T );
+}
+
+static void ge_p1p1_to_p3( ge_p3 *r, const ge_p1p1 *p )
+{
+	fe_mul( r->X, p->X, p->T );
+	fe_mul( r->Y, p->Y, p->Z );
+	fe_mul( r->Z, p->Z, p->T );
+	fe_mul( r->T, p->X, p->Y );
+}
+
+static void ge_p3_to_cached( ge_cached *r, const ge_p3 *p )
+{
+	fe_add( r->YplusX, p->Y, p->X );
+	fe_sub( r->YminusX, p->Y, p->X );
+	fe_copy( r->Z, p->Z );
+	fe_mul( r->T2d, p->T, fe_d2 );
+}
+
+static void ge_p2_dbl( ge_p1p1 *r, const ge_p2 *p )
+{
+	fe t0;
+	fe_sq( r->X, p->X );
+	fe_sq( r->Z, p->Y );
+	fe_sq( r->T, p->Z );
+	fe_add( r->T, r->T, r->T );
+	fe_add( r->Y, p->X, p->Y );
+	fe_sq( t0, r->Y );
+	fe_add( r->Y, r->Z, r->X );
+	fe_sub( r->Z, r->Z, r->X );
+	fe_sub( r->X, t0, r->Y );
+	fe_sub( r->T, r->T, r->Z );
+}
+
+static void ge_p3_dbl( ge_p1p1 *r, const ge_p3 *p )
+{
+	ge_p2 q;
+	fe_copy( q.X, p->X );
+	fe_copy( q.Y, p->Y );
+	fe_copy( q.Z, p->Z );
+	ge_p2_dbl( r, &q );
+}
+
+static void ge_add( ge_p1p1 *r, const ge_p3 *p, const ge_cached *q )
+{
+	fe t0;
+	fe_add( r->X, p->Y, p->X );
+	fe_sub( r->Y, p->Y, p->X );
+	fe_mul( r->Z, r->X, q->YplusX );
+	fe_mul( r->Y, r->Y, q->YminusX );
+	fe_mul( r->T, q->T2d, p->T );
+	fe_mul( r->X, p->Z, q->Z );
+	fe_add( t0, r->X, r->X );
+	fe_sub( r->X, r->Z, r->Y );
+	fe_add( r->Y, r->Z, r->Y );
+	fe_add( r->Z, t0, r->T );
+	fe_sub( r->T, t0, r->T );
+}
+
+static void ge_sub( ge_p1p1 *r, const ge_p3 *p, const ge_cached *q )
+{
+	fe t0;
+	fe_add( r->X, p->Y, p->X );
+	fe_sub( r->Y, p->Y, p->X );
+	fe_mul( r->Z, r->X, q->YminusX );
+	fe_mul( r->Y, r->Y, q->YplusX );
+	fe_mul( r->T, q->T2d, p->T );
+	fe_mul( r->X, p->Z, q->Z );
+	fe_add( t0, r->X, r->X );
+	fe_sub( r->X, r->Z, r->Y );
+	fe_add( r->Y, r->Z, r->Y );
+	fe_sub( r->Z, t0, r->T );
+	fe_add( r->T, t0, r->T );
+}
+
+static void ge_madd( ge_p1p1 *r, const ge_p3 *p, const ge_precomp *q )
+{
+	fe t0;
+	fe_add( r->X, p->Y, p->X );
+	fe_sub( r->Y, p->Y, p->X );
+	fe_mul( r->Z, r->X, q->yplusx );
+	fe_mul( r->Y, r->Y, q->yminusx );
+	fe_mul( r->T, q->xy2d, p->T );
+	fe_add( t0, p->Z, p->Z );
+	fe_sub( r->X, r->Z, r->Y );
+	fe_add( r->Y, r->Z, r->Y );
+	fe_add( r->Z, t0, r->T );
+	fe_sub( r->T, t0, r->T );
+}
+
+static void ge_msub( ge_p1p1 *r, const ge_p3 *p, const ge_precomp *q )
+{
+	fe t0;
+	fe_add( r->X, p->Y, p->X );
+	fe_sub( r->Y, p->Y, p->X );
+	fe_mul( r->Z, r->X, q->yminusx );
+	fe_mul( r->Y, r->Y, q->yplusx );
+	fe_mul( r->T, q->xy2d, p->T );
+	fe_add( t0, p->Z, p->Z );
+	fe_sub( r->X, r->Z, r->Y );
+	fe_add( r->Y, r->Z, r->Y );
+	fe_sub( r->Z, t0, r->T );
+	fe_add( r->T, t0, r->T );
+}
+
+static void ge_p2_tobytes( uint8_t s[32], const fe X, const fe Y, const fe Z )
+{
+	fe recip, x, y;
+	fe_invert( recip, Z );
+	fe_mul( x, X, recip );
+	fe_mul( y, Y, recip );
+	fe_tobytes( s, y );
+	s[31] ^= (uint8_t)(fe_isnegative( x ) << 7);
+}
+
+// Decodes -P from its encoding; fails if there is no such point.
+static int ge_frombytes_negate_vartime( ge_p3 *h, const uint8_t s[32] )
+{
+	fe u, v, v3, vxx, check;
+	fe_frombytes( h->Y, s );
+	fe_1( h->Z );
+	fe_sq( u, h->Y );
+	fe_mul( v, u, fe_d );
+	fe_sub( u, u, h->Z );		// y^2 - 1
+	fe_add( v, v, h->Z );		// dy^2 + 1
+	fe_sq( v3, v );
+	fe_mul( v3, v3, v );		// v^3
+	fe_sq( h->X, v3 );
+	fe_mul( h->X, h->X, v );
+	fe_mul( h->X, h->X, u );	// uv^7
+	fe_pow22523( h->X, h->X );
+	fe_mul( h->X, h->X, v3 );
+	fe_mul( h->X, h->X, u );	// uv^3 (uv^7)^((p - 5) / 8)
+	fe_sq( vxx, h->X );
+	fe_mul( vxx, vxx, v );
+	fe_sub( check, vxx, u );
+	if( !fe_iszero( check )) {
+		fe_add( check, vxx, u );
+		if( !fe_iszero( check )) return -1;
+		fe_mul( h->X, h->X, fe_sqrtm1 );
+	}
+	if( fe_isnegative( h->X ) == (s[31] >> 7) ) {
+		fe_neg( h->X, h->X );
+	}
+	fe_mul( h->T, h->X, h->Y );
+	return 0;
+}
+
+// Normalizes points to affine precomputed form, with one inversion.
+static void ge_batch_precomp( ge_precomp *out, const ge_p3 *in, int count )
+{
+	fe *acc = malloc( count * sizeof( fe ));
+	fe inv, t, x, y;
+	int i;
+	fe_copy( acc[0], in[0].Z );
+	for( i = 1; i < count; i++ ) fe_mul( acc[i], acc[i - 1], in[i].Z );
+	fe_invert( inv, acc[count - 1] );
+	for( i = count - 1; i >= 0; i-- ) {
+		if( i > 0 ) {
+			fe_mul( t, inv, acc[i - 1] );	// 1 / Z_i
+			fe_mul( inv, inv, in[i].Z );
+		} else {
+			fe_copy( t, inv );
+		}
+		fe_mul( x, in[i].X, t );
+		fe_mul( y, in[i].Y, t );
+		fe_add( out[i].yplusx, y, x );
+		fe_sub( out[i].yminusx, y, x );
+		fe_mul( out[i].xy2d, x, y );
+		fe_mul( out[i].xy2d, out[i].xy2d, fe_d2 );
+	}
+	free( acc );
+}
+
+static unsigned char ct_equal( signed char b, signed char c )
+{
+	uint32_t y = (uint8_t)(b ^ c);
+	y -= 1;
+	return (unsigned char)(y >> 31);
+}
+
+static unsigned char ct_negative( signed char b )
+{
+	uint64_t x = (uint64_t)(int64_t)b;
+	return (unsigned char)(x >> 63);
+}
+
+static void ge_select( ge_precomp *t, int pos, signed char b )
+{
+	ge_precomp minust;
+	unsigned char bnegative = ct_negative( b );
+	unsigned char babs = (unsigned char)(b - (((-bnegative) & b) * 2));
+	int j;
+	ge_precomp_0( t );
+	for( j = 0; j < BASE_COLS; j++ ) {
+		unsigned int m = ct_equal( (signed char)babs, (signed char)(j + 1) );
+		fe_cmov( t->yplusx, base_table[pos][j].yplusx, m );
+		fe_cmov( t->yminusx, base_table[pos][j].yminusx, m );
+		fe_cmov( t->xy2d, base_table[pos][j].xy2d, m );
+	}
+	fe_copy( minust.yplusx, t->yminusx );
+	fe_copy( minust.yminusx, t->yplusx );
+	fe_neg( minust.xy2d, t->xy2d );
+	fe_cmov( t->yplusx, minust.yplusx, bnegative );
+	fe_cmov( t->yminusx, minust.yminusx, bnegative );
+	fe_cmov( t->xy2d, minust.xy2d, bnegative );
+}
+
+// h = a * B, in constant time.  Requires a[31] <= 127.
+static void ge_scalarmult_base( ge_p3 *h, const uint8_t a[32] )
+{
+	signed char e[64], carry = 0;
+	ge_p1p1 r;
+	ge_precomp t;
+	int i;
+	for( i = 0; i < 32; i++ ) {
+		e[2 * i] = a[i] & 15;
+		e[2 * i + 1] = (a[i] >> 4) & 15;
+	}
+	// Signed digits, -8 to 8
+	for( i = 0; i < 63; i++ ) {
+		e[i] += carry;
+		carry = (signed char)((e[i] + 8) >> 4);
+		e[i] -= (signed char)(carry * 16);
+	}
+	e[63] += carry;
+
+	ge_p3_0( h );
+	for( i = 0; i < BASE_ROWS; i++ ) {
+		ge_select( &t, i, e[i] );
+		ge_madd( &r, h, &t );
+		ge_p1p1_to_p3( h, &r );
+	}
+	sodium_memzero( e, sizeof( e ));
+}
+
+// Width-w NAF: odd digits of at most 2^(w-1) - 1, each followed by w - 1 zeros.
+static void sqrl_curve_wnaf( signed char r[256], const uint8_t a[32], int w )
+{
+	int limit = (1 << (w - 1)) - 1;
+	int i, b, k;
+	for( i = 0; i < 256; i++ ) {
+		r[i] = 1 & (a[i >> 3] >> (i & 7));
+	}
+	for( i = 0; i < 256; i++ ) {
+		if( !r[i] ) continue;
+		for( b = 1; b <= w && i + b < 256; b++ ) {
+			if( !r[i + b] ) continue;
+			if( r[i] + (r[i + b] << b) <= limit ) {
+				r[i] += r[i + b] << b;
+				r[i + b] = 0;
+			} else if( r[i] - (r[i + b] << b) >= -limit ) {
+				r[i] -= r[i + b] << b;
+				for( k = i + b; k < 256; k++ ) {
+					if( !r[k] ) {
+						r[k] = 1;
+						break;
+					}
+					r[k] = 0;
+				}
+			} else {
+				break;
+			}
+		}
+	}
+}
+
+// r = a * A + b * B, in variable time.
+static void ge_double_scalarmult_vartime( ge_p2 *r, const uint8_t a[32], const ge_p3 *A, const uint8_t b[32] )
+{
+	signed char aslide[256], bslide[256];
+	ge_cached Ai[8];
+	ge_p1p1 t;
+	ge_p3 u, A2;
+	int i;
+
+	sqrl_curve_wnaf( aslide, a, 5 );
+	sqrl_curve_wnaf( bslide, b, VERIFY_WINDOW );
+
+	ge_p3_to_cached( &Ai[0], A );
+	ge_p3_dbl( &t, A );
+	ge_p1p1_to_p3( &A2, &t );
+	for( i = 1; i < 8; i++ ) {
+		ge_add( &t, &A2, &Ai[i - 1] );
+		ge_p1p1_to_p3( &u, &t );
+		ge_p3_to_cached( &Ai[i], &u );
+	}
+
+	fe_0( r->X );
+	fe_1( r->Y );
+	fe_1( r->Z );
+	for( i = 255; i >= 0; i-- ) {
+		if( aslide[i] || bslide[i] ) break;
+	}
+	for( ; i >= 0; i-- ) {
+		ge_p2_dbl( &t, r );
+		if( aslide[i] > 0 ) {
+			ge_p1p1_to_p3( &u, &t );
+			ge_add( &t, &u, &Ai[aslide[i] / 2] );
+		} else if( aslide[i] < 0 ) {
+			ge_p1p1_to_p3( &u, &t );
+			ge_sub( &t, &u, &Ai[(-aslide[i]) / 2] );
+		}
+		if( bslide[i] > 0 ) {
+			ge_p1p1_to_p3( &u, &t );
+			ge_madd( &t, &u, &base_odd[bslide[i] / 2] );
+		} else if( bslide[i] < 0 ) {
+			ge_p1p1_to_p3( &u, &t );
+			ge_msub( &t, &u, &base_odd[(-bslide[i]) / 2] );
+		}
+		ge_p1p1_to_p2( r, &t );
+	}
+}
+
+static bool ge_p3_is_identity( const ge_p3 *p )
+{
+	fe t;
+	fe_sub( t, p->Y, p->Z );
+	return fe_iszero( p->X ) && fe_iszero( t );
+}
+
+/* Setup */
+
+static void sqrl_curve_build()
+{
+	static const uint8_t pm1_over4[32] = {
+		0xfb, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x1f
+	};
+	ge_p3 *points, B, P, B2;
+	ge_p1p1 t;
+	ge_cached c;
+	fe one, two, num, den, s, y2, y;
+	uint8_t enc[32];
+	int i, j, k;
+
+	// d = -121665 / 121666
+	fe_0( num );
+	num[0] = 121665;
+	fe_neg( num, num );
+	fe_0( den );
+	den[0] = 121666;
+	fe_invert( den, den );
+	fe_mul( fe_d, num, den );
+	fe_add( fe_d2, fe_d, fe_d );
+
+	// sqrt(-1) = 2^((p - 1) / 4)
+	fe_0( two );
+	two[0] = 2;
+	fe_1( s );
+	for( i = 255; i >= 0; i-- ) {
+		fe_sq( s, s );
+		if( (pm1_over4[i >> 3] >> (i & 7)) & 1 ) fe_mul( s, s, two );
+	}
+	fe_copy( fe_sqrtm1, s );
+
+	// The base point has y = 4/5 and positive x
+	fe_0( num );
+	num[0] = 4;
+	fe_0( den );
+	den[0] = 5;
+	fe_invert( den, den );
+	fe_mul( y, num, den );
+	fe_tobytes( enc, y );
+	if( ge_frombytes_negate_vartime( &B, enc ) != 0 ) return;
+	fe_neg( B.X, B.X );
+	fe_neg( B.T, B.T );
+
+	// Points of order 8 have y^2 = (-1 +- sqrt(1 + d)) / d
+	fe_1( one );
+	fe_add( num, one, fe_d );
+	if( !fe_sqrt( s, num )) return;
+	fe_invert( den, fe_d );
+	for( k = 0; k < 2; k++ ) {
+		if( k == 0 ) {
+			fe_sub( y2, s, one );				// -1 + sqrt(1 + d)
+		} else {
+			fe_add( y2, one, s );
+			fe_neg( y2, y2 );					// -1 - sqrt(1 + d)
+		}
+		fe_mul( y2, y2, den );
+		if( fe_sqrt( y, y2 )) break;
+	}
+	if( k == 2 ) return;
+	fe_tobytes( small_order_y[0], y );
+	fe_neg( y, y );
+	fe_tobytes( small_order_y[1], y );
+	// Check it really is of order 8
+	if( ge_frombytes_negate_vartime( &P, small_order_y[0] ) != 0 ) return;
+	for( i = 0; i < 3; i++ ) {
+		if( i == 2 && ge_p3_is_identity( &P )) return;
+		ge_p3_dbl( &t, &P );
+		ge_p1p1_to_p3( &P, &t );
+	}
+	if( !ge_p3_is_identity( &P )) return;
+
+	points = malloc( BASE_ROWS * BASE_COLS * sizeof( ge_p3 ));
+	if( !points ) return;
+
+	// Row i holds 1..8 times 16^i B
+	P = B;
+	for( i = 0; i < BASE_ROWS; i++ ) {
+		ge_p3_to_cached( &c, &P );
+		points[i * BASE_COLS] = P;
+		for( j = 1; j < BASE_COLS; j++ ) {
+			ge_add( &t, &points[i * BASE_COLS + j - 1], &c );
+			ge_p1p1_to_p3( &points[i * BASE_COLS + j], &t );
+		}
+		for( j = 0; j < 4; j++ ) {
+			ge_p3_dbl( &t, &P );
+			ge_p1p1_to_p3( &P, &t );
+		}
+	}
+	ge_batch_precomp( &base_table[0][0], points, BASE_ROWS * BASE_COLS );
+
+	// B, 3B, 5B, ...
+	ge_p3_dbl( &t, &B );
+	ge_p1p1_to_p3( &B2, &t );
+	ge_p3_to_cached( &c, &B2 );
+	points[0] = B;
+	for( i = 1; i < VERIFY_POINTS; i++ ) {
+		ge_add( &t, &points[i - 1], &c );
+		ge_p1p1_to_p3( &points[i], &t );
+	}
+	ge_batch_precomp( base_odd, points, VERIFY_POINTS );
+	free( points );
+
+	sqrl_curve_ready = true;
+}
+
+#ifdef UNIX
+static pthread_once_t sqrl_curve_once = PTHREAD_ONCE_INIT;
+#else
+static INIT_ONCE sqrl_curve_once = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK sqrl_curve_build_once( PINIT_ONCE once, PVOID param, PVOID *context )
+{
+	sqrl_curve_build();
+	return TRUE;
+}
+#endif
+
+static bool sqrl_curve_init()
+{
+#ifdef UNIX
+	pthread_once( &sqrl_curve_once, sqrl_curve_build );
+#else
+	InitOnceExecuteOnce( &sqrl_curve_once, sqrl_curve_build_once, NULL, NULL );
+#endif
+	return sqrl_curve_ready;
+}
+
+/* Operations */
+
+static const uint8_t sqrl_curve_order[32] = {
+	0xed, 0xd3, 0xf5, 0x5c, 0x1a, 0x63, 0x12, 0x58, 0xd6, 0x9c, 0xf7, 0xa2, 0xde, 0xf9, 0xde, 0x14,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10
+};
+
+// s < L
+static bool sqrl_curve_scalar_is_canonical( const uint8_t s[32] )
+{
+	int i;
+	for( i = 31; i >= 0; i-- ) {
+		if( s[i] < sqrl_curve_order[i] ) return true;
+		if( s[i] > sqrl_curve_order[i] ) return false;
+	}
+	return false;
+}
+
+// y < p
+static bool sqrl_curve_point_is_canonical( const uint8_t s[32] )
+{
+	int i;
+	if( (s[31] & 0x7f) != 0x7f ) return true;
+	for( i = 30; i > 0; i-- ) {
+		if( s[i] != 0xff ) return true;
+	}
+	return s[0] < 0xed;
+}
+
+// Matches libsodium's list: y is 0, 1, -1 or an order 8 y, allowing the
+// non-canonical encodings of 0 and 1.
+static bool sqrl_curve_has_small_order( const uint8_t s[32] )
+{
+	uint8_t y[32];
+	fe f;
+	int i, k;
+	bool zero = true, one = true, minus = true;
+	fe_frombytes( f, s );
+	fe_tobytes( y, f );
+	for( i = 0; i < 32; i++ ) {
+		if( y[i] != 0 ) zero = false;
+		if( y[i] != (i == 0 ? 1 : 0) ) one = false;
+		if( y[i] != (i == 0 ? 0xec : i == 31 ? 0x7f : 0xff) ) minus = false;
+	}
+	if( zero || one || minus ) return true;
+	for( k = 0; k < 2; k++ ) {
+		if( 0 == memcmp( y, small_order_y[k], 32 )) return true;
+	}
+	return false;
+}
+
+static int sqrl_curve_fe51_ed25519_base( uint8_t q[32], const uint8_t n[32] )
+{
+	uint8_t t[32], d = 0;
+	ge_p3 P;
+	int i;
+	memcpy( t, n, 32 );
+	t[31] &= 127;
+	ge_scalarmult_base( &P, t );
+	ge_p2_tobytes( q, P.X, P.Y, P.Z );
+	sodium_memzero( t, sizeof( t ));
+	for( i = 0; i < 32; i++ ) d |= n[i];
+	// The identity, or a zero scalar
+	for( i = 1; i < 32; i++ ) {
+		if( q[i] ) break;
+	}
+	if( d == 0 || (i == 32 && q[0] == 1) ) return -1;
+	return 0;
+}
+
+static int sqrl_curve_fe51_ed25519_verify( const uint8_t sig[64], const uint8_t *m, size_t mlen, const uint8_t pk[32] )
+{
+	crypto_hash_sha512_state hs;
+	uint8_t h[64], rcheck[32];
+	ge_p3 A;
+	ge_p2 R;
+
+	if( !sqrl_curve_scalar_is_canonical( sig + 32 ) || sqrl_curve_has_small_order( sig )) return -1;
+	if( !sqrl_curve_point_is_canonical( pk ) || sqrl_curve_has_small_order( pk )) return -1;
+	if( ge_frombytes_negate_vartime( &A, pk ) != 0 ) return -1;
+
+	crypto_hash_sha512_init( &hs );
+	crypto_hash_sha512_update( &hs, sig, 32 );
+	crypto_hash_sha512_update( &hs, pk, 32 );
+	crypto_hash_sha512_update( &hs, m, mlen );
+	crypto_hash_sha512_final( &hs, h );
+	crypto_core_ed25519_scalar_reduce( h, h );
+
+	ge_double_scalarmult_vartime( &R, h, &A, sig + 32 );
+	ge_p2_tobytes( rcheck, R.X, R.Y, R.Z );
+	return sodium_memcmp( rcheck, sig, 32 );
+}
+
+static int sqrl_curve_fe51_x25519_base( uint8_t q[32], const uint8_t n[32] )
+{
+	uint8_t e[32];
+	ge_p3 P;
+	fe num, den;
+	memcpy( e, n, 32 );
+	e[0] &= 248;
+	e[31] &= 127;
+	e[31] |= 64;
+	ge_scalarmult_base( &P, e );
+	// u = (1 + y) / (1 - y) = (Z + Y) / (Z - Y)
+	fe_add( num, P.Z, P.Y );
+	fe_sub( den, P.Z, P.Y );
+	fe_invert( den, den );
+	fe_mul( num, num, den );
+	fe_tobytes( q, num );
+	sodium_memzero( e, sizeof( e ));
+	sodium_memzero( &P, sizeof( P ));
+	return 0;
+}
+
+static int sqrl_curve_fe51_x25519( uint8_t q[32], const uint8_t n[32], const uint8_t p[32] )
+{
+	uint8_t e[32], d = 0;
+	fe x1, x2, z2, x3, z3, a, aa, b, bb, c, dd, da, cb, t;
+	unsigned int swap = 0, bit;
+	int pos, i;
+
+	memcpy( e, n, 32 );
+	e[0] &= 248;
+	e[31] &= 127;
+	e[31] |= 64;
+	fe_frombytes( x1, p );
+	fe_1( x2 );
+	fe_0( z2 );
+	fe_copy( x3, x1 );
+	fe_1( z3 );
+	for( pos = 254; pos >= 0; pos-- ) {
+		bit = (e[pos >> 3] >> (pos & 7)) & 1;
+		swap ^= bit;
+		fe_cswap( x2, x3, swap );
+		fe_cswap( z2, z3, swap );
+		swap = bit;
+		fe_add( a, x2, z2 );
+		fe_sq( aa, a );
+		fe_sub( b, x2, z2 );
+		fe_sq( bb, b );
+		fe_sub( t, aa, bb );		// E
+		fe_add( c, x3, z3 );
+		fe_sub( dd, x3, z3 );
+		fe_mul( da, dd, a );
+		fe_mul( cb, c, b );
+		fe_add( x3, da, cb );
+		fe_sq( x3, x3 );
+		fe_sub( z3, da, cb );
+		fe_sq( z3, z3 );
+		fe_mul( z3, z3, x1 );
+		fe_mul( x2, aa, bb );
+		fe_mul_small( z2, t, 121665 );
+		fe_add( z2, z2, aa );
+		fe_mul( z2, z2, t );
+	}
+	fe_cswap( x2, x3, swap );
+	fe_cswap( z2, z3, swap );
+	fe_invert( z2, z2 );
+	fe_mul( x2, x2, z2 );
+	fe_tobytes( q, x2 );
+	sodium_memzero( e, sizeof( e ));
+	sodium_memzero( x2, sizeof( fe ));
+	sodium_memzero( x3, sizeof( fe ));
+	// Small order points give zero
+	for( i = 0; i < 32; i++ ) d |= q[i];
+	return d == 0 ? -1 : 0;
+}
+
+#endif /* SQRL_CURVE_FE51 */
+
+// Checks whether a curve backend can be used here.
+bool sqrl_curve_backend_supported( Sqrl_Curve_Backend backend )
+{
+	switch( backend ) {
+	case SQRL_CURVE_BACKEND_AUTO:
+	case SQRL_CURVE_BACKEND_SODIUM:
+		return true;
+#ifdef SQRL_CURVE_FE51
+	case SQRL_CURVE_BACKEND_FE51:
+		return sqrl_curve_init();
+#endif
+	default:
+		return false;
+	}
+}
+
+// Gets the curve backend in use, choosing the best on first use.
+Sqrl_Curve_Backend sqrl_curve_backend()
+{
+	int backend = SQRL_ATOMIC_LOAD( &sqrl_curve_active );
+	if( backend == SQRL_CURVE_BACKEND_AUTO ) {
+		backend = sqrl_curve_backend_supported( SQRL_CURVE_BACKEND_FE51 )
+			? SQRL_CURVE_BACKEND_FE51 : SQRL_CURVE_BACKEND_SODIUM;
+		SQRL_ATOMIC_STORE( &sqrl_curve_active, backend );
+	}
+	return (Sqrl_Curve_Backend)backend;
+}
+
+// Forces a curve backend (for testing), or returns to automatic selection
+// with SQRL_CURVE_BACKEND_AUTO.  Fails if it cannot be used here.
+bool sqrl_curve_select_backend( Sqrl_Curve_Backend backend )
+{
+	if( !sqrl_curve_backend_supported( backend )) return false;
+	SQRL_ATOMIC_STORE( &sqrl_curve_active, (int)backend );
+	return true;
+}
+
+const char *sqrl_curve_backend_name( Sqrl_Curve_Backend backend )
+{
+	if( backend < 0 || backend >= SQRL_CURVE_BACKEND_COUNT ) return NULL;
+	return sqrl_curve_backend_names[backend];
+}
+
+/**
+Multiplies the Ed25519 base point, as \p crypto_scalarmult_ed25519_base_noclamp().
+
+@param q Receives the encoded point
+@param n The scalar; its top bit is ignored
+@return 0 on success, -1 if \p n is zero or the result is the identity
+*/
+int sqrl_curve_ed25519_base( uint8_t q[32], const uint8_t n[32] )
+{
+#ifdef SQRL_CURVE_FE51
+	if( sqrl_curve_backend() == SQRL_CURVE_BACKEND_FE51 ) {
+		return sqrl_curve_fe51_ed25519_base( q, n );
+	}
+#endif
+	return crypto_scalarmult_ed25519_base_noclamp( q, n );
+}
+
+/**
+Verifies an Ed25519 signature, as \p crypto_sign_verify_detached().
+
+@param sig The 64 byte signature
+@param m The message
+@param mlen Length of \p m
+@param pk The 32 byte public key
+@return 0 if the signature is valid, otherwise -1
+*/
+int sqrl_curve_ed25519_verify( const uint8_t sig[64], const uint8_t *m, size_t mlen, const uint8_t pk[32] )
+{
+#ifdef SQRL_CURVE_FE51
+	if( sqrl_curve_backend() == SQRL_CURVE_BACKEND_FE51 ) {
+		return sqrl_curve_fe51_ed25519_verify( sig, m, mlen, pk ) == 0 ? 0 : -1;
+	}
+#endif
+	return crypto_sign_verify_detached( sig, m, mlen, pk );
+}
+
+/**
+Computes an X25519 public key, as \p crypto_scalarmult_base().
+
+@param q Receives the public key
+@param n The private key
+@return 0 on success
+*/
+int sqrl_curve_x25519_base( uint8_t q[32], const uint8_t n[32] )
+{
+#ifdef SQRL_CURVE_FE51
+	if( sqrl_curve_backend() == SQRL_CURVE_BACKEND_FE51 ) {
+		return sqrl_curve_fe51_x25519_base( q, n );
+	}
+#endif
+	return crypto_scalarmult_base( q, n );
+}
+
+/**
+Computes an X25519 shared secret, as \p crypto_scalarmult().
+
+@param q Receives the shared secret
+@param n Our private key
+@param p Their public key
+@return 0 on success, -1 if \p p has small order
+*/
+int sqrl_curve_x25519( uint8_t q[32], const uint8_t n[32], const uint8_t p[32] )
+{
+#ifdef SQRL_CURVE_FE51
+	if( sqrl_curve_backend() == SQRL_CURVE_BACKEND_FE51 ) {
+		return sqrl_curve_fe51_x25519( q, n, p );
+	}
+#endif
+	return crypto_scalarmult( q, n, p );
+}
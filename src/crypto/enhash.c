@@ -0,0 +1,374 @@
+/** @file enhash.c EnHash: sixteen chained SHA-256s, XORed together
+
+@author Adam Comley
+
+This file is part of libsqrl.  It is released under the MIT license.
+For more details, see the LICENSE file included with this package.
+
+Every link of the chain hashes exactly 32 bytes, which is one padded
+SHA-256 block, and each digest (as big-endian words) is the next block's
+first eight message words.  So the chain can stay in SHA-256's native
+word order from start to finish.
+
+With the SHA extensions, each EnHash takes about a microsecond.  Without
+them, independent EnHashes (\p sqrl_enhash_multi()) run together in the
+eight 32-bit lanes of AVX2, and failing that libsodium's SHA-256 is
+used.  Intermediate values are kept in the thread's locked scratch arena
+(see scratch.c), rather than in stack buffers locked on every call.
+**/
+
+#include "../sqrl_internal.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SQRL_ENHASH_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SQRL_ENHASH_TARGET(t) __attribute__((target(t)))
+#else
+#define SQRL_ENHASH_TARGET(t)
+#endif
+
+#define ENHASH_ROUNDS 16
+#define ENHASH_LANES 8
+#define ENHASH_SCRATCH_SIZE 4096
+
+static const uint32_t sqrl_sha256_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint32_t sqrl_sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const char *sqrl_enhash_kernel_names[SQRL_ENHASH_KERNEL_COUNT] = {
+	"auto", "scalar", "avx2", "sha"
+};
+
+static int sqrl_enhash_active = SQRL_ENHASH_KERNEL_AUTO;
+
+static uint32_t sqrl_be32dec( const uint8_t *p )
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+		((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void sqrl_be32enc( uint8_t *p, uint32_t x )
+{
+	p[0] = (uint8_t)(x >> 24);
+	p[1] = (uint8_t)(x >> 16);
+	p[2] = (uint8_t)(x >> 8);
+	p[3] = (uint8_t)x;
+}
+
+static void sqrl_enhash_scalar( uint8_t *out, const uint8_t *in, uint8_t *scratch )
+{
+	uint8_t *trans = scratch;
+	uint8_t *tmp = scratch + 32;
+	int i, k;
+	memset( out, 0, 32 );
+	memcpy( tmp, in, 32 );
+	for( i = 0; i < ENHASH_ROUNDS; i++ ) {
+		crypto_hash_sha256( trans, tmp, 32 );
+		for( k = 0; k < 32; k++ ) out[k] ^= trans[k];
+		memcpy( tmp, trans, 32 );
+	}
+}
+
+#ifdef SQRL_ENHASH_X86
+
+static bool sqrl_enhash_detect_shani()
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuidex( info, 7, 0 );
+	if( !(info[1] & (1 << 29)) ) return false;
+	__cpuid( info, 1 );
+	return (info[2] & (1 << 19)) && (info[2] & (1 << 9));
+#elif defined(__GNUC__) || defined(__clang__)
+	unsigned int a, b, c, d;
+	if( !__get_cpuid_count( 7, 0, &a, &b, &c, &d ) || !(b & (1u << 29)) ) return false;
+	if( !__get_cpuid( 1, &a, &b, &c, &d )) return false;
+	// SSSE3 and SSE4.1
+	return (c & (1u << 9)) && (c & (1u << 19));
+#else
+	return false;
+#endif
+}
+
+/*
+SHA extensions.  Four rounds per step; W0 to W3 hold a rolling window of
+sixteen message words, extended in place.  Steps 3 to 14 finish the next
+window with msg2, and steps 1 to 12 start one with msg1.
+*/
+#define SHANI_ROUND4( g, M0, M1, M3 ) \
+	MSG = _mm_add_epi32( M0, _mm_loadu_si128( (const __m128i*)&sqrl_sha256_k[(g) * 4] )); \
+	S1 = _mm_sha256rnds2_epu32( S1, S0, MSG ); \
+	if( (g) >= 3 && (g) <= 14 ) { \
+		M1 = _mm_sha256msg2_epu32( _mm_add_epi32( M1, _mm_alignr_epi8( M0, M3, 4 )), M0 ); \
+	} \
+	MSG = _mm_shuffle_epi32( MSG, 0x0E ); \
+	S0 = _mm_sha256rnds2_epu32( S0, S1, MSG ); \
+	if( (g) >= 1 && (g) <= 12 ) { \
+		M3 = _mm_sha256msg1_epu32( M3, M0 ); \
+	}
+
+SQRL_ENHASH_TARGET("sha,sse4.1,ssse3")
+static void sqrl_enhash_shani_one( uint8_t *out, const uint8_t *in )
+{
+	const __m128i BSWAP = _mm_set_epi64x( 0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL );
+	// The padding of a 32 byte message: words 8 and 15
+	const __m128i PAD0 = _mm_set_epi32( 0, 0, 0, (int)0x80000000 );
+	const __m128i PAD1 = _mm_set_epi32( 256, 0, 0, 0 );
+	__m128i IV0, IV1, S0, S1, MSG, TMP, W0, W1, W2, W3, H0, H1, A0, A1;
+	int i;
+
+	// The IV as ABEF and CDGH, the order sha256rnds2 works in
+	TMP = _mm_shuffle_epi32( _mm_loadu_si128( (const __m128i*)&sqrl_sha256_iv[0] ), 0xB1 );
+	IV1 = _mm_shuffle_epi32( _mm_loadu_si128( (const __m128i*)&sqrl_sha256_iv[4] ), 0x1B );
+	IV0 = _mm_alignr_epi8( TMP, IV1, 8 );
+	IV1 = _mm_blend_epi16( IV1, TMP, 0xF0 );
+
+	H0 = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i*)in ), BSWAP );
+	H1 = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i*)(in + 16) ), BSWAP );
+	A0 = _mm_setzero_si128();
+	A1 = _mm_setzero_si128();
+	for( i = 0; i < ENHASH_ROUNDS; i++ ) {
+		S0 = IV0;
+		S1 = IV1;
+		W0 = H0;
+		W1 = H1;
+		W2 = PAD0;
+		W3 = PAD1;
+		SHANI_ROUND4(  0, W0, W1, W3 )
+		SHANI_ROUND4(  1, W1, W2, W0 )
+		SHANI_ROUND4(  2, W2, W3, W1 )
+		SHANI_ROUND4(  3, W3, W0, W2 )
+		SHANI_ROUND4(  4, W0, W1, W3 )
+		SHANI_ROUND4(  5, W1, W2, W0 )
+		SHANI_ROUND4(  6, W2, W3, W1 )
+		SHANI_ROUND4(  7, W3, W0, W2 )
+		SHANI_ROUND4(  8, W0, W1, W3 )
+		SHANI_ROUND4(  9, W1, W2, W0 )
+		SHANI_ROUND4( 10, W2, W3, W1 )
+		SHANI_ROUND4( 11, W3, W0, W2 )
+		SHANI_ROUND4( 12, W0, W1, W3 )
+		SHANI_ROUND4( 13, W1, W2, W0 )
+		SHANI_ROUND4( 14, W2, W3, W1 )
+		SHANI_ROUND4( 15, W3, W0, W2 )
+		S0 = _mm_add_epi32( S0, IV0 );
+		S1 = _mm_add_epi32( S1, IV1 );
+
+		// Back to ABCD and EFGH: the digest, and the next message
+		TMP = _mm_shuffle_epi32( S0, 0x1B );
+		S1 = _mm_shuffle_epi32( S1, 0xB1 );
+		H0 = _mm_blend_epi16( TMP, S1, 0xF0 );
+		H1 = _mm_alignr_epi8( S1, TMP, 8 );
+		A0 = _mm_xor_si128( A0, H0 );
+		A1 = _mm_xor_si128( A1, H1 );
+	}
+	_mm_storeu_si128( (__m128i*)out, _mm_shuffle_epi8( A0, BSWAP ));
+	_mm_storeu_si128( (__m128i*)(out + 16), _mm_shuffle_epi8( A1, BSWAP ));
+}
+
+#undef SHANI_ROUND4
+
+/*
+AVX2: eight EnHashes at once, one per 32-bit lane.  The message schedule,
+chaining values and accumulators live in locked scratch memory.
+*/
+#define AVX_ROTR(x,n) _mm256_or_si256( _mm256_srli_epi32( (x), (n) ), _mm256_slli_epi32( (x), 32 - (n) ))
+#define AVX_XOR3(a,b,c) _mm256_xor_si256( _mm256_xor_si256( (a), (b) ), (c) )
+#define AVX_BSIG0(a) AVX_XOR3( AVX_ROTR( (a), 2 ), AVX_ROTR( (a), 13 ), AVX_ROTR( (a), 22 ))
+#define AVX_BSIG1(e) AVX_XOR3( AVX_ROTR( (e), 6 ), AVX_ROTR( (e), 11 ), AVX_ROTR( (e), 25 ))
+#define AVX_SSIG0(w) AVX_XOR3( AVX_ROTR( (w), 7 ), AVX_ROTR( (w), 18 ), _mm256_srli_epi32( (w), 3 ))
+#define AVX_SSIG1(w) AVX_XOR3( AVX_ROTR( (w), 17 ), AVX_ROTR( (w), 19 ), _mm256_srli_epi32( (w), 10 ))
+#define AVX_CH(e,f,g) _mm256_xor_si256( (g), _mm256_and_si256( (e), _mm256_xor_si256( (f), (g) )))
+#define AVX_MAJ(a,b,c) _mm256_or_si256( _mm256_and_si256( (a), (b) ), _mm256_and_si256( (c), _mm256_or_si256( (a), (b) )))
+
+#define AVX_ROUND( a, b, c, d, e, f, g, h, t ) { \
+	__m256i T1 = _mm256_add_epi32( _mm256_add_epi32( (h), AVX_BSIG1( e )), \
+		_mm256_add_epi32( AVX_CH( (e), (f), (g) ), \
+		_mm256_add_epi32( _mm256_set1_epi32( (int)sqrl_sha256_k[(t)] ), W[(t)] ))); \
+	d = _mm256_add_epi32( (d), T1 ); \
+	h = _mm256_add_epi32( T1, _mm256_add_epi32( AVX_BSIG0( a ), AVX_MAJ( (a), (b), (c) ))); }
+
+SQRL_ENHASH_TARGET("avx2")
+static void sqrl_enhash_avx2_lanes( uint8_t *const *out, const uint8_t *const *in, int count, uint8_t *scratch )
+{
+	__m256i *W = (__m256i*)scratch;           // 64 words
+	__m256i *H = W + 64;                      // Chaining value
+	__m256i *A = H + 8;                       // Accumulated output
+	uint32_t *lane = (uint32_t*)(A + 8);      // One transposed word
+	__m256i a, b, c, d, e, f, g, h;
+	int i, k, l, t;
+
+	for( k = 0; k < 8; k++ ) {
+		for( l = 0; l < ENHASH_LANES; l++ ) {
+			lane[l] = sqrl_be32dec( in[l < count ? l : 0] + k * 4 );
+		}
+		H[k] = _mm256_loadu_si256( (const __m256i*)lane );
+		A[k] = _mm256_setzero_si256();
+	}
+	for( i = 0; i < ENHASH_ROUNDS; i++ ) {
+		for( t = 0; t < 8; t++ ) W[t] = H[t];
+		W[8] = _mm256_set1_epi32( (int)0x80000000 );
+		for( t = 9; t < 15; t++ ) W[t] = _mm256_setzero_si256();
+		W[15] = _mm256_set1_epi32( 256 );
+		for( t = 16; t < 64; t++ ) {
+			W[t] = _mm256_add_epi32(
+				_mm256_add_epi32( AVX_SSIG1( W[t - 2] ), W[t - 7] ),
+				_mm256_add_epi32( AVX_SSIG0( W[t - 15] ), W[t - 16] ));
+		}
+		a = _mm256_set1_epi32( (int)sqrl_sha256_iv[0] );
+		b = _mm256_set1_epi32( (int)sqrl_sha256_iv[1] );
+		c = _mm256_set1_epi32( (int)sqrl_sha256_iv[2] );
+		d = _mm256_set1_epi32( (int)sqrl_sha256_iv[3] );
+		e = _mm256_set1_epi32( (int)sqrl_sha256_iv[4] );
+		f = _mm256_set1_epi32( (int)sqrl_sha256_iv[5] );
+		g = _mm256_set1_epi32( (int)sqrl_sha256_iv[6] );
+		h = _mm256_set1_epi32( (int)sqrl_sha256_iv[7] );
+		for( t = 0; t < 64; t += 8 ) {
+			AVX_ROUND( a, b, c, d, e, f, g, h, t + 0 )
+			AVX_ROUND( h, a, b, c, d, e, f, g, t + 1 )
+			AVX_ROUND( g, h, a, b, c, d, e, f, t + 2 )
+			AVX_ROUND( f, g, h, a, b, c, d, e, t + 3 )
+			AVX_ROUND( e, f, g, h, a, b, c, d, t + 4 )
+			AVX_ROUND( d, e, f, g, h, a, b, c, t + 5 )
+			AVX_ROUND( c, d, e, f, g, h, a, b, t + 6 )
+			AVX_ROUND( b, c, d, e, f, g, h, a, t + 7 )
+		}
+		H[0] = _mm256_add_epi32( a, _mm256_set1_epi32( (int)sqrl_sha256_iv[0] ));
+		H[1] = _mm256_add_epi32( b, _mm256_set1_epi32( (int)sqrl_sha256_iv[1] ));
+		H[2] = _mm256_add_epi32( c, _mm256_set1_epi32( (int)sqrl_sha256_iv[2] ));
+		H[3] = _mm256_add_epi32( d, _mm256_set1_epi32( (int)sqrl_sha256_iv[3] ));
+		H[4] = _mm256_add_epi32( e, _mm256_set1_epi32( (int)sqrl_sha256_iv[4] ));
+		H[5] = _mm256_add_epi32( f, _mm256_set1_epi32( (int)sqrl_sha256_iv[5] ));
+		H[6] = _mm256_add_epi32( g, _mm256_set1_epi32( (int)sqrl_sha256_iv[6] ));
+		H[7] = _mm256_add_epi32( h, _mm256_set1_epi32( (int)sqrl_sha256_iv[7] ));
+		for( k = 0; k < 8; k++ ) A[k] = _mm256_xor_si256( A[k], H[k] );
+	}
+	for( k = 0; k < 8; k++ ) {
+		_mm256_storeu_si256( (__m256i*)lane, A[k] );
+		for( l = 0; l < count; l++ ) {
+			sqrl_be32enc( out[l] + k * 4, lane[l] );
+		}
+	}
+}
+
+#undef AVX_ROUND
+
+#endif // SQRL_ENHASH_X86
+
+// Checks whether this CPU can run an EnHash kernel.
+bool sqrl_enhash_kernel_supported( Sqrl_EnHash_Kernel kernel )
+{
+	switch( kernel ) {
+	case SQRL_ENHASH_KERNEL_AUTO:
+	case SQRL_ENHASH_KERNEL_SCALAR:
+		return true;
+#ifdef SQRL_ENHASH_X86
+	case SQRL_ENHASH_KERNEL_AVX2:
+		return 0 != sodium_runtime_has_avx2();
+	case SQRL_ENHASH_KERNEL_SHA:
+		return sqrl_enhash_detect_shani();
+#endif
+	default:
+		return false;
+	}
+}
+
+// Gets the EnHash kernel in use, detecting the best one on first use.
+Sqrl_EnHash_Kernel sqrl_enhash_kernel()
+{
+	int kernel = SQRL_ATOMIC_LOAD( &sqrl_enhash_active );
+	if( kernel == SQRL_ENHASH_KERNEL_AUTO ) {
+		for( kernel = SQRL_ENHASH_KERNEL_COUNT - 1; kernel > SQRL_ENHASH_KERNEL_SCALAR; kernel-- ) {
+			if( sqrl_enhash_kernel_supported( (Sqrl_EnHash_Kernel)kernel )) break;
+		}
+		SQRL_ATOMIC_STORE( &sqrl_enhash_active, kernel );
+	}
+	return (Sqrl_EnHash_Kernel)kernel;
+}
+
+// Forces an EnHash kernel (for testing), or returns to automatic selection
+// with SQRL_ENHASH_KERNEL_AUTO.  Fails if this CPU cannot run it.
+bool sqrl_enhash_select_kernel( Sqrl_EnHash_Kernel kernel )
+{
+	if( !sqrl_enhash_kernel_supported( kernel )) return false;
+	SQRL_ATOMIC_STORE( &sqrl_enhash_active, (int)kernel );
+	return true;
+}
+
+const char *sqrl_enhash_kernel_name( Sqrl_EnHash_Kernel kernel )
+{
+	if( kernel < 0 || kernel >= SQRL_ENHASH_KERNEL_COUNT ) return NULL;
+	return sqrl_enhash_kernel_names[kernel];
+}
+
+/**
+Computes several independent EnHashes.  Without the SHA extensions, up to
+eight are computed together with AVX2.
+
+@param out Receives each 32 byte result; may be the same as \p in
+@param in Each 32 byte input
+@param count Number of \p in and \p out
+*/
+void sqrl_enhash_multi( uint8_t *const *out, const uint8_t *const *in, int count )
+{
+	uint8_t *scratch = sqrl_scratch_push( ENHASH_SCRATCH_SIZE );
+	uint8_t result[32];
+	int i, n;
+
+	if( !scratch ) {
+		for( i = 0; i < count; i++ ) {
+			sodium_memzero( out[i], 32 );
+		}
+		return;
+	}
+	int kernel = sqrl_enhash_kernel();
+	for( i = 0; i < count; i += n ) {
+		n = 1;
+		switch( kernel ) {
+#ifdef SQRL_ENHASH_X86
+		case SQRL_ENHASH_KERNEL_SHA:
+			sqrl_enhash_shani_one( result, in[i] );
+			memcpy( out[i], result, 32 );
+			break;
+		case SQRL_ENHASH_KERNEL_AVX2:
+			n = count - i;
+			if( n > ENHASH_LANES ) n = ENHASH_LANES;
+			sqrl_enhash_avx2_lanes( out + i, in + i, n, scratch );
+			break;
+#endif
+		default:
+			sqrl_enhash_scalar( result, in[i], scratch );
+			memcpy( out[i], result, 32 );
+			break;
+		}
+	}
+	sodium_memzero( result, sizeof( result ));
+	sqrl_scratch_pop( scratch );
+}
+
+int Sqrl_EnHash( uint64_t *out, uint64_t *in )
+{
+	uint8_t *o = (uint8_t*)out;
+	const uint8_t *p = (const uint8_t*)in;
+	sqrl_enhash_multi( &o, &p, 1 );
+	return 0;
+}
@@ -0,0 +1,150 @@
+/** @file scratch.c Per-thread locked scratch memory for key material
+
+@author Adam Comley
+
+This file is part of libsqrl.  It is released under the MIT license.
+For more details, see the LICENSE file included with this package.
+
+Each thread gets one arena from sodium_malloc(), so it is locked once and
+surrounded by guard pages.  Temporaries are taken from it like a stack:
+every \p sqrl_scratch_push() is matched by a \p sqrl_scratch_pop(), in
+reverse order, and popping wipes everything above the popped pointer.
+
+If the arena is full, a push gets its own sodium_malloc() block, which
+the matching pop frees.  So callers never need to care about the size.
+**/
+
+#include "../sqrl_internal.h"
+
+#define SCRATCH_ARENA_SIZE (16 * 1024)
+#define SCRATCH_ALIGN 64
+
+typedef struct Sqrl_Scratch {
+	uint8_t *base;
+	size_t top;
+} Sqrl_Scratch;
+
+static void sqrl_scratch_free( void *data )
+{
+	Sqrl_Scratch *scratch = (Sqrl_Scratch*)data;
+	if( !scratch ) return;
+	// sodium_free() wipes it
+	sodium_free( scratch->base );
+	free( scratch );
+}
+
+#ifdef UNIX
+static pthread_key_t sqrl_scratch_key;
+static pthread_once_t sqrl_scratch_key_once = PTHREAD_ONCE_INIT;
+
+static void sqrl_scratch_key_create()
+{
+	pthread_key_create( &sqrl_scratch_key, sqrl_scratch_free );
+}
+#else
+static DWORD sqrl_scratch_key = FLS_OUT_OF_INDEXES;
+static INIT_ONCE sqrl_scratch_key_once = INIT_ONCE_STATIC_INIT;
+
+static VOID WINAPI sqrl_scratch_fls_free( PVOID data )
+{
+	sqrl_scratch_free( data );
+}
+
+static BOOL CALLBACK sqrl_scratch_key_create( PINIT_ONCE once, PVOID param, PVOID *context )
+{
+	sqrl_scratch_key = FlsAlloc( sqrl_scratch_fls_free );
+	return TRUE;
+}
+#endif
+
+// Gets this thread's arena, creating it on first use.
+static Sqrl_Scratch *sqrl_scratch_arena()
+{
+	Sqrl_Scratch *scratch;
+#ifdef UNIX
+	pthread_once( &sqrl_scratch_key_once, sqrl_scratch_key_create );
+	scratch = pthread_getspecific( sqrl_scratch_key );
+#else
+	InitOnceExecuteOnce( &sqrl_scratch_key_once, sqrl_scratch_key_create, NULL, NULL );
+	scratch = FlsGetValue( sqrl_scratch_key );
+#endif
+	if( !scratch ) {
+		scratch = calloc( 1, sizeof( Sqrl_Scratch ));
+		if( !scratch ) return NULL;
+		scratch->base = sodium_malloc( SCRATCH_ARENA_SIZE );
+		if( !scratch->base ) {
+			free( scratch );
+			return NULL;
+		}
+		sodium_memzero( scratch->base, SCRATCH_ARENA_SIZE );
+#ifdef UNIX
+		pthread_setspecific( sqrl_scratch_key, scratch );
+#else
+		FlsSetValue( sqrl_scratch_key, scratch );
+#endif
+	}
+	return scratch;
+}
+
+static bool sqrl_scratch_owns( Sqrl_Scratch *scratch, const uint8_t *p )
+{
+	return scratch && p >= scratch->base && p < scratch->base + SCRATCH_ARENA_SIZE;
+}
+
+/**
+Takes \p len bytes of locked, zeroed, 64-byte aligned memory from this
+thread's scratch arena.  Release it with \p sqrl_scratch_pop().
+
+@param len Number of bytes needed
+@return The memory, or NULL if none could be allocated
+*/
+uint8_t *sqrl_scratch_push( size_t len )
+{
+	Sqrl_Scratch *scratch = sqrl_scratch_arena();
+	size_t start;
+	if( scratch ) {
+		start = (scratch->top + SCRATCH_ALIGN - 1) & ~((size_t)SCRATCH_ALIGN - 1);
+		if( len <= SCRATCH_ARENA_SIZE - start ) {
+			scratch->top = start + len;
+			return scratch->base + start;
+		}
+	}
+	// Full; this one is on its own.  sodium_malloc() puts the block against
+	// its guard page, so it is only aligned when the size is a multiple.
+	len = (len + SCRATCH_ALIGN - 1) & ~((size_t)SCRATCH_ALIGN - 1);
+	uint8_t *p = sodium_malloc( len );
+	if( p ) sodium_memzero( p, len );
+	return p;
+}
+
+/**
+Returns memory from \p sqrl_scratch_push(), and everything pushed after it,
+to this thread's scratch arena, wiping it.
+
+@param p The memory to release; NULL is ignored
+*/
+void sqrl_scratch_pop( uint8_t *p )
+{
+	if( !p ) return;
+	Sqrl_Scratch *scratch = sqrl_scratch_arena();
+	if( !sqrl_scratch_owns( scratch, p )) {
+		sodium_free( p );
+		return;
+	}
+	size_t start = (size_t)(p - scratch->base);
+	if( start < scratch->top ) {
+		sodium_memzero( p, scratch->top - start );
+		scratch->top = start;
+	}
+}
+
+/**
+Gets how many bytes of this thread's scratch arena are in use.
+
+@return Bytes in use, including alignment
+*/
+size_t sqrl_scratch_used()
+{
+	Sqrl_Scratch *scratch = sqrl_scratch_arena();
+	return scratch ? scratch->top : 0;
+}
@@ -0,0 +1,515 @@
+/** @file scrypt.c scrypt, specialized for EnScrypt
+
+@author Adam Comley
+
+This file is part of libsqrl.  It is released under the MIT license.
+For more details, see the LICENSE file included with this package.
+
+EnScrypt only ever runs scrypt with r = ENSCRYPT_R and p = ENSCRYPT_P, so
+the block geometry here is fixed at compile time.  ROMix has a scalar
+kernel, and on x86 an SSE2, an AVX2 and an AVX-512 kernel, one of which
+is chosen at runtime.  A single Salsa20/8 core is a chain of dependent
+four-word operations, so the wider kernels gain from three-operand
+encodings, native rotates and fused three-way XORs rather than from
+wider lanes.
+**/
+
+#include "../sqrl_internal.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SQRL_SCRYPT_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SQRL_SCRYPT_TARGET(t) __attribute__((target(t)))
+#else
+#define SQRL_SCRYPT_TARGET(t)
+#endif
+
+// Salsa20/8 sub-blocks per scrypt block
+#define SCRYPT_SUBBLOCKS (2 * ENSCRYPT_R)
+#define SCRYPT_BLOCK_BYTES (128 * ENSCRYPT_R)
+#define SCRYPT_BLOCK_WORDS (SCRYPT_BLOCK_BYTES / 4)
+#define SCRYPT_BLOCK_VECTORS (SCRYPT_BLOCK_BYTES / 16)
+
+#if ENSCRYPT_P != 1
+#error "scrypt.c assumes ENSCRYPT_P == 1"
+#endif
+
+typedef void (*sqrl_scrypt_romix_fn)( uint8_t *B, uint32_t *X, uint32_t *Y, uint32_t *V, uint64_t N );
+
+static const char *sqrl_scrypt_kernel_names[SQRL_SCRYPT_KERNEL_COUNT] = {
+	"auto", "scalar", "sse2", "avx2", "avx512"
+};
+
+static int sqrl_scrypt_active = SQRL_SCRYPT_KERNEL_AUTO;
+
+static uint32_t sqrl_le32dec( const uint8_t *p )
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+		((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void sqrl_le32enc( uint8_t *p, uint32_t x )
+{
+	p[0] = (uint8_t)x;
+	p[1] = (uint8_t)(x >> 8);
+	p[2] = (uint8_t)(x >> 16);
+	p[3] = (uint8_t)(x >> 24);
+}
+
+// PBKDF2-HMAC-SHA256 with a single iteration, as scrypt uses it.
+static void sqrl_scrypt_pbkdf2(
+	const uint8_t *password, size_t password_len,
+	const uint8_t *salt, size_t salt_len,
+	uint8_t *out, size_t out_len )
+{
+	crypto_auth_hmacsha256_state base, st;
+	uint8_t ivec[4], U[32];
+	size_t i, clen;
+
+	crypto_auth_hmacsha256_init( &base, password, password_len );
+	if( salt_len ) {
+		crypto_auth_hmacsha256_update( &base, salt, salt_len );
+	}
+	for( i = 0; i * 32 < out_len; i++ ) {
+		ivec[0] = (uint8_t)((i + 1) >> 24);
+		ivec[1] = (uint8_t)((i + 1) >> 16);
+		ivec[2] = (uint8_t)((i + 1) >> 8);
+		ivec[3] = (uint8_t)(i + 1);
+		memcpy( &st, &base, sizeof( st ));
+		crypto_auth_hmacsha256_update( &st, ivec, 4 );
+		crypto_auth_hmacsha256_final( &st, U );
+		clen = out_len - i * 32;
+		if( clen > 32 ) clen = 32;
+		memcpy( out + i * 32, U, clen );
+	}
+	sodium_memzero( &base, sizeof( base ));
+	sodium_memzero( &st, sizeof( st ));
+	sodium_memzero( U, sizeof( U ));
+}
+
+/*
+Scalar kernel.  Blocks are held as little-endian words in their natural
+order.
+*/
+
+#define SCRYPT_ROTL(a,b) (((a) << (b)) | ((a) >> (32 - (b))))
+
+static void sqrl_salsa20_8( uint32_t B[16] )
+{
+	uint32_t x[16];
+	int i;
+	memcpy( x, B, 64 );
+	for( i = 0; i < 8; i += 2 ) {
+		// Columns
+		x[ 4] ^= SCRYPT_ROTL( x[ 0] + x[12],  7 );  x[ 8] ^= SCRYPT_ROTL( x[ 4] + x[ 0],  9 );
+		x[12] ^= SCRYPT_ROTL( x[ 8] + x[ 4], 13 );  x[ 0] ^= SCRYPT_ROTL( x[12] + x[ 8], 18 );
+		x[ 9] ^= SCRYPT_ROTL( x[ 5] + x[ 1],  7 );  x[13] ^= SCRYPT_ROTL( x[ 9] + x[ 5],  9 );
+		x[ 1] ^= SCRYPT_ROTL( x[13] + x[ 9], 13 );  x[ 5] ^= SCRYPT_ROTL( x[ 1] + x[13], 18 );
+		x[14] ^= SCRYPT_ROTL( x[10] + x[ 6],  7 );  x[ 2] ^= SCRYPT_ROTL( x[14] + x[10],  9 );
+		x[ 6] ^= SCRYPT_ROTL( x[ 2] + x[14], 13 );  x[10] ^= SCRYPT_ROTL( x[ 6] + x[ 2], 18 );
+		x[ 3] ^= SCRYPT_ROTL( x[15] + x[11],  7 );  x[ 7] ^= SCRYPT_ROTL( x[ 3] + x[15],  9 );
+		x[11] ^= SCRYPT_ROTL( x[ 7] + x[ 3], 13 );  x[15] ^= SCRYPT_ROTL( x[11] + x[ 7], 18 );
+		// Rows
+		x[ 1] ^= SCRYPT_ROTL( x[ 0] + x[ 3],  7 );  x[ 2] ^= SCRYPT_ROTL( x[ 1] + x[ 0],  9 );
+		x[ 3] ^= SCRYPT_ROTL( x[ 2] + x[ 1], 13 );  x[ 0] ^= SCRYPT_ROTL( x[ 3] + x[ 2], 18 );
+		x[ 6] ^= SCRYPT_ROTL( x[ 5] + x[ 4],  7 );  x[ 7] ^= SCRYPT_ROTL( x[ 6] + x[ 5],  9 );
+		x[ 4] ^= SCRYPT_ROTL( x[ 7] + x[ 6], 13 );  x[ 5] ^= SCRYPT_ROTL( x[ 4] + x[ 7], 18 );
+		x[11] ^= SCRYPT_ROTL( x[10] + x[ 9],  7 );  x[ 8] ^= SCRYPT_ROTL( x[11] + x[10],  9 );
+		x[ 9] ^= SCRYPT_ROTL( x[ 8] + x[11], 13 );  x[10] ^= SCRYPT_ROTL( x[ 9] + x[ 8], 18 );
+		x[12] ^= SCRYPT_ROTL( x[15] + x[14],  7 );  x[13] ^= SCRYPT_ROTL( x[12] + x[15],  9 );
+		x[14] ^= SCRYPT_ROTL( x[13] + x[12], 13 );  x[15] ^= SCRYPT_ROTL( x[14] + x[13], 18 );
+	}
+	for( i = 0; i < 16; i++ ) {
+		B[i] += x[i];
+	}
+}
+
+// Y = BlockMix( A ^ C ).  C may be NULL.
+static void sqrl_scrypt_blockmix( const uint32_t *A, const uint32_t *C, uint32_t *Y )
+{
+	uint32_t X[16];
+	size_t i;
+	int k;
+	const uint32_t *a = A + (SCRYPT_SUBBLOCKS - 1) * 16;
+	const uint32_t *c = C ? C + (SCRYPT_SUBBLOCKS - 1) * 16 : NULL;
+
+	for( k = 0; k < 16; k++ ) {
+		X[k] = c ? a[k] ^ c[k] : a[k];
+	}
+	for( i = 0; i < SCRYPT_SUBBLOCKS; i++ ) {
+		a = A + i * 16;
+		if( C ) {
+			c = C + i * 16;
+			for( k = 0; k < 16; k++ ) X[k] ^= a[k] ^ c[k];
+		} else {
+			for( k = 0; k < 16; k++ ) X[k] ^= a[k];
+		}
+		sqrl_salsa20_8( X );
+		memcpy( Y + ((i & 1) * ENSCRYPT_R + (i >> 1)) * 16, X, 64 );
+	}
+	sodium_memzero( X, sizeof( X ));
+}
+
+static void sqrl_scrypt_romix_scalar( uint8_t *B, uint32_t *X, uint32_t *Y, uint32_t *V, uint64_t N )
+{
+	uint32_t *x = X, *y = Y, *t;
+	uint64_t i, j;
+	size_t k;
+
+	for( k = 0; k < SCRYPT_BLOCK_WORDS; k++ ) {
+		V[k] = sqrl_le32dec( B + k * 4 );
+	}
+	for( i = 0; i + 1 < N; i++ ) {
+		sqrl_scrypt_blockmix( V + i * SCRYPT_BLOCK_WORDS, NULL, V + (i + 1) * SCRYPT_BLOCK_WORDS );
+	}
+	sqrl_scrypt_blockmix( V + (N - 1) * SCRYPT_BLOCK_WORDS, NULL, x );
+
+	for( i = 0; i < N; i++ ) {
+		t = x + (SCRYPT_SUBBLOCKS - 1) * 16;
+		j = (((uint64_t)t[1] << 32) | t[0]) & (N - 1);
+		sqrl_scrypt_blockmix( x, V + j * SCRYPT_BLOCK_WORDS, y );
+		t = x;
+		x = y;
+		y = t;
+	}
+	for( k = 0; k < SCRYPT_BLOCK_WORDS; k++ ) {
+		sqrl_le32enc( B + k * 4, x[k] );
+	}
+}
+
+#ifdef SQRL_SCRYPT_X86
+
+/*
+Vector kernels.  Each 64 byte sub-block is stored with word i at position
+j where i = (j * 5) % 16, which lines up the Salsa20 diagonals.  When
+several blocks are processed together, their 16 byte vectors are
+interleaved: vector q of block l is at index q * lanes + l.
+*/
+
+#define SCRYPT_WORD_INDEX(k,j,lanes,l) ((((k) * 4 + (j) / 4) * (lanes) + (l)) * 4 + (j) % 4)
+
+static void sqrl_scrypt_shuffle_in( uint32_t *X, const uint8_t *B, int lanes, int l )
+{
+	size_t k;
+	int j;
+	for( k = 0; k < SCRYPT_SUBBLOCKS; k++ ) {
+		for( j = 0; j < 16; j++ ) {
+			X[SCRYPT_WORD_INDEX( k, j, lanes, l )] = sqrl_le32dec( B + (k * 16 + (j * 5 % 16)) * 4 );
+		}
+	}
+}
+
+static void sqrl_scrypt_shuffle_out( uint8_t *B, const uint32_t *X, int lanes, int l )
+{
+	size_t k;
+	int j;
+	for( k = 0; k < SCRYPT_SUBBLOCKS; k++ ) {
+		for( j = 0; j < 16; j++ ) {
+			sqrl_le32enc( B + (k * 16 + (j * 5 % 16)) * 4, X[SCRYPT_WORD_INDEX( k, j, lanes, l )] );
+		}
+	}
+}
+
+// Words 0 and 1 of the last sub-block sit at positions 0 and 13.
+static uint64_t sqrl_scrypt_integerify( const uint32_t *X, int lanes, int l )
+{
+	return ((uint64_t)X[SCRYPT_WORD_INDEX( SCRYPT_SUBBLOCKS - 1, 13, lanes, l )] << 32) |
+		X[SCRYPT_WORD_INDEX( SCRYPT_SUBBLOCKS - 1, 0, lanes, l )];
+}
+
+// One block per call, four words per vector
+#define SCRYPT_LANES 1
+#define SCRYPT_VEC __m128i
+#define SCRYPT_ADD(a,b) _mm_add_epi32( (a), (b) )
+#define SCRYPT_XOR(a,b) _mm_xor_si128( (a), (b) )
+#define SCRYPT_SHUFFLE(a,i) _mm_shuffle_epi32( (a), (i) )
+#define SCRYPT_GATHER(C,q) (C)[0][(q)]
+#define SCRYPT_XOR3(a,b,c) _mm_xor_si128( _mm_xor_si128( (a), (b) ), (c) )
+#define SCRYPT_ARX(o,a,b,s) { \
+	__m128i T = _mm_add_epi32( (a), (b) ); \
+	o = _mm_xor_si128( o, _mm_slli_epi32( T, s )); \
+	o = _mm_xor_si128( o, _mm_srli_epi32( T, 32 - s )); }
+
+#define SCRYPT_KERNEL(name) sqrl_scrypt_##name##_sse2
+#define SCRYPT_TARGET SQRL_SCRYPT_TARGET("sse2")
+#include "scrypt_kernel.h"
+#undef SCRYPT_KERNEL
+#undef SCRYPT_TARGET
+
+// Same code as SSE2; VEX encoding drops the register copies
+#define SCRYPT_KERNEL(name) sqrl_scrypt_##name##_avx2
+#define SCRYPT_TARGET SQRL_SCRYPT_TARGET("avx2")
+#include "scrypt_kernel.h"
+#undef SCRYPT_KERNEL
+#undef SCRYPT_TARGET
+#undef SCRYPT_XOR3
+#undef SCRYPT_ARX
+
+#define SCRYPT_XOR3(a,b,c) _mm_ternarylogic_epi32( (a), (b), (c), 0x96 )
+#define SCRYPT_ARX(o,a,b,s) \
+	o = _mm_xor_si128( o, _mm_rol_epi32( _mm_add_epi32( (a), (b) ), s ));
+
+#define SCRYPT_KERNEL(name) sqrl_scrypt_##name##_avx512
+#define SCRYPT_TARGET SQRL_SCRYPT_TARGET("avx512f,avx512vl")
+#include "scrypt_kernel.h"
+#undef SCRYPT_KERNEL
+#undef SCRYPT_TARGET
+#undef SCRYPT_LANES
+#undef SCRYPT_VEC
+#undef SCRYPT_ADD
+#undef SCRYPT_XOR
+#undef SCRYPT_SHUFFLE
+#undef SCRYPT_GATHER
+#undef SCRYPT_XOR3
+#undef SCRYPT_ARX
+
+// Two blocks per call, one in each 128-bit half
+#define SCRYPT_LANES 2
+#define SCRYPT_VEC __m256i
+#define SCRYPT_ADD(a,b) _mm256_add_epi32( (a), (b) )
+#define SCRYPT_XOR(a,b) _mm256_xor_si256( (a), (b) )
+#define SCRYPT_XOR3(a,b,c) _mm256_xor_si256( _mm256_xor_si256( (a), (b) ), (c) )
+#define SCRYPT_SHUFFLE(a,i) _mm256_shuffle_epi32( (a), (i) )
+#define SCRYPT_GATHER(C,q) _mm256_inserti128_si256( \
+	_mm256_castsi128_si256( (C)[0][(q) * 2] ), (C)[1][(q) * 2], 1 )
+#define SCRYPT_ARX(o,a,b,s) { \
+	__m256i T = _mm256_add_epi32( (a), (b) ); \
+	o = _mm256_xor_si256( o, _mm256_slli_epi32( T, s )); \
+	o = _mm256_xor_si256( o, _mm256_srli_epi32( T, 32 - s )); }
+
+#define SCRYPT_KERNEL(name) sqrl_scrypt_##name##_avx2x2
+#define SCRYPT_TARGET SQRL_SCRYPT_TARGET("avx2")
+#include "scrypt_kernel.h"
+#undef SCRYPT_KERNEL
+#undef SCRYPT_TARGET
+#undef SCRYPT_LANES
+#undef SCRYPT_VEC
+#undef SCRYPT_ADD
+#undef SCRYPT_XOR
+#undef SCRYPT_XOR3
+#undef SCRYPT_SHUFFLE
+#undef SCRYPT_GATHER
+#undef SCRYPT_ARX
+
+// Four blocks per call, one in each 128-bit quarter
+#define SCRYPT_LANES 4
+#define SCRYPT_VEC __m512i
+#define SCRYPT_ADD(a,b) _mm512_add_epi32( (a), (b) )
+#define SCRYPT_XOR(a,b) _mm512_xor_si512( (a), (b) )
+#define SCRYPT_XOR3(a,b,c) _mm512_ternarylogic_epi32( (a), (b), (c), 0x96 )
+#define SCRYPT_SHUFFLE(a,i) _mm512_shuffle_epi32( (a), (_MM_PERM_ENUM)(i) )
+#define SCRYPT_GATHER(C,q) _mm512_inserti32x4( _mm512_inserti32x4( _mm512_inserti32x4( \
+	_mm512_castsi128_si512( (C)[0][(q) * 4] ), (C)[1][(q) * 4], 1 ), (C)[2][(q) * 4], 2 ), (C)[3][(q) * 4], 3 )
+#define SCRYPT_ARX(o,a,b,s) \
+	o = _mm512_xor_si512( o, _mm512_rol_epi32( _mm512_add_epi32( (a), (b) ), s ));
+
+#define SCRYPT_KERNEL(name) sqrl_scrypt_##name##_avx512x4
+#define SCRYPT_TARGET SQRL_SCRYPT_TARGET("avx512f")
+#include "scrypt_kernel.h"
+#undef SCRYPT_KERNEL
+#undef SCRYPT_TARGET
+#undef SCRYPT_LANES
+#undef SCRYPT_VEC
+#undef SCRYPT_ADD
+#undef SCRYPT_XOR
+#undef SCRYPT_XOR3
+#undef SCRYPT_SHUFFLE
+#undef SCRYPT_GATHER
+#undef SCRYPT_ARX
+
+static bool sqrl_scrypt_has_avx512vl()
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuidex( info, 7, 0 );
+	return 0 != (info[1] & (1 << 31));
+#elif defined(__GNUC__) || defined(__clang__)
+	__builtin_cpu_init();
+	return 0 != __builtin_cpu_supports( "avx512vl" );
+#else
+	return false;
+#endif
+}
+
+#endif // SQRL_SCRYPT_X86
+
+// Gets the ROMix for kernel that processes lanes blocks at once.
+static sqrl_scrypt_romix_fn sqrl_scrypt_romix( int kernel, int lanes )
+{
+	switch( kernel ) {
+#ifdef SQRL_SCRYPT_X86
+	case SQRL_SCRYPT_KERNEL_SSE2:
+		if( lanes == 1 ) return sqrl_scrypt_romix_sse2;
+		break;
+	case SQRL_SCRYPT_KERNEL_AVX2:
+		if( lanes == 1 ) return sqrl_scrypt_romix_avx2;
+		if( lanes == 2 ) return sqrl_scrypt_romix_avx2x2;
+		break;
+	case SQRL_SCRYPT_KERNEL_AVX512:
+		if( lanes == 1 ) return sqrl_scrypt_romix_avx512;
+		if( lanes == 2 ) return sqrl_scrypt_romix_avx2x2;
+		if( lanes == 4 ) return sqrl_scrypt_romix_avx512x4;
+		break;
+#endif
+	default:
+		if( lanes == 1 ) return sqrl_scrypt_romix_scalar;
+		break;
+	}
+	return NULL;
+}
+
+// Checks whether this CPU can run a scrypt kernel.
+bool sqrl_scrypt_kernel_supported( Sqrl_Scrypt_Kernel kernel )
+{
+	switch( kernel ) {
+	case SQRL_SCRYPT_KERNEL_AUTO:
+	case SQRL_SCRYPT_KERNEL_SCALAR:
+		return true;
+#ifdef SQRL_SCRYPT_X86
+	case SQRL_SCRYPT_KERNEL_SSE2:
+		return 0 != sodium_runtime_has_sse2();
+	case SQRL_SCRYPT_KERNEL_AVX2:
+		return 0 != sodium_runtime_has_avx2();
+	case SQRL_SCRYPT_KERNEL_AVX512:
+		return sodium_runtime_has_avx512f() && sqrl_scrypt_has_avx512vl();
+#endif
+	default:
+		return false;
+	}
+}
+
+// Gets the scrypt kernel in use, detecting the best one on first use.
+Sqrl_Scrypt_Kernel sqrl_scrypt_kernel()
+{
+	int kernel = SQRL_ATOMIC_LOAD( &sqrl_scrypt_active );
+	if( kernel == SQRL_SCRYPT_KERNEL_AUTO ) {
+		for( kernel = SQRL_SCRYPT_KERNEL_COUNT - 1; kernel > SQRL_SCRYPT_KERNEL_SCALAR; kernel-- ) {
+			if( sqrl_scrypt_kernel_supported( (Sqrl_Scrypt_Kernel)kernel )) break;
+		}
+		SQRL_ATOMIC_STORE( &sqrl_scrypt_active, kernel );
+	}
+	return (Sqrl_Scrypt_Kernel)kernel;
+}
+
+// Forces a scrypt kernel (for testing), or returns to automatic selection
+// with SQRL_SCRYPT_KERNEL_AUTO.  Fails if this CPU cannot run it.
+bool sqrl_scrypt_select_kernel( Sqrl_Scrypt_Kernel kernel )
+{
+	if( !sqrl_scrypt_kernel_supported( kernel )) return false;
+	SQRL_ATOMIC_STORE( &sqrl_scrypt_active, (int)kernel );
+	return true;
+}
+
+const char *sqrl_scrypt_kernel_name( Sqrl_Scrypt_Kernel kernel )
+{
+	if( kernel < 0 || kernel >= SQRL_SCRYPT_KERNEL_COUNT ) return NULL;
+	return sqrl_scrypt_kernel_names[kernel];
+}
+
+// The workspace size sqrl_scrypt() needs for N.
+size_t sqrl_scrypt_workspace_size( uint64_t N )
+{
+	// B, then X and Y, then V
+	return (size_t)SCRYPT_BLOCK_BYTES * 3 + (size_t)SCRYPT_BLOCK_BYTES * N;
+}
+
+// The number of independent scrypts the active kernel runs together.
+int sqrl_scrypt_lanes()
+{
+	switch( sqrl_scrypt_kernel() ) {
+	case SQRL_SCRYPT_KERNEL_AVX512:
+		return 4;
+	case SQRL_SCRYPT_KERNEL_AVX2:
+		return 2;
+	default:
+		return 1;
+	}
+}
+
+/**
+Runs up to \p sqrl_scrypt_lanes() independent scrypts, all with cost \p N,
+interleaved in one ROMix.  The workspace is left holding password-derived
+data.
+
+@param workspace 64 byte aligned scratch memory
+@param workspace_len Size of \p workspace; at least \p sqrl_scrypt_lanes() times \p sqrl_scrypt_workspace_size()
+@param lanes Each scrypt's password, salt and 32 byte output
+@param count Number of \p lanes
+@param N The scrypt cost, a power of 2
+@return 0 on success, -1 on failure
+*/
+int sqrl_scrypt_multi(
+	uint8_t *workspace,
+	size_t workspace_len,
+	const Sqrl_Scrypt_Lane *lanes,
+	int count,
+	uint64_t N )
+{
+	int kernel = sqrl_scrypt_kernel();
+	int width, l;
+	sqrl_scrypt_romix_fn romix = NULL;
+
+	if( !workspace || !lanes || count < 1 || count > 4 ) return -1;
+	if( N < 2 || (N & (N - 1)) ) return -1;
+	if( ((uintptr_t)workspace & 63) ) return -1;
+	// The narrowest kernel which fits; spare lanes repeat lane 0
+	for( width = count; width <= 4; width++ ) {
+		if( (romix = sqrl_scrypt_romix( kernel, width ))) break;
+	}
+	if( !romix ) return -1;
+	if( N > SIZE_MAX / ((size_t)SCRYPT_BLOCK_BYTES * width) - 3 ) return -1;
+	if( workspace_len < width * sqrl_scrypt_workspace_size( N )) return -1;
+
+	uint8_t *B = workspace;
+	uint32_t *X = (uint32_t*)(B + (size_t)SCRYPT_BLOCK_BYTES * width);
+	uint32_t *Y = (uint32_t*)(B + (size_t)SCRYPT_BLOCK_BYTES * width * 2);
+	uint32_t *V = (uint32_t*)(B + (size_t)SCRYPT_BLOCK_BYTES * width * 3);
+	const Sqrl_Scrypt_Lane *lane;
+
+	for( l = 0; l < width; l++ ) {
+		lane = &lanes[l < count ? l : 0];
+		sqrl_scrypt_pbkdf2( lane->password, lane->password_len, lane->salt, lane->salt_len,
+			B + (size_t)SCRYPT_BLOCK_BYTES * l, SCRYPT_BLOCK_BYTES );
+	}
+	romix( B, X, Y, V, N );
+	for( l = 0; l < count; l++ ) {
+		lane = &lanes[l];
+		sqrl_scrypt_pbkdf2( lane->password, lane->password_len,
+			B + (size_t)SCRYPT_BLOCK_BYTES * l, SCRYPT_BLOCK_BYTES, lane->out, 32 );
+	}
+	return 0;
+}
+
+/**
+Runs scrypt( password, salt, N, ENSCRYPT_R, ENSCRYPT_P ) in a caller
+supplied workspace.  The workspace is left holding password-derived data.
+
+@param workspace 64 byte aligned scratch memory
+@param workspace_len Size of \p workspace; at least \p sqrl_scrypt_workspace_size()
+@param password The password
+@param password_len Length of \p password
+@param salt The salt
+@param salt_len Length of \p salt
+@param N The scrypt cost, a power of 2
+@param out Receives the 32 byte result
+@return 0 on success, -1 on failure
+*/
+int sqrl_scrypt(
+	uint8_t *workspace,
+	size_t workspace_len,
+	const uint8_t *password,
+	size_t password_len,
+	const uint8_t *salt,
+	size_t salt_len,
+	uint64_t N,
+	uint8_t out[32] )
+{
+	Sqrl_Scrypt_Lane lane = { password, password_len, salt, salt_len, out };
+	return sqrl_scrypt_multi( workspace, workspace_len, &lane, 1, N );
+}
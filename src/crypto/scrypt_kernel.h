@@ -0,0 +1,138 @@
+/** @file scrypt_kernel.h Vector ROMix for EnScrypt
+
+@author Adam Comley
+
+This file is part of libsqrl.  It is released under the MIT license.
+For more details, see the LICENSE file included with this package.
+
+Included by scrypt.c once for each instruction set and lane count.  Before
+including it, define:
+
+    SCRYPT_KERNEL(name)   Decorates function names for this instantiation
+    SCRYPT_TARGET         Function attribute enabling the instruction set
+    SCRYPT_LANES          Independent blocks processed together
+    SCRYPT_VEC            Vector type; 128 bits per lane
+    SCRYPT_ADD(a,b)       Lane-wise 32-bit add
+    SCRYPT_XOR(a,b)       a ^ b
+    SCRYPT_XOR3(a,b,c)    a ^ b ^ c
+    SCRYPT_ARX(o,a,b,s)   o ^= (a + b) <<< s
+    SCRYPT_SHUFFLE(a,i)   32-bit shuffle within each 128-bit lane
+    SCRYPT_GATHER(C,q)    Vector q of the blocks at C[0..SCRYPT_LANES-1]
+
+Blocks are held in the diagonal word order produced by
+sqrl_scrypt_shuffle_in(), so that each Salsa20 quarter-round is one
+operation per lane.  With several lanes, the 128-bit vectors of the
+blocks are interleaved, so vector q of every block loads as one
+SCRYPT_VEC.
+**/
+
+#define SCRYPT_SALSA20_2ROUNDS \
+	/* Columns */ \
+	SCRYPT_ARX( X1, X0, X3, 7 ) \
+	SCRYPT_ARX( X2, X1, X0, 9 ) \
+	SCRYPT_ARX( X3, X2, X1, 13 ) \
+	SCRYPT_ARX( X0, X3, X2, 18 ) \
+	X1 = SCRYPT_SHUFFLE( X1, 0x93 ); \
+	X2 = SCRYPT_SHUFFLE( X2, 0x4E ); \
+	X3 = SCRYPT_SHUFFLE( X3, 0x39 ); \
+	/* Rows */ \
+	SCRYPT_ARX( X3, X0, X1, 7 ) \
+	SCRYPT_ARX( X2, X3, X0, 9 ) \
+	SCRYPT_ARX( X1, X2, X3, 13 ) \
+	SCRYPT_ARX( X0, X1, X2, 18 ) \
+	X1 = SCRYPT_SHUFFLE( X1, 0x39 ); \
+	X2 = SCRYPT_SHUFFLE( X2, 0x4E ); \
+	X3 = SCRYPT_SHUFFLE( X3, 0x93 );
+
+// Y = BlockMix( A ^ C ), where C holds each lane's block of V, or is NULL.
+SCRYPT_TARGET
+static void SCRYPT_KERNEL(blockmix)( const SCRYPT_VEC *A, const __m128i *const *C, SCRYPT_VEC *Y )
+{
+	SCRYPT_VEC X0, X1, X2, X3, Z0, Z1, Z2, Z3;
+	const SCRYPT_VEC *a;
+	SCRYPT_VEC *y;
+	size_t i, q = (SCRYPT_SUBBLOCKS - 1) * 4;
+
+	a = A + q;
+	if( C ) {
+		X0 = SCRYPT_XOR( a[0], SCRYPT_GATHER( C, q ));
+		X1 = SCRYPT_XOR( a[1], SCRYPT_GATHER( C, q + 1 ));
+		X2 = SCRYPT_XOR( a[2], SCRYPT_GATHER( C, q + 2 ));
+		X3 = SCRYPT_XOR( a[3], SCRYPT_GATHER( C, q + 3 ));
+	} else {
+		X0 = a[0];
+		X1 = a[1];
+		X2 = a[2];
+		X3 = a[3];
+	}
+	for( i = 0; i < SCRYPT_SUBBLOCKS; i++ ) {
+		q = i * 4;
+		a = A + q;
+		if( C ) {
+			X0 = SCRYPT_XOR3( X0, a[0], SCRYPT_GATHER( C, q ));
+			X1 = SCRYPT_XOR3( X1, a[1], SCRYPT_GATHER( C, q + 1 ));
+			X2 = SCRYPT_XOR3( X2, a[2], SCRYPT_GATHER( C, q + 2 ));
+			X3 = SCRYPT_XOR3( X3, a[3], SCRYPT_GATHER( C, q + 3 ));
+		} else {
+			X0 = SCRYPT_XOR( X0, a[0] );
+			X1 = SCRYPT_XOR( X1, a[1] );
+			X2 = SCRYPT_XOR( X2, a[2] );
+			X3 = SCRYPT_XOR( X3, a[3] );
+		}
+		Z0 = X0;
+		Z1 = X1;
+		Z2 = X2;
+		Z3 = X3;
+		SCRYPT_SALSA20_2ROUNDS
+		SCRYPT_SALSA20_2ROUNDS
+		SCRYPT_SALSA20_2ROUNDS
+		SCRYPT_SALSA20_2ROUNDS
+		X0 = SCRYPT_ADD( X0, Z0 );
+		X1 = SCRYPT_ADD( X1, Z1 );
+		X2 = SCRYPT_ADD( X2, Z2 );
+		X3 = SCRYPT_ADD( X3, Z3 );
+
+		// Even sub-blocks go to the first half of Y, odd to the second
+		y = Y + ((i & 1) * ENSCRYPT_R + (i >> 1)) * 4;
+		y[0] = X0;
+		y[1] = X1;
+		y[2] = X2;
+		y[3] = X3;
+	}
+}
+
+// ROMix over SCRYPT_LANES consecutive blocks of B, each with its own V.
+SCRYPT_TARGET
+static void SCRYPT_KERNEL(romix)( uint8_t *B, uint32_t *X, uint32_t *Y, uint32_t *V, uint64_t N )
+{
+	SCRYPT_VEC *x = (SCRYPT_VEC*)X, *y = (SCRYPT_VEC*)Y, *t;
+	SCRYPT_VEC *v = (SCRYPT_VEC*)V;
+	const __m128i *C[SCRYPT_LANES];
+	uint64_t i, j;
+	int l;
+
+	// Each V[i+1] is mixed straight out of V[i], so nothing is copied
+	for( l = 0; l < SCRYPT_LANES; l++ ) {
+		sqrl_scrypt_shuffle_in( V, B + l * SCRYPT_BLOCK_BYTES, SCRYPT_LANES, l );
+	}
+	for( i = 0; i + 1 < N; i++ ) {
+		SCRYPT_KERNEL(blockmix)( v + i * SCRYPT_BLOCK_VECTORS, NULL, v + (i + 1) * SCRYPT_BLOCK_VECTORS );
+	}
+	SCRYPT_KERNEL(blockmix)( v + (N - 1) * SCRYPT_BLOCK_VECTORS, NULL, x );
+
+	for( i = 0; i < N; i++ ) {
+		for( l = 0; l < SCRYPT_LANES; l++ ) {
+			j = sqrl_scrypt_integerify( (uint32_t*)x, SCRYPT_LANES, l ) & (N - 1);
+			C[l] = (const __m128i*)(v + j * SCRYPT_BLOCK_VECTORS) + l;
+		}
+		SCRYPT_KERNEL(blockmix)( x, C, y );
+		t = x;
+		x = y;
+		y = t;
+	}
+	for( l = 0; l < SCRYPT_LANES; l++ ) {
+		sqrl_scrypt_shuffle_out( B + l * SCRYPT_BLOCK_BYTES, (uint32_t*)x, SCRYPT_LANES, l );
+	}
+}
+
+#undef SCRYPT_SALSA20_2ROUNDS
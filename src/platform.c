@@ -62,10 +62,61 @@ void sqrl_mutex_leave( SqrlMutex sm )
     #endif
 }
 
+SqrlCondition sqrl_cond_create()
+{
+    #ifdef _WIN32
+    CONDITION_VARIABLE *cv = calloc( 1, sizeof( CONDITION_VARIABLE ));
+    InitializeConditionVariable( cv );
+    return (SqrlCondition)cv;
+    #else
+    pthread_cond_t *cond = calloc( 1, sizeof( pthread_cond_t ));
+    pthread_cond_init( cond, NULL );
+    return (SqrlCondition)cond;
+    #endif
+}
+
+void sqrl_cond_destroy( SqrlCondition sc )
+{
+    if( !sc ) return;
+    #ifndef _WIN32
+    pthread_cond_destroy( (pthread_cond_t*)sc );
+    #endif
+    free( sc );
+}
+
+// Waits on sc.  The mutex sm must be held, and is held again on return.
+void sqrl_cond_wait( SqrlCondition sc, SqrlMutex sm )
+{
+    #ifdef _WIN32
+    SleepConditionVariableCS( (CONDITION_VARIABLE*)sc, (CRITICAL_SECTION*)sm, INFINITE );
+    #else
+    pthread_cond_wait( (pthread_cond_t*)sc, (pthread_mutex_t*)sm );
+    #endif
+}
+
+void sqrl_cond_signal( SqrlCondition sc )
+{
+    #ifdef _WIN32
+    WakeConditionVariable( (CONDITION_VARIABLE*)sc );
+    #else
+    pthread_cond_signal( (pthread_cond_t*)sc );
+    #endif
+}
+
+void sqrl_cond_broadcast( SqrlCondition sc )
+{
+    #ifdef _WIN32
+    WakeAllConditionVariable( (CONDITION_VARIABLE*)sc );
+    #else
+    pthread_cond_broadcast( (pthread_cond_t*)sc );
+    #endif
+}
+
+// Returns 0 if the thread could not be started.
 SqrlThread sqrl_thread_create( sqrl_thread_function function, SQRL_THREAD_FUNCTION_INPUT_TYPE input )
 {
 #ifdef WIN32
-    return CreateThread( NULL, 0, function, data, 0, NULL );
+    return CreateThread( NULL, 0, function, input, 0, NULL );
 #endif
 #ifdef UNIX
     pthread_attr_t attr;
@@ -74,10 +125,57 @@ SqrlThread sqrl_thread_create( sqrl_thread_function function, SQRL_THREAD_FUNCTI
 
     SqrlThread thread;
 
-    pthread_create( &thread, &attr, function, input );
+    if( 0 != pthread_create( &thread, &attr, function, input )) {
+        thread = (SqrlThread)0;
+    }
     pthread_attr_destroy( &attr );
     return thread;
 #endif
 }
 
+void sqrl_thread_join( SqrlThread thread )
+{
+#ifdef WIN32
+    WaitForSingleObject( thread, INFINITE );
+    CloseHandle( thread );
+#endif
+#ifdef UNIX
+    pthread_join( thread, NULL );
+#endif
+}
+
+// Lets a thread run on its own; it is never joined.
+void sqrl_thread_detach( SqrlThread thread )
+{
+#ifdef WIN32
+    CloseHandle( thread );
+#endif
+#ifdef UNIX
+    pthread_detach( thread );
+#endif
+}
+
+static int sqrl_cpu_count_forced = 0;
+
+// Makes sqrl_cpu_count() report n CPUs, so tests can take the paths for
+// other machines.  0 detects them again.
+void sqrl_cpu_count_force( int n )
+{
+    SQRL_ATOMIC_STORE( &sqrl_cpu_count_forced, n );
+}
 
+int sqrl_cpu_count()
+{
+    int forced = SQRL_ATOMIC_LOAD( &sqrl_cpu_count_forced );
+    if( forced > 0 ) return forced;
+#ifdef WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo( &si );
+    return (int)si.dwNumberOfProcessors;
+#endif
+#ifdef UNIX
+    long n = sysconf( _SC_NPROCESSORS_ONLN );
+    return n > 0 ? (int)n : 1;
+#endif
+    return 1;
+}
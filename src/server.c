@@ -9,6 +9,125 @@ For more details, see the LICENSE file included with this package.
 #include "sqrl_internal.h"
 #include "crypto/aes.h"
 
+static Sqrl_Server_Config *sqrl_server_config_create(
+    Sqrl_Server_Config *base,
+    char *uri,
+    char *passcode,
+    size_t passcode_len,
+    bool rotate,
+    int nut_life,
+    sqrl_scb_user *onUserOp,
+    sqrl_scb_send *onSend )
+{
+    Sqrl_Server_Config *config = calloc( 1, sizeof( Sqrl_Server_Config ));
+    if( !config ) return NULL;
+    config->referenceCount = 1;
+
+    if( uri ) {
+        config->uri = sqrl_uri_parse( uri );
+    } else if( base ) {
+        config->uri = sqrl_uri_parse( base->uri->challenge );
+    }
+    if( !config->uri ) {
+        free( config );
+        return NULL;
+    }
+
+    if( passcode ) {
+        crypto_hash_sha256( config->key, (unsigned char*)passcode, passcode_len );
+    } else if( base && !rotate ) {
+        memcpy( config->key, base->key, 32 );
+    } else {
+        randombytes_buf( config->key, 32 );
+    }
+
+    if( nut_life > 0 ) {
+        config->nut_expires = (uint64_t)nut_life * 1000000;
+    } else if( base ) {
+        config->nut_expires = base->nut_expires;
+    }
+
+    if( base ) {
+        uint64_t now = sqrl_get_timestamp();
+        if( 0 != sodium_memcmp( config->key, base->key, 32 )) {
+            // Nuts minted under the old key remain valid for one (old) nut lifetime
+            memcpy( config->previous_key, base->key, 32 );
+            config->previous_expires = now + base->nut_expires;
+        } else if( base->previous_expires > now ) {
+            memcpy( config->previous_key, base->previous_key, 32 );
+            config->previous_expires = base->previous_expires;
+        }
+        config->onUserOp = base->onUserOp;
+        config->onSend = base->onSend;
+    }
+    if( onUserOp ) config->onUserOp = onUserOp;
+    if( onSend ) config->onSend = onSend;
+    return config;
+}
+
+/**
+Gets a reference to the current configuration of a \p Sqrl_Server.  Never blocks,
+and the returned snapshot does not change, even if the server is reconfigured.
+
+\warning Release the snapshot with \p sqrl_server_config_release() when finished!
+
+@param server The \p Sqrl_Server
+@return The current \p Sqrl_Server_Config, or NULL
+*/
+DLL_PUBLIC
+Sqrl_Server_Config *sqrl_server_config_acquire( Sqrl_Server *server )
+{
+    if( !server ) return NULL;
+    uint32_t epoch;
+    // Register as a reader of the current epoch; retry if a writer
+    // advances the epoch before we are counted.
+    for( ;; ) {
+        epoch = SQRL_ATOMIC_LOAD( &server->epoch );
+        SQRL_ATOMIC_INC( &server->readers[epoch & 1] );
+        if( SQRL_ATOMIC_LOAD( &server->epoch ) == epoch ) break;
+        SQRL_ATOMIC_DEC( &server->readers[epoch & 1] );
+    }
+    Sqrl_Server_Config *config = SQRL_ATOMIC_LOAD_PTR( &server->config );
+    if( config ) {
+        SQRL_ATOMIC_INC( &config->referenceCount );
+    }
+    SQRL_ATOMIC_DEC( &server->readers[epoch & 1] );
+    return config;
+}
+
+/**
+Releases a reference to a \p Sqrl_Server_Config.  The snapshot is securely
+erased when the last reference is released.
+
+@param config The \p Sqrl_Server_Config
+@return NULL
+*/
+DLL_PUBLIC
+Sqrl_Server_Config *sqrl_server_config_release( Sqrl_Server_Config *config )
+{
+    if( !config ) return NULL;
+    if( SQRL_ATOMIC_DEC( &config->referenceCount ) == 0 ) {
+        if( config->uri ) sqrl_uri_free( config->uri );
+        sodium_memzero( config, sizeof( Sqrl_Server_Config ));
+        free( config );
+    }
+    return NULL;
+}
+
+// Replaces the published snapshot.  Caller must hold server->writer.
+static void sqrl_server_config_publish( Sqrl_Server *server, Sqrl_Server_Config *config )
+{
+    Sqrl_Server_Config *old = SQRL_ATOMIC_EXCHANGE_PTR( &server->config, config );
+    // Grace period: wait for readers that may have loaded the old pointer,
+    // but have not yet taken their reference.
+    uint32_t epoch = SQRL_ATOMIC_LOAD( &server->epoch );
+    SQRL_ATOMIC_STORE( &server->epoch, epoch + 1 );
+    while( SQRL_ATOMIC_LOAD( &server->readers[epoch & 1] ) != 0 ) {
+        sqrl_sleep( 0 );
+    }
+    sqrl_server_config_release( old );
+}
+
 DLL_PUBLIC
 bool sqrl_server_init(
     Sqrl_Server *server,
@@ -21,40 +140,132 @@ bool sqrl_server_init(
 {
     if( !server ) return false;
     memset( server, 0, sizeof( Sqrl_Server ));
+    if( !uri ) return false;
 
     if( !onUserOp ) onUserOp = sqrl_scb_user_default;
     if( !onSend ) onSend = sqrl_scb_send_default;
-    server->onUserOp = onUserOp;
-    server->onSend = onSend;
 
-    if( uri ) {
-        char *p, *pp;
-        server->uri = sqrl_uri_parse( uri );
-        if( ! server->uri ) {
-            sqrl_server_clear( server );
-            return false;
-        }
-    } else {
+    server->config = sqrl_server_config_create( NULL, uri, passcode, passcode_len,
+        false, nut_life, onUserOp, onSend );
+    if( !server->config ) {
         return false;
     }
-
-    if( passcode ) {
-        crypto_hash_sha256( server->key, (unsigned char*)passcode, passcode_len );
-    } else {
-        randombytes_buf( server->key, 32 );
-    }
-
-    server->nut_expires = nut_life * 1000000;
+    server->writer = sqrl_mutex_create();
     return true;
 }
 
+/**
+Clears a \p Sqrl_Server.  Contexts created from \p server keep their own
+reference to its configuration, but no new requests may be started.
+
+@param server The \p Sqrl_Server
+*/
 void sqrl_server_clear( Sqrl_Server *server )
 {
     if( !server ) return;
-    if( server->uri ) server->uri = sqrl_uri_free( server->uri );
+    if( server->writer ) {
+        sqrl_mutex_enter( server->writer );
+        sqrl_server_config_publish( server, NULL );
+        sqrl_mutex_leave( server->writer );
+        sqrl_mutex_destroy( server->writer );
+        free( server->writer );
+    }
     sodium_memzero( server, sizeof( Sqrl_Server ));
 }
 
+/**
+Atomically replaces the configuration of a running \p Sqrl_Server.  Requests
+already in progress finish with the configuration they started with.  If the
+key changes, nuts minted under the old key are accepted for one more nut lifetime.
+
+@param server The \p Sqrl_Server
+@param uri New SQRL URI, or NULL to keep the current URI
+@param passcode New passcode, or NULL to keep the current key
+@param passcode_len Length of \p passcode
+@param nut_life New nut lifetime in seconds, or 0 to keep the current lifetime
+@return true on success
+*/
+DLL_PUBLIC
+bool sqrl_server_reconfigure(
+    Sqrl_Server *server,
+    char *uri,
+    char *passcode,
+    size_t passcode_len,
+    int nut_life )
+{
+    if( !server || !server->writer ) return false;
+    bool retVal = false;
+    sqrl_mutex_enter( server->writer );
+    Sqrl_Server_Config *config = sqrl_server_config_create( server->config,
+        uri, passcode, passcode_len, false, nut_life, NULL, NULL );
+    if( config ) {
+        sqrl_server_config_publish( server, config );
+        retVal = true;
+    }
+    sqrl_mutex_leave( server->writer );
+    return retVal;
+}
+
+/**
+Rotates the key of a running \p Sqrl_Server.  See \p sqrl_server_reconfigure().
+
+@param server The \p Sqrl_Server
+@param passcode New passcode, or NULL to generate a random key
+@param passcode_len Length of \p passcode
+@return true on success
+*/
+DLL_PUBLIC
+bool sqrl_server_rekey(
+    Sqrl_Server *server,
+    char *passcode,
+    size_t passcode_len )
+{
+    if( !server || !server->writer ) return false;
+    bool retVal = false;
+    sqrl_mutex_enter( server->writer );
+    Sqrl_Server_Config *config = sqrl_server_config_create( server->config,
+        NULL, passcode, passcode_len, true, 0, NULL, NULL );
+    if( config ) {
+        sqrl_server_config_publish( server, config );
+        retVal = true;
+    }
+    sqrl_mutex_leave( server->writer );
+    return retVal;
+}
+
+/**
+Sets the previous key of a running \p Sqrl_Server, as if it had been rekeyed
+from \p passcode, and accepts it until \p expires.  For checking traffic
+captured across a key rotation.
+
+@param server The \p Sqrl_Server
+@param passcode The previous passcode
+@param passcode_len Length of \p passcode
+@param expires Timestamp after which the previous key is refused
+@return true on success
+*/
+DLL_PUBLIC
+bool sqrl_server_set_previous_key(
+    Sqrl_Server *server,
+    char *passcode,
+    size_t passcode_len,
+    uint64_t expires )
+{
+    if( !server || !server->writer || !passcode ) return false;
+    bool retVal = false;
+    sqrl_mutex_enter( server->writer );
+    Sqrl_Server_Config *config = sqrl_server_config_create( server->config,
+        NULL, NULL, 0, false, 0, NULL, NULL );
+    if( config ) {
+        crypto_hash_sha256( config->previous_key, (unsigned char*)passcode, passcode_len );
+        config->previous_expires = expires;
+        sqrl_server_config_publish( server, config );
+        retVal = true;
+    }
+    sqrl_mutex_leave( server->writer );
+    return retVal;
+}
+
 DLL_PUBLIC
 Sqrl_Server *sqrl_server_create(
     char *uri,
@@ -81,13 +292,12 @@ Sqrl_Server *sqrl_server_destroy( Sqrl_Server *server )
     return NULL;
 }
 
-DLL_PUBLIC
-bool sqrl_server_nut_generate(
-    Sqrl_Server *server,
+bool sqrl_server_config_nut_generate(
+    Sqrl_Server_Config *config,
     Sqrl_Nut *nut,
     uint32_t ip )
 {
-    if( !server ) return false;
+    if( !config ) return false;
     if( !nut ) return false;
     Sqrl_Nut pt;
     pt.ip = ip;
@@ -95,7 +305,7 @@ bool sqrl_server_nut_generate(
     pt.random = randombytes_random();
 
     aes_context ctx;
-    if( 0 != aes_setkey( &ctx, ENCRYPT, server->key, 16 )) {
+    if( 0 != aes_setkey( &ctx, ENCRYPT, config->key, 16 )) {
         return false;
     }
     if( 0 != aes_cipher( &ctx, (unsigned char*)&pt, (unsigned char*)nut )) {
@@ -106,18 +316,17 @@ bool sqrl_server_nut_generate(
     return true;
 }
 
-DLL_PUBLIC
-bool sqrl_server_nut_decrypt(
-    Sqrl_Server *server,
+bool sqrl_server_config_nut_decrypt(
+    const uint8_t *key,
     Sqrl_Nut *nut )
 {
-    if( !server ) return false;
+    if( !key ) return false;
     if( !nut ) return false;
     Sqrl_Nut pt;
     memset( &pt, 0, sizeof( Sqrl_Nut ));
 
     aes_context ctx;
-    if( 0 != aes_setkey( &ctx, DECRYPT, server->key, 16 )) {
+    if( 0 != aes_setkey( &ctx, DECRYPT, key, 16 )) {
         return false;
     }
     if( 0 != aes_cipher( &ctx, (unsigned char*)nut, (unsigned char*)&pt )) {
@@ -130,11 +339,35 @@ bool sqrl_server_nut_decrypt(
     return true;
 }
 
-void sqrl_server_add_mac( Sqrl_Server *server, UT_string *str, char sep )
+DLL_PUBLIC
+bool sqrl_server_nut_generate(
+    Sqrl_Server *server,
+    Sqrl_Nut *nut,
+    uint32_t ip )
+{
+    Sqrl_Server_Config *config = sqrl_server_config_acquire( server );
+    bool retVal = sqrl_server_config_nut_generate( config, nut, ip );
+    sqrl_server_config_release( config );
+    return retVal;
+}
+
+DLL_PUBLIC
+bool sqrl_server_nut_decrypt(
+    Sqrl_Server *server,
+    Sqrl_Nut *nut )
 {
-    if( !server || !str ) return;
+    Sqrl_Server_Config *config = sqrl_server_config_acquire( server );
+    if( !config ) return false;
+    bool retVal = sqrl_server_config_nut_decrypt( config->key, nut );
+    sqrl_server_config_release( config );
+    return retVal;
+}
+
+void sqrl_server_config_add_mac( Sqrl_Server_Config *config, UT_string *str, char sep )
+{
+    if( !config || !str ) return;
     uint8_t mac[crypto_auth_BYTES];
-    crypto_auth( mac, (unsigned char*)utstring_body( str ), utstring_len( str ), server->key );
+    crypto_auth( mac, (unsigned char*)utstring_body( str ), utstring_len( str ), config->key );
     if( sep > 0 ) {
         utstring_printf( str, "%cmac=", sep );
     } else {
@@ -143,9 +376,46 @@ void sqrl_server_add_mac( Sqrl_Server *server, UT_string *str, char sep )
     sqrl_b64u_encode_append( str, mac, SQRL_SERVER_MAC_LENGTH );
 }
 
-bool sqrl_server_verify_mac( Sqrl_Server *server, UT_string *str )
+void sqrl_server_add_mac( Sqrl_Server *server, UT_string *str, char sep )
 {
-    if( !server || !str ) return false;
+    Sqrl_Server_Config *config = sqrl_server_config_acquire( server );
+    sqrl_server_config_add_mac( config, str, sep );
+    sqrl_server_config_release( config );
+}
+
+static bool sqrl_server_mac_matches( const uint8_t *key, UT_string *str, size_t len, UT_string *v )
+{
+    uint8_t mac[crypto_auth_BYTES];
+    crypto_auth( mac, (unsigned char*)utstring_body(str), len, key );
+    return utstring_len( v ) >= SQRL_SERVER_MAC_LENGTH &&
+        0 == sodium_memcmp( mac, utstring_body(v), SQRL_SERVER_MAC_LENGTH );
+}
+
+/**
+Verifies the MAC on a server string, trying the previous key if it has not yet expired.
+
+@param config A \p Sqrl_Server_Config
+@param str The string to check
+@return Pointer to the key that produced the MAC, or NULL if the MAC is invalid
+*/
+const uint8_t *sqrl_server_config_verify_mac( Sqrl_Server_Config *config, UT_string *str )
+{
+    return sqrl_server_config_verify_mac_at( config, str, sqrl_get_timestamp() );
+}
+
+/**
+Verifies the MAC on a server string as of a given time, so that a request
+is checked against the keys that were valid when it was received.
+
+@param config A \p Sqrl_Server_Config
+@param str The string to check
+@param now The timestamp to check the previous key's expiry against
+@return Pointer to the key that produced the MAC, or NULL if the MAC is invalid
+*/
+const uint8_t *sqrl_server_config_verify_mac_at( Sqrl_Server_Config *config, UT_string *str, uint64_t now )
+{
+    if( !config || !str ) return NULL;
+    const uint8_t *retVal = NULL;
     size_t len = 0;
     char *m = strstr( utstring_body( str ), "&mac=" );
     if( m ) {
@@ -159,17 +429,26 @@ bool sqrl_server_verify_mac( Sqrl_Server *server, UT_string *str )
         }
     }
     if( m ) {
-        uint8_t mac[crypto_auth_BYTES];
-        crypto_auth( mac, (unsigned char*)utstring_body(str), len, server->key );
         UT_string *v;
         utstring_new( v );
         sqrl_b64u_decode( v, m, strlen( m ));
-        if( 0 == memcmp( mac, utstring_body(v), SQRL_SERVER_MAC_LENGTH )) {
-            utstring_free( v );
-            return true;
+        if( sqrl_server_mac_matches( config->key, str, len, v )) {
+            retVal = config->key;
+        } else if( config->previous_expires > now &&
+            sqrl_server_mac_matches( config->previous_key, str, len, v )) {
+            retVal = config->previous_key;
         }
+        utstring_free( v );
     }
-    return false;
+    return retVal;
+}
+
+bool sqrl_server_verify_mac( Sqrl_Server *server, UT_string *str )
+{
+    Sqrl_Server_Config *config = sqrl_server_config_acquire( server );
+    bool retVal = (NULL != sqrl_server_config_verify_mac( config, str ));
+    sqrl_server_config_release( config );
+    return retVal;
 }
 
 DLL_PUBLIC
@@ -178,31 +457,43 @@ char *sqrl_server_create_link( Sqrl_Server *server, uint32_t ip )
     if( !server ) return false;
     char *retVal = NULL;
     Sqrl_Nut nut;
-    if( sqrl_server_nut_generate( server, &nut, ip )) {
+    Sqrl_Server_Config *config = sqrl_server_config_acquire( server );
+    if( sqrl_server_config_nut_generate( config, &nut, ip )) {
         char *p, *pp;
-        p = strstr( server->uri->challenge, SQRL_SERVER_TOKEN_NUT );
+        p = strstr( config->uri->challenge, SQRL_SERVER_TOKEN_NUT );
         if( p ) {
             UT_string *str;
             utstring_new( str );
-            utstring_bincpy( str, server->uri->challenge, p - server->uri->challenge );
+            utstring_bincpy( str, config->uri->challenge, p - config->uri->challenge );
             sqrl_b64u_encode_append( str, (uint8_t*)&nut, sizeof( Sqrl_Nut ));
             pp = p + strlen( SQRL_SERVER_TOKEN_NUT );
             utstring_printf( str, "%s", pp );
-            sqrl_server_add_mac( server, str, '&' );
+            sqrl_server_config_add_mac( config, str, '&' );
             retVal = malloc( utstring_len( str ) + 1 );
             strcpy( retVal, utstring_body( str ));
             utstring_free( str );
         }
     }
+    sqrl_server_config_release( config );
     return retVal;
 }
 
+/**
+Creates a context for handling one request.  The context holds the server's
+configuration as it was when the context was created.
+
+@param server The \p Sqrl_Server
+@return A new \p Sqrl_Server_Context
+*/
 DLL_PUBLIC
 Sqrl_Server_Context *sqrl_server_context_create( Sqrl_Server *server )
 {
     if( !server ) return NULL;
+    Sqrl_Server_Config *config = sqrl_server_config_acquire( server );
+    if( !config ) return NULL;
     Sqrl_Server_Context *ctx = calloc( 1, sizeof( Sqrl_Server_Context ));
     ctx->server = server;
+    ctx->config = config;
     return ctx;
 }
 
@@ -225,6 +516,7 @@ Sqrl_Server_Context *sqrl_server_context_destroy( Sqrl_Server_Context *ctx )
             free( ctx->server_strings[i] );
     }
     if( ctx->reply ) free( ctx->reply );
+    ctx->config = sqrl_server_config_release( ctx->config );
     free( ctx );
     return NULL;
 }
@@ -237,6 +529,18 @@ struct sqrl_default_user_list {
 
 static struct sqrl_default_user_list *SDUL = NULL;
 
+// Replaces *dst with a copy of src, sized to fit.
+static bool sqrl_default_user_copy( char **dst, const char *src )
+{
+    size_t len = strlen( src );
+    char *copy = malloc( len + 1 );
+    if( !copy ) return false;
+    memcpy( copy, src, len + 1 );
+    if( *dst ) free( *dst );
+    *dst = copy;
+    return true;
+}
+
 bool sqrl_scb_user_default(
     Sqrl_Server_User_Op op,
     char *host,
@@ -245,32 +549,38 @@ bool sqrl_scb_user_default(
     char *blob )
 {
     if( !host || !idk ) return false;
+    if( !blob && op != SQRL_SCB_USER_DELETE && op != SQRL_SCB_USER_IDENTIFIED ) return false;
     struct sqrl_default_user_list *l, *lp = NULL;
     char *cmpStr = idk;
 
     if( op == SQRL_SCB_USER_CREATE ) {
         l = calloc( 1, sizeof( struct sqrl_default_user_list ));
-        l->idk = malloc( 1 + strlen( idk ));
-        strcpy( l->idk, idk );
-        l->blob = malloc( 1 + strlen( blob ));
-        strcpy( l->blob, blob );
+        if( !l ) return false;
+        if( !sqrl_default_user_copy( &l->idk, idk ) ||
+            !sqrl_default_user_copy( &l->blob, blob )) {
+            free( l->idk );
+            free( l->blob );
+            free( l );
+            return false;
+        }
         l->next = SDUL;
         SDUL = l;
         return true;
     }
     l = SDUL;
     if( op == SQRL_SCB_USER_REKEYED ) {
+        if( !pidk ) return false;
         cmpStr = pidk;
     }
     while( l ) {
         if( 0 == strcmp( cmpStr, l->idk )) {
             switch( op ) {
             case SQRL_SCB_USER_FIND:
-                strcpy( blob, l->blob );
+                strncpy( blob, l->blob, SQRL_SERVER_USER_BLOB_SIZE - 1 );
+                blob[SQRL_SERVER_USER_BLOB_SIZE - 1] = 0;
                 return true;
             case SQRL_SCB_USER_UPDATE:
-                strcpy( l->blob, blob );
-                return true;
+                return sqrl_default_user_copy( &l->blob, blob );
             case SQRL_SCB_USER_DELETE:
                 if( lp ) {
                     lp->next = l->next;
@@ -282,9 +592,8 @@ bool sqrl_scb_user_default(
                 free( l );
                 return true;
             case SQRL_SCB_USER_REKEYED:
-                strcpy( l->idk, idk );
-                strcpy( l->blob, blob );
-                return true;
+                return sqrl_default_user_copy( &l->idk, idk ) &&
+                    sqrl_default_user_copy( &l->blob, blob );
             case SQRL_SCB_USER_IDENTIFIED:
                 printf( "%10s: %s\n", "SRV_ID", idk );
                 return true;
@@ -31,8 +31,9 @@ bool sqrl_server_verify_nut(
         FLAG_SET( context->tif, SQRL_TIF_IP_MATCH );
     }
 
-    int64_t diff = sqrl_get_timestamp() - context->nut.timestamp;
-    if( diff < 0 || diff > context->server->nut_expires ) {
+    uint64_t now = context->timestamp ? context->timestamp : sqrl_get_timestamp();
+    int64_t diff = now - context->nut.timestamp;
+    if( diff < 0 || diff > context->config->nut_expires ) {
         FLAG_SET( context->tif, SQRL_TIF_TRANSIENT_ERROR );
         return false;
     }
@@ -47,7 +48,9 @@ bool sqrl_server_verify_server_string(
     UT_string *srv;
     utstring_new( srv );
     sqrl_b64u_decode( srv, context->context_strings[CONTEXT_KV_SERVER], strlen( context->context_strings[CONTEXT_KV_SERVER ]));
-    if( sqrl_server_verify_mac( context->server, srv )) {
+    uint64_t now = context->timestamp ? context->timestamp : sqrl_get_timestamp();
+    const uint8_t *key = sqrl_server_config_verify_mac_at( context->config, srv, now );
+    if( key ) {
         char *p, *pp;
         p = strstr( utstring_body( srv ), "nut=" );
         if( p ) {
@@ -64,7 +67,7 @@ bool sqrl_server_verify_server_string(
             sqrl_b64u_decode( t, p, len );
             memcpy( &context->nut, utstring_body( t ), sizeof( Sqrl_Nut ));
             utstring_free( t );
-            if( sqrl_server_nut_decrypt( context->server, &context->nut )) {
+            if( sqrl_server_config_nut_decrypt( key, &context->nut )) {
                 if( sqrl_server_verify_nut( context, client_ip )) {
                     utstring_free( srv );
                     FLAG_SET( context->flags, SQRL_SERVER_CONTEXT_FLAG_VALID_SERVER_STRING );
@@ -73,7 +76,9 @@ bool sqrl_server_verify_server_string(
             }
         }
     }
+#if DEBUG_PRINT_SERVER_PROTOCOL
     printf( "*** BAD SERVER STRING ***\n" );
+#endif
     FLAG_SET( context->tif, SQRL_TIF_COMMAND_FAILURE | SQRL_TIF_CLIENT_FAILURE );
     utstring_free( srv );
     return false;
@@ -175,7 +180,9 @@ bool sqrl_server_verify_signatures(
                 utstring_free( str );
                 utstring_free( key );
                 utstring_free( sig );
+#if DEBUG_PRINT_SERVER_PROTOCOL
                 printf( "IDS FAILURE\n" );
+#endif
                 FLAG_SET( context->tif, SQRL_TIF_COMMAND_FAILURE | SQRL_TIF_CLIENT_FAILURE );
                 return false;
             }
@@ -188,7 +195,9 @@ bool sqrl_server_verify_signatures(
                 utstring_free( str );
                 utstring_free( key );
                 utstring_free( sig );
+#if DEBUG_PRINT_SERVER_PROTOCOL
                 printf( "PIDS FAILURE\n" );
+#endif
                 FLAG_SET( context->tif, SQRL_TIF_COMMAND_FAILURE | SQRL_TIF_CLIENT_FAILURE );
                 return false;
             }
@@ -209,15 +218,15 @@ bool sqrl_server_build_reply( Sqrl_Server_Context *context, UT_string *reply )
     utstring_renew( reply );
     utstring_printf( reply, "ver=%s\r\n", SQRL_VERSION_STRING );
     uint32_t ip = context->nut.ip; // Reuse original IP address
-    sqrl_server_nut_generate( context->server, &context->nut, ip );
+    sqrl_server_config_nut_generate( context->config, &context->nut, ip );
     utstring_printf( reply, "nut=" );
     sqrl_b64u_encode_append( reply, (unsigned char*)&context->nut, sizeof( Sqrl_Nut ));
     utstring_printf( reply, "\r\n" );
     utstring_printf( reply, "tif=%X\r\n", context->tif );
     if( !context->server_strings[SERVER_KV_QRY] ) {
-        size_t len = strlen( context->server->uri->prefix );
+        size_t len = strlen( context->config->uri->prefix );
         char *p, *pp;
-        p = context->server->uri->challenge + len - 1;
+        p = context->config->uri->challenge + len - 1;
         pp = strchr( p, '?' );
         if( pp ) {
             len = pp - p;
@@ -237,7 +246,7 @@ bool sqrl_server_build_reply( Sqrl_Server_Context *context, UT_string *reply )
     if( context->server_strings[SERVER_KV_URL] ) {
         utstring_printf( reply, "url=%s\r\n", context->server_strings[SERVER_KV_URL] );
     }
-    sqrl_server_add_mac( context->server, reply, 0 );
+    sqrl_server_config_add_mac( context->config, reply, 0 );
     return true;
 }
 
@@ -260,6 +269,7 @@ void sqrl_server_parse_query(
     UT_string *rStr;
 
     FLAG_CLEAR( context->flags, SQRL_SERVER_CONTEXT_FLAG_VALID_QUERY );
+    context->client_ip = client_ip;
 
     utstring_new( rStr );
     utstring_bincpy( rStr, query, query_len );
@@ -299,11 +309,11 @@ bool sqrl_server_get_user(
     Sqrl_Server_Context *context,
     char *idk )
 {
-    char *blob = malloc( 512 );
-    sqrl_scb_user *onUserOp = (sqrl_scb_user*)context->server->onUserOp;
+    char *blob = malloc( SQRL_SERVER_USER_BLOB_SIZE );
+    sqrl_scb_user *onUserOp = (sqrl_scb_user*)context->config->onUserOp;
     if( (onUserOp)( 
         SQRL_SCB_USER_FIND,
-        context->server->uri->host,
+        context->config->uri->host,
         idk,
         NULL,
         blob )) 
@@ -338,19 +348,13 @@ void sqrl_server_add_user_suk( Sqrl_Server_Context *context )
     utstring_free( tmp );
 }
 
-DLL_PUBLIC
-void sqrl_server_handle_query(
-    Sqrl_Server_Context *context,
-    uint32_t client_ip,
-    const char *query,
-    size_t query_len )
+// Applies a parsed and verified query to user state, and sends the reply.
+static void sqrl_server_execute( Sqrl_Server_Context *context )
 {
-    if( !context || !query ) return;
-    sqrl_scb_user *onUserOp = (sqrl_scb_user*)context->server->onUserOp;
+    sqrl_scb_user *onUserOp = (sqrl_scb_user*)context->config->onUserOp;
 
     UT_string *reply, *tmp;
     utstring_new( reply );
-    sqrl_server_parse_query( context, client_ip, query, query_len );
     if( !FLAG_CHECK( context->flags, SQRL_SERVER_CONTEXT_FLAG_VALID_QUERY )) {
         FLAG_SET( context->tif, SQRL_TIF_COMMAND_FAILURE );
         goto REPLY;
@@ -396,7 +400,7 @@ void sqrl_server_handle_query(
         goto REPLY;
     case SQRL_CMD_REMOVE:
         if( (onUserOp)(SQRL_SCB_USER_DELETE,
-            context->server->uri->host,
+            context->config->uri->host,
             context->client_strings[CLIENT_KV_IDK],
             NULL, NULL )) {
             FLAG_CLEAR( context->tif, SQRL_TIF_ID_MATCH );
@@ -412,7 +416,7 @@ void sqrl_server_handle_query(
             sqrl_b64u_encode( tmp, (uint8_t*)context->user, sizeof( Sqrl_Server_User ));
 
             if( (onUserOp)(SQRL_SCB_USER_UPDATE,
-                context->server->uri->host,
+                context->config->uri->host,
                 context->client_strings[CLIENT_KV_IDK],
                 NULL, utstring_body( tmp ))) {
                 FLAG_CLEAR( context->tif, SQRL_TIF_SQRL_DISABLED );
@@ -426,7 +430,7 @@ void sqrl_server_handle_query(
             utstring_new( tmp );
             sqrl_b64u_encode( tmp, (uint8_t*)context->user, sizeof( Sqrl_Server_User ));
             if( (onUserOp)(SQRL_SCB_USER_REKEYED,
-                context->server->uri->host,
+                context->config->uri->host,
                 context->client_strings[CLIENT_KV_IDK],
                 context->client_strings[CLIENT_KV_PIDK],
                 utstring_body( tmp ))) {
@@ -447,7 +451,7 @@ void sqrl_server_handle_query(
             sqrl_b64u_encode( tmp, (uint8_t*)context->user, sizeof( Sqrl_Server_User ));
 
             if( (onUserOp)(SQRL_SCB_USER_UPDATE,
-                context->server->uri->host,
+                context->config->uri->host,
                 context->client_strings[CLIENT_KV_IDK],
                 NULL, utstring_body( tmp ))) {
                 FLAG_SET( context->tif, SQRL_TIF_SQRL_DISABLED );
@@ -465,7 +469,7 @@ void sqrl_server_handle_query(
                 break;
             }
             (onUserOp)(SQRL_SCB_USER_IDENTIFIED,
-                context->server->uri->host,
+                context->config->uri->host,
                 context->client_strings[CLIENT_KV_IDK],
                 NULL, NULL );
         } else if( FLAG_CHECK( context->tif, SQRL_TIF_PREVIOUS_ID_MATCH )) {
@@ -482,7 +486,7 @@ void sqrl_server_handle_query(
             memcpy( context->user->idk, utstring_body( tmp ), SQRL_KEY_SIZE);
             sqrl_b64u_encode( tmp, (uint8_t*)context->user, sizeof( Sqrl_Server_User ));
             (onUserOp)(SQRL_SCB_USER_REKEYED,
-                context->server->uri->host,
+                context->config->uri->host,
                 context->client_strings[CLIENT_KV_IDK],
                 context->client_strings[CLIENT_KV_PIDK],
                 utstring_body( tmp ));
@@ -490,7 +494,7 @@ void sqrl_server_handle_query(
             FLAG_CLEAR( context->tif, SQRL_TIF_PREVIOUS_ID_MATCH );
             FLAG_SET( context->tif, SQRL_TIF_ID_MATCH );
             (onUserOp)(SQRL_SCB_USER_IDENTIFIED,
-                context->server->uri->host,
+                context->config->uri->host,
                 context->client_strings[CLIENT_KV_IDK],
                 NULL, NULL );
         } else {
@@ -509,11 +513,11 @@ void sqrl_server_handle_query(
                 memcpy( &context->user->vuk, utstring_body( tmp ), SQRL_KEY_SIZE );
                 sqrl_b64u_encode( tmp, (uint8_t*)context->user, sizeof( Sqrl_Server_User ));
                 if( (onUserOp)( SQRL_SCB_USER_CREATE,
-                    context->server->uri->host,
+                    context->config->uri->host,
                     context->client_strings[CLIENT_KV_IDK],
                     NULL, utstring_body( tmp ))) {
                     (onUserOp)(SQRL_SCB_USER_IDENTIFIED,
-                        context->server->uri->host,
+                        context->config->uri->host,
                         context->client_strings[CLIENT_KV_IDK],
                         NULL, NULL );
                     FLAG_SET( context->tif, SQRL_TIF_ID_MATCH );
@@ -532,10 +536,254 @@ void sqrl_server_handle_query(
 
 REPLY:
     sqrl_server_build_reply( context, reply );
-    sqrl_scb_send *onSend = (sqrl_scb_send*)context->server->onSend;
+    sqrl_scb_send *onSend = (sqrl_scb_send*)context->config->onSend;
     (onSend)( context, utstring_body( reply ), utstring_len( reply ));
 
     utstring_free( reply );
 }
 
+DLL_PUBLIC
+void sqrl_server_handle_query(
+    Sqrl_Server_Context *context,
+    uint32_t client_ip,
+    const char *query,
+    size_t query_len )
+{
+    if( !context || !query ) return;
+    sqrl_server_parse_query( context, client_ip, query, query_len );
+    sqrl_server_execute( context );
+}
+
+#define SQRL_ENVELOPE_VERSION  1
+#define SQRL_ENVELOPE_HAS_IDK  0x01
+#define SQRL_ENVELOPE_HAS_PIDK 0x02
+#define SQRL_ENVELOPE_HAS_SUK  0x04
+#define SQRL_ENVELOPE_HAS_VUK  0x08
+#define SQRL_ENVELOPE_HAS_URS  0x10
+#define SQRL_ENVELOPE_HEADER   (1 + 1 + 2 + 2 + 1 + 4 + 16)
+#define SQRL_ENVELOPE_SIG_SIZE 64
+
+static const int envelope_keys[4] = {
+    CLIENT_KV_IDK, CLIENT_KV_PIDK, CLIENT_KV_SUK, CLIENT_KV_VUK
+};
+
+// Envelopes are MACed with a key derived from the server key, so they
+// can never be mistaken for a server string.
+static void sqrl_server_envelope_mac( const uint8_t *key, const uint8_t *msg, size_t msg_len, uint8_t *mac )
+{
+    uint8_t ekey[crypto_auth_KEYBYTES];
+    uint8_t full[crypto_auth_BYTES];
+    crypto_generichash( ekey, sizeof( ekey ), (const unsigned char*)"libsqrl envelope", 16, key, 32 );
+    crypto_auth( full, msg, msg_len, ekey );
+    memcpy( mac, full, SQRL_SERVER_MAC_LENGTH );
+    sodium_memzero( ekey, sizeof( ekey ));
+}
+
+static void sqrl_server_envelope_put( UT_string *str, uint64_t value, int bytes )
+{
+    uint8_t buf[8];
+    int i;
+    for( i = 0; i < bytes; i++ ) {
+        buf[i] = (value >> (i * 8)) & 0xFF;
+    }
+    utstring_bincpy( str, buf, bytes );
+}
+
+static uint64_t sqrl_server_envelope_get( const uint8_t **p, int bytes )
+{
+    uint64_t value = 0;
+    int i;
+    for( i = 0; i < bytes; i++ ) {
+        value |= (uint64_t)(*p)[i] << (i * 8);
+    }
+    *p += bytes;
+    return value;
+}
+
+static bool sqrl_server_envelope_put_b64( UT_string *str, const char *b64, size_t size )
+{
+    bool retVal = false;
+    UT_string *tmp;
+    utstring_new( tmp );
+    sqrl_b64u_decode( tmp, b64, strlen( b64 ));
+    if( utstring_len( tmp ) == size ) {
+        utstring_bincpy( str, utstring_body( tmp ), size );
+        retVal = true;
+    }
+    utstring_free( tmp );
+    return retVal;
+}
+
+static void sqrl_server_envelope_put_string( UT_string *str, const char *value )
+{
+    size_t len = strlen( value );
+    sqrl_server_envelope_put( str, len, 2 );
+    utstring_bincpy( str, value, len );
+}
+
+/**
+Serializes a verified \p Sqrl_Server_Context into a MAC protected envelope,
+which can be resumed by any \p Sqrl_Server sharing this server's key.
 
+@param context A context which has passed \p sqrl_server_parse_query()
+@param envelope Receives the envelope
+@return true on success; false if \p context is not a verified query
+*/
+DLL_PUBLIC
+bool sqrl_server_context_export( Sqrl_Server_Context *context, UT_string *envelope )
+{
+    if( !context || !envelope ) return false;
+    if( !FLAG_CHECK( context->flags, SQRL_SERVER_CONTEXT_FLAG_VALID_QUERY )) return false;
+    int i;
+    uint8_t present = 0;
+    uint8_t mac[SQRL_SERVER_MAC_LENGTH];
+
+    for( i = 0; i < 4; i++ ) {
+        if( context->client_strings[envelope_keys[i]] ) present |= (1 << i);
+    }
+    if( context->context_strings[CONTEXT_KV_URS] ) present |= SQRL_ENVELOPE_HAS_URS;
+
+    utstring_renew( envelope );
+    sqrl_server_envelope_put( envelope, SQRL_ENVELOPE_VERSION, 1 );
+    sqrl_server_envelope_put( envelope, context->command, 1 );
+    sqrl_server_envelope_put( envelope, context->tif, 2 );
+    sqrl_server_envelope_put( envelope, context->flags, 2 );
+    sqrl_server_envelope_put( envelope, present, 1 );
+    sqrl_server_envelope_put( envelope, context->client_ip, 4 );
+    sqrl_server_envelope_put( envelope, context->nut.ip, 4 );
+    sqrl_server_envelope_put( envelope, context->nut.random, 4 );
+    sqrl_server_envelope_put( envelope, context->nut.timestamp, 8 );
+    for( i = 0; i < 4; i++ ) {
+        if( (present & (1 << i)) &&
+            !sqrl_server_envelope_put_b64( envelope, context->client_strings[envelope_keys[i]], SQRL_KEY_SIZE )) {
+            goto ERROR;
+        }
+    }
+    if( present & SQRL_ENVELOPE_HAS_URS ) {
+        // The URS can only be checked against the stored VUK, so keep what was signed
+        if( !sqrl_server_envelope_put_b64( envelope, context->context_strings[CONTEXT_KV_URS], SQRL_ENVELOPE_SIG_SIZE )) {
+            goto ERROR;
+        }
+        sqrl_server_envelope_put_string( envelope, context->context_strings[CONTEXT_KV_CLIENT] );
+        sqrl_server_envelope_put_string( envelope, context->context_strings[CONTEXT_KV_SERVER] );
+    }
+    sqrl_server_envelope_mac( context->config->key,
+        (uint8_t*)utstring_body( envelope ), utstring_len( envelope ), mac );
+    utstring_bincpy( envelope, mac, SQRL_SERVER_MAC_LENGTH );
+    return true;
+
+ERROR:
+    utstring_renew( envelope );
+    return false;
+}
+
+static char *sqrl_server_envelope_get_string( const uint8_t **p, const uint8_t *end )
+{
+    if( end - *p < 2 ) return NULL;
+    size_t len = sqrl_server_envelope_get( p, 2 );
+    if( (size_t)(end - *p) < len ) return NULL;
+    char *str = malloc( len + 1 );
+    memcpy( str, *p, len );
+    str[len] = 0;
+    *p += len;
+    return str;
+}
+
+static char *sqrl_server_envelope_get_b64( const uint8_t **p, size_t size )
+{
+    UT_string *tmp;
+    utstring_new( tmp );
+    sqrl_b64u_encode( tmp, *p, size );
+    char *str = malloc( utstring_len( tmp ) + 1 );
+    strcpy( str, utstring_body( tmp ));
+    utstring_free( tmp );
+    *p += size;
+    return str;
+}
+
+/**
+Recreates a verified \p Sqrl_Server_Context from an envelope made by
+\p sqrl_server_context_export().  The query is not verified again;
+call \p sqrl_server_context_resume() to process it.
+
+@param server The \p Sqrl_Server
+@param envelope The envelope
+@param envelope_len Length of \p envelope
+@return A new \p Sqrl_Server_Context, or NULL if the envelope is invalid
+*/
+DLL_PUBLIC
+Sqrl_Server_Context *sqrl_server_context_import(
+    Sqrl_Server *server,
+    const uint8_t *envelope,
+    size_t envelope_len )
+{
+    if( !server || !envelope ) return NULL;
+    if( envelope_len < SQRL_ENVELOPE_HEADER + SQRL_SERVER_MAC_LENGTH ) return NULL;
+    Sqrl_Server_Context *context = sqrl_server_context_create( server );
+    if( !context ) return NULL;
+
+    int i;
+    uint8_t mac[SQRL_SERVER_MAC_LENGTH];
+    size_t body_len = envelope_len - SQRL_SERVER_MAC_LENGTH;
+    const uint8_t *p = envelope;
+    const uint8_t *end = envelope + body_len;
+
+    sqrl_server_envelope_mac( context->config->key, envelope, body_len, mac );
+    if( 0 != sodium_memcmp( mac, end, SQRL_SERVER_MAC_LENGTH )) {
+        if( context->config->previous_expires <= sqrl_get_timestamp() ) goto ERROR;
+        sqrl_server_envelope_mac( context->config->previous_key, envelope, body_len, mac );
+        if( 0 != sodium_memcmp( mac, end, SQRL_SERVER_MAC_LENGTH )) goto ERROR;
+    }
+
+    if( sqrl_server_envelope_get( &p, 1 ) != SQRL_ENVELOPE_VERSION ) goto ERROR;
+    context->command = (Sqrl_Cmd)sqrl_server_envelope_get( &p, 1 );
+    context->tif = (Sqrl_Tif)sqrl_server_envelope_get( &p, 2 );
+    context->flags = (uint16_t)sqrl_server_envelope_get( &p, 2 );
+    uint8_t present = (uint8_t)sqrl_server_envelope_get( &p, 1 );
+    context->client_ip = (uint32_t)sqrl_server_envelope_get( &p, 4 );
+    context->nut.ip = (uint32_t)sqrl_server_envelope_get( &p, 4 );
+    context->nut.random = (uint32_t)sqrl_server_envelope_get( &p, 4 );
+    context->nut.timestamp = sqrl_server_envelope_get( &p, 8 );
+    if( context->command > SQRL_CMD_REMOVE ) goto ERROR;
+    // An envelope is only good for as long as its nut
+    int64_t age = (int64_t)(sqrl_get_timestamp() - context->nut.timestamp);
+    if( age < 0 || age > (int64_t)context->config->nut_expires ) goto ERROR;
+
+    for( i = 0; i < 4; i++ ) {
+        if( present & (1 << i) ) {
+            if( end - p < SQRL_KEY_SIZE ) goto ERROR;
+            context->client_strings[envelope_keys[i]] = sqrl_server_envelope_get_b64( &p, SQRL_KEY_SIZE );
+        }
+    }
+    if( !context->client_strings[CLIENT_KV_IDK] ) goto ERROR;
+    if( present & SQRL_ENVELOPE_HAS_URS ) {
+        if( end - p < SQRL_ENVELOPE_SIG_SIZE ) goto ERROR;
+        context->context_strings[CONTEXT_KV_URS] = sqrl_server_envelope_get_b64( &p, SQRL_ENVELOPE_SIG_SIZE );
+        context->context_strings[CONTEXT_KV_CLIENT] = sqrl_server_envelope_get_string( &p, end );
+        context->context_strings[CONTEXT_KV_SERVER] = sqrl_server_envelope_get_string( &p, end );
+        if( !context->context_strings[CONTEXT_KV_CLIENT] ||
+            !context->context_strings[CONTEXT_KV_SERVER] ) {
+            goto ERROR;
+        }
+    }
+    if( p != end ) goto ERROR;
+    context->client_strings[CLIENT_KV_CMD] = malloc( strlen( commands[context->command] ) + 1 );
+    strcpy( context->client_strings[CLIENT_KV_CMD], commands[context->command] );
+    return context;
+
+ERROR:
+    return sqrl_server_context_destroy( context );
+}
+
+/**
+Processes a \p Sqrl_Server_Context created by \p sqrl_server_context_import(),
+exactly as \p sqrl_server_handle_query() would have after verifying it.
+
+@param context The imported \p Sqrl_Server_Context
+*/
+DLL_PUBLIC
+void sqrl_server_context_resume( Sqrl_Server_Context *context )
+{
+    if( !context ) return;
+    sqrl_server_execute( context );
+}
@@ -0,0 +1,352 @@
+/** @file server_queue.c
+
+@author Adam Comley
+
+This file is part of libsqrl.  It is released under the MIT license.
+For more details, see the LICENSE file included with this package.
+
+A bounded priority admission queue in front of \p sqrl_server_handle_query().
+
+Requests which finish a login (ident, disable, enable, remove) are served
+before queries, which only start one.  When the queue is full, the oldest
+query is shed to admit a more important request.  Requests whose nut will
+expire before a worker can reach them are answered immediately with a
+transient error, which tells the client to retry with a fresh nut.
+*/
+
+#include "sqrl_internal.h"
+
+typedef struct Sqrl_Queue_Item {
+    Sqrl_Server_Context *context;
+    uint32_t client_ip;
+    char *query;
+    size_t query_len;
+    uint64_t enqueued;
+    uint64_t deadline;
+    struct Sqrl_Queue_Item *next;
+} Sqrl_Queue_Item;
+
+typedef struct Sqrl_Queue_List {
+    Sqrl_Queue_Item *head;
+    Sqrl_Queue_Item *tail;
+    int count;
+} Sqrl_Queue_List;
+
+struct Sqrl_Server_Queue {
+    Sqrl_Server *server;
+    int capacity;
+    int workerCount;
+    SqrlThread *workers;
+    SqrlMutex mutex;
+    SqrlCondition ready;
+    bool stopping;
+    Sqrl_Queue_List high;
+    Sqrl_Queue_List low;
+    uint64_t serviceTime;   // moving average, microseconds
+    Sqrl_Server_Queue_Stats stats;
+};
+
+static void sqrl_queue_push( Sqrl_Queue_List *list, Sqrl_Queue_Item *item )
+{
+    item->next = NULL;
+    if( list->tail ) {
+        list->tail->next = item;
+    } else {
+        list->head = item;
+    }
+    list->tail = item;
+    list->count++;
+}
+
+static Sqrl_Queue_Item *sqrl_queue_pop( Sqrl_Queue_List *list )
+{
+    Sqrl_Queue_Item *item = list->head;
+    if( item ) {
+        list->head = item->next;
+        if( !list->head ) list->tail = NULL;
+        list->count--;
+    }
+    return item;
+}
+
+// Finds the value of key in an application/x-www-form-urlencoded query.
+static bool sqrl_queue_query_value( const char *query, size_t query_len, const char *key, UT_string *value )
+{
+    size_t key_len = strlen( key );
+    const char *p = query, *end = query + query_len;
+    while( p < end ) {
+        const char *amp = memchr( p, '&', end - p );
+        if( !amp ) amp = end;
+        if( (size_t)(amp - p) > key_len && p[key_len] == '=' && 0 == memcmp( p, key, key_len )) {
+            p += key_len + 1;
+            sqrl_b64u_decode( value, p, amp - p );
+            return true;
+        }
+        p = amp + 1;
+    }
+    return false;
+}
+
+// Reads the command and nut deadline of a query.  Only the server string's
+// MAC is checked here; workers do the full verification.
+static bool sqrl_queue_classify(
+    Sqrl_Server_Config *config,
+    const char *query,
+    size_t query_len,
+    bool *high,
+    uint64_t *deadline )
+{
+    bool retVal = false;
+    char *p, *pp;
+    UT_string *str, *tmp;
+    utstring_new( str );
+    utstring_new( tmp );
+
+    *high = false;
+    if( sqrl_queue_query_value( query, query_len, "client", str )) {
+        p = strstr( utstring_body( str ), "cmd=" );
+        if( p ) {
+            p += 4;
+            *high = 0 != strncmp( p, "query", 5 );
+        }
+    }
+
+    utstring_clear( str );
+    if( sqrl_queue_query_value( query, query_len, "server", str )) {
+        // The MAC tells us which key minted the nut
+        const uint8_t *key = sqrl_server_config_verify_mac( config, str );
+        p = key ? strstr( utstring_body( str ), "nut=" ) : NULL;
+        if( p ) {
+            p += 4;
+            pp = strchr( p, '&' );
+            sqrl_b64u_decode( tmp, p, pp ? (size_t)(pp - p) : strlen( p ));
+            Sqrl_Nut nut;
+            if( utstring_len( tmp ) >= sizeof( Sqrl_Nut )) {
+                memcpy( &nut, utstring_body( tmp ), sizeof( Sqrl_Nut ));
+                if( sqrl_server_config_nut_decrypt( key, &nut )) {
+                    *deadline = nut.timestamp + config->nut_expires;
+                    retVal = true;
+                }
+            }
+        }
+    }
+    utstring_free( str );
+    utstring_free( tmp );
+    return retVal;
+}
+
+// Answers a request without processing it, and frees it.
+static void sqrl_queue_reject( Sqrl_Queue_Item *item, Sqrl_Tif tif )
+{
+    Sqrl_Server_Context *context = item->context;
+    UT_string *reply;
+    utstring_new( reply );
+    FLAG_SET( context->tif, tif );
+    // The query was never parsed, so the new nut takes the request's IP;
+    // otherwise the client's retry would lose SQRL_TIF_IP_MATCH
+    context->client_ip = item->client_ip;
+    context->nut.ip = item->client_ip;
+    sqrl_server_build_reply( context, reply );
+    sqrl_scb_send *onSend = (sqrl_scb_send*)context->config->onSend;
+    (onSend)( context, utstring_body( reply ), utstring_len( reply ));
+    utstring_free( reply );
+    sqrl_server_context_destroy( context );
+    free( item->query );
+    free( item );
+}
+
+static SQRL_THREAD_FUNCTION_RETURN_TYPE sqrl_queue_worker( SQRL_THREAD_FUNCTION_INPUT_TYPE input )
+{
+    Sqrl_Server_Queue *queue = (Sqrl_Server_Queue*)input;
+    Sqrl_Queue_Item *item;
+    uint64_t now, wait, elapsed;
+
+    sqrl_mutex_enter( queue->mutex );
+    for( ;; ) {
+        while( !queue->stopping && !queue->high.head && !queue->low.head ) {
+            sqrl_cond_wait( queue->ready, queue->mutex );
+        }
+        item = sqrl_queue_pop( &queue->high );
+        if( !item ) item = sqrl_queue_pop( &queue->low );
+        if( !item ) break;
+
+        now = sqrl_get_timestamp();
+        wait = now - item->enqueued;
+        queue->stats.depth = queue->high.count + queue->low.count;
+        queue->stats.totalWait += wait;
+        if( wait > queue->stats.maxWait ) queue->stats.maxWait = wait;
+        if( now > item->deadline ) {
+            queue->stats.expired++;
+            sqrl_mutex_leave( queue->mutex );
+            sqrl_queue_reject( item, SQRL_TIF_TRANSIENT_ERROR | SQRL_TIF_COMMAND_FAILURE );
+            sqrl_mutex_enter( queue->mutex );
+            continue;
+        }
+        sqrl_mutex_leave( queue->mutex );
+
+        sqrl_server_handle_query( item->context, item->client_ip, item->query, item->query_len );
+        sqrl_server_context_destroy( item->context );
+        free( item->query );
+        free( item );
+        elapsed = sqrl_get_timestamp() - now;
+
+        sqrl_mutex_enter( queue->mutex );
+        queue->stats.completed++;
+        queue->serviceTime = queue->serviceTime ? (queue->serviceTime * 7 + elapsed) / 8 : elapsed;
+    }
+    sqrl_mutex_leave( queue->mutex );
+#ifdef UNIX
+    return NULL;
+#else
+    return 0;
+#endif
+}
+
+/**
+Creates a priority admission queue served by its own worker threads.
+
+@param server The \p Sqrl_Server
+@param capacity Maximum number of waiting requests
+@param workers Number of worker threads
+@return A new \p Sqrl_Server_Queue, or NULL if no worker could be started
+*/
+DLL_PUBLIC
+Sqrl_Server_Queue *sqrl_server_queue_create( Sqrl_Server *server, int capacity, int workers )
+{
+    if( !server || capacity < 1 || workers < 1 ) return NULL;
+    Sqrl_Server_Queue *queue = calloc( 1, sizeof( Sqrl_Server_Queue ));
+    if( !queue ) return NULL;
+    queue->workers = calloc( workers, sizeof( SqrlThread ));
+    if( !queue->workers ) {
+        free( queue );
+        return NULL;
+    }
+    queue->server = server;
+    queue->capacity = capacity;
+    queue->mutex = sqrl_mutex_create();
+    queue->ready = sqrl_cond_create();
+    int i;
+    SqrlThread thread;
+    // Only workers that started are kept, and later joined
+    for( i = 0; i < workers; i++ ) {
+        thread = sqrl_thread_create( sqrl_queue_worker, queue );
+        if( thread ) queue->workers[queue->workerCount++] = thread;
+    }
+    if( queue->workerCount == 0 ) {
+        return sqrl_server_queue_destroy( queue );
+    }
+    return queue;
+}
+
+/**
+Stops a \p Sqrl_Server_Queue.  Requests already admitted are processed first.
+
+@param queue The \p Sqrl_Server_Queue
+@return NULL
+*/
+DLL_PUBLIC
+Sqrl_Server_Queue *sqrl_server_queue_destroy( Sqrl_Server_Queue *queue )
+{
+    if( !queue ) return NULL;
+    int i;
+    sqrl_mutex_enter( queue->mutex );
+    queue->stopping = true;
+    sqrl_cond_broadcast( queue->ready );
+    sqrl_mutex_leave( queue->mutex );
+    for( i = 0; i < queue->workerCount; i++ ) {
+        sqrl_thread_join( queue->workers[i] );
+    }
+    free( queue->workers );
+    sqrl_cond_destroy( queue->ready );
+    sqrl_mutex_destroy( queue->mutex );
+    free( queue->mutex );
+    free( queue );
+    return NULL;
+}
+
+/**
+Submits a query to be handled by a worker thread.  The queue takes ownership
+of \p context, and destroys it after its reply has been sent.  If the request
+cannot be admitted, a transient error is sent before this returns.
+
+@param queue The \p Sqrl_Server_Queue
+@param context A new \p Sqrl_Server_Context
+@param client_ip The client's IP address
+@param query The query
+@param query_len Length of \p query
+@return true if the request was admitted
+*/
+DLL_PUBLIC
+bool sqrl_server_queue_submit(
+    Sqrl_Server_Queue *queue,
+    Sqrl_Server_Context *context,
+    uint32_t client_ip,
+    const char *query,
+    size_t query_len )
+{
+    if( !queue || !context || !query ) return false;
+    bool high = false;
+    uint64_t now = sqrl_get_timestamp();
+    Sqrl_Queue_Item *item = calloc( 1, sizeof( Sqrl_Queue_Item ));
+    item->context = context;
+    item->client_ip = client_ip;
+    item->query = malloc( query_len + 1 );
+    memcpy( item->query, query, query_len );
+    item->query[query_len] = 0;
+    item->query_len = query_len;
+    item->enqueued = now;
+    // Unreadable nuts fail verification anyway; don't let them wait
+    if( !sqrl_queue_classify( context->config, query, query_len, &high, &item->deadline )) {
+        item->deadline = now;
+    }
+
+    Sqrl_Queue_Item *shed = NULL;
+    bool admitted = false;
+    sqrl_mutex_enter( queue->mutex );
+    int depth = queue->high.count + queue->low.count;
+    uint64_t expectedWait = (uint64_t)(depth / queue->workerCount) * queue->serviceTime;
+    if( queue->stopping || now + expectedWait > item->deadline ) {
+        // Would expire before a worker reaches it
+        queue->stats.expired++;
+    } else if( depth < queue->capacity ) {
+        admitted = true;
+    } else if( high && queue->low.head ) {
+        shed = sqrl_queue_pop( &queue->low );
+        queue->stats.rejected++;
+        admitted = true;
+    } else {
+        queue->stats.rejected++;
+    }
+    if( admitted ) {
+        sqrl_queue_push( high ? &queue->high : &queue->low, item );
+        queue->stats.admitted++;
+        queue->stats.depth = queue->high.count + queue->low.count;
+        sqrl_cond_signal( queue->ready );
+    }
+    sqrl_mutex_leave( queue->mutex );
+
+    if( shed ) {
+        sqrl_queue_reject( shed, SQRL_TIF_TRANSIENT_ERROR | SQRL_TIF_COMMAND_FAILURE );
+    }
+    if( !admitted ) {
+        sqrl_queue_reject( item, SQRL_TIF_TRANSIENT_ERROR | SQRL_TIF_COMMAND_FAILURE );
+    }
+    return admitted;
+}
+
+/**
+Gets statistics for a \p Sqrl_Server_Queue.
+
+@param queue The \p Sqrl_Server_Queue
+@param stats Receives the statistics
+*/
+DLL_PUBLIC
+void sqrl_server_queue_stats( Sqrl_Server_Queue *queue, Sqrl_Server_Queue_Stats *stats )
+{
+    if( !queue || !stats ) return;
+    sqrl_mutex_enter( queue->mutex );
+    memcpy( stats, &queue->stats, sizeof( Sqrl_Server_Queue_Stats ));
+    stats->depth = queue->high.count + queue->low.count;
+    stats->high = queue->high.count;
+    sqrl_mutex_leave( queue->mutex );
+}
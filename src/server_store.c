@@ -0,0 +1,765 @@
+/** @file server_store.c
+
+@author Adam Comley
+
+This file is part of libsqrl.  It is released under the MIT license.
+For more details, see the LICENSE file included with this package.
+
+A remote user store for \p Sqrl_Server, and the matching store server.
+
+Both ends exchange frames of the form:
+
+    uint32 length | uint32 id | uint8 op | uint8 count | count * field
+
+All integers are little endian.  A field is a uint16 length followed by that
+many bytes; a length of 0xFFFF encodes NULL.  Requests carry the arguments of
+an \p sqrl_scb_user call (host, idk, pidk, blob).  Replies carry the result in
+\p op and, for finds, the user blob.  A FIND_MULTI request carries host/idk
+pairs and its reply carries one blob (or NULL) per pair.
+
+Requests are pipelined: replies are matched to requests by id, so any number
+may be outstanding on a connection.  Finds issued while another find is in
+flight are combined into a single FIND_MULTI.
+
+Reader threads never write.  A reader that blocked on a full socket would
+stop reading its own, and two connections waiting on each other would
+deadlock.  When a reply frees room for more finds, the reader wakes the
+oldest waiting caller, and that caller sends them.
+*/
+
+#include "sqrl_internal.h"
+
+#ifdef UNIX
+#include <errno.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#define SQRL_STORE_FIND_MULTI 0x80
+#define SQRL_STORE_NULL_FIELD 0xFFFF
+#define SQRL_STORE_MAX_FIELDS 255
+#define SQRL_STORE_MAX_BATCH  (SQRL_STORE_MAX_FIELDS / 2)
+#define SQRL_STORE_MAX_FRAME  (1<<20)
+#define SQRL_STORE_BLOB_SIZE  SQRL_SERVER_USER_BLOB_SIZE
+#define SQRL_STORE_BUCKETS    64
+
+typedef struct Sqrl_Store_Frame {
+    uint32_t id;
+    uint8_t op;
+    uint8_t count;
+    char *fields[SQRL_STORE_MAX_FIELDS];
+} Sqrl_Store_Frame;
+
+static void sqrl_store_put32( uint8_t *p, uint32_t v )
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+static uint32_t sqrl_store_get32( const uint8_t *p )
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void sqrl_store_frame_begin( UT_string *f, uint32_t id, uint8_t op, uint8_t count )
+{
+    uint8_t hdr[10];
+    sqrl_store_put32( hdr, 0 );
+    sqrl_store_put32( hdr + 4, id );
+    hdr[8] = op;
+    hdr[9] = count;
+    utstring_bincpy( f, hdr, 10 );
+}
+
+static void sqrl_store_frame_field( UT_string *f, const char *str )
+{
+    uint8_t len[2];
+    size_t l = str ? strlen( str ) : SQRL_STORE_NULL_FIELD;
+    if( l > SQRL_STORE_NULL_FIELD - 1 && str ) l = SQRL_STORE_NULL_FIELD - 1;
+    len[0] = l & 0xFF;
+    len[1] = (l >> 8) & 0xFF;
+    utstring_bincpy( f, len, 2 );
+    if( str ) utstring_bincpy( f, str, l );
+}
+
+static void sqrl_store_frame_end( UT_string *f )
+{
+    sqrl_store_put32( (uint8_t*)utstring_body( f ), (uint32_t)utstring_len( f ) - 4 );
+}
+
+// Parses a frame body in place.  Each field is moved back over its length
+// prefix, which leaves room to NUL terminate it.
+static bool sqrl_store_frame_parse( UT_string *body, Sqrl_Store_Frame *frame )
+{
+    uint8_t *p = (uint8_t*)utstring_body( body );
+    uint8_t *end = p + utstring_len( body );
+    int i;
+    if( end - p < 6 ) return false;
+    frame->id = sqrl_store_get32( p );
+    frame->op = p[4];
+    frame->count = p[5];
+    p += 6;
+    for( i = 0; i < frame->count; i++ ) {
+        if( end - p < 2 ) return false;
+        size_t len = p[0] | (p[1] << 8);
+        if( len == SQRL_STORE_NULL_FIELD ) {
+            frame->fields[i] = NULL;
+            p += 2;
+            continue;
+        }
+        if( (size_t)(end - p) < len + 2 ) return false;
+        memmove( p, p + 2, len );
+        p[len] = 0;
+        frame->fields[i] = (char*)p;
+        p += len + 2;
+    }
+    return true;
+}
+
+#ifdef UNIX
+
+static bool sqrl_store_write( int fd, const char *buf, size_t len )
+{
+    int flags = 0;
+#ifdef MSG_NOSIGNAL
+    flags = MSG_NOSIGNAL;
+#endif
+    while( len > 0 ) {
+        ssize_t n = send( fd, buf, len, flags );
+        if( n < 0 ) {
+            if( errno == EINTR ) continue;
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool sqrl_store_read( int fd, uint8_t *buf, size_t len )
+{
+    while( len > 0 ) {
+        ssize_t n = recv( fd, buf, len, 0 );
+        if( n < 0 && errno == EINTR ) continue;
+        if( n <= 0 ) return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Reads one frame (without its length) into body.
+static bool sqrl_store_read_frame( int fd, UT_string *body )
+{
+    uint8_t len[4];
+    if( !sqrl_store_read( fd, len, 4 )) return false;
+    uint32_t l = sqrl_store_get32( len );
+    if( l < 6 || l > SQRL_STORE_MAX_FRAME ) return false;
+    utstring_clear( body );
+    utstring_reserve( body, l + 1 );
+    if( !sqrl_store_read( fd, (uint8_t*)utstring_body( body ), l )) return false;
+    body->i = l;
+    body->d[l] = 0;
+    return true;
+}
+
+// Resolves "unix:/path" or "host:port".  Returns a socket fd, or -1.
+static int sqrl_store_socket( const char *address, bool listening )
+{
+    int fd = -1;
+    if( 0 == strncmp( address, "unix:", 5 )) {
+        struct sockaddr_un sa;
+        memset( &sa, 0, sizeof( sa ));
+        sa.sun_family = AF_UNIX;
+        if( strlen( address + 5 ) >= sizeof( sa.sun_path )) return -1;
+        strcpy( sa.sun_path, address + 5 );
+        fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+        if( fd < 0 ) return -1;
+        if( listening ) {
+            unlink( sa.sun_path );
+            if( 0 == bind( fd, (struct sockaddr*)&sa, sizeof( sa )) &&
+                0 == listen( fd, 64 )) {
+                return fd;
+            }
+        } else if( 0 == connect( fd, (struct sockaddr*)&sa, sizeof( sa ))) {
+            return fd;
+        }
+        close( fd );
+        return -1;
+    }
+
+    char host[256];
+    const char *port = strrchr( address, ':' );
+    if( !port || (size_t)(port - address) >= sizeof( host )) return -1;
+    memcpy( host, address, port - address );
+    host[port - address] = 0;
+    port++;
+
+    struct addrinfo hints, *res, *ai;
+    memset( &hints, 0, sizeof( hints ));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if( listening ) hints.ai_flags = AI_PASSIVE;
+    if( 0 != getaddrinfo( host[0] ? host : NULL, port, &hints, &res )) return -1;
+    for( ai = res; ai; ai = ai->ai_next ) {
+        fd = socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol );
+        if( fd < 0 ) continue;
+        if( listening ) {
+            int one = 1;
+            setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ));
+            if( 0 == bind( fd, ai->ai_addr, ai->ai_addrlen ) &&
+                0 == listen( fd, 64 )) {
+                break;
+            }
+        } else if( 0 == connect( fd, ai->ai_addr, ai->ai_addrlen )) {
+            break;
+        }
+        close( fd );
+        fd = -1;
+    }
+    freeaddrinfo( res );
+    return fd;
+}
+
+/* Client */
+
+typedef struct Sqrl_Store_Waiter {
+    bool done;
+    bool result;
+    char *host;
+    char *idk;
+    char *blob;
+    SqrlCondition cond;
+    struct Sqrl_Store_Waiter *next;
+} Sqrl_Store_Waiter;
+
+typedef struct Sqrl_Store_Request {
+    uint32_t id;
+    int fd;
+    bool multi;
+    int count;
+    Sqrl_Store_Waiter *waiters;
+    struct Sqrl_Store_Request *next;
+} Sqrl_Store_Request;
+
+typedef struct Sqrl_Store_Connection {
+    int fd;
+    SqrlMutex write;
+} Sqrl_Store_Connection;
+
+static struct {
+    char *address;
+    int connectionCount;
+    Sqrl_Store_Connection *connections;
+    // mutex protects everything below
+    SqrlMutex mutex;
+    uint32_t nextId;
+    int nextConnection;
+    Sqrl_Store_Request *inFlight[SQRL_STORE_BUCKETS];
+    Sqrl_Store_Waiter *findPending;
+    Sqrl_Store_Waiter **findPendingTail;
+    int findsInFlight;
+    int readers;
+    int closing;
+    SqrlCondition readersDone;
+} SQRL_STORE;
+
+static SQRL_THREAD_FUNCTION_RETURN_TYPE sqrl_store_reader( SQRL_THREAD_FUNCTION_INPUT_TYPE input );
+
+// Connects conn and starts its reader.  Caller holds conn->write.
+static bool sqrl_store_open( Sqrl_Store_Connection *conn )
+{
+    conn->fd = sqrl_store_socket( SQRL_STORE.address, false );
+    if( conn->fd < 0 ) return false;
+    sqrl_mutex_enter( SQRL_STORE.mutex );
+    SQRL_STORE.readers++;
+    sqrl_mutex_leave( SQRL_STORE.mutex );
+    SqrlThread thread = sqrl_thread_create( sqrl_store_reader, conn );
+    if( thread ) {
+        sqrl_thread_detach( thread );
+        return true;
+    }
+    close( conn->fd );
+    conn->fd = -1;
+    sqrl_mutex_enter( SQRL_STORE.mutex );
+    if( --SQRL_STORE.readers == 0 ) {
+        sqrl_cond_broadcast( SQRL_STORE.readersDone );
+    }
+    sqrl_mutex_leave( SQRL_STORE.mutex );
+    return false;
+}
+
+// Completes all waiters of req and frees it.  Caller holds SQRL_STORE.mutex.
+static void sqrl_store_complete( Sqrl_Store_Request *req, Sqrl_Store_Frame *frame )
+{
+    Sqrl_Store_Waiter *w = req->waiters, *next;
+    int i = 0;
+    while( w ) {
+        next = w->next;
+        w->result = false;
+        if( frame ) {
+            if( req->multi ) {
+                if( i < frame->count && frame->fields[i] ) {
+                    strncpy( w->blob, frame->fields[i], SQRL_STORE_BLOB_SIZE - 1 );
+                    w->blob[SQRL_STORE_BLOB_SIZE - 1] = 0;
+                    w->result = true;
+                }
+            } else {
+                w->result = frame->op != 0;
+                if( w->result && w->blob && frame->count > 0 && frame->fields[0] ) {
+                    strncpy( w->blob, frame->fields[0], SQRL_STORE_BLOB_SIZE - 1 );
+                    w->blob[SQRL_STORE_BLOB_SIZE - 1] = 0;
+                }
+            }
+        }
+        w->done = true;
+        sqrl_cond_signal( w->cond );
+        w = next;
+        i++;
+    }
+    if( req->multi ) SQRL_STORE.findsInFlight--;
+    free( req );
+}
+
+static Sqrl_Store_Request *sqrl_store_remove( uint32_t id )
+{
+    Sqrl_Store_Request **pp = &SQRL_STORE.inFlight[id % SQRL_STORE_BUCKETS];
+    while( *pp ) {
+        if( (*pp)->id == id ) {
+            Sqrl_Store_Request *req = *pp;
+            *pp = req->next;
+            return req;
+        }
+        pp = &(*pp)->next;
+    }
+    return NULL;
+}
+
+// Takes up to SQRL_STORE_MAX_BATCH pending finds.  Caller holds SQRL_STORE.mutex.
+static Sqrl_Store_Request *sqrl_store_take_finds()
+{
+    if( !SQRL_STORE.findPending ) return NULL;
+    if( SQRL_STORE.findsInFlight >= SQRL_STORE.connectionCount ) return NULL;
+    Sqrl_Store_Request *req = calloc( 1, sizeof( Sqrl_Store_Request ));
+    req->multi = true;
+    Sqrl_Store_Waiter **tail = &req->waiters;
+    while( SQRL_STORE.findPending && req->count < SQRL_STORE_MAX_BATCH ) {
+        *tail = SQRL_STORE.findPending;
+        SQRL_STORE.findPending = SQRL_STORE.findPending->next;
+        tail = &(*tail)->next;
+        req->count++;
+    }
+    *tail = NULL;
+    if( !SQRL_STORE.findPending ) SQRL_STORE.findPendingTail = &SQRL_STORE.findPending;
+    SQRL_STORE.findsInFlight++;
+    return req;
+}
+
+// Wakes the oldest caller with a find still pending, to send the finds
+// there is now room for.  Caller holds SQRL_STORE.mutex.
+static void sqrl_store_wake_finds()
+{
+    if( SQRL_STORE.findPending ) sqrl_cond_signal( SQRL_STORE.findPending->cond );
+}
+
+static void sqrl_store_send( Sqrl_Store_Request *req, Sqrl_Server_User_Op op, char *host, char *idk, char *pidk, char *blob )
+{
+    UT_string *f;
+    utstring_new( f );
+    Sqrl_Store_Connection *conn;
+
+    sqrl_mutex_enter( SQRL_STORE.mutex );
+    req->id = ++SQRL_STORE.nextId;
+    conn = &SQRL_STORE.connections[SQRL_STORE.nextConnection++ % SQRL_STORE.connectionCount];
+    sqrl_mutex_leave( SQRL_STORE.mutex );
+
+    if( req->multi ) {
+        sqrl_store_frame_begin( f, req->id, SQRL_STORE_FIND_MULTI, req->count * 2 );
+        Sqrl_Store_Waiter *w;
+        for( w = req->waiters; w; w = w->next ) {
+            sqrl_store_frame_field( f, w->host );
+            sqrl_store_frame_field( f, w->idk );
+        }
+    } else {
+        sqrl_store_frame_begin( f, req->id, (uint8_t)op, 4 );
+        sqrl_store_frame_field( f, host );
+        sqrl_store_frame_field( f, idk );
+        sqrl_store_frame_field( f, pidk );
+        sqrl_store_frame_field( f, op == SQRL_SCB_USER_FIND ? NULL : blob );
+    }
+    sqrl_store_frame_end( f );
+
+    sqrl_mutex_enter( conn->write );
+    if( conn->fd < 0 && !SQRL_ATOMIC_LOAD( &SQRL_STORE.closing )) {
+        sqrl_store_open( conn );
+    }
+    sqrl_mutex_enter( SQRL_STORE.mutex );
+    req->fd = conn->fd;
+    if( req->fd < 0 ) {
+        sqrl_store_complete( req, NULL );
+        req = NULL;
+    } else {
+        uint32_t b = req->id % SQRL_STORE_BUCKETS;
+        req->next = SQRL_STORE.inFlight[b];
+        SQRL_STORE.inFlight[b] = req;
+    }
+    sqrl_mutex_leave( SQRL_STORE.mutex );
+    if( req && !sqrl_store_write( conn->fd, utstring_body( f ), utstring_len( f ))) {
+        // The reader fails everything outstanding on this socket
+        shutdown( conn->fd, SHUT_RDWR );
+    }
+    sqrl_mutex_leave( conn->write );
+    utstring_free( f );
+}
+
+static void sqrl_store_send_finds( Sqrl_Store_Request *req )
+{
+    while( req ) {
+        sqrl_store_send( req, SQRL_SCB_USER_FIND, NULL, NULL, NULL, NULL );
+        sqrl_mutex_enter( SQRL_STORE.mutex );
+        req = sqrl_store_take_finds();
+        sqrl_mutex_leave( SQRL_STORE.mutex );
+    }
+}
+
+static SQRL_THREAD_FUNCTION_RETURN_TYPE sqrl_store_reader( SQRL_THREAD_FUNCTION_INPUT_TYPE input )
+{
+    Sqrl_Store_Connection *conn = (Sqrl_Store_Connection*)input;
+    int fd = conn->fd;
+    int i;
+    UT_string *body;
+    utstring_new( body );
+    Sqrl_Store_Frame frame;
+    Sqrl_Store_Request *req;
+
+    while( sqrl_store_read_frame( fd, body ) && sqrl_store_frame_parse( body, &frame )) {
+        sqrl_mutex_enter( SQRL_STORE.mutex );
+        req = sqrl_store_remove( frame.id );
+        if( req ) {
+            bool multi = req->multi;
+            sqrl_store_complete( req, &frame );
+            if( multi ) sqrl_store_wake_finds();
+        }
+        sqrl_mutex_leave( SQRL_STORE.mutex );
+    }
+
+    // Connection lost; new requests will reconnect.
+    sqrl_mutex_enter( conn->write );
+    conn->fd = -1;
+    sqrl_mutex_leave( conn->write );
+
+    sqrl_mutex_enter( SQRL_STORE.mutex );
+    for( i = 0; i < SQRL_STORE_BUCKETS; i++ ) {
+        Sqrl_Store_Request **pp = &SQRL_STORE.inFlight[i];
+        while( *pp ) {
+            req = *pp;
+            if( req->fd == fd ) {
+                *pp = req->next;
+                sqrl_store_complete( req, NULL );
+            } else {
+                pp = &req->next;
+            }
+        }
+    }
+    sqrl_store_wake_finds();
+    sqrl_mutex_leave( SQRL_STORE.mutex );
+    close( fd );
+    utstring_free( body );
+
+    sqrl_mutex_enter( SQRL_STORE.mutex );
+    if( --SQRL_STORE.readers == 0 ) {
+        sqrl_cond_broadcast( SQRL_STORE.readersDone );
+    }
+    sqrl_mutex_leave( SQRL_STORE.mutex );
+    return NULL;
+}
+
+#endif // UNIX
+
+/**
+Connects the remote user store used by \p sqrl_scb_user_remote().
+
+@param address "unix:/path/to/socket" or "host:port"
+@param connections Number of persistent connections to open
+@return true if at least one connection could be opened
+*/
+DLL_PUBLIC
+bool sqrl_server_store_connect( const char *address, int connections )
+{
+#ifdef UNIX
+    if( !address || SQRL_STORE.address ) return false;
+    if( connections < 1 ) connections = 1;
+    int i, open = 0;
+    SQRL_STORE.address = malloc( strlen( address ) + 1 );
+    strcpy( SQRL_STORE.address, address );
+    SQRL_STORE.connectionCount = connections;
+    SQRL_STORE.connections = calloc( connections, sizeof( Sqrl_Store_Connection ));
+    SQRL_STORE.mutex = sqrl_mutex_create();
+    SQRL_STORE.readersDone = sqrl_cond_create();
+    SQRL_STORE.findPendingTail = &SQRL_STORE.findPending;
+    for( i = 0; i < connections; i++ ) {
+        Sqrl_Store_Connection *conn = &SQRL_STORE.connections[i];
+        conn->write = sqrl_mutex_create();
+        sqrl_mutex_enter( conn->write );
+        if( sqrl_store_open( conn )) open++;
+        sqrl_mutex_leave( conn->write );
+    }
+    if( open == 0 ) {
+        sqrl_server_store_disconnect();
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+/**
+Closes the remote user store.  No calls to \p sqrl_scb_user_remote() may be in progress.
+*/
+DLL_PUBLIC
+void sqrl_server_store_disconnect()
+{
+#ifdef UNIX
+    if( !SQRL_STORE.address ) return;
+    int i;
+    SQRL_ATOMIC_STORE( &SQRL_STORE.closing, 1 );
+    for( i = 0; i < SQRL_STORE.connectionCount; i++ ) {
+        Sqrl_Store_Connection *conn = &SQRL_STORE.connections[i];
+        sqrl_mutex_enter( conn->write );
+        if( conn->fd >= 0 ) shutdown( conn->fd, SHUT_RDWR );
+        sqrl_mutex_leave( conn->write );
+    }
+    sqrl_mutex_enter( SQRL_STORE.mutex );
+    while( SQRL_STORE.readers > 0 ) {
+        sqrl_cond_wait( SQRL_STORE.readersDone, SQRL_STORE.mutex );
+    }
+    sqrl_mutex_leave( SQRL_STORE.mutex );
+    for( i = 0; i < SQRL_STORE.connectionCount; i++ ) {
+        sqrl_mutex_destroy( SQRL_STORE.connections[i].write );
+        free( SQRL_STORE.connections[i].write );
+    }
+    free( SQRL_STORE.connections );
+    sqrl_cond_destroy( SQRL_STORE.readersDone );
+    free( SQRL_STORE.address );
+    sqrl_mutex_destroy( SQRL_STORE.mutex );
+    free( SQRL_STORE.mutex );
+    memset( &SQRL_STORE, 0, sizeof( SQRL_STORE ));
+#endif
+}
+
+/**
+A \p sqrl_scb_user implementation backed by the remote store opened with
+\p sqrl_server_store_connect().  Safe to call from many threads at once.
+*/
+DLL_PUBLIC
+bool sqrl_scb_user_remote(
+    Sqrl_Server_User_Op op,
+    char *host,
+    char *idk,
+    char *pidk,
+    char *blob )
+{
+#ifdef UNIX
+    if( !SQRL_STORE.address || !host || !idk ) return false;
+    Sqrl_Store_Waiter w;
+    memset( &w, 0, sizeof( w ));
+    w.host = host;
+    w.idk = idk;
+    w.blob = blob;
+    w.cond = sqrl_cond_create();
+
+    if( op == SQRL_SCB_USER_FIND ) {
+        if( !blob ) {
+            sqrl_cond_destroy( w.cond );
+            return false;
+        }
+        sqrl_mutex_enter( SQRL_STORE.mutex );
+        *SQRL_STORE.findPendingTail = &w;
+        SQRL_STORE.findPendingTail = &w.next;
+        sqrl_mutex_leave( SQRL_STORE.mutex );
+    } else {
+        Sqrl_Store_Request *req = calloc( 1, sizeof( Sqrl_Store_Request ));
+        req->count = 1;
+        req->waiters = &w;
+        w.blob = NULL;
+        sqrl_store_send( req, op, host, idk, pidk, blob );
+    }
+
+    sqrl_mutex_enter( SQRL_STORE.mutex );
+    while( !w.done ) {
+        // Readers don't write, so callers send the finds there is room for
+        Sqrl_Store_Request *req = sqrl_store_take_finds();
+        if( req ) {
+            sqrl_mutex_leave( SQRL_STORE.mutex );
+            sqrl_store_send_finds( req );
+            sqrl_mutex_enter( SQRL_STORE.mutex );
+            continue;
+        }
+        sqrl_cond_wait( w.cond, SQRL_STORE.mutex );
+    }
+    sqrl_mutex_leave( SQRL_STORE.mutex );
+    sqrl_cond_destroy( w.cond );
+    return w.result;
+#else
+    return false;
+#endif
+}
+
+/* Server */
+
+#ifdef UNIX
+
+static struct {
+    int fd;
+    int running;
+    sqrl_scb_user *backend;
+    // backendMutex protects the backend and connections
+    SqrlMutex backendMutex;
+    int connections;
+    SqrlCondition connectionsDone;
+} SQRL_STORE_SERVER = { -1, 0, NULL, NULL, 0, NULL };
+
+static SQRL_THREAD_FUNCTION_RETURN_TYPE sqrl_store_serve_connection( SQRL_THREAD_FUNCTION_INPUT_TYPE input )
+{
+    int fd = (int)(intptr_t)input;
+    int i;
+    char blob[SQRL_STORE_BLOB_SIZE];
+    Sqrl_Store_Frame frame;
+    UT_string *body, *reply;
+    utstring_new( body );
+    utstring_new( reply );
+
+    while( sqrl_store_read_frame( fd, body ) && sqrl_store_frame_parse( body, &frame )) {
+        utstring_clear( reply );
+        if( frame.op == SQRL_STORE_FIND_MULTI ) {
+            int n = frame.count / 2;
+            sqrl_store_frame_begin( reply, frame.id, 1, n );
+            for( i = 0; i < n; i++ ) {
+                bool found = false;
+                blob[0] = 0;
+                if( frame.fields[i*2] && frame.fields[i*2+1] ) {
+                    sqrl_mutex_enter( SQRL_STORE_SERVER.backendMutex );
+                    found = (SQRL_STORE_SERVER.backend)( SQRL_SCB_USER_FIND,
+                        frame.fields[i*2], frame.fields[i*2+1], NULL, blob );
+                    sqrl_mutex_leave( SQRL_STORE_SERVER.backendMutex );
+                }
+                sqrl_store_frame_field( reply, found ? blob : NULL );
+            }
+        } else {
+            bool result = false;
+            char *arg = frame.count > 3 ? frame.fields[3] : NULL;
+            if( frame.op == SQRL_SCB_USER_FIND ) {
+                blob[0] = 0;
+                arg = blob;
+            }
+            if( frame.op <= SQRL_SCB_USER_IDENTIFIED &&
+                frame.count >= 2 && frame.fields[0] && frame.fields[1] ) {
+                sqrl_mutex_enter( SQRL_STORE_SERVER.backendMutex );
+                result = (SQRL_STORE_SERVER.backend)( (Sqrl_Server_User_Op)frame.op,
+                    frame.fields[0], frame.fields[1], frame.count > 2 ? frame.fields[2] : NULL, arg );
+                sqrl_mutex_leave( SQRL_STORE_SERVER.backendMutex );
+            }
+            if( result && frame.op == SQRL_SCB_USER_FIND ) {
+                sqrl_store_frame_begin( reply, frame.id, 1, 1 );
+                sqrl_store_frame_field( reply, blob );
+            } else {
+                sqrl_store_frame_begin( reply, frame.id, result ? 1 : 0, 0 );
+            }
+        }
+        sqrl_store_frame_end( reply );
+        if( !sqrl_store_write( fd, utstring_body( reply ), utstring_len( reply ))) break;
+    }
+    close( fd );
+    utstring_free( body );
+    utstring_free( reply );
+    sqrl_mutex_enter( SQRL_STORE_SERVER.backendMutex );
+    if( --SQRL_STORE_SERVER.connections == 0 ) {
+        sqrl_cond_broadcast( SQRL_STORE_SERVER.connectionsDone );
+    }
+    sqrl_mutex_leave( SQRL_STORE_SERVER.backendMutex );
+    return NULL;
+}
+
+#endif // UNIX
+
+/**
+Serves a user store to \p sqrl_scb_user_remote() clients.  Blocks until
+\p sqrl_server_store_stop() is called and every client it accepted has
+disconnected.  Calls to \p backend are serialized.
+
+@param address "unix:/path/to/socket" or "host:port"
+@param backend The store to serve, or NULL for \p sqrl_scb_user_default
+@return false if \p address could not be opened
+*/
+DLL_PUBLIC
+bool sqrl_server_store_serve( const char *address, sqrl_scb_user *backend )
+{
+#ifdef UNIX
+    if( !address ) return false;
+    int fd = sqrl_store_socket( address, true );
+    if( fd < 0 ) return false;
+    SQRL_STORE_SERVER.backend = backend ? backend : sqrl_scb_user_default;
+    SQRL_STORE_SERVER.backendMutex = sqrl_mutex_create();
+    SQRL_STORE_SERVER.connectionsDone = sqrl_cond_create();
+    SQRL_STORE_SERVER.connections = 0;
+    SQRL_ATOMIC_STORE( &SQRL_STORE_SERVER.fd, fd );
+    SQRL_ATOMIC_STORE( &SQRL_STORE_SERVER.running, 1 );
+
+    while( SQRL_ATOMIC_LOAD( &SQRL_STORE_SERVER.running )) {
+        int client = accept( fd, NULL, NULL );
+        if( client < 0 ) {
+            if( errno == EINTR || errno == ECONNABORTED ) continue;
+            break;
+        }
+        sqrl_mutex_enter( SQRL_STORE_SERVER.backendMutex );
+        SQRL_STORE_SERVER.connections++;
+        sqrl_mutex_leave( SQRL_STORE_SERVER.backendMutex );
+        SqrlThread thread = sqrl_thread_create( sqrl_store_serve_connection, (void*)(intptr_t)client );
+        if( thread ) {
+            sqrl_thread_detach( thread );
+            continue;
+        }
+        close( client );
+        sqrl_mutex_enter( SQRL_STORE_SERVER.backendMutex );
+        if( --SQRL_STORE_SERVER.connections == 0 ) {
+            sqrl_cond_broadcast( SQRL_STORE_SERVER.connectionsDone );
+        }
+        sqrl_mutex_leave( SQRL_STORE_SERVER.backendMutex );
+    }
+    SQRL_ATOMIC_STORE( &SQRL_STORE_SERVER.fd, -1 );
+    close( fd );
+    if( 0 == strncmp( address, "unix:", 5 )) unlink( address + 5 );
+
+    // The connections still use the backend
+    sqrl_mutex_enter( SQRL_STORE_SERVER.backendMutex );
+    while( SQRL_STORE_SERVER.connections > 0 ) {
+        sqrl_cond_wait( SQRL_STORE_SERVER.connectionsDone, SQRL_STORE_SERVER.backendMutex );
+    }
+    sqrl_mutex_leave( SQRL_STORE_SERVER.backendMutex );
+    sqrl_cond_destroy( SQRL_STORE_SERVER.connectionsDone );
+    SQRL_STORE_SERVER.connectionsDone = NULL;
+    sqrl_mutex_destroy( SQRL_STORE_SERVER.backendMutex );
+    free( SQRL_STORE_SERVER.backendMutex );
+    SQRL_STORE_SERVER.backendMutex = NULL;
+    return true;
+#else
+    return false;
+#endif
+}
+
+/**
+Stops \p sqrl_server_store_serve().  Connections already accepted are served until their clients disconnect.
+*/
+DLL_PUBLIC
+void sqrl_server_store_stop()
+{
+#ifdef UNIX
+    SQRL_ATOMIC_STORE( &SQRL_STORE_SERVER.running, 0 );
+    int fd = SQRL_ATOMIC_LOAD( &SQRL_STORE_SERVER.fd );
+    if( fd >= 0 ) shutdown( fd, SHUT_RDWR );
+#endif
+}
@@ -13,6 +13,7 @@ For more details, see the LICENSE file included with this package.
 #define SQRL_UNIQUE_ID_LENGTH 				    43
 #define SQRL_LOCAL_KEY_LENGTH 				    32
 #define SQRL_RESCUE_CODE_LENGTH 			    24
+#define SQRL_CHECKPOINT_LENGTH 				   140
 
 // User Option Flags
 #define SQRL_OPTION_CHECK_FOR_UPDATES		0x0001
@@ -84,6 +85,8 @@ char*      sqrl_user_get_rescue_code( Sqrl_User u );
 void*      sqrl_user_get_tag( Sqrl_User u );
 uint16_t   sqrl_user_get_timeout_minutes( Sqrl_User u );
 UT_string* sqrl_user_secure_memory_monitor( UT_string *dest, Sqrl_User u );
+bool       sqrl_user_get_checkpoint( Sqrl_User u, const uint8_t *key, uint8_t *checkpoint );
+bool       sqrl_user_set_checkpoint( Sqrl_User u, const uint8_t *key, const uint8_t *checkpoint );
 void       sqrl_user_set_enscrypt_seconds( Sqrl_User u, uint8_t seconds );
 void       sqrl_user_set_flags( Sqrl_User u, uint16_t flags );
 void       sqrl_user_set_hint_length( Sqrl_User u, uint8_t length );
@@ -225,6 +228,22 @@ this would be a good place to free any tag data.
 typedef void (sqrl_ccb_transaction_complete)(
 	Sqrl_Transaction transaction );
 
+/** Runs transactions on worker threads; see \p sqrl_client_executor_create() */
+typedef struct Sqrl_Client_Executor Sqrl_Client_Executor;
+
+/** A transaction submitted to a \p Sqrl_Client_Executor */
+typedef struct Sqrl_Client_Job Sqrl_Client_Job;
+
+/** Called on a worker thread when a \p Sqrl_Client_Job finishes or is cancelled.
+@param job The \p Sqrl_Client_Job
+@param status How it finished
+@param data The data given to \p sqrl_client_submit
+*/
+typedef void (sqrl_ccb_job_complete)(
+	Sqrl_Client_Job *job,
+	Sqrl_Transaction_Status status,
+	void *data );
+
 /**
 Pointers to the various client callback functions
 */
@@ -264,6 +283,23 @@ void sqrl_client_receive(
 	Sqrl_Transaction transaction,
 	const char *payload, size_t payload_len );
 void sqrl_client_set_callbacks( Sqrl_Client_Callbacks *callbacks );
+void sqrl_client_transaction_cancel( Sqrl_Transaction transaction );
+
+Sqrl_Client_Executor *sqrl_client_executor_create( int workers );
+Sqrl_Client_Executor *sqrl_client_executor_destroy( Sqrl_Client_Executor *executor );
+Sqrl_Client_Job *sqrl_client_submit(
+	Sqrl_Client_Executor *executor,
+	Sqrl_Transaction_Type type,
+	Sqrl_User user,
+	const char *string,
+	size_t string_len,
+	void *tag,
+	sqrl_ccb_job_complete *onComplete,
+	void *data );
+bool sqrl_client_job_cancel( Sqrl_Client_Job *job );
+bool sqrl_client_job_done( Sqrl_Client_Job *job, Sqrl_Transaction_Status *status );
+Sqrl_Transaction_Status sqrl_client_job_wait( Sqrl_Client_Job *job );
+Sqrl_Client_Job *sqrl_client_job_release( Sqrl_Client_Job *job );
 
 
 void sqrl_client_answer( 
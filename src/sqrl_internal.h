@@ -102,9 +102,13 @@ double sqrl_get_real_time( );
 uint64_t sqrl_get_timestamp();
 
 typedef void* SqrlMutex;
+typedef void* SqrlCondition;
+
+#define SQRL_USER_INDEX_STRIPES 64
 
 struct Sqrl_Global_Mutices {
-	SqrlMutex user;
+	SqrlMutex user[SQRL_USER_INDEX_STRIPES];
+	SqrlCondition unlock[SQRL_USER_INDEX_STRIPES];	// Paired with user[]
 	SqrlMutex site;
 	SqrlMutex transaction;
 };
@@ -116,6 +120,38 @@ void sqrl_mutex_destroy( SqrlMutex sm );
 bool sqrl_mutex_enter( SqrlMutex sm );
 void sqrl_mutex_leave( SqrlMutex sm );
 
+SqrlCondition sqrl_cond_create();
+void sqrl_cond_destroy( SqrlCondition sc );
+void sqrl_cond_wait( SqrlCondition sc, SqrlMutex sm );
+void sqrl_cond_signal( SqrlCondition sc );
+void sqrl_cond_broadcast( SqrlCondition sc );
+
+// Sequentially consistent atomics on 32 bit integers and pointers.
+// The arithmetic forms return the new value.
+#ifdef WIN32
+#define SQRL_ATOMIC_INC(p)            InterlockedIncrement( (LONG volatile*)(p) )
+#define SQRL_ATOMIC_DEC(p)            InterlockedDecrement( (LONG volatile*)(p) )
+#define SQRL_ATOMIC_ADD(p,v)          (InterlockedExchangeAdd( (LONG volatile*)(p), (LONG)(v) ) + (LONG)(v))
+#define SQRL_ATOMIC_LOAD(p)           InterlockedCompareExchange( (LONG volatile*)(p), 0, 0 )
+#define SQRL_ATOMIC_STORE(p,v)        InterlockedExchange( (LONG volatile*)(p), (LONG)(v) )
+#define SQRL_ATOMIC_CAS(p,e,v)        (InterlockedCompareExchange( (LONG volatile*)(p), (LONG)(v), (LONG)(e) ) == (LONG)(e))
+#define SQRL_ATOMIC_LOAD_PTR(p)       InterlockedCompareExchangePointer( (PVOID volatile*)(p), NULL, NULL )
+#define SQRL_ATOMIC_STORE_PTR(p,v)    ((void)InterlockedExchangePointer( (PVOID volatile*)(p), (PVOID)(v) ))
+#define SQRL_ATOMIC_EXCHANGE_PTR(p,v) InterlockedExchangePointer( (PVOID volatile*)(p), (PVOID)(v) )
+#define SQRL_ATOMIC_CAS_PTR(p,e,v)    (InterlockedCompareExchangePointer( (PVOID volatile*)(p), (PVOID)(v), (PVOID)(e) ) == (PVOID)(e))
+#else
+#define SQRL_ATOMIC_INC(p)            __atomic_add_fetch( (p), 1, __ATOMIC_SEQ_CST )
+#define SQRL_ATOMIC_DEC(p)            __atomic_sub_fetch( (p), 1, __ATOMIC_SEQ_CST )
+#define SQRL_ATOMIC_ADD(p,v)          __atomic_add_fetch( (p), (v), __ATOMIC_SEQ_CST )
+#define SQRL_ATOMIC_LOAD(p)           __atomic_load_n( (p), __ATOMIC_SEQ_CST )
+#define SQRL_ATOMIC_STORE(p,v)        __atomic_store_n( (p), (v), __ATOMIC_SEQ_CST )
+#define SQRL_ATOMIC_CAS(p,e,v)        __sync_bool_compare_and_swap( (p), (e), (v) )
+#define SQRL_ATOMIC_LOAD_PTR(p)       __atomic_load_n( (p), __ATOMIC_SEQ_CST )
+#define SQRL_ATOMIC_STORE_PTR(p,v)    __atomic_store_n( (p), (v), __ATOMIC_SEQ_CST )
+#define SQRL_ATOMIC_EXCHANGE_PTR(p,v) __atomic_exchange_n( (p), (v), __ATOMIC_SEQ_CST )
+#define SQRL_ATOMIC_CAS_PTR(p,e,v)    __sync_bool_compare_and_swap( (p), (e), (v) )
+#endif
+
 #ifdef UNIX
 typedef pthread_t SqrlThread;
 #define SQRL_THREAD_FUNCTION_RETURN_TYPE void*
@@ -133,6 +169,10 @@ typedef HANDLE SqrlThread;
 typedef SQRL_THREAD_FUNCTION_RETURN_TYPE (*sqrl_thread_function)(SQRL_THREAD_FUNCTION_INPUT_TYPE data);
 
 SqrlThread sqrl_thread_create( sqrl_thread_function function, SQRL_THREAD_FUNCTION_INPUT_TYPE input );
+void sqrl_thread_join( SqrlThread thread );
+void sqrl_thread_detach( SqrlThread thread );
+int sqrl_cpu_count();
+void sqrl_cpu_count_force( int n );
 
 typedef struct Sqrl_Crypt_Context
 {
@@ -152,10 +192,16 @@ typedef struct Sqrl_Crypt_Context
 #define KEY_SCRATCH_SIZE 2048
 
 #define USER_MAX_KEYS 16
+#define USER_INDEX_COUNT 3
+#define USER_SITE_CACHE_SIZE 16
+#define USER_KDF_JOBS 2
+#define USER_UNLOCK_PASSWORD 0
+#define USER_UNLOCK_RESCUE 1
 
 #define USER_FLAG_MEMLOCKED 	0x0001
 #define USER_FLAG_T1_CHANGED	0x0002
 #define USER_FLAG_T2_CHANGED	0x0004
+#define USER_FLAG_RELOCK		0x0008
 
 typedef struct Sqrl_User_Options {
 	/** 16 bit Flags, defined at [grc sqrl storage](https://www.grc.com/sqrl/storage.htm) */
@@ -180,6 +226,34 @@ struct Sqrl_Keys
 };
 #pragma pack(pop)
 
+// An expanded Ed25519 signing key; see crypt.c
+typedef struct Sqrl_Sign_Key {
+	uint8_t scalar[32];
+	uint8_t prefix[32];
+	uint8_t pub[32];
+} Sqrl_Sign_Key;
+
+// Keys derived for one site; see sqrl_site_set_user_keys()
+typedef struct Sqrl_Site_Keys {
+	uint8_t sec[SQRL_KEY_SIZE];
+	uint8_t psec[SQRL_KEY_SIZE];
+	Sqrl_Sign_Key sign;
+	Sqrl_Sign_Key psign;
+	int previous;		// Where the search for a previous identity ended
+	bool hasPrevious;	// psec and psign are set
+} Sqrl_Site_Keys;
+
+typedef struct Sqrl_Site_Cache_Entry {
+	uint8_t id[SQRL_KEY_SIZE];
+	uint64_t lastUsed;
+	Sqrl_Site_Keys keys;
+} Sqrl_Site_Cache_Entry;
+
+struct Sqrl_Site_Cache {
+	uint64_t clock;
+	Sqrl_Site_Cache_Entry entries[USER_SITE_CACHE_SIZE];
+};
+
 struct Sqrl_User 
 {
 	uint8_t lookup[USER_MAX_KEYS];
@@ -187,12 +261,22 @@ struct Sqrl_User
 	uint32_t hint_iterations;
 	uint16_t edition;
 	Sqrl_User_Options options;
-	SqrlMutex referenceCountMutex;
 	int referenceCount;
+	int transactionCount;	// Live transactions using this user
+	int keySessions;
 	Sqrl_Storage storage;
 	void *tag;
 	char unique_id[SQRL_UNIQUE_ID_LENGTH+1];
 	struct Sqrl_Keys *keys;
+	struct Sqrl_Site_Cache *siteCache;
+	struct Sqrl_Kdf_Job *kdfJobs[USER_KDF_JOBS];
+	struct Sqrl_Enscrypt_State *checkpoint;
+	// The key unlock in progress; see sqrl_user_unlock()
+	bool unlocking;
+	uint8_t unlockFailed;	// Bit per USER_UNLOCK_*
+	struct Sqrl_Transaction *unlockLeader;
+	// Hash chains for the user indexes; see user.c
+	struct Sqrl_User *indexNext[USER_INDEX_COUNT];
 };
 
 struct sqrl_user_callback_data {
@@ -215,9 +299,14 @@ struct Sqrl_Transaction {
 	Sqrl_Export exportType;
 	Sqrl_Encoding encodingType;
 	void *data;
-	SqrlMutex mutex;
 	int referenceCount;
 	void *tag;
+	int cancelled;
+	// Slot bookkeeping; see transaction.c
+	Sqrl_Transaction handle;
+	uint32_t index;
+	uint32_t generation;
+	struct Sqrl_Transaction *nextFree;
 };
 
 typedef struct Sqrl_Site {
@@ -229,39 +318,39 @@ typedef struct Sqrl_Site {
 	UT_string *serverString;
 	UT_string *clientString;
 	uint8_t keys[9][SQRL_KEY_SIZE];
+	Sqrl_Sign_Key *signKeys;	// Locked; indexed by SITE_SIGN_*
 	char *sin;
 	Sqrl_Transaction_Type currentTransaction;
 	int previous_identity;
 	double lastAction;
 	SqrlMutex mutex;
+	// Keys derived while a query is out; see client_protocol.c
+	struct Sqrl_Site_Speculation *speculation;
+	// Site table and expiry wheel links; see client_protocol.c
+	struct Sqrl_Site *hashNext;
+	struct Sqrl_Site *wheelNext;
+	struct Sqrl_Site **wheelPrev;
 } Sqrl_Site;
 
 
 
-#define SQRL_CAST_TRANSACTION(a,b) struct Sqrl_Transaction *(a) = (struct Sqrl_Transaction*)(b)
+#define SQRL_CAST_TRANSACTION(a,b) struct Sqrl_Transaction *(a) = sqrl_transaction_resolve(b)
 #define WITH_TRANSACTION(transaction,t) struct Sqrl_Transaction *transaction = (struct Sqrl_Transaction*)sqrl_transaction_hold( t )
 #define END_WITH_TRANSACTION(transaction) sqrl_transaction_release( transaction )
 
 #define SQRL_CAST_USER(a,b) struct Sqrl_User *(a) = (struct Sqrl_User*)(b)
 #define WITH_USER(user,u) \
-struct Sqrl_User *user = NULL; \
-bool wu_relock = false; \
-user = (struct Sqrl_User*)sqrl_user_hold(u); \
-if( user ) { \
-	sqrl_user_ensure_keys_allocated(user); \
-	wu_relock = sqrl_user_is_memlocked(user); \
-	if( wu_relock ) { \
-		sqrl_user_memunlock( user ); \
-	} \
-}
+struct Sqrl_User *user = sqrl_user_keys_open(u)
 
 #define END_WITH_USER(user) \
-if( user != NULL ) { \
-	if( wu_relock ) { \
-		sqrl_user_memlock( user ); \
-	} \
-	user = sqrl_user_release( (Sqrl_User)(user) ); \
-}
+user = sqrl_user_keys_close(user)
+
+// Holds a user without opening its keys; for non-secret metadata only
+#define WITH_USER_INFO(user,u) \
+struct Sqrl_User *user = (struct Sqrl_User*)sqrl_user_hold(u)
+
+#define END_WITH_USER_INFO(user) \
+user = sqrl_user_release( (Sqrl_User)(user) )
 
 
 void        sqrl_user_default_options( Sqrl_User_Options *options );
@@ -285,11 +374,47 @@ bool        sqrl_user_try_load_password( Sqrl_Transaction transaction, bool retr
 bool        sqrl_user_try_load_rescue( Sqrl_Transaction transaction, bool retry );
 void        sqrl_user_memlock( Sqrl_User user );
 void        sqrl_user_memunlock( Sqrl_User user );
+struct Sqrl_User *sqrl_user_keys_open( Sqrl_User u );
+struct Sqrl_User *sqrl_user_keys_close( struct Sqrl_User *user );
 uint8_t*    sqrl_user_new_key( Sqrl_User u, int key_type );
 bool        sqrl_user_regen_keys( Sqrl_Transaction transaction );
 bool        sqrl_user_rekey( Sqrl_Transaction transaction );
 void        sqrl_user_remove_key( Sqrl_User user, int key_type );
 bool        sqrl_user_save( Sqrl_Transaction transaction );
+bool        sqrl_user_site_cache_get( 
+				Sqrl_User u, 
+				const char *host, 
+				size_t host_len, 
+				int previous, 
+				Sqrl_Site_Keys *keys );
+void        sqrl_user_site_cache_put( 
+				Sqrl_User u, 
+				const char *host, 
+				size_t host_len, 
+				int previous, 
+				const Sqrl_Site_Keys *keys );
+void        sqrl_user_site_cache_flush( Sqrl_User u );
+void        sqrl_user_kdf_start(
+				Sqrl_User u,
+				int block,
+				const char *password,
+				size_t password_len,
+				int millis );
+bool        sqrl_user_kdf_pending( Sqrl_User u, int block );
+void        sqrl_user_kdf_settle( Sqrl_User u );
+bool        sqrl_user_kdf_take(
+				Sqrl_User u,
+				int block,
+				const char *password,
+				size_t password_len,
+				int millis,
+				uint8_t *salt,
+				uint8_t *key,
+				uint32_t *count );
+void        sqrl_user_kdf_discard( Sqrl_User u, int block );
+struct Sqrl_Enscrypt_State *sqrl_user_checkpoint_take( Sqrl_User u );
+void        sqrl_user_checkpoint_put( Sqrl_User u, struct Sqrl_Enscrypt_State *state );
+void        sqrl_user_checkpoint_discard( Sqrl_User u );
 bool        sqrl_user_save_to_buffer( Sqrl_Transaction transaction );
 uint8_t*    sqrl_user_scratch( Sqrl_User user );
 bool        sqrl_user_set_password( 
@@ -298,12 +423,16 @@ bool        sqrl_user_set_password(
 				size_t password_len );
 bool        sqrl_user_update_storage( Sqrl_Transaction transaction );
 void		sqrl_client_release_all_users();
+void		sqrl_user_set_unique_id( struct Sqrl_User *user, const char *unique_id );
 
 Sqrl_Transaction sqrl_transaction_create( Sqrl_Transaction_Type type );
+struct Sqrl_Transaction *sqrl_transaction_resolve( Sqrl_Transaction t );
+Sqrl_Transaction sqrl_transaction_handle( Sqrl_Transaction t );
 Sqrl_Transaction sqrl_transaction_hold( Sqrl_Transaction t );
 Sqrl_Transaction sqrl_transaction_release( Sqrl_Transaction t );
 int sqrl_transactions_with_user( Sqrl_User u );
 void sqrl_transaction_set_user( Sqrl_Transaction t, Sqrl_User u );
+void sqrl_transaction_swap_user( struct Sqrl_Transaction *transaction, Sqrl_User u );
 int sqrl_transaction_count();
 int sqrl_user_count();
 int sqrl_site_count();
@@ -313,20 +442,6 @@ void sqrl_client_user_maintenance( bool forceLockAll );
 #define BIT_SET(v,b) v |= b
 #define BIT_UNSET(v,b) v &= ~(b)
 
-struct Sqrl_User_List {
-	struct Sqrl_User *user;
-	struct Sqrl_User_List *next;
-};
-
-struct Sqrl_Site_List {
-	struct Sqrl_Site *site;
-	struct Sqrl_Site_List *next;
-};
-
-struct Sqrl_Transaction_List {
-	struct Sqrl_Transaction *transaction;
-	struct Sqrl_Transaction_List *next;
-};
 
 extern struct Sqrl_Client_Callbacks *SQRL_CLIENT_CALLBACKS;
 
@@ -355,6 +470,13 @@ void sqrl_client_call_transaction_complete(
 	Sqrl_Transaction transaction );
 
 
+bool sqrl_client_transaction_cancelled( Sqrl_Transaction transaction );
+Sqrl_Transaction_Status sqrl_client_run_transaction(
+	Sqrl_Transaction t,
+	Sqrl_User user,
+	const char *string,
+	size_t string_len );
+
 bool sqrl_client_require_password( Sqrl_Transaction transaction );
 bool sqrl_client_require_hint( Sqrl_Transaction transaction );
 bool sqrl_client_require_rescue_code( Sqrl_Transaction transaction );
@@ -369,33 +491,128 @@ bool sqrl_client_require_rescue_code( Sqrl_Transaction transaction );
 #define SITE_KEY_URSK 7
 #define SITE_KEY_URPK 8
 
+#define SITE_SIGN_IDS 0
+#define SITE_SIGN_PIDS 1
+#define SITE_SIGN_URS 2
+#define SITE_SIGN_COUNT 3
+
 // Site information saved for 5 minutes (600 seconds) past last action
 #define SQRL_CLIENT_SITE_TIMEOUT 600
 
 Sqrl_Transaction_Status sqrl_client_resume_transaction( Sqrl_Transaction t, const char *response, size_t response_len );
 void sqrl_client_site_maintenance( bool forceDeleteAll );
+void sqrl_client_site_release( Sqrl_Transaction transaction );
+Sqrl_Site *sqrl_client_site_create( Sqrl_Transaction t );
+bool sqrl_site_set_user_keys( Sqrl_Site *site );
+void sqrl_site_create_unlock_keys( struct Sqrl_Site *site );
+void sqrl_site_speculate( Sqrl_Site *site );
+bool sqrl_site_speculation_keys( Sqrl_Site *site, const char *host, size_t host_len, int first, const uint8_t *mk, Sqrl_Site_Keys *keys );
+bool sqrl_site_speculation_unlock( Sqrl_Site *site, const uint8_t *ilk );
 
 /* crypt.c */
-void 		sqrl_sign( const UT_string *msg, const uint8_t sk[32], const uint8_t pk[32], uint8_t sig[64] );
+bool 		sqrl_sign( const UT_string *msg, const uint8_t sk[32], const uint8_t pk[32], uint8_t sig[64] );
+bool 		sqrl_sign_key_expand( Sqrl_Sign_Key *key, const uint8_t seed[32], const uint8_t *pk );
+bool 		sqrl_sign_expanded( const UT_string *msg, const Sqrl_Sign_Key *key, uint8_t sig[64] );
+bool 		sqrl_sign_multi( const UT_string *msg, const Sqrl_Sign_Key *const *keys, int count, uint8_t (*sigs)[64] );
 bool 		sqrl_verify_sig( const UT_string *, const uint8_t *, const uint8_t * );
 int 		sqrl_make_shared_secret( uint8_t *, const uint8_t *, const uint8_t * );
 //int 		sqrl_make_dh_keys( uint8_t *, uint8_t * );
-void 		sqrl_ed_public_key( uint8_t *puk, const uint8_t *prk );
+bool 		sqrl_ed_public_key( uint8_t *puk, const uint8_t *prk );
 bool 		sqrl_crypt( Sqrl_Crypt_Context *sctx, const char *password, size_t password_len, enscrypt_progress_fn callback, void * callback_data );
 bool 		sqrl_crypt_gcm( Sqrl_Crypt_Context *sctx, uint8_t *key );
 uint32_t 	sqrl_crypt_enscrypt( Sqrl_Crypt_Context *sctx, uint8_t *key, const char *password, size_t password_len, enscrypt_progress_fn callback, void * callback_data );
+uint32_t 	sqrl_crypt_enscrypt_resume( Sqrl_Crypt_Context *sctx, struct Sqrl_Enscrypt_State *state, uint8_t *key, const char *password, size_t password_len, enscrypt_progress_fn callback, void * callback_data );
 
-void sqrl_gen_ilk( uint8_t ilk[SQRL_KEY_SIZE], const uint8_t iuk[SQRL_KEY_SIZE] );
+bool sqrl_gen_ilk( uint8_t ilk[SQRL_KEY_SIZE], const uint8_t iuk[SQRL_KEY_SIZE] );
 void sqrl_gen_local( uint8_t local[SQRL_KEY_SIZE], const uint8_t mk[SQRL_KEY_SIZE] );
 void sqrl_gen_mk( uint8_t mk[SQRL_KEY_SIZE], const uint8_t iuk[SQRL_KEY_SIZE] );
-void sqrl_gen_rlk( uint8_t rlk[SQRL_KEY_SIZE] );
+bool sqrl_gen_rlk( uint8_t rlk[SQRL_KEY_SIZE] );
 void sqrl_gen_suk( uint8_t suk[SQRL_KEY_SIZE], const uint8_t rlk[SQRL_KEY_SIZE] );
-void sqrl_gen_vuk( uint8_t vuk[SQRL_KEY_SIZE], const uint8_t ilk[SQRL_KEY_SIZE], const uint8_t rlk[SQRL_KEY_SIZE] );
-void sqrl_gen_ursk( uint8_t ursk[SQRL_KEY_SIZE], const uint8_t suk[SQRL_KEY_SIZE], const uint8_t iuk[SQRL_KEY_SIZE] );
-
+bool sqrl_gen_vuk( uint8_t vuk[SQRL_KEY_SIZE], const uint8_t ilk[SQRL_KEY_SIZE], const uint8_t rlk[SQRL_KEY_SIZE] );
+bool sqrl_gen_ursk( uint8_t ursk[SQRL_KEY_SIZE], const uint8_t suk[SQRL_KEY_SIZE], const uint8_t iuk[SQRL_KEY_SIZE] );
+
+
+/* scrypt.c */
+#define ENSCRYPT_R 256
+#define ENSCRYPT_P 1
+
+typedef enum {
+	SQRL_SCRYPT_KERNEL_AUTO = 0,
+	SQRL_SCRYPT_KERNEL_SCALAR,
+	SQRL_SCRYPT_KERNEL_SSE2,
+	SQRL_SCRYPT_KERNEL_AVX2,
+	SQRL_SCRYPT_KERNEL_AVX512,
+	SQRL_SCRYPT_KERNEL_COUNT
+} Sqrl_Scrypt_Kernel;
+
+typedef struct Sqrl_Scrypt_Lane {
+	const uint8_t *password;
+	size_t password_len;
+	const uint8_t *salt;
+	size_t salt_len;
+	uint8_t *out;
+} Sqrl_Scrypt_Lane;
+
+bool sqrl_scrypt_kernel_supported( Sqrl_Scrypt_Kernel kernel );
+Sqrl_Scrypt_Kernel sqrl_scrypt_kernel();
+bool sqrl_scrypt_select_kernel( Sqrl_Scrypt_Kernel kernel );
+const char *sqrl_scrypt_kernel_name( Sqrl_Scrypt_Kernel kernel );
+size_t sqrl_scrypt_workspace_size( uint64_t N );
+int sqrl_scrypt_lanes();
+int sqrl_scrypt_multi(
+	uint8_t *workspace,
+	size_t workspace_len,
+	const Sqrl_Scrypt_Lane *lanes,
+	int count,
+	uint64_t N );
+int sqrl_scrypt(
+	uint8_t *workspace,
+	size_t workspace_len,
+	const uint8_t *password,
+	size_t password_len,
+	const uint8_t *salt,
+	size_t salt_len,
+	uint64_t N,
+	uint8_t out[32] );
 
 uint16_t readint_16( void *buf );
+/* scratch.c */
+uint8_t *sqrl_scratch_push( size_t len );
+void sqrl_scratch_pop( uint8_t *p );
+size_t sqrl_scratch_used();
+
+/* curve25519.c */
+typedef enum {
+	SQRL_CURVE_BACKEND_AUTO = 0,
+	SQRL_CURVE_BACKEND_SODIUM,
+	SQRL_CURVE_BACKEND_FE51,
+	SQRL_CURVE_BACKEND_COUNT
+} Sqrl_Curve_Backend;
+
+bool sqrl_curve_backend_supported( Sqrl_Curve_Backend backend );
+Sqrl_Curve_Backend sqrl_curve_backend();
+bool sqrl_curve_select_backend( Sqrl_Curve_Backend backend );
+const char *sqrl_curve_backend_name( Sqrl_Curve_Backend backend );
+int sqrl_curve_ed25519_base( uint8_t q[32], const uint8_t n[32] );
+int sqrl_curve_ed25519_verify( const uint8_t sig[64], const uint8_t *m, size_t mlen, const uint8_t pk[32] );
+int sqrl_curve_x25519_base( uint8_t q[32], const uint8_t n[32] );
+int sqrl_curve_x25519( uint8_t q[32], const uint8_t n[32], const uint8_t p[32] );
+
+/* enhash.c */
+typedef enum {
+	SQRL_ENHASH_KERNEL_AUTO = 0,
+	SQRL_ENHASH_KERNEL_SCALAR,
+	SQRL_ENHASH_KERNEL_AVX2,
+	SQRL_ENHASH_KERNEL_SHA,
+	SQRL_ENHASH_KERNEL_COUNT
+} Sqrl_EnHash_Kernel;
+
+bool sqrl_enhash_kernel_supported( Sqrl_EnHash_Kernel kernel );
+Sqrl_EnHash_Kernel sqrl_enhash_kernel();
+bool sqrl_enhash_select_kernel( Sqrl_EnHash_Kernel kernel );
+const char *sqrl_enhash_kernel_name( Sqrl_EnHash_Kernel kernel );
 int Sqrl_EnHash( uint64_t *out, uint64_t *in );
+void sqrl_enhash_multi( uint8_t *const *out, const uint8_t *const *in, int count );
 
 int sqrl_enscrypt( 
 	uint8_t *buf, 
@@ -417,8 +634,66 @@ int sqrl_enscrypt_ms(
 	int millis,
 	enscrypt_progress_fn cb_ptr, 
 	void *cb_data );
+double sqrl_enscrypt_calibrate( uint8_t nFactor );
+double sqrl_enscrypt_cost( uint8_t nFactor );
+uint32_t sqrl_enscrypt_plan( uint8_t nFactor, int millis );
+
+typedef struct Sqrl_Enscrypt_Job {
+	const char *password;
+	size_t password_len;
+	const uint8_t *salt;
+	uint8_t salt_len;
+	uint8_t nFactor;
+	uint16_t iterations;
+	/** Receives the EnScrypt result */
+	uint8_t result[32];
+} Sqrl_Enscrypt_Job;
+
+int sqrl_enscrypt_multi(
+	Sqrl_Enscrypt_Job *jobs,
+	int count,
+	enscrypt_progress_fn cb_ptr,
+	void *cb_data );
+
+/** Where a resumable EnScrypt chain has got to; see \p sqrl_enscrypt_resume() */
+typedef struct Sqrl_Enscrypt_State {
+	uint32_t index;		// Iterations done; 0 for a fresh state
+	uint32_t elapsed;	// Milliseconds spent, over every run
+	uint32_t target;	// Iterations, or milliseconds with SQRL_MILLIS
+	uint8_t flags;		// SQRL_ITERATIONS or SQRL_MILLIS
+	uint8_t nFactor;
+	uint8_t salt_len;	// 0 if the salt was too long to keep
+	uint8_t salt[32];
+	uint8_t last[32];	// Last output, which salts the next iteration
+	uint8_t acc[32];	// XOR of every output so far
+} Sqrl_Enscrypt_State;
+
+Sqrl_Enscrypt_State *sqrl_enscrypt_state_create();
+Sqrl_Enscrypt_State *sqrl_enscrypt_state_destroy( Sqrl_Enscrypt_State *state );
+void sqrl_enscrypt_state_reset( Sqrl_Enscrypt_State *state );
+bool sqrl_enscrypt_state_continues(
+	const Sqrl_Enscrypt_State *state,
+	const uint8_t *salt,
+	uint8_t salt_len,
+	uint8_t nFactor,
+	uint8_t flags,
+	uint32_t target );
+int sqrl_enscrypt_resume(
+	Sqrl_Enscrypt_State *state,
+	uint8_t *buf,
+	const char *password,
+	size_t password_len,
+	const uint8_t *salt,
+	uint8_t salt_len,
+	uint8_t nFactor,
+	uint8_t flags,
+	uint32_t target,
+	enscrypt_progress_fn cb_ptr,
+	void *cb_data );
+bool sqrl_enscrypt_state_seal( const Sqrl_Enscrypt_State *state, const uint8_t *key, uint8_t *sealed );
+bool sqrl_enscrypt_state_open( Sqrl_Enscrypt_State *state, const uint8_t *key, const uint8_t *sealed );
 
-void sqrl_curve_private_key( uint8_t *key );
+bool sqrl_curve_private_key( uint8_t *key );
 void sqrl_curve_public_key( uint8_t *puk, const uint8_t *prk );
 
 void reverse_buffer( uint8_t *in, size_t in_len );
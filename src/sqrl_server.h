@@ -76,18 +76,46 @@ typedef enum {
     SQRL_SCB_USER_IDENTIFIED
 } Sqrl_Server_User_Op;
 
-typedef struct Sqrl_Server {
+/**
+An immutable snapshot of a \p Sqrl_Server's configuration.  A snapshot is
+never modified once published; changing the server's keys or URI publishes
+a new snapshot, and the old one is freed when its last reference is released.
+*/
+typedef struct Sqrl_Server_Config {
+    /** Internal use */
+    int referenceCount;
+    /** The parsed SQRL URI (with nut token) */
     Sqrl_Uri *uri;
+    /** Key used to encrypt nuts and MAC server strings */
     uint8_t key[32];
+    /** The key replaced by the most recent rotation */
+    uint8_t previous_key[32];
+    /** Timestamp after which \p previous_key is no longer accepted (0 if none) */
+    uint64_t previous_expires;
+    /** Lifetime of a nut, in timestamp units */
     uint64_t nut_expires;
     void *onUserOp;
     void *onSend;
+} Sqrl_Server_Config;
+
+typedef struct Sqrl_Server {
+    /** The current \p Sqrl_Server_Config.  Use \p sqrl_server_config_acquire() to read it. */
+    Sqrl_Server_Config *config;
+    /** Internal use: grace period tracking for config readers */
+    uint32_t epoch;
+    uint32_t readers[2];
+    /** Internal use: serializes config writers */
+    void *writer;
 } Sqrl_Server;
 
 typedef struct Sqrl_Server_Context {
     Sqrl_Server *server;
+    Sqrl_Server_Config *config;
     Sqrl_Server_User *user;
     Sqrl_Nut nut;
+    uint64_t timestamp; // When the query was received; 0 means now
+    uint32_t client_ip;
+    void *data;         // Application data; not used by libsqrl
     Sqrl_Cmd command;
     Sqrl_Tif tif;
     uint16_t flags;
@@ -97,6 +125,32 @@ typedef struct Sqrl_Server_Context {
     char *reply;
 } Sqrl_Server_Context;
 
+/**
+Statistics for a \p Sqrl_Server_Queue.  Times are in microseconds.
+*/
+typedef struct Sqrl_Server_Queue_Stats {
+    /** Requests waiting */
+    int depth;
+    /** Requests waiting which finish a login (not queries) */
+    int high;
+    /** Requests accepted into the queue */
+    uint64_t admitted;
+    /** Requests refused or shed because the queue was full */
+    uint64_t rejected;
+    /** Requests dropped because their nut would expire first */
+    uint64_t expired;
+    /** Requests processed */
+    uint64_t completed;
+    /** Total and longest time spent waiting for a worker */
+    uint64_t totalWait;
+    uint64_t maxWait;
+} Sqrl_Server_Queue_Stats;
+
+typedef struct Sqrl_Server_Queue Sqrl_Server_Queue;
+
+/** Size of the \p blob buffer given to a \p SQRL_SCB_USER_FIND */
+#define SQRL_SERVER_USER_BLOB_SIZE 512
+
 typedef bool (sqrl_scb_user)(
     Sqrl_Server_User_Op op,
     char *host,
@@ -121,6 +175,17 @@ bool sqrl_scb_user_default(
     char *pidk,
     char *blob );
 
+bool sqrl_scb_user_remote(
+    Sqrl_Server_User_Op op,
+    char *host,
+    char *idk,
+    char *pidk,
+    char *blob );
+bool sqrl_server_store_connect( const char *address, int connections );
+void sqrl_server_store_disconnect();
+bool sqrl_server_store_serve( const char *address, sqrl_scb_user *backend );
+void sqrl_server_store_stop();
+
 bool sqrl_server_init(
     Sqrl_Server *server,
     char *uri,
@@ -130,6 +195,23 @@ bool sqrl_server_init(
     sqrl_scb_send *onSend,
     int nut_life );
 void sqrl_server_clear( Sqrl_Server *server );
+bool sqrl_server_reconfigure(
+    Sqrl_Server *server,
+    char *uri,
+    char *passcode,
+    size_t passcode_len,
+    int nut_life );
+bool sqrl_server_rekey(
+    Sqrl_Server *server,
+    char *passcode,
+    size_t passcode_len );
+bool sqrl_server_set_previous_key(
+    Sqrl_Server *server,
+    char *passcode,
+    size_t passcode_len,
+    uint64_t expires );
+Sqrl_Server_Config *sqrl_server_config_acquire( Sqrl_Server *server );
+Sqrl_Server_Config *sqrl_server_config_release( Sqrl_Server_Config *config );
 Sqrl_Server *sqrl_server_create(
     char *uri,
     char *passcode,
@@ -151,13 +233,45 @@ Sqrl_Server_Context *sqrl_server_context_create( Sqrl_Server *server );
 Sqrl_Server_Context *sqrl_server_context_destroy( Sqrl_Server_Context *context );
 void sqrl_server_add_mac( Sqrl_Server *server, UT_string *str, char sep );
 bool sqrl_server_verify_mac( Sqrl_Server *server, UT_string *str );
+void sqrl_server_config_add_mac( Sqrl_Server_Config *config, UT_string *str, char sep );
+const uint8_t *sqrl_server_config_verify_mac( Sqrl_Server_Config *config, UT_string *str );
+const uint8_t *sqrl_server_config_verify_mac_at( Sqrl_Server_Config *config, UT_string *str, uint64_t now );
+bool sqrl_server_config_nut_generate(
+    Sqrl_Server_Config *config,
+    Sqrl_Nut *nut,
+    uint32_t ip );
+bool sqrl_server_config_nut_decrypt(
+    const uint8_t *key,
+    Sqrl_Nut *nut );
 
 char *sqrl_server_create_link( Sqrl_Server *server, uint32_t ip );
+void sqrl_server_parse_query(
+    Sqrl_Server_Context *context,
+    uint32_t client_ip,
+    const char *query,
+    size_t query_len );
 void sqrl_server_handle_query(
     Sqrl_Server_Context *context,
     uint32_t client_ip,
     const char *query,
     size_t query_len );
+bool sqrl_server_context_export( Sqrl_Server_Context *context, UT_string *envelope );
+Sqrl_Server_Context *sqrl_server_context_import(
+    Sqrl_Server *server,
+    const uint8_t *envelope,
+    size_t envelope_len );
+void sqrl_server_context_resume( Sqrl_Server_Context *context );
+bool sqrl_server_build_reply( Sqrl_Server_Context *context, UT_string *reply );
+
+Sqrl_Server_Queue *sqrl_server_queue_create( Sqrl_Server *server, int capacity, int workers );
+Sqrl_Server_Queue *sqrl_server_queue_destroy( Sqrl_Server_Queue *queue );
+bool sqrl_server_queue_submit(
+    Sqrl_Server_Queue *queue,
+    Sqrl_Server_Context *context,
+    uint32_t client_ip,
+    const char *query,
+    size_t query_len );
+void sqrl_server_queue_stats( Sqrl_Server_Queue *queue, Sqrl_Server_Queue_Stats *stats );
 
 
 #endif // SQRL_SERVER_H_INCLUDED
@@ -241,6 +241,33 @@ int main()
     }
     PC( "PASS", "Rescue Identity" );
 
+    // Different users run side by side; a user's second job waits its turn
+    Sqrl_Client_Executor *executor = sqrl_client_executor_create( 2 );
+    Sqrl_Client_Job *jobs[3];
+    jobs[0] = sqrl_client_submit( executor, SQRL_TRANSACTION_IDENTITY_RESCUE, gen_user, NULL, 0, NULL, NULL, NULL );
+    jobs[1] = sqrl_client_submit( executor, SQRL_TRANSACTION_IDENTITY_RESCUE, t1_user, NULL, 0, NULL, NULL, NULL );
+    jobs[2] = sqrl_client_submit( executor, SQRL_TRANSACTION_IDENTITY_RESCUE, t1_user, NULL, 0, NULL, NULL, NULL );
+    if( !sqrl_client_job_cancel( jobs[2] ) || 
+        SQRL_TRANSACTION_STATUS_CANCELLED != sqrl_client_job_wait( jobs[2] )) {
+        PC( "FAIL", "Cancel Queued Job" );
+        exit(1);
+    }
+    sqrl_client_job_cancel( jobs[1] );
+    if( SQRL_TRANSACTION_STATUS_CANCELLED != sqrl_client_job_wait( jobs[1] )) {
+        PC( "FAIL", "Cancel Running Job" );
+        exit(1);
+    }
+    if( SQRL_TRANSACTION_STATUS_SUCCESS != sqrl_client_job_wait( jobs[0] ) ||
+        !sqrl_client_job_done( jobs[0], NULL ) || sqrl_client_job_cancel( jobs[0] )) {
+        PC( "FAIL", "Executor Job" );
+        exit(1);
+    }
+    for( int i = 0; i < 3; i++ ) {
+        sqrl_client_job_release( jobs[i] );
+    }
+    executor = sqrl_client_executor_destroy( executor );
+    PC( "PASS", "Executor" );
+
     gen_user = sqrl_user_release( gen_user );
     t1_user = sqrl_user_release( t1_user );
     //load_user = sqrl_user_release( load_user );
@@ -50,12 +50,172 @@ void idlock_test()
 	printf( "URK: %s\n", utstring_body( buf ));
 
 
-	if( sqrl_verify_sig( msg, sig, vuk )) {
+	if( sqrl_verify_sig( msg, sig, vuk ) && sqrl_scratch_used() == 0 ) {
 		printf( "[ PASS ] Identity Lock Key Generation\n" );
 	} else {
 		printf( "[ FAIL ] Identity Lock Key Generation\n" );
 		exit(1);
 	}
+
+	// Expanded keys must sign exactly as libsodium does
+	Sqrl_Sign_Key keys[3];
+	const Sqrl_Sign_Key *kp[3] = { &keys[0], &keys[1], &keys[2] };
+	uint8_t sigs[3][SQRL_SIG_SIZE], pk[32], sk[64];
+	int i, k;
+	for( i = 0; i < 50; i++ ) {
+		utstring_clear( msg );
+		randombytes_buf( tmp, 32 );
+		sqrl_b64u_encode( buf, tmp, i );
+		utstring_concat( msg, buf );
+		for( k = 0; k < 3; k++ ) {
+			randombytes_buf( tmp, 32 );
+			crypto_sign_seed_keypair( pk, sk, tmp );
+			if( !sqrl_sign_key_expand( &keys[k], tmp, k == 0 ? pk : NULL ) ||
+				0 != memcmp( keys[k].pub, pk, 32 )) {
+				printf( "[ FAIL ] Sign key expansion\n" );
+				exit(1);
+			}
+			crypto_sign_detached( sig, NULL, (unsigned char*)utstring_body( msg ), utstring_len( msg ), sk );
+			sqrl_sign_multi( msg, kp, k + 1, sigs );
+			if( 0 != memcmp( sig, sigs[k], SQRL_SIG_SIZE )) {
+				printf( "[ FAIL ] Expanded signature\n" );
+				exit(1);
+			}
+		}
+	}
+	printf( "[ PASS ] Expanded Signing Keys\n" );
+}
+
+// Every curve backend must give libsodium's results, including rejections
+void curve_test()
+{
+	static const uint8_t order[32] = {
+		0xed, 0xd3, 0xf5, 0x5c, 0x1a, 0x63, 0x12, 0x58, 0xd6, 0x9c, 0xf7, 0xa2, 0xde, 0xf9, 0xde, 0x14,
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10
+	};
+	static const uint8_t order8[32] = {
+		0x26, 0xe8, 0x95, 0x8f, 0xc2, 0xb2, 0x27, 0xb0, 0x45, 0xc3, 0xf4, 0x89, 0xf2, 0xef, 0x98, 0xf0,
+		0xd5, 0xdf, 0xac, 0x05, 0xd3, 0xc6, 0x33, 0x39, 0xb1, 0x38, 0x02, 0x88, 0x6d, 0x53, 0xfc, 0x05
+	};
+	uint8_t seed[32], pk[32], sk[64], sig[64], bad[64], n[32], p[32], a[32], b[32], small[8][32];
+	uint8_t msg[64];
+	int backend, i, k, ra, rb;
+
+	// 0, 1, p - 1, p, p + 1, the order 8 points, and a high bit variant
+	memset( small, 0, sizeof( small ));
+	small[1][0] = 1;
+	for( k = 2; k < 5; k++ ) {
+		memset( small[k], 0xff, 32 );
+		small[k][31] = 0x7f;
+		small[k][0] = (uint8_t)(0xec + k - 2);
+	}
+	memcpy( small[5], order8, 32 );
+	memcpy( small[6], order8, 32 );
+	small[6][31] |= 0x80;
+	small[7][0] = 0x80;		// Not small; an ordinary point to compare
+
+	for( backend = SQRL_CURVE_BACKEND_SODIUM; backend < SQRL_CURVE_BACKEND_COUNT; backend++ ) {
+		const char *name = sqrl_curve_backend_name( backend );
+		if( !sqrl_curve_select_backend( backend )) {
+			printf( "[ SKIP ] Curve25519 (%s)\n", name );
+			continue;
+		}
+		for( i = 0; i < 200; i++ ) {
+			randombytes_buf( seed, 32 );
+			randombytes_buf( msg, sizeof( msg ));
+			crypto_sign_seed_keypair( pk, sk, seed );
+			crypto_sign_detached( sig, NULL, msg, i % 64, sk );
+
+			// Valid, then damaged signatures, keys and messages
+			for( k = -1; k < 8; k++ ) {
+				memcpy( bad, sig, 64 );
+				memcpy( p, pk, 32 );
+				switch( k ) {
+				case -1: break;
+				case 0: bad[i % 64] ^= (uint8_t)(1 << (i % 8)); break;
+				case 1: p[i % 32] ^= (uint8_t)(1 << (i % 8)); break;
+				case 2: memcpy( bad + 32, order, 32 ); break;
+				case 3: memcpy( bad + 32, order, 32 ); bad[32]--; break;
+				case 4: memcpy( bad + 32, order, 32 ); bad[32]++; break;
+				case 5: memcpy( bad, small[i % 7], 32 ); break;
+				case 6: memcpy( p, small[i % 7], 32 ); break;
+				case 7: randombytes_buf( p, 32 ); break;
+				}
+				ra = sqrl_curve_ed25519_verify( bad, msg, i % 64, p );
+				rb = crypto_sign_verify_detached( bad, msg, i % 64, p );
+				if( ra != rb || (k == -1 && ra != 0) ) {
+					printf( "[ FAIL ] Curve25519 (%s) verify %d: %d != %d\n", name, k, ra, rb );
+					exit(1);
+				}
+			}
+
+			// Fixed base, clamped and not
+			randombytes_buf( n, 32 );
+			if( i == 0 ) memset( n, 0, 32 );
+			if( i == 1 ) memcpy( n, order, 32 );
+			ra = sqrl_curve_ed25519_base( a, n );
+			rb = crypto_scalarmult_ed25519_base_noclamp( b, n );
+			if( ra != rb || (ra == 0 && memcmp( a, b, 32 ))) {
+				printf( "[ FAIL ] Curve25519 (%s) Ed25519 base\n", name );
+				exit(1);
+			}
+			ra = sqrl_curve_x25519_base( a, n );
+			rb = crypto_scalarmult_base( b, n );
+			if( ra != rb || memcmp( a, b, 32 )) {
+				printf( "[ FAIL ] Curve25519 (%s) X25519 base\n", name );
+				exit(1);
+			}
+
+			// Shared secrets with real, random and small order points
+			if( i % 3 == 0 ) {
+				crypto_scalarmult_base( p, seed );
+			} else if( i % 3 == 1 ) {
+				randombytes_buf( p, 32 );
+			} else {
+				memcpy( p, small[(i / 3) % 8], 32 );
+			}
+			ra = sqrl_curve_x25519( a, n, p );
+			rb = crypto_scalarmult( b, n, p );
+			if( ra != rb || (ra == 0 && memcmp( a, b, 32 ))) {
+				printf( "[ FAIL ] Curve25519 (%s) X25519\n", name );
+				exit(1);
+			}
+		}
+		printf( "[ PASS ] Curve25519 (%s)\n", name );
+	}
+	sqrl_curve_select_backend( SQRL_CURVE_BACKEND_AUTO );
+}
+
+void scratch_test()
+{
+	uint8_t *a, *b, *big;
+	size_t i;
+
+	a = sqrl_scratch_push( 32 );
+	memset( a, 0xaa, 32 );
+	b = sqrl_scratch_push( 100 );
+	memset( b, 0xbb, 100 );
+	// Larger than the arena; gets its own block
+	big = sqrl_scratch_push( 1024 * 1024 + 1 );
+	if( !a || !b || !big || ((uintptr_t)b & 63) || ((uintptr_t)big & 63) || b < a + 32 ) {
+		printf( "[ FAIL ] Scratch push\n" );
+		exit(1);
+	}
+	sqrl_scratch_pop( big );
+	sqrl_scratch_pop( a );
+	// Popping a releases and wipes b too
+	for( i = 0; i < 100; i++ ) {
+		if( b[i] != 0 || (i < 32 && a[i] != 0) ) {
+			printf( "[ FAIL ] Scratch wipe\n" );
+			exit(1);
+		}
+	}
+	if( sqrl_scratch_used() != 0 || sqrl_scratch_push( 32 ) != a ) {
+		printf( "[ FAIL ] Scratch pop\n" );
+		exit(1);
+	}
+	sqrl_scratch_pop( a );
+	printf( "[ PASS ] Scratch\n" );
 }
 
 void enhash_test() 
@@ -70,13 +230,21 @@ void enhash_test()
 	utstring_new( input );
 	utstring_new( output );
 	uint8_t out[SQRL_KEY_SIZE];
+	uint8_t (*inputs)[SQRL_KEY_SIZE] = malloc( 1000 * SQRL_KEY_SIZE );
+	uint8_t (*outputs)[SQRL_KEY_SIZE] = malloc( 1000 * SQRL_KEY_SIZE );
+	uint8_t (*results)[SQRL_KEY_SIZE] = malloc( 1000 * SQRL_KEY_SIZE );
+	const uint8_t *in[16];
+	uint8_t *res[16];
+	int i, n, kernel;
 
 	int ln = 0;
 
-	while( (read = getline( &line, &len, fp )) != -1 ) {
-		ln++;
+	while( ln < 1000 && (read = getline( &line, &len, fp )) != -1 ) {
 		sqrl_b64u_decode( input, line, 43 );
 		sqrl_b64u_decode( output, line+43, 43 );
+		memcpy( inputs[ln], utstring_body( input ), SQRL_KEY_SIZE );
+		memcpy( outputs[ln], utstring_body( output ), SQRL_KEY_SIZE );
+		ln++;
 		Sqrl_EnHash( (uint64_t*)out, (uint64_t*)(utstring_body(input)));
 		if( memcmp( out, utstring_body(output), 32 ) != 0 ) {
 			printf( "[ FAIL ] EnHash at line: %d\n", ln );
@@ -84,6 +252,34 @@ void enhash_test()
 		}
 	}
 
+	// Batches of 1 to 16, to cover full and partial lanes
+	for( kernel = SQRL_ENHASH_KERNEL_SCALAR; kernel < SQRL_ENHASH_KERNEL_COUNT; kernel++ ) {
+		if( !sqrl_enhash_select_kernel( kernel )) {
+			printf( "[ SKIP ] EnHash (%s)\n", sqrl_enhash_kernel_name( kernel ));
+			continue;
+		}
+		memset( results, 0, 1000 * SQRL_KEY_SIZE );
+		for( i = 0, n = 1; i < ln; i += n, n = n % 16 + 1 ) {
+			int k, count = i + n > ln ? ln - i : n;
+			for( k = 0; k < count; k++ ) {
+				in[k] = inputs[i + k];
+				res[k] = results[i + k];
+			}
+			sqrl_enhash_multi( res, in, count );
+		}
+		for( i = 0; i < ln; i++ ) {
+			if( memcmp( results[i], outputs[i], SQRL_KEY_SIZE ) != 0 ) {
+				printf( "[ FAIL ] EnHash (%s) at line: %d\n", sqrl_enhash_kernel_name( kernel ), i + 1 );
+				exit(1);
+			}
+		}
+		printf( "[ PASS ] EnHash (%s)\n", sqrl_enhash_kernel_name( kernel ));
+	}
+	sqrl_enhash_select_kernel( SQRL_ENHASH_KERNEL_AUTO );
+
+	free( inputs );
+	free( outputs );
+	free( results );
 	utstring_free( input );
 	utstring_free( output );
 	free( line );
@@ -91,6 +287,100 @@ void enhash_test()
 	printf( "[ PASS ] EnHash\n" );
 }
 
+typedef struct Scrypt_Vector {
+	int nFactor;
+	UT_string *password;
+	UT_string *salt;
+	UT_string *output;
+} Scrypt_Vector;
+
+void scrypt_test()
+{
+	FILE *fp = fopen( "vectors/scrypt-vectors.txt", "r" );
+	if( !fp ) exit(1);
+
+	char *line = NULL;
+	size_t len = 0;
+	char pw[128], salt[128], expected[64];
+	int nFactor, kernel, i, j, l, count = 0;
+	Scrypt_Vector vectors[64];
+	Sqrl_Scrypt_Lane lanes[4];
+	uint8_t out[4][32];
+
+	while( count < 64 && getline( &line, &len, fp ) != -1 ) {
+		if( 4 != sscanf( line, "%d %127s %127s %63s", &nFactor, pw, salt, expected )) continue;
+		vectors[count].nFactor = nFactor;
+		utstring_new( vectors[count].password );
+		utstring_new( vectors[count].salt );
+		utstring_new( vectors[count].output );
+		sqrl_b64u_decode( vectors[count].password, pw, strlen( pw ));
+		sqrl_b64u_decode( vectors[count].salt, salt, strlen( salt ));
+		sqrl_b64u_decode( vectors[count].output, expected, strlen( expected ));
+		count++;
+	}
+	free( line );
+	fclose(fp);
+
+	size_t size = 4 * sqrl_scrypt_workspace_size( 1 << 9 );
+	uint8_t *mem = malloc( size + 63 );
+	uint8_t *workspace = (uint8_t*)(((uintptr_t)mem + 63) & ~(uintptr_t)63);
+
+	for( kernel = SQRL_SCRYPT_KERNEL_SCALAR; kernel < SQRL_SCRYPT_KERNEL_COUNT; kernel++ ) {
+		if( !sqrl_scrypt_select_kernel( kernel )) {
+			printf( "[ SKIP ] scrypt (%s)\n", sqrl_scrypt_kernel_name( kernel ));
+			continue;
+		}
+		for( i = 0; i < count; i++ ) {
+			if( 0 != sqrl_scrypt( workspace, size,
+					(uint8_t*)utstring_body( vectors[i].password ), utstring_len( vectors[i].password ),
+					(uint8_t*)utstring_body( vectors[i].salt ), utstring_len( vectors[i].salt ),
+					(uint64_t)1 << vectors[i].nFactor, out[0] ) ||
+				0 != memcmp( out[0], utstring_body( vectors[i].output ), 32 )) {
+				printf( "[ FAIL ] scrypt (%s) vector: %d\n", sqrl_scrypt_kernel_name( kernel ), i + 1 );
+				exit(1);
+			}
+		}
+		// Interleaved: up to sqrl_scrypt_lanes() vectors with the same nFactor
+		for( nFactor = 1; nFactor < 10; nFactor++ ) {
+			l = 0;
+			for( i = 0; i < count && l < sqrl_scrypt_lanes(); i++ ) {
+				if( vectors[i].nFactor != nFactor ) continue;
+				lanes[l].password = (uint8_t*)utstring_body( vectors[i].password );
+				lanes[l].password_len = utstring_len( vectors[i].password );
+				lanes[l].salt = (uint8_t*)utstring_body( vectors[i].salt );
+				lanes[l].salt_len = utstring_len( vectors[i].salt );
+				lanes[l].out = out[l];
+				l++;
+			}
+			if( 0 != sqrl_scrypt_multi( workspace, size, lanes, l, (uint64_t)1 << nFactor )) {
+				printf( "[ FAIL ] scrypt x%d (%s) nFactor: %d\n", l, sqrl_scrypt_kernel_name( kernel ), nFactor );
+				exit(1);
+			}
+			for( i = 0, j = 0; i < count && j < l; i++ ) {
+				if( vectors[i].nFactor != nFactor ) continue;
+				if( 0 != memcmp( out[j++], utstring_body( vectors[i].output ), 32 )) {
+					printf( "[ FAIL ] scrypt x%d (%s) vector: %d\n", l, sqrl_scrypt_kernel_name( kernel ), i + 1 );
+					exit(1);
+				}
+			}
+		}
+		printf( "[ PASS ] scrypt (%s, %d lanes)\n", sqrl_scrypt_kernel_name( kernel ), sqrl_scrypt_lanes() );
+	}
+	sqrl_scrypt_select_kernel( SQRL_SCRYPT_KERNEL_AUTO );
+
+	for( i = 0; i < count; i++ ) {
+		utstring_free( vectors[i].password );
+		utstring_free( vectors[i].salt );
+		utstring_free( vectors[i].output );
+	}
+	free( mem );
+}
+
+static int enscrypt_stop( int percent, void *data )
+{
+	return percent < *(int*)data;
+}
+
 void enscrypt_test()
 {
 	uint8_t emptySalt[32] = {0};
@@ -113,12 +403,23 @@ void enscrypt_test()
 	sodium_bin2hex( str, 128, buf, 32 );
 	if( 0 == memcmp( buf, buf2, 32 )) {
 		printf( "PASS [1000ms](%di): %s\n", i, str );
+		printf( "     cost: %.3fms/i, plan: %ui\n", sqrl_enscrypt_cost( 9 ), sqrl_enscrypt_plan( 9, 1000 ));
 	} else {
 		printf( "FAIL [1000ms](%di): %s\n", i, str );
 		sodium_bin2hex( str, 128, buf2, 32 );
 		printf( "     [%di](%dms): %s\n", i, time, str );
 		exit(1);
 	}
+	double cost = sqrl_enscrypt_calibrate( 9 );
+	uint32_t planned = sqrl_enscrypt_plan( 9, 1000 );
+	if( cost <= 0 || planned < 1 || sqrl_enscrypt_cost( 9 ) <= 0 ||
+		sqrl_enscrypt_plan( 9, 2000 ) < planned * 2 - 1 || 
+		sqrl_enscrypt_plan( 9, 2000 ) > planned * 2 + 1 ||
+		sqrl_enscrypt_plan( 9, 0 ) != 1 || sqrl_enscrypt_cost( 40 ) != -1 ) {
+		printf( "FAIL [plan](%.3fms/i): %u\n", cost, planned );
+		exit(1);
+	}
+	printf( "PASS [plan](%.3fms/i): %ui in 1000ms\n", cost, planned );
 	time = sqrl_enscrypt( buf, NULL, 0, NULL, 0, 9, 100, NULL, NULL );
 	sodium_bin2hex( str, 128, buf, 32 );
 	if( strcmp( str, "45a42a01709a0012a37b7b6874cf16623543409d19e7740ed96741d2e99aab67" ) == 0 ) {
@@ -143,6 +444,77 @@ void enscrypt_test()
 		printf( "FAIL [Npw123i](%dms): %s\n", time, str );
 		exit(1);
 	}
+
+	Sqrl_Enscrypt_Job jobs[5];
+	memset( jobs, 0, sizeof( jobs ));
+	for( i = 0; i < 5; i++ ) {
+		jobs[i].password = i & 1 ? password : NULL;
+		jobs[i].password_len = i & 1 ? password_len : 0;
+		jobs[i].salt = i > 2 ? emptySalt : NULL;
+		jobs[i].salt_len = i > 2 ? 32 : 0;
+		jobs[i].nFactor = i == 4 ? 8 : 9;
+		jobs[i].iterations = 1 + i * 2;
+	}
+	time = sqrl_enscrypt_multi( jobs, 5, NULL, NULL );
+	for( i = 0; i < 5; i++ ) {
+		sqrl_enscrypt( buf, jobs[i].password, jobs[i].password_len, jobs[i].salt, jobs[i].salt_len,
+			jobs[i].nFactor, jobs[i].iterations, NULL, NULL );
+		if( time < 0 || 0 != memcmp( buf, jobs[i].result, 32 )) {
+			printf( "FAIL [multi %d]\n", i );
+			exit(1);
+		}
+	}
+	jobs[4].nFactor = 31;
+	if( -1 != sqrl_enscrypt_multi( jobs, 5, NULL, NULL )) {
+		printf( "FAIL [multi nFactor]\n" );
+		exit(1);
+	}
+	printf( "PASS [multi x%d](%dms)\n", sqrl_scrypt_lanes(), time );
+
+	// Cancel part way, seal, reopen and finish
+	Sqrl_Enscrypt_State *state = sqrl_enscrypt_state_create();
+	uint8_t sealKey[32] = {1}, sealed[SQRL_CHECKPOINT_LENGTH];
+	int stop = 50;
+	i = sqrl_enscrypt_resume( state, buf, password, password_len, emptySalt, 32, 9, SQRL_ITERATIONS, 123, enscrypt_stop, &stop );
+	if( i != -1 || state->index < 2 || state->index >= 123 ||
+		!sqrl_enscrypt_state_seal( state, sealKey, sealed )) {
+		printf( "FAIL [resume stop]\n" );
+		exit(1);
+	}
+	sqrl_enscrypt_state_reset( state );
+	sealKey[0] = 2;
+	if( sqrl_enscrypt_state_open( state, sealKey, sealed )) {
+		printf( "FAIL [resume open wrong key]\n" );
+		exit(1);
+	}
+	sealKey[0] = 1;
+	if( !sqrl_enscrypt_state_open( state, sealKey, sealed ) || state->index < 2 ) {
+		printf( "FAIL [resume open]\n" );
+		exit(1);
+	}
+	i = sqrl_enscrypt_resume( state, buf, password, password_len, emptySalt, 32, 9, SQRL_ITERATIONS, 123, NULL, NULL );
+	sodium_bin2hex( str, 128, buf, 32 );
+	if( i != 123 || state->index != 0 || 
+		strcmp( str, "2f30b9d4e5c48056177ff90a6cc9da04b648a7e8451dfa60da56c148187f6a7d" ) != 0 ) {
+		printf( "FAIL [resume]: %s\n", str );
+		exit(1);
+	}
+	// A checkpoint for another salt starts over
+	sqrl_enscrypt_state_open( state, sealKey, sealed );
+	i = sqrl_enscrypt_resume( state, buf, password, password_len, NULL, 0, 9, SQRL_ITERATIONS, 123, NULL, NULL );
+	sqrl_enscrypt( buf2, password, password_len, NULL, 0, 9, 123, NULL, NULL );
+	if( i != 123 || 0 != memcmp( buf, buf2, 32 )) {
+		printf( "FAIL [resume other salt]\n" );
+		exit(1);
+	}
+	// A salt too long to keep is refused
+	uint8_t longSalt[33] = {0};
+	if( -1 != sqrl_enscrypt_resume( state, buf, password, password_len, longSalt, sizeof( longSalt ), 9, SQRL_ITERATIONS, 2, NULL, NULL )) {
+		printf( "FAIL [resume long salt]\n" );
+		exit(1);
+	}
+	state = sqrl_enscrypt_state_destroy( state );
+	printf( "PASS [resume]\n" );
 	/* 
 	time = sqrl_enscrypt( buf, NULL, 0, NULL, 0, 9, 1000, NULL, NULL );
 	sodium_bin2hex( str, 128, buf, 32 );
@@ -158,8 +530,11 @@ void enscrypt_test()
 int main() 
 {
 	sqrl_init();
+	scratch_test();
+	scrypt_test();
 	enscrypt_test();
 	idlock_test();
 	enhash_test();
+	curve_test();
 	exit( sqrl_stop() );
 }
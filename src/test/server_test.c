@@ -10,11 +10,54 @@ For more details, see the LICENSE file included with this package.
 
 char host[] = "sqrlid.com";
 
+int replies = 0;
+int transient = 0;
+int transientIpKept = 0;
+#define QUEUE_CLIENT_IP 0x0100007F
+
+void onSend( Sqrl_Server_Context *context, char *reply, size_t reply_len )
+{
+    SQRL_ATOMIC_INC( &replies );
+    if( FLAG_CHECK( context->tif, SQRL_TIF_TRANSIENT_ERROR )) {
+        SQRL_ATOMIC_INC( &transient );
+        // The retry's nut must still match the client's IP
+        Sqrl_Nut nut = context->nut;
+        if( sqrl_server_config_nut_decrypt( context->config->key, &nut ) && nut.ip == QUEUE_CLIENT_IP ) {
+            SQRL_ATOMIC_INC( &transientIpKept );
+        }
+    }
+}
+
+// Builds a signed query for the link, as a client would.
+void build_query( UT_string *query, char *lnk, char *cmd, uint8_t *pk, uint8_t *sk )
+{
+    UT_string *srv, *cli, *tmp;
+    uint8_t sig[crypto_sign_BYTES];
+    utstring_new( srv );
+    utstring_new( cli );
+    utstring_new( tmp );
+    sqrl_b64u_encode( srv, (uint8_t*)lnk, strlen( lnk ));
+    utstring_printf( tmp, "ver=1\r\ncmd=%s\r\nidk=", cmd );
+    sqrl_b64u_encode_append( tmp, pk, crypto_sign_PUBLICKEYBYTES );
+    utstring_printf( tmp, "\r\n" );
+    sqrl_b64u_encode( cli, (uint8_t*)utstring_body( tmp ), utstring_len( tmp ));
+    utstring_clear( tmp );
+    utstring_printf( tmp, "%s%s", utstring_body( cli ), utstring_body( srv ));
+    crypto_sign_detached( sig, NULL, (uint8_t*)utstring_body( tmp ), utstring_len( tmp ), sk );
+    utstring_renew( query );
+    utstring_printf( query, "client=%s&server=%s&ids=", utstring_body( cli ), utstring_body( srv ));
+    sqrl_b64u_encode_append( query, sig, crypto_sign_BYTES );
+    utstring_free( srv );
+    utstring_free( cli );
+    utstring_free( tmp );
+}
+
 int main()
 {
     UT_string *str;
     utstring_new( str );
     char buf[128];
+    int i;
 
     sqrl_init();
 
@@ -26,9 +69,10 @@ int main()
         printf( "Failed to create server\n" );
         exit(1);
     }
-    printf( "host: %s\n", server->uri->host );
-    printf( "url:  %s\n", server->uri->url );
-    printf( "chal: %s\n", server->uri->challenge );
+    Sqrl_Server_Config *config = sqrl_server_config_acquire( server );
+    printf( "host: %s\n", config->uri->host );
+    printf( "url:  %s\n", config->uri->url );
+    printf( "chal: %s\n", config->uri->challenge );
 
     printf( "Nut Len: %lu\n", sizeof( Sqrl_Nut ));
 
@@ -56,7 +100,120 @@ int main()
         printf( "Failed to create link\n" );
         exit(1);
     }
+
+    // Links created before a key rotation must remain valid
+    utstring_clear( str );
+    utstring_printf( str, "%s", lnk );
     free( lnk );
+    if( ! sqrl_server_rekey( server, NULL, 0 )) {
+        printf( "Failed to rotate key\n" );
+        exit(1);
+    }
+    if( ! sqrl_server_verify_mac( server, str )) {
+        printf( "Link invalid after key rotation\n" );
+        exit(1);
+    }
+    lnk = sqrl_server_create_link( server, 0 );
+    utstring_clear( str );
+    utstring_printf( str, "%s", lnk );
+    free( lnk );
+    if( ! sqrl_server_verify_mac( server, str )) {
+        printf( "Link invalid with rotated key\n" );
+        exit(1);
+    }
+    // The snapshot held from before the rotation still has the old key
+    if( sqrl_server_config_verify_mac( config, str )) {
+        printf( "Old snapshot accepted new key\n" );
+        exit(1);
+    }
+    config = sqrl_server_config_release( config );
+
+    // A verified request can be resumed by another server with the same key
+    Sqrl_Server *edge = sqrl_server_create(
+        "sqrl://sqrlid.com/auth.php?nut=_LIBSQRL_NUT_",
+        "I am SQRLid!", 12,
+        NULL, NULL, 60 );
+    Sqrl_Server *central = sqrl_server_create(
+        "sqrl://sqrlid.com/auth.php?nut=_LIBSQRL_NUT_",
+        "I am SQRLid!", 12,
+        NULL, NULL, 60 );
+    uint8_t pk[crypto_sign_PUBLICKEYBYTES], sk[crypto_sign_SECRETKEYBYTES];
+    crypto_sign_keypair( pk, sk );
+    lnk = sqrl_server_create_link( edge, 7 );
+    build_query( str, lnk, "query", pk, sk );
+    free( lnk );
+    Sqrl_Server_Context *ctx = sqrl_server_context_create( edge );
+    sqrl_server_parse_query( ctx, 7, utstring_body( str ), utstring_len( str ));
+    UT_string *envelope;
+    utstring_new( envelope );
+    if( !sqrl_server_context_export( ctx, envelope )) {
+        printf( "Envelope export failed\n" );
+        exit(1);
+    }
+    printf( "Envelope: %lu bytes\n", (unsigned long)utstring_len( envelope ));
+    Sqrl_Server_Context *resumed = sqrl_server_context_import( central,
+        (uint8_t*)utstring_body( envelope ), utstring_len( envelope ));
+    if( !resumed ||
+        resumed->command != SQRL_CMD_QUERY ||
+        resumed->tif != ctx->tif ||
+        0 != memcmp( &resumed->nut, &ctx->nut, sizeof( Sqrl_Nut )) ||
+        0 != strcmp( resumed->client_strings[CLIENT_KV_IDK], ctx->client_strings[CLIENT_KV_IDK] )) {
+        printf( "Envelope import failed\n" );
+        exit(1);
+    }
+    sqrl_server_context_resume( resumed );
+    if( !resumed->reply ) {
+        printf( "Resumed context did not reply\n" );
+        exit(1);
+    }
+    resumed = sqrl_server_context_destroy( resumed );
+    utstring_body( envelope )[10] ^= 1;
+    if( sqrl_server_context_import( central,
+        (uint8_t*)utstring_body( envelope ), utstring_len( envelope ))) {
+        printf( "Tampered envelope accepted\n" );
+        exit(1);
+    }
+    // Nor may one be replayed once its nut has expired
+    ctx->nut.timestamp -= (uint64_t)61 * 1000000;
+    utstring_clear( envelope );
+    if( !sqrl_server_context_export( ctx, envelope ) ||
+        sqrl_server_context_import( central,
+            (uint8_t*)utstring_body( envelope ), utstring_len( envelope ))) {
+        printf( "Expired envelope accepted\n" );
+        exit(1);
+    }
+    utstring_free( envelope );
+    sqrl_server_context_destroy( ctx );
+    sqrl_server_destroy( edge );
+    sqrl_server_destroy( central );
+
+    // Admission queue: fresh requests are served, stale ones are turned away
+    Sqrl_Server *queued = sqrl_server_create(
+        "sqrl://sqrlid.com/auth.php?nut=_LIBSQRL_NUT_",
+        "I am SQRLid!", 12,
+        NULL, onSend, 1 );
+    Sqrl_Server_Queue *queue = sqrl_server_queue_create( queued, 16, 2 );
+    // This server's nuts live for a second
+    lnk = sqrl_server_create_link( queued, QUEUE_CLIENT_IP );
+    build_query( str, lnk, "query", pk, sk );
+    free( lnk );
+    sqrl_sleep( 1100 );
+    sqrl_server_queue_submit( queue, sqrl_server_context_create( queued ), QUEUE_CLIENT_IP, utstring_body( str ), utstring_len( str ));
+    for( i = 0; i < 4; i++ ) {
+        lnk = sqrl_server_create_link( queued, 0 );
+        build_query( str, lnk, i % 2 ? "ident" : "query", pk, sk );
+        free( lnk );
+        if( !sqrl_server_queue_submit( queue, sqrl_server_context_create( queued ), 0, utstring_body( str ), utstring_len( str ))) {
+            printf( "Queue refused a fresh request\n" );
+            exit(1);
+        }
+    }
+    queue = sqrl_server_queue_destroy( queue );
+    if( replies != 5 || transient != 1 || transientIpKept != 1 ) {
+        printf( "Queue: %d replies, %d transient errors, %d kept the IP\n", replies, transient, transientIpKept );
+        exit(1);
+    }
+    sqrl_server_destroy( queued );
 
     sqrl_server_destroy( server );
     exit( sqrl_stop() );
@@ -0,0 +1,97 @@
+/* store_test.c
+
+@author Adam Comley
+
+This file is part of libsqrl.  It is released under the MIT license.
+For more details, see the LICENSE file included with this package.
+**/
+
+#include "../sqrl_internal.h"
+
+#define THREADS 8
+#define USERS 200
+
+char address[64];
+int failures = 0;
+
+SQRL_THREAD_FUNCTION_RETURN_TYPE serve( SQRL_THREAD_FUNCTION_INPUT_TYPE input )
+{
+    sqrl_server_store_serve( address, NULL );
+    return NULL;
+}
+
+SQRL_THREAD_FUNCTION_RETURN_TYPE lookup( SQRL_THREAD_FUNCTION_INPUT_TYPE input )
+{
+    int t = (int)(intptr_t)input;
+    char idk[32], expected[32], blob[512];
+    int i;
+    for( i = 0; i < USERS; i++ ) {
+        sprintf( idk, "idk%d", (i + t) % USERS );
+        sprintf( expected, "blob%d", (i + t) % USERS );
+        if( !sqrl_scb_user_remote( SQRL_SCB_USER_FIND, "sqrlid.com", idk, NULL, blob ) ||
+            0 != strcmp( blob, expected )) {
+            SQRL_ATOMIC_INC( &failures );
+        }
+        if( sqrl_scb_user_remote( SQRL_SCB_USER_FIND, "sqrlid.com", "missing", NULL, blob )) {
+            SQRL_ATOMIC_INC( &failures );
+        }
+    }
+    return NULL;
+}
+
+int main()
+{
+    char idk[32], blob[512];
+    int i;
+
+    sqrl_init();
+    sprintf( address, "unix:/tmp/sqrl_store_test_%d.sock", (int)getpid() );
+    SqrlThread server = sqrl_thread_create( serve, NULL );
+
+    for( i = 0; i < 100 && !sqrl_server_store_connect( address, 2 ); i++ ) {
+        sqrl_sleep( 10 );
+    }
+    if( i == 100 ) {
+        printf( "Failed to connect to %s\n", address );
+        exit(1);
+    }
+
+    for( i = 0; i < USERS; i++ ) {
+        sprintf( idk, "idk%d", i );
+        sprintf( blob, "blob%d", i );
+        if( !sqrl_scb_user_remote( SQRL_SCB_USER_CREATE, "sqrlid.com", idk, NULL, blob )) {
+            printf( "Create failed: %s\n", idk );
+            exit(1);
+        }
+    }
+
+    SqrlThread threads[THREADS];
+    for( i = 0; i < THREADS; i++ ) {
+        threads[i] = sqrl_thread_create( lookup, (void*)(intptr_t)i );
+    }
+    for( i = 0; i < THREADS; i++ ) {
+        sqrl_thread_join( threads[i] );
+    }
+    if( failures ) {
+        printf( "%d lookups failed\n", failures );
+        exit(1);
+    }
+
+    if( !sqrl_scb_user_remote( SQRL_SCB_USER_UPDATE, "sqrlid.com", "idk7", NULL, "updated" ) ||
+        !sqrl_scb_user_remote( SQRL_SCB_USER_FIND, "sqrlid.com", "idk7", NULL, blob ) ||
+        0 != strcmp( blob, "updated" )) {
+        printf( "Update failed\n" );
+        exit(1);
+    }
+    if( !sqrl_scb_user_remote( SQRL_SCB_USER_DELETE, "sqrlid.com", "idk7", NULL, NULL ) ||
+        sqrl_scb_user_remote( SQRL_SCB_USER_FIND, "sqrlid.com", "idk7", NULL, blob )) {
+        printf( "Delete failed\n" );
+        exit(1);
+    }
+
+    sqrl_server_store_disconnect();
+    sqrl_server_store_stop();
+    sqrl_thread_join( server );
+    printf( "Remote store: %d users, %d threads OK\n", USERS, THREADS );
+    exit( sqrl_stop() );
+}
@@ -17,6 +17,7 @@ static int assertions_passed = 0;
 char myPassword[] = "the password";
 size_t myPasswordLength = 12;
 char myRescueCode[SQRL_RESCUE_CODE_LENGTH+1];
+char myNewPassword[] = "the new password";
 
 #define ASSERT(m,a) if((a)) { assertions_passed++; printf( "  PASS: %s\n", m); } else { printf( "  FAIL: %s\n", m ); goto ERROR; }
 
@@ -37,6 +38,11 @@ bool onAuthenticationRequired(
 		cred = malloc( SQRL_RESCUE_CODE_LENGTH + 1 );
 		strcpy( cred, myRescueCode );
 		break;
+	case SQRL_CREDENTIAL_NEW_PASSWORD:
+		printf( "   REQ: New Password\n" );
+		cred = malloc( strlen( myNewPassword ) + 1 );
+		strcpy( cred, myNewPassword );
+		break;
 	case SQRL_CREDENTIAL_HINT:
 		printf( "   REQ: Hint\n" );
 		len = sqrl_user_get_hint_length( sqrl_transaction_user( transaction ));
@@ -71,8 +77,10 @@ char transactionType[14][10] = {
 };
 bool showingProgress = false;
 int nextProgress = 0;
+int enscryptsFinished = 0;
 int onProgress( Sqrl_Transaction transaction, int p )
 {
+	if( p >= 100 ) SQRL_ATOMIC_INC( &enscryptsFinished );
 	if( !showingProgress ) {
 		// Transaction type
 		showingProgress = true;
@@ -95,10 +103,43 @@ int onProgress( Sqrl_Transaction transaction, int p )
 
 }
 
+// Cancels an EnScrypt once it has been called *data times
+int stopAfter( int p, void *data )
+{
+	int *left = (int*)data;
+	return --(*left) > 0;
+}
+
+// The new password's background EnScrypt must match a fresh one
+int saveSuggestions = 0;
+bool newPasswordStretched = false;
+void onSaveSuggested( Sqrl_User u )
+{
+	uint8_t salt[16], key[SQRL_KEY_SIZE], check[SQRL_KEY_SIZE];
+	uint32_t count = 0;
+	saveSuggestions++;
+	newPasswordStretched = sqrl_user_is_hintlocked( u ) == false &&
+		sqrl_user_kdf_take( u, SQRL_BLOCK_USER, myNewPassword, strlen( myNewPassword ),
+			sqrl_user_get_enscrypt_seconds( u ) * SQRL_MILLIS_PER_SECOND, salt, key, &count ) &&
+		count > 0 &&
+		sqrl_enscrypt( check, myNewPassword, strlen( myNewPassword ), salt, 16, SQRL_DEFAULT_N_FACTOR, count, NULL, NULL ) > 0 &&
+		0 == sodium_memcmp( key, check, SQRL_KEY_SIZE );
+}
+
 void printKV( char *key, char *value ) {
 	printf( "%6s: %s\n", key, value );
 }
 
+Sqrl_Transaction unlockTransactions[2];
+uint8_t *unlockKeys[2];
+
+SQRL_THREAD_FUNCTION_RETURN_TYPE unlockThread( SQRL_THREAD_FUNCTION_INPUT_TYPE input )
+{
+	int i = (int)(intptr_t)input;
+	unlockKeys[i] = sqrl_user_key( unlockTransactions[i], KEY_MK );
+	SQRL_THREAD_LEAVE;
+}
+
 int main() 
 {
 	bool bError = false;
@@ -112,6 +153,7 @@ int main()
 	memset( &cbs, 0, sizeof( Sqrl_Client_Callbacks ));
 	cbs.onAuthenticationRequired = onAuthenticationRequired;
 	cbs.onProgress = onProgress;
+	cbs.onSaveSuggested = onSaveSuggested;
 	sqrl_client_set_callbacks( &cbs );
 
 	Sqrl_User user = sqrl_user_create();
@@ -160,6 +202,44 @@ int main()
 	strcpy( myRescueCode, rc );
 	printKV( "RC", str );
 
+	// Rekeying started the rescue code's EnScrypt; it must match a fresh one
+	uint8_t rescueSalt[16], rescueKey[SQRL_KEY_SIZE], rescueCheck[SQRL_KEY_SIZE];
+	uint32_t rescueCount = 0;
+	int rescueMillis = SQRL_RESCUE_ENSCRYPT_SECONDS * SQRL_MILLIS_PER_SECOND;
+	ASSERT( "rescue_1", sqrl_user_kdf_pending( user, SQRL_BLOCK_RESCUE ) &&
+		sqrl_user_kdf_take( user, SQRL_BLOCK_RESCUE, rc, SQRL_RESCUE_CODE_LENGTH, rescueMillis, rescueSalt, rescueKey, &rescueCount ))
+	sqrl_enscrypt( rescueCheck, rc, SQRL_RESCUE_CODE_LENGTH, rescueSalt, 16, SQRL_DEFAULT_N_FACTOR, rescueCount, NULL, NULL );
+	ASSERT( "rescue_2", rescueCount > 0 && 0 == memcmp( rescueKey, rescueCheck, SQRL_KEY_SIZE ))
+	ASSERT( "rescue_3", !sqrl_user_kdf_pending( user, SQRL_BLOCK_RESCUE ) &&
+		!sqrl_user_kdf_take( user, SQRL_BLOCK_RESCUE, rc, SQRL_RESCUE_CODE_LENGTH, rescueMillis, rescueSalt, rescueKey, &rescueCount ))
+	sqrl_user_kdf_start( user, SQRL_BLOCK_RESCUE, rc, SQRL_RESCUE_CODE_LENGTH, rescueMillis );
+	sqrl_user_kdf_start( user, SQRL_BLOCK_USER, myPassword, myPasswordLength, 1000 );
+	sqrl_user_kdf_discard( user, 0 );
+	ASSERT( "rescue_4", !sqrl_user_kdf_pending( user, SQRL_BLOCK_RESCUE ) && !sqrl_user_kdf_pending( user, SQRL_BLOCK_USER ))
+
+	// A cancelled rescue EnScrypt survives being sealed and restored
+	uint8_t localKey[SQRL_LOCAL_KEY_LENGTH] = {7}, checkpoint[SQRL_CHECKPOINT_LENGTH];
+	int stop = 3;
+	struct Sqrl_Enscrypt_State *state = sqrl_user_checkpoint_take( user );
+	sqrl_enscrypt_resume( state, rescueKey, rc, SQRL_RESCUE_CODE_LENGTH, rescueSalt, 16,
+		SQRL_DEFAULT_N_FACTOR, SQRL_ITERATIONS, 5, stopAfter, &stop );
+	sqrl_user_checkpoint_put( user, state );
+	ASSERT( "checkpoint_1", sqrl_user_get_checkpoint( user, localKey, checkpoint ))
+	sqrl_user_checkpoint_discard( user );
+	localKey[0] = 8;
+	ASSERT( "checkpoint_2", !sqrl_user_get_checkpoint( user, localKey, checkpoint ) &&
+		!sqrl_user_set_checkpoint( user, localKey, checkpoint ))
+	localKey[0] = 7;
+	ASSERT( "checkpoint_3", sqrl_user_set_checkpoint( user, localKey, checkpoint ))
+	state = sqrl_user_checkpoint_take( user );
+	int resumedAt = state ? (int)state->index : 0;
+	rescueCount = sqrl_enscrypt_resume( state, rescueKey, rc, SQRL_RESCUE_CODE_LENGTH, rescueSalt, 16,
+		SQRL_DEFAULT_N_FACTOR, SQRL_ITERATIONS, 5, NULL, NULL );
+	sqrl_user_checkpoint_put( user, state );
+	sqrl_user_checkpoint_discard( user );
+	sqrl_enscrypt( rescueCheck, rc, SQRL_RESCUE_CODE_LENGTH, rescueSalt, 16, SQRL_DEFAULT_N_FACTOR, 5, NULL, NULL );
+	ASSERT( "checkpoint_4", resumedAt == 3 && rescueCount == 5 && 0 == memcmp( rescueKey, rescueCheck, SQRL_KEY_SIZE ))
+
 	UT_string *ubuf;
 	utstring_new( ubuf );
 	WITH_USER(u,user);
@@ -182,14 +262,60 @@ int main()
 	key = sqrl_user_key( genericTransaction, KEY_MK );
 	ASSERT( "load_mk", 0 == sodium_memcmp( key, saved + (SQRL_KEY_SIZE * 6), SQRL_KEY_SIZE ));
 
+	sqrl_user_memlock( user );
+	ASSERT( "memlock_1", sqrl_user_is_memlocked( user ) && sqrl_user_get_edition( user ) == 4 )
+	struct Sqrl_User *session = sqrl_user_keys_open( user );
+	key = sqrl_user_key( genericTransaction, KEY_MK );
+	ASSERT( "memlock_2", !sqrl_user_is_memlocked( user ) && 0 == sodium_memcmp( key, saved + (SQRL_KEY_SIZE * 6), SQRL_KEY_SIZE ))
+	session = sqrl_user_keys_close( session );
+	ASSERT( "memlock_3", sqrl_user_is_memlocked( user ))
+	sqrl_user_memunlock( user );
+
+	Sqrl_Site_Keys siteKeys, cached;
+	char host[32];
+	randombytes_buf( &siteKeys, sizeof( Sqrl_Site_Keys ));
+	siteKeys.previous = 1;
+	siteKeys.hasPrevious = true;
+	sqrl_user_site_cache_put( user, "example.com", 11, 0, &siteKeys );
+	ASSERT( "site_cache_1", sqrl_user_site_cache_get( user, "example.com", 11, 0, &cached ) && 0 == memcmp( &cached, &siteKeys, sizeof( Sqrl_Site_Keys )))
+	ASSERT( "site_cache_2", !sqrl_user_site_cache_get( user, "example.com", 11, 1, &cached ) && !sqrl_user_site_cache_get( user, "example.org", 11, 0, &cached ))
+	sqrl_user_memlock( user );
+	ASSERT( "site_cache_3", sqrl_user_site_cache_get( user, "example.com", 11, 0, &cached ) && sqrl_user_is_memlocked( user ))
+	sqrl_user_memunlock( user );
+	// example.com was used last, so the next oldest entry is evicted
+	for( i = 0; i < USER_SITE_CACHE_SIZE; i++ ) {
+		snprintf( host, sizeof( host ), "%d.example.net", i );
+		sqrl_user_site_cache_put( user, host, strlen( host ), 0, &siteKeys );
+		if( i == 0 ) sqrl_user_site_cache_get( user, "example.com", 11, 0, &cached );
+	}
+	ASSERT( "site_cache_4", sqrl_user_site_cache_get( user, "example.com", 11, 0, &cached ) && !sqrl_user_site_cache_get( user, "0.example.net", 13, 0, &cached ))
+	sqrl_user_site_cache_flush( user );
+	ASSERT( "site_cache_5", !sqrl_user_site_cache_get( user, "example.com", 11, 0, &cached ))
+
 	ASSERT( "user_edition", sqrl_user_get_edition( user ) == 4 )
 
+	char uid[SQRL_UNIQUE_ID_LENGTH+1] = {0};
+	sqrl_user_unique_id( user, uid );
+	Sqrl_User found = sqrl_user_find( uid );
+	ASSERT( "user_find", found == user )
+	sqrl_user_release( found );
+	sqrl_user_set_tag( user, &bError );
+	found = sqrl_get_user_by_tag( &bError );
+	ASSERT( "user_by_tag", found == user )
+	sqrl_user_release( found );
+
 	ASSERT( "hintlock_1", !sqrl_user_is_hintlocked( user ) )
 	Sqrl_Transaction trans = sqrl_transaction_create( SQRL_TRANSACTION_IDENTITY_UNLOCK );
 	sqrl_transaction_set_user( trans, user );
 	sqrl_user_hintunlock( trans, NULL, 0 );
 	ASSERT( "hintlock_2", !sqrl_user_is_hintlocked( user ) )
+	ASSERT( "user_transactions_1", sqrl_transactions_with_user( user ) == 2 )
 	sqrl_transaction_release( trans );
+	ASSERT( "user_transactions_2", sqrl_transactions_with_user( user ) == 1 )
+	ASSERT( "stale_handle_1", sqrl_transaction_hold( trans ) == NULL )
+	Sqrl_Transaction reused = sqrl_transaction_create( SQRL_TRANSACTION_IDENTITY_UNLOCK );
+	ASSERT( "stale_handle_2", reused != trans && sqrl_transaction_type( trans ) == SQRL_TRANSACTION_UNKNOWN )
+	sqrl_transaction_release( reused );
 
 	key = sqrl_user_key( genericTransaction, KEY_ILK );
 	ASSERT( "load_ilk", 0 == sodium_memcmp( key, saved + (SQRL_KEY_SIZE * 5), SQRL_KEY_SIZE ));
@@ -206,6 +332,21 @@ int main()
 	user = sqrl_user_create_from_buffer( buf, strlen( buf ));
 	sqrl_transaction_set_user( genericTransaction, user );
 
+	// Two transactions needing the MK at once share one decrypt
+	SqrlThread unlockThreads[2];
+	enscryptsFinished = 0;
+	for( i = 0; i < 2; i++ ) {
+		unlockTransactions[i] = sqrl_transaction_create( SQRL_TRANSACTION_UNKNOWN );
+		sqrl_transaction_set_user( unlockTransactions[i], user );
+		unlockThreads[i] = sqrl_thread_create( unlockThread, (SQRL_THREAD_FUNCTION_INPUT_TYPE)(intptr_t)i );
+	}
+	for( i = 0; i < 2; i++ ) {
+		sqrl_thread_join( unlockThreads[i] );
+		sqrl_transaction_release( unlockTransactions[i] );
+	}
+	ASSERT( "unlock_once", enscryptsFinished == 1 && unlockKeys[0] && unlockKeys[0] == unlockKeys[1] &&
+		0 == sodium_memcmp( unlockKeys[0], saved + (SQRL_KEY_SIZE * 6), SQRL_KEY_SIZE ))
+
 	sPointer = loaded;
 	int keys[] = { KEY_PIUK3, KEY_PIUK2, KEY_PIUK1, KEY_PIUK0, KEY_IUK, KEY_ILK, KEY_MK };
 	for( i = 0; i < 7; i++ ) {
@@ -215,6 +356,122 @@ int main()
 	}
 	ASSERT( "load_rc", 0 == sodium_memcmp( loaded, saved, SQRL_KEY_SIZE * 7 ));
 
+	// With two CPUs, blocks 1 and 2 are saved side by side
+	sqrl_user_set_rescue_code( user, myRescueCode );
+	WITH_USER(pu,user);
+	pu->flags |= (USER_FLAG_T1_CHANGED | USER_FLAG_T2_CHANGED);
+	sqrl_cpu_count_force( 2 );
+	transaction = sqrl_transaction_create( SQRL_TRANSACTION_IDENTITY_SAVE );
+	sqrl_transaction_set_user( transaction, user );
+	sqrl_user_update_storage( transaction );
+	sqrl_cpu_count_force( 0 );
+	utstring_new( ubuf );
+	sqrl_storage_save_to_buffer( pu->storage, ubuf, SQRL_EXPORT_ALL, SQRL_ENCODING_BASE64 );
+	sqrl_transaction_release( transaction );
+	END_WITH_USER(pu);
+	ASSERT( "parallel_save_1", utstring_len( ubuf ) == strlen( buf ) && strcmp( utstring_body( ubuf ), buf ) != 0 )
+	sqrl_user_release( user );
+	user = sqrl_user_create_from_buffer( utstring_body( ubuf ), utstring_len( ubuf ));
+	utstring_free( ubuf );
+	sqrl_transaction_set_user( genericTransaction, user );
+	key = sqrl_user_key( genericTransaction, KEY_MK );
+	ASSERT( "parallel_save_2", key && 0 == sodium_memcmp( key, saved + (SQRL_KEY_SIZE * 6), SQRL_KEY_SIZE ))
+	key = sqrl_user_key( genericTransaction, KEY_IUK );
+	ASSERT( "parallel_save_3", key && 0 == sodium_memcmp( key, saved + (SQRL_KEY_SIZE * 4), SQRL_KEY_SIZE ))
+
+	// A finished background EnScrypt goes into block 2 instead of a new chain
+	sqrl_user_set_rescue_code( user, myRescueCode );
+	sqrl_user_kdf_start( user, SQRL_BLOCK_RESCUE, myRescueCode, SQRL_RESCUE_CODE_LENGTH, rescueMillis );
+	sqrl_sleep( rescueMillis + 1000 );
+	WITH_USER(ku,user);
+	ku->flags |= USER_FLAG_T2_CHANGED;
+	transaction = sqrl_transaction_create( SQRL_TRANSACTION_IDENTITY_SAVE );
+	sqrl_transaction_set_user( transaction, user );
+	double saveTime = sqrl_get_real_time();
+	sqrl_user_update_storage( transaction );
+	saveTime = sqrl_get_real_time() - saveTime;
+	utstring_new( ubuf );
+	sqrl_storage_save_to_buffer( ku->storage, ubuf, SQRL_EXPORT_ALL, SQRL_ENCODING_BASE64 );
+	sqrl_transaction_release( transaction );
+	END_WITH_USER(ku);
+	ASSERT( "kdf_used_1", !sqrl_user_kdf_pending( user, SQRL_BLOCK_RESCUE ) &&
+		saveTime < SQRL_RESCUE_ENSCRYPT_SECONDS / 2.0 )
+	sqrl_user_release( user );
+	user = sqrl_user_create_from_buffer( utstring_body( ubuf ), utstring_len( ubuf ));
+	utstring_free( ubuf );
+	sqrl_transaction_set_user( genericTransaction, user );
+	key = sqrl_user_key( genericTransaction, KEY_IUK );
+	ASSERT( "kdf_used_2", key && 0 == sodium_memcmp( key, saved + (SQRL_KEY_SIZE * 4), SQRL_KEY_SIZE ))
+
+	// With two CPUs, the new password is stretched during the old one's decrypt
+	sqrl_user_release( user );
+	user = sqrl_user_create_from_buffer( buf, strlen( buf ));
+	sqrl_cpu_count_force( 2 );
+	ASSERT( "change_password_1", SQRL_TRANSACTION_STATUS_SUCCESS ==
+		sqrl_client_begin_transaction( SQRL_TRANSACTION_IDENTITY_CHANGE_PASSWORD, user, NULL, 0 ))
+	sqrl_cpu_count_force( 0 );
+	ASSERT( "change_password_2", saveSuggestions == 1 && newPasswordStretched )
+
+	// Keys speculated while a query is out match the ones derived inline
+	sqrl_user_release( user );
+	user = sqrl_user_create_from_buffer( buf, strlen( buf ));
+	Sqrl_Transaction queries[2];
+	Sqrl_Site *sites[2];
+	for( i = 0; i < 2; i++ ) {
+		queries[i] = sqrl_transaction_create( SQRL_TRANSACTION_AUTH_IDENT );
+		sqrl_transaction_set_user( queries[i], user );
+		sqrl_transaction_resolve( queries[i] )->uri = sqrl_uri_parse( "sqrl://example.com/sqrl?nut=speculate" );
+		sites[i] = sqrl_client_site_create( queries[i] );
+		sites[i]->currentTransaction = SQRL_TRANSACTION_AUTH_QUERY;
+	}
+	const char *siteHost = "example.com";
+	Sqrl_Site_Keys *specKeys = malloc( sizeof( Sqrl_Site_Keys ));
+	uint8_t mk[SQRL_KEY_SIZE], ilk[SQRL_KEY_SIZE], iuk[SQRL_KEY_SIZE], ursk[SQRL_KEY_SIZE], vuk[SQRL_KEY_SIZE];
+	memcpy( mk, sqrl_user_key( queries[0], KEY_MK ), SQRL_KEY_SIZE );
+	memcpy( ilk, sqrl_user_key( queries[0], KEY_ILK ), SQRL_KEY_SIZE );
+	memcpy( iuk, sqrl_user_key( queries[0], KEY_IUK ), SQRL_KEY_SIZE );
+	sqrl_site_speculate( sites[0] );
+	ASSERT( "speculate_single_cpu", !sqrl_site_speculation_keys( sites[0], siteHost, strlen( siteHost ), 1, mk, specKeys ))
+	sqrl_cpu_count_force( 2 );
+	sqrl_site_speculate( sites[0] );
+	ASSERT( "speculate_keys_1", sqrl_site_speculation_keys( sites[0], siteHost, strlen( siteHost ), 1, mk, specKeys ))
+	ASSERT( "speculate_unlock_1", sqrl_site_speculation_unlock( sites[0], ilk ))
+	sqrl_gen_ursk( ursk, sites[0]->keys[SITE_KEY_SUK], iuk );
+	sqrl_ed_public_key( vuk, ursk );
+	ASSERT( "speculate_unlock_2", 0 == memcmp( vuk, sites[0]->keys[SITE_KEY_VUK], SQRL_KEY_SIZE ))
+	sqrl_user_site_cache_flush( user );
+	sites[1]->previous_identity = 1;
+	ASSERT( "speculate_keys_2", sqrl_site_set_user_keys( sites[1] ) &&
+		specKeys->previous == sites[1]->previous_identity &&
+		0 == memcmp( specKeys->sec, sites[1]->keys[SITE_KEY_SEC], SQRL_KEY_SIZE ) &&
+		0 == memcmp( specKeys->sign.pub, sites[1]->keys[SITE_KEY_PUB], SQRL_KEY_SIZE ) &&
+		specKeys->hasPrevious == (sites[1]->keys[SITE_KEY_LOOKUP][SITE_KEY_PPUB] != 0) &&
+		(!specKeys->hasPrevious || 0 == memcmp( specKeys->psign.pub, sites[1]->keys[SITE_KEY_PPUB], SQRL_KEY_SIZE )))
+
+	// Speculation for another host, MK or ILK is passed over for the inline path
+	sqrl_site_speculate( sites[0] );
+	ASSERT( "speculate_mismatch_1", !sqrl_site_speculation_keys( sites[0], "example.org", 11, 1, mk, specKeys ))
+	mk[0] ^= 1;
+	ilk[0] ^= 1;
+	ASSERT( "speculate_mismatch_2", !sqrl_site_speculation_keys( sites[0], siteHost, strlen( siteHost ), 1, mk, specKeys ) &&
+		!sqrl_site_speculation_unlock( sites[0], ilk ))
+	sqrl_cpu_count_force( 0 );
+	sqrl_user_site_cache_flush( user );
+	sites[0]->previous_identity = 1;
+	memset( sites[0]->keys, 0, sizeof( sites[0]->keys ));
+	sqrl_site_create_unlock_keys( sites[0] );
+	sqrl_gen_ursk( ursk, sites[0]->keys[SITE_KEY_SUK], iuk );
+	sqrl_ed_public_key( vuk, ursk );
+	ASSERT( "speculate_fallback", sqrl_site_set_user_keys( sites[0] ) &&
+		0 == memcmp( sites[0]->keys[SITE_KEY_PUB], sites[1]->keys[SITE_KEY_PUB], SQRL_KEY_SIZE ) &&
+		0 == memcmp( sites[0]->keys[SITE_KEY_PPUB], sites[1]->keys[SITE_KEY_PPUB], SQRL_KEY_SIZE ) &&
+		0 == memcmp( vuk, sites[0]->keys[SITE_KEY_VUK], SQRL_KEY_SIZE ))
+	free( specKeys );
+	for( i = 0; i < 2; i++ ) {
+		sqrl_client_site_release( queries[i] );
+		sqrl_transaction_release( queries[i] );
+	}
+
 	char *start = buf;
 	char *line = buf;
 	char tmp[CHAR_PER_LINE + 1];
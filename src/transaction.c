@@ -9,107 +9,207 @@ For more details, see the LICENSE file included with this package.
 #include <stdio.h>
 #include "sqrl_internal.h"
 
-struct Sqrl_Transaction_List *SQRL_TRANSACTION_LIST = NULL;
+/*
+Transactions live in slabs of slots which are never returned to the system,
+so a stale handle always points at readable memory.  A handle encodes a
+slot's index and its generation, which changes each time the slot is freed:
 
-Sqrl_Transaction sqrl_transaction_create( Sqrl_Transaction_Type type )
+    [ generation | index (16 bits) | 1 ]
+
+Handles are odd.  Library code also passes raw (even) struct pointers,
+which are trusted, since internal callers always hold a reference.
+
+The index is 16 bits, so at most 65536 transactions can be live at once;
+past that, sqrl_transaction_create() returns NULL.
+
+Each user counts the live transactions pointing at it, so checking for
+them doesn't mean looking through the table.
+*/
+#define SQRL_TRANSACTION_SLAB_BITS  8
+#define SQRL_TRANSACTION_SLAB_SIZE  (1 << SQRL_TRANSACTION_SLAB_BITS)
+#define SQRL_TRANSACTION_INDEX_BITS 16
+#define SQRL_TRANSACTION_MAX_SLABS  (1 << (SQRL_TRANSACTION_INDEX_BITS - SQRL_TRANSACTION_SLAB_BITS))
+
+static struct Sqrl_Transaction *sqrl_transaction_slabs[SQRL_TRANSACTION_MAX_SLABS];
+static int sqrl_transaction_slab_count = 0;
+static struct Sqrl_Transaction *sqrl_transaction_free = NULL;
+static int sqrl_transaction_live = 0;
+
+static Sqrl_Transaction sqrl_transaction_make_handle( struct Sqrl_Transaction *transaction )
 {
-    struct Sqrl_Transaction *transaction = calloc( 1, sizeof( struct Sqrl_Transaction ));
-    struct Sqrl_Transaction_List *list = calloc( 1, sizeof( struct Sqrl_Transaction_List ));
-    transaction->type = type;
-    transaction->referenceCount = 1;
-    transaction->mutex = sqrl_mutex_create();
-    list->transaction = transaction;
+    uintptr_t h = (uintptr_t)transaction->generation;
+    h = (h << SQRL_TRANSACTION_INDEX_BITS) | transaction->index;
+    return (Sqrl_Transaction)((h << 1) | 1);
+}
+
+// Takes a slot from the pool, adding a slab if needed.
+static struct Sqrl_Transaction *sqrl_transaction_alloc()
+{
+    struct Sqrl_Transaction *transaction = NULL;
     sqrl_mutex_enter( SQRL_GLOBAL_MUTICES.transaction );
-    list->next = SQRL_TRANSACTION_LIST;
-    SQRL_TRANSACTION_LIST = list;
+    if( !sqrl_transaction_free && sqrl_transaction_slab_count < SQRL_TRANSACTION_MAX_SLABS ) {
+        struct Sqrl_Transaction *slab = calloc( SQRL_TRANSACTION_SLAB_SIZE, sizeof( struct Sqrl_Transaction ));
+        if( slab ) {
+            int i;
+            uint32_t base = (uint32_t)sqrl_transaction_slab_count << SQRL_TRANSACTION_SLAB_BITS;
+            for( i = SQRL_TRANSACTION_SLAB_SIZE - 1; i >= 0; i-- ) {
+                slab[i].index = base + i;
+                slab[i].nextFree = sqrl_transaction_free;
+                sqrl_transaction_free = &slab[i];
+            }
+            SQRL_ATOMIC_STORE_PTR( &sqrl_transaction_slabs[sqrl_transaction_slab_count], slab );
+            sqrl_transaction_slab_count++;
+        }
+    }
+    if( sqrl_transaction_free ) {
+        transaction = sqrl_transaction_free;
+        sqrl_transaction_free = transaction->nextFree;
+        transaction->nextFree = NULL;
+        sqrl_transaction_live++;
+    }
     sqrl_mutex_leave( SQRL_GLOBAL_MUTICES.transaction );
-    return (Sqrl_Transaction)transaction;
+    return transaction;
 }
 
-int sqrl_transaction_count()
+// Returns a slot to the pool.  Outstanding handles to it become invalid.
+static void sqrl_transaction_free_slot( struct Sqrl_Transaction *transaction )
 {
     sqrl_mutex_enter( SQRL_GLOBAL_MUTICES.transaction );
-    int i = 0;
-    struct Sqrl_Transaction_List *list = SQRL_TRANSACTION_LIST;
-    while( list ) {
-        i++;
-        list = list->next;
-    }
+    SQRL_ATOMIC_STORE_PTR( &transaction->handle, NULL );
+    transaction->generation++;
+    transaction->nextFree = sqrl_transaction_free;
+    sqrl_transaction_free = transaction;
+    sqrl_transaction_live--;
     sqrl_mutex_leave( SQRL_GLOBAL_MUTICES.transaction );
-    return i;
+}
+
+Sqrl_Transaction sqrl_transaction_create( Sqrl_Transaction_Type type )
+{
+    struct Sqrl_Transaction *transaction = sqrl_transaction_alloc();
+    if( !transaction ) return NULL;
+    transaction->type = type;
+    transaction->user = NULL;
+    transaction->uri = NULL;
+    transaction->string = NULL;
+    transaction->string_len = 0;
+    transaction->status = SQRL_TRANSACTION_STATUS_WORKING;
+    transaction->altIdentity = NULL;
+    transaction->exportType = 0;
+    transaction->encodingType = 0;
+    transaction->data = NULL;
+    transaction->tag = NULL;
+    SQRL_ATOMIC_STORE( &transaction->cancelled, 0 );
+    SQRL_ATOMIC_STORE( &transaction->referenceCount, 1 );
+    Sqrl_Transaction handle = sqrl_transaction_make_handle( transaction );
+    SQRL_ATOMIC_STORE_PTR( &transaction->handle, handle );
+    return handle;
+}
+
+int sqrl_transaction_count()
+{
+    return SQRL_ATOMIC_LOAD( &sqrl_transaction_live );
+}
+
+/**
+Finds the transaction a handle refers to, without holding it.
+
+@param t A \p Sqrl_Transaction handle, or an internal transaction pointer
+@return The transaction, or NULL if \p t has been released
+*/
+struct Sqrl_Transaction *sqrl_transaction_resolve( Sqrl_Transaction t )
+{
+    uintptr_t h = (uintptr_t)t;
+    if( !(h & 1) ) return (struct Sqrl_Transaction*)t;
+    uint32_t index = (uint32_t)(h >> 1) & ((1 << SQRL_TRANSACTION_INDEX_BITS) - 1);
+    struct Sqrl_Transaction *slab = SQRL_ATOMIC_LOAD_PTR( &sqrl_transaction_slabs[index >> SQRL_TRANSACTION_SLAB_BITS] );
+    if( !slab ) return NULL;
+    struct Sqrl_Transaction *transaction = &slab[index & (SQRL_TRANSACTION_SLAB_SIZE - 1)];
+    if( SQRL_ATOMIC_LOAD_PTR( &transaction->handle ) != t ) return NULL;
+    return transaction;
+}
+
+/**
+Gets the handle for a transaction, as given to the application.
+
+@param t A \p Sqrl_Transaction handle, or an internal transaction pointer
+@return The \p Sqrl_Transaction handle
+*/
+Sqrl_Transaction sqrl_transaction_handle( Sqrl_Transaction t )
+{
+    if( !t || ((uintptr_t)t & 1) ) return t;
+    return SQRL_ATOMIC_LOAD_PTR( &((struct Sqrl_Transaction*)t)->handle );
 }
 
 Sqrl_Transaction sqrl_transaction_hold( Sqrl_Transaction t )
 {
-    SQRL_CAST_TRANSACTION(transaction,t);
+    struct Sqrl_Transaction *transaction = sqrl_transaction_resolve( t );
     if( !transaction ) return NULL;
-    struct Sqrl_Transaction_List *l;
-    sqrl_mutex_enter( SQRL_GLOBAL_MUTICES.transaction );
-    l = SQRL_TRANSACTION_LIST;
-    while( l ) {
-        if( l->transaction == transaction ) {
-            sqrl_mutex_enter( transaction->mutex );
-            transaction->referenceCount++;
+    int refs;
+    do {
+        refs = SQRL_ATOMIC_LOAD( &transaction->referenceCount );
+        if( refs < 1 ) return NULL;
+    } while( !SQRL_ATOMIC_CAS( &transaction->referenceCount, refs, refs + 1 ));
 #if DEBUG_PRINT_TRANSACTION_COUNT==1
-			printf( "sqrl_transaction_hold: %d\n", transaction->referenceCount );
+    printf( "sqrl_transaction_hold: %d\n", refs + 1 );
 #endif
-            sqrl_mutex_leave( transaction->mutex );
-            break;
-        }
-        l = l->next;
+    if( ((uintptr_t)t & 1) && SQRL_ATOMIC_LOAD_PTR( &transaction->handle ) != t ) {
+        // The slot was recycled between the lookup and the hold
+        sqrl_transaction_release( transaction );
+        return NULL;
     }
-    sqrl_mutex_leave( SQRL_GLOBAL_MUTICES.transaction );
     return (Sqrl_Transaction)transaction;
 }
 
 Sqrl_Transaction sqrl_transaction_release( Sqrl_Transaction t )
 {
-    SQRL_CAST_TRANSACTION(transaction,t);
+    struct Sqrl_Transaction *transaction = sqrl_transaction_resolve( t );
     if( transaction == NULL ) return NULL;
-    struct Sqrl_Transaction *freeMe = NULL;
-    struct Sqrl_Transaction_List *l = NULL, *n = NULL;
-    sqrl_mutex_enter( SQRL_GLOBAL_MUTICES.transaction );
-    n = SQRL_TRANSACTION_LIST;
-    while( n ) {
-        if( n->transaction == transaction ) {
-            sqrl_mutex_enter( transaction->mutex );
-            transaction->referenceCount--;
+    int refs = SQRL_ATOMIC_DEC( &transaction->referenceCount );
 #if DEBUG_PRINT_TRANSACTION_COUNT==1
-			printf( "sqrl_transaction_release: %d\n", transaction->referenceCount );
+    printf( "sqrl_transaction_release: %d\n", refs );
 #endif
-            if( transaction->referenceCount < 1 ) {
-                if( l ) l->next = n->next;
-                else SQRL_TRANSACTION_LIST = n->next;
-                free( n );
-                freeMe = transaction;
-            }
-            sqrl_mutex_leave( transaction->mutex );
-            break;
-        }
-        l = n;
-        n = l->next;
-    }
-    sqrl_mutex_leave( SQRL_GLOBAL_MUTICES.transaction );
-    if( freeMe ) {
-        freeMe->user = sqrl_user_release( freeMe->user );
-        freeMe->uri = sqrl_uri_free( freeMe->uri );
-        if( freeMe->string ) free( freeMe->string );
-        if( freeMe->altIdentity ) free( freeMe->altIdentity );
+    if( refs == 0 ) {
+        // Return the slot before releasing the user, so that a hintlock
+        // from sqrl_user_release() doesn't count this transaction
+        Sqrl_User user = transaction->user;
+        Sqrl_Uri *uri = transaction->uri;
+        char *string = transaction->string;
+        char *altIdentity = transaction->altIdentity;
+        sqrl_transaction_swap_user( transaction, NULL );
+        transaction->uri = NULL;
+        transaction->string = NULL;
+        transaction->altIdentity = NULL;
         // free ->data
-        sqrl_mutex_destroy( freeMe->mutex );
-        free( freeMe );
+        sqrl_transaction_free_slot( transaction );
+        sqrl_user_release( user );
+        sqrl_uri_free( uri );
+        if( string ) free( string );
+        if( altIdentity ) free( altIdentity );
     }
     return NULL;
 }
 
 int sqrl_transactions_with_user( Sqrl_User u ) {
-	int retval = 0;
-	struct Sqrl_Transaction_List *l = SQRL_TRANSACTION_LIST;
-	while( l ) {
-		if( l->transaction->user == u ) retval++;
-		l = l->next;
-	}
-	return retval;
+	SQRL_CAST_USER(user,u);
+	if( !user ) return 0;
+	return SQRL_ATOMIC_LOAD( &user->transactionCount );
+}
+
+/**
+Points a transaction at a user, keeping both users' transaction counts.
+References are left to the caller.
+
+@param transaction The transaction
+@param u The new \p Sqrl_User, or NULL
+*/
+void sqrl_transaction_swap_user( struct Sqrl_Transaction *transaction, Sqrl_User u )
+{
+	SQRL_CAST_USER(ou,transaction->user);
+	SQRL_CAST_USER(nu,u);
+	if( ou == nu ) return;
+	if( nu ) SQRL_ATOMIC_INC( &nu->transactionCount );
+	transaction->user = u;
+	if( ou ) SQRL_ATOMIC_DEC( &ou->transactionCount );
 }
 
 void sqrl_transaction_set_user( Sqrl_Transaction t, Sqrl_User u )
@@ -121,7 +221,7 @@ void sqrl_transaction_set_user( Sqrl_Transaction t, Sqrl_User u )
     }
     if( transaction->user != u ) {
 		Sqrl_User ou = transaction->user;
-		transaction->user = sqrl_user_hold( u );
+		sqrl_transaction_swap_user( transaction, sqrl_user_hold( u ));
 		if( ou ) {
 			sqrl_user_release( ou );
 		}
@@ -197,6 +297,7 @@ DLL_PUBLIC
 size_t sqrl_transaction_string( Sqrl_Transaction t, char *buf, size_t *len )
 {
     WITH_TRANSACTION(transaction,t);
+    if( !transaction ) return 0;
     size_t retVal = transaction->string_len;
     if( transaction->string ) {
         if( buf && len && *len ) {
@@ -9,7 +9,144 @@ For more details, see the LICENSE file included with this package.
 #include <stdio.h>
 #include "sqrl_internal.h"
 
-struct Sqrl_User_List *SQRL_USER_LIST;
+/*
+Users are indexed three ways: by handle (so a Sqrl_User can be validated
+before it is touched), by unique id and by tag.  Each index is a chained
+hash table linked through the Sqrl_User itself.  Buckets share a set of
+striped locks, so holds on unrelated users rarely contend; the reference
+count itself is atomic.
+
+A hold still takes its bucket's lock.  A Sqrl_User is a raw pointer to
+memory that is freed with the user, so it can't be touched until it has
+been found in the handle index.  Holding without a lock would need
+generational handles into memory that is never freed, as transactions
+have.
+*/
+#define SQRL_USER_INDEX_BUCKETS 4096
+#define USER_INDEX_HANDLE 0
+#define USER_INDEX_ID     1
+#define USER_INDEX_TAG    2
+
+static struct Sqrl_User *sqrl_user_index[USER_INDEX_COUNT][SQRL_USER_INDEX_BUCKETS];
+static int sqrl_user_live = 0;
+
+static uint32_t sqrl_user_hash_ptr( const void *p )
+{
+	uint64_t h = (uint64_t)(uintptr_t)p;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return (uint32_t)h & (SQRL_USER_INDEX_BUCKETS - 1);
+}
+
+static uint32_t sqrl_user_hash_id( const char *unique_id )
+{
+	uint32_t h = 2166136261u;
+	if( unique_id ) {
+		while( *unique_id ) {
+			h ^= (uint8_t)*unique_id++;
+			h *= 16777619u;
+		}
+	}
+	return h & (SQRL_USER_INDEX_BUCKETS - 1);
+}
+
+static uint32_t sqrl_user_bucket( int index, struct Sqrl_User *user )
+{
+	switch( index ) {
+	case USER_INDEX_HANDLE:
+		return sqrl_user_hash_ptr( user );
+	case USER_INDEX_ID:
+		return sqrl_user_hash_id( user->unique_id );
+	default:
+		return sqrl_user_hash_ptr( user->tag );
+	}
+}
+
+#define USER_INDEX_STRIPE(bucket) SQRL_GLOBAL_MUTICES.user[(bucket) & (SQRL_USER_INDEX_STRIPES - 1)]
+#define USER_UNLOCK_STRIPE(bucket) SQRL_GLOBAL_MUTICES.unlock[(bucket) & (SQRL_USER_INDEX_STRIPES - 1)]
+
+static void sqrl_user_index_add( int index, struct Sqrl_User *user )
+{
+	uint32_t bucket = sqrl_user_bucket( index, user );
+	sqrl_mutex_enter( USER_INDEX_STRIPE( bucket ));
+	user->indexNext[index] = sqrl_user_index[index][bucket];
+	sqrl_user_index[index][bucket] = user;
+	sqrl_mutex_leave( USER_INDEX_STRIPE( bucket ));
+}
+
+static void sqrl_user_index_remove( int index, struct Sqrl_User *user )
+{
+	uint32_t bucket = sqrl_user_bucket( index, user );
+	sqrl_mutex_enter( USER_INDEX_STRIPE( bucket ));
+	struct Sqrl_User **pp = &sqrl_user_index[index][bucket];
+	while( *pp ) {
+		if( *pp == user ) {
+			*pp = user->indexNext[index];
+			break;
+		}
+		pp = &(*pp)->indexNext[index];
+	}
+	user->indexNext[index] = NULL;
+	sqrl_mutex_leave( USER_INDEX_STRIPE( bucket ));
+}
+
+// Adds a reference unless the user is already being freed.
+static bool sqrl_user_try_hold( struct Sqrl_User *user )
+{
+	int refs;
+	do {
+		refs = SQRL_ATOMIC_LOAD( &user->referenceCount );
+		if( refs < 1 ) return false;
+	} while( !SQRL_ATOMIC_CAS( &user->referenceCount, refs, refs + 1 ));
+#if DEBUG_PRINT_USER_COUNT==1
+	printf( "sqrl_user_hold: %d\n", refs + 1 );
+#endif
+	return true;
+}
+
+// Finds a user in an index, and returns a new reference to it.
+static Sqrl_User sqrl_user_index_find( int index, const void *key )
+{
+	struct Sqrl_User *user;
+	const char *unique_id = key ? (const char*)key : "";
+	uint32_t bucket = index == USER_INDEX_ID ? sqrl_user_hash_id( unique_id ) : sqrl_user_hash_ptr( key );
+	sqrl_mutex_enter( USER_INDEX_STRIPE( bucket ));
+	for( user = sqrl_user_index[index][bucket]; user; user = user->indexNext[index] ) {
+		bool match;
+		switch( index ) {
+		case USER_INDEX_HANDLE:
+			match = (user == key);
+			break;
+		case USER_INDEX_ID:
+			match = (0 == strcmp( user->unique_id, unique_id ));
+			break;
+		default:
+			match = (user->tag == key);
+			break;
+		}
+		if( match && sqrl_user_try_hold( user )) break;
+	}
+	sqrl_mutex_leave( USER_INDEX_STRIPE( bucket ));
+	return (Sqrl_User)user;
+}
+
+/**
+Changes a \p Sqrl_User's unique id, keeping the unique id index current.
+
+@param user The \p Sqrl_User
+@param unique_id The new unique id, or NULL to clear it
+*/
+void sqrl_user_set_unique_id( struct Sqrl_User *user, const char *unique_id )
+{
+	if( !user ) return;
+	sqrl_user_index_remove( USER_INDEX_ID, user );
+	memset( user->unique_id, 0, sizeof( user->unique_id ));
+	if( unique_id ) {
+		strncpy( user->unique_id, unique_id, SQRL_UNIQUE_ID_LENGTH );
+	}
+	sqrl_user_index_add( USER_INDEX_ID, user );
+}
 
 int sqrl_user_enscrypt_callback( int percent, void *data )
 {
@@ -37,14 +174,7 @@ void sqrl_user_ensure_keys_allocated( Sqrl_User u )
 }
 
 #if defined(DEBUG) && DEBUG_PRINT_USER_COUNT==1
-#define PRINT_USER_COUNT(tag) \
-int _pucI = 0;\
-struct Sqrl_User_List *_pucC = SQRL_USER_LIST;\
-while( _pucC ) {\
-	_pucI++;\
-	_pucC = _pucC->next;\
-}\
-printf( "%10s: %d\n", tag, _pucI )
+#define PRINT_USER_COUNT(tag) printf( "%10s: %d\n", tag, sqrl_user_count() )
 #else
 #define PRINT_USER_COUNT(tag)
 #endif
@@ -59,20 +189,7 @@ with \p sqrl_user_release when you are finished with the \p Sqrl_User.
 DLL_PUBLIC
 Sqrl_User sqrl_user_find( const char *unique_id )
 {
-	Sqrl_User user = NULL;
-	struct Sqrl_User_List *l;
-	sqrl_mutex_enter( SQRL_GLOBAL_MUTICES.user );
-	l = SQRL_USER_LIST;
-	while( l ) {
-		if( l->user && sqrl_user_unique_id_match( l->user, unique_id )) {
-			user = l->user;
-			sqrl_user_hold( user );
-			break;
-		}
-		l = l->next;
-	}
-	sqrl_mutex_leave( SQRL_GLOBAL_MUTICES.user );
-	return user;
+	return sqrl_user_index_find( USER_INDEX_ID, unique_id );
 }
 
 /**
@@ -87,14 +204,10 @@ Sqrl_User sqrl_user_create()
 	struct Sqrl_User *user = calloc( 1, sizeof( struct Sqrl_User ));
 	sqrl_user_default_options( &user->options );
 	user->referenceCount = 1;
-	user->referenceCountMutex = sqrl_mutex_create();
-	struct Sqrl_User_List *l = calloc( 1, sizeof( struct Sqrl_User_List ));
-	l->user = user;
-	sqrl_mutex_enter( SQRL_GLOBAL_MUTICES.user );
-	l->next = SQRL_USER_LIST;
-	SQRL_USER_LIST = l;
+	sqrl_user_index_add( USER_INDEX_ID, user );
+	sqrl_user_index_add( USER_INDEX_HANDLE, user );
+	SQRL_ATOMIC_INC( &sqrl_user_live );
 	PRINT_USER_COUNT("usr_create");
-	sqrl_mutex_leave( SQRL_GLOBAL_MUTICES.user );
 	return (Sqrl_User)user;
 }
 
@@ -103,20 +216,13 @@ Counts the number of \p Sqrl_Users currently in memory
 */
 int sqrl_user_count()
 {
-    sqrl_mutex_enter( SQRL_GLOBAL_MUTICES.user );
-    int i = 0;
-    struct Sqrl_User_List *list = SQRL_USER_LIST;
-    while( list ) {
-        i++;
-        list = list->next;
-    }
-    sqrl_mutex_leave( SQRL_GLOBAL_MUTICES.user );
-    return i;
+	return SQRL_ATOMIC_LOAD( &sqrl_user_live );
 }
 
 /** 
 Creates a reference to a \p Sqrl_User.  The \p Sqrl_User will not be 
 freed from memory until all references have been released with \p sqrl_user_release().
+Takes the lock for the user's index bucket.
 
 @param user The \p Sqrl_User
 @return Reference to \p user, or NULL
@@ -124,26 +230,9 @@ freed from memory until all references have been released with \p sqrl_user_rele
 DLL_PUBLIC
 Sqrl_User sqrl_user_hold( Sqrl_User u )
 {
-	SQRL_CAST_USER(user,u);
-	if( user == NULL ) return NULL;
-	sqrl_mutex_enter( SQRL_GLOBAL_MUTICES.user );
+	if( u == NULL ) return NULL;
 	// Make sure the user is still in active memory...
-	struct Sqrl_User_List *c = SQRL_USER_LIST;
-	while( c ) {
-		if( c->user == user ) {
-			sqrl_mutex_enter( user->referenceCountMutex );
-			user->referenceCount++;
-#if DEBUG_PRINT_USER_COUNT==1
-			printf( "sqrl_user_hold: %d\n", user->referenceCount );
-#endif
-			sqrl_mutex_leave( user->referenceCountMutex );
-			sqrl_mutex_leave( SQRL_GLOBAL_MUTICES.user );
-			return u;
-		}
-		c = c->next;
-	}
-	sqrl_mutex_leave( SQRL_GLOBAL_MUTICES.user );
-	return NULL;
+	return sqrl_user_index_find( USER_INDEX_HANDLE, u );
 }
 
 /**
@@ -159,88 +248,91 @@ Sqrl_User sqrl_user_release( Sqrl_User u )
 	SQRL_CAST_USER(user,u);
 	if( user == NULL ) return NULL;
 
-	sqrl_mutex_enter( SQRL_GLOBAL_MUTICES.user );
-	struct Sqrl_User_List *list = SQRL_USER_LIST;
-	if( list == NULL ) {
-		sqrl_mutex_leave( SQRL_GLOBAL_MUTICES.user );
-		return NULL;
+	uint32_t bucket = sqrl_user_hash_ptr( user );
+	sqrl_mutex_enter( USER_INDEX_STRIPE( bucket ));
+	struct Sqrl_User **pp = &sqrl_user_index[USER_INDEX_HANDLE][bucket];
+	while( *pp && *pp != user ) {
+		pp = &(*pp)->indexNext[USER_INDEX_HANDLE];
 	}
-	struct Sqrl_User_List *prev;
-	if( list->user == user ) {
-		prev = NULL;
-	} else {
-		prev = list;
-		list = NULL;
-		while( prev ) {
-			if( prev->next && prev->next->user == user ) {
-				list = prev->next;
-				break;
-			}
-			prev = prev->next;
-		}
-	}
-	if( list == NULL ) {
-		sqrl_mutex_leave( SQRL_GLOBAL_MUTICES.user );
+	if( *pp == NULL ) {
+		sqrl_mutex_leave( USER_INDEX_STRIPE( bucket ));
 		return NULL;
 	}
-	sqrl_mutex_enter( user->referenceCountMutex );
-	user->referenceCount--;
+	int refs = SQRL_ATOMIC_DEC( &user->referenceCount );
 #if DEBUG_PRINT_USER_COUNT==1
-	printf( "sqrl_user_release: %d\n", user->referenceCount );
+	printf( "sqrl_user_release: %d\n", refs );
 #endif
+	if( refs < 1 ) {
+		// No further holds can succeed; unlink before anyone else finds it
+		*pp = user->indexNext[USER_INDEX_HANDLE];
+	}
+	sqrl_mutex_leave( USER_INDEX_STRIPE( bucket ));
 
-	if( user->referenceCount > 0 ) {
-		sqrl_mutex_leave( user->referenceCountMutex );
-		sqrl_mutex_leave( SQRL_GLOBAL_MUTICES.user );
+	if( refs > 0 ) {
 		sqrl_user_hintlock( u );
 		return NULL;
 	}
+	sqrl_user_index_remove( USER_INDEX_ID, user );
+	if( user->tag ) {
+		sqrl_user_index_remove( USER_INDEX_TAG, user );
+	}
+	SQRL_ATOMIC_DEC( &sqrl_user_live );
 	if( user->keys != NULL ) {
 		sodium_mprotect_readwrite( user->keys );
 		sodium_free( user->keys );
 	}
-	sqrl_mutex_destroy( user->referenceCountMutex );
-	sodium_memzero( user, sizeof( Sqrl_User ));
-
-	if( prev == NULL ) {
-		SQRL_USER_LIST = list->next;
-	} else {
-		prev->next = list->next;
+	if( user->siteCache != NULL ) {
+		sodium_mprotect_readwrite( user->siteCache );
+		sodium_free( user->siteCache );
 	}
-	free( list );
+	sqrl_user_kdf_discard( u, 0 );
+	sqrl_user_checkpoint_discard( u );
+	sodium_memzero( user, sizeof( struct Sqrl_User ));
 	PRINT_USER_COUNT( "usr_rel" );
-	sqrl_mutex_leave( SQRL_GLOBAL_MUTICES.user );
 	free( user );
 	return NULL;
 }
 
 void sqrl_client_release_all_users() {
-	struct Sqrl_User_List *list; 
-	
-LOOP:	
-	sqrl_mutex_enter( SQRL_GLOBAL_MUTICES.user );
-	list = SQRL_USER_LIST;
-	if( list ) {
-		sqrl_mutex_leave( SQRL_GLOBAL_MUTICES.user );
-		sqrl_user_release( list->user );
-		goto LOOP;
+	struct Sqrl_User *user;
+	int i;
+	for( i = 0; i < SQRL_USER_INDEX_BUCKETS; i++ ) {
+		for( ;; ) {
+			sqrl_mutex_enter( USER_INDEX_STRIPE( i ));
+			user = sqrl_user_index[USER_INDEX_HANDLE][i];
+			sqrl_mutex_leave( USER_INDEX_STRIPE( i ));
+			if( !user ) break;
+			sqrl_user_release( user );
+		}
 	}
-	sqrl_mutex_leave( SQRL_GLOBAL_MUTICES.user );
 }
 
 void sqrl_client_user_maintenance( bool forceLockAll )
 {
 	// TODO: Get User Idle Time
 	double idleTime = 600;
-	sqrl_mutex_enter( SQRL_GLOBAL_MUTICES.user );
-	struct Sqrl_User_List *list = SQRL_USER_LIST;
-	while( list ) {
-		if( forceLockAll || idleTime >= sqrl_user_get_timeout_minutes( list->user )) {
-			sqrl_user_hintlock( list->user );
+	struct Sqrl_User *user, **held = NULL;
+	int i, j, count, size = 0;
+	for( i = 0; i < SQRL_USER_INDEX_BUCKETS; i++ ) {
+		// Hold this bucket's users, so they can be locked without the stripe
+		count = 0;
+		sqrl_mutex_enter( USER_INDEX_STRIPE( i ));
+		for( user = sqrl_user_index[USER_INDEX_HANDLE][i]; user; user = user->indexNext[USER_INDEX_HANDLE] ) {
+			if( count == size ) {
+				size = size ? size * 2 : 16;
+				held = realloc( held, size * sizeof( struct Sqrl_User* ));
+			}
+			if( sqrl_user_try_hold( user )) held[count++] = user;
+		}
+		sqrl_mutex_leave( USER_INDEX_STRIPE( i ));
+		for( j = 0; j < count; j++ ) {
+			if( forceLockAll || idleTime >= sqrl_user_get_timeout_minutes( held[j] )) {
+				sqrl_user_hintlock( held[j] );
+			}
+			sqrl_user_release( held[j] );
 		}
-		list = list->next;
 	}
-	sqrl_mutex_leave( SQRL_GLOBAL_MUTICES.user );
+	if( held ) free( held );
 }
 
 
@@ -256,20 +348,7 @@ Finds a \p Sqrl_User in memory, and returns a new reference to it.
 DLL_PUBLIC
 Sqrl_User sqrl_get_user( const char *unique_id )
 {
-	Sqrl_User retVal = NULL;
-	sqrl_mutex_enter( SQRL_GLOBAL_MUTICES.user );
-	struct Sqrl_User_List *list = SQRL_USER_LIST;
-	while( list ) {
-		if( sqrl_user_unique_id_match( list->user, unique_id )) {
-			retVal = list->user;
-			break;
-		}
-	}
-	sqrl_mutex_leave( SQRL_GLOBAL_MUTICES.user );
-	if( sqrl_user_hold( retVal )) {
-		return retVal;
-	}
-	return NULL;
+	return sqrl_user_index_find( USER_INDEX_ID, unique_id );
 }
 
 /**
@@ -283,20 +362,8 @@ Finds a \p Sqrl_User in by tag, and returns a new reference to it.
 DLL_PUBLIC
 Sqrl_User sqrl_get_user_by_tag( void* tag )
 {
-	Sqrl_User retVal = NULL;
-	sqrl_mutex_enter( SQRL_GLOBAL_MUTICES.user );
-	struct Sqrl_User_List *list = SQRL_USER_LIST;
-	while( list ) {
-		if( tag == list->user->tag ) {
-			retVal = list->user;
-			break;
-		}
-	}
-	sqrl_mutex_leave( SQRL_GLOBAL_MUTICES.user );
-	if( sqrl_user_hold( retVal )) {
-		return retVal;
-	}
-	return NULL;
+	if( tag == NULL ) return NULL;
+	return sqrl_user_index_find( USER_INDEX_TAG, tag );
 }
 
 /**
@@ -308,9 +375,14 @@ Sets the tag for a \p Sqrl_User
 DLL_PUBLIC
 void sqrl_user_set_tag( Sqrl_User u, void *tag )
 {
-	SQRL_CAST_USER(user,u);
+	SQRL_CAST_USER(user,sqrl_user_hold(u));
 	if( user == NULL ) return;
-	user->tag = tag;
+	if( user->tag != tag ) {
+		if( user->tag ) sqrl_user_index_remove( USER_INDEX_TAG, user );
+		user->tag = tag;
+		if( user->tag ) sqrl_user_index_add( USER_INDEX_TAG, user );
+	}
+	sqrl_user_release( user );
 }
 
 /**
@@ -336,23 +408,542 @@ bool sqrl_user_is_memlocked( Sqrl_User u ) {
 	return false;
 }
 
+// Requires the user's index stripe.
+static void sqrl_user_protect_keys( struct Sqrl_User *user, bool protect )
+{
+	if( user->keys != NULL ) {
+		if( protect ) sodium_mprotect_noaccess( user->keys );
+		else sodium_mprotect_readwrite( user->keys );
+	}
+	if( user->siteCache != NULL ) {
+		if( protect ) sodium_mprotect_noaccess( user->siteCache );
+		else sodium_mprotect_readwrite( user->siteCache );
+	}
+	if( protect ) BIT_SET( user->flags, USER_FLAG_MEMLOCKED );
+	else BIT_UNSET( user->flags, USER_FLAG_MEMLOCKED );
+}
+
 void sqrl_user_memlock( Sqrl_User u ) {
 	SQRL_CAST_USER(user,u);
 	if( user == NULL ) return;
-	if( user->keys != NULL ) {
-		sodium_mprotect_noaccess( user->keys );
+	uint32_t bucket = sqrl_user_hash_ptr( user );
+	sqrl_mutex_enter( USER_INDEX_STRIPE( bucket ));
+	if( user->keySessions > 0 ) {
+		// Locked when the last session closes
+		BIT_SET( user->flags, USER_FLAG_RELOCK );
+	} else {
+		sqrl_user_protect_keys( user, true );
 	}
-	BIT_SET( user->flags, USER_FLAG_MEMLOCKED );
+	sqrl_mutex_leave( USER_INDEX_STRIPE( bucket ));
 }
 
 void sqrl_user_memunlock( Sqrl_User u )
 {
 	SQRL_CAST_USER(user,u);
 	if( user == NULL ) return;
-	if( user->keys != NULL ) {
-		sodium_mprotect_readwrite( user->keys );
+	uint32_t bucket = sqrl_user_hash_ptr( user );
+	sqrl_mutex_enter( USER_INDEX_STRIPE( bucket ));
+	BIT_UNSET( user->flags, USER_FLAG_RELOCK );
+	sqrl_user_protect_keys( user, false );
+	sqrl_mutex_leave( USER_INDEX_STRIPE( bucket ));
+}
+
+/**
+Opens a key-access session on a \p Sqrl_User.  Its protected key memory
+stays readable until the matching \p sqrl_user_keys_close(), so nested
+accesses within one step don't each pay for a pair of mprotect() calls.
+
+@param u A \p Sqrl_User
+@return A new reference to the user, or NULL
+*/
+struct Sqrl_User *sqrl_user_keys_open( Sqrl_User u )
+{
+	struct Sqrl_User *user = (struct Sqrl_User*)sqrl_user_hold( u );
+	if( user == NULL ) return NULL;
+	uint32_t bucket = sqrl_user_hash_ptr( user );
+	sqrl_mutex_enter( USER_INDEX_STRIPE( bucket ));
+	sqrl_user_ensure_keys_allocated( user );
+	if( user->keySessions++ == 0 && BIT_CHECK( user->flags, USER_FLAG_MEMLOCKED )) {
+		sqrl_user_protect_keys( user, false );
+		BIT_SET( user->flags, USER_FLAG_RELOCK );
+	}
+	sqrl_mutex_leave( USER_INDEX_STRIPE( bucket ));
+	return user;
+}
+
+/**
+Closes a key-access session opened with \p sqrl_user_keys_open(), and
+releases its reference.
+
+@param user The \p Sqrl_User
+@return NULL
+*/
+struct Sqrl_User *sqrl_user_keys_close( struct Sqrl_User *user )
+{
+	if( user == NULL ) return NULL;
+	uint32_t bucket = sqrl_user_hash_ptr( user );
+	sqrl_mutex_enter( USER_INDEX_STRIPE( bucket ));
+	if( --user->keySessions == 0 && BIT_CHECK( user->flags, USER_FLAG_RELOCK )) {
+		BIT_UNSET( user->flags, USER_FLAG_RELOCK );
+		sqrl_user_protect_keys( user, true );
+	}
+	sqrl_mutex_leave( USER_INDEX_STRIPE( bucket ));
+	sqrl_user_release( user );
+	return NULL;
+}
+
+/*
+Each user keeps a small LRU cache of the keys derived for the sites it
+has visited, so the query and ident round trips of a login (and repeat
+logins) don't repeat the HMAC, EnHash and Ed25519 key derivations.  The
+cache lives in its own sodium_malloc() block, protected along with the
+user's keys, and is wiped whenever the keys it came from are locked away
+or replaced.
+*/
+
+// Identifies a cache entry by host string and first previous identity tried.
+static void sqrl_user_site_cache_id( uint8_t id[SQRL_KEY_SIZE], const char *host, size_t host_len, int previous )
+{
+	crypto_hash_sha256_state state;
+	uint8_t p = (uint8_t)previous;
+	crypto_hash_sha256_init( &state );
+	crypto_hash_sha256_update( &state, &p, 1 );
+	crypto_hash_sha256_update( &state, (const unsigned char*)host, host_len );
+	crypto_hash_sha256_final( &state, id );
+	sodium_memzero( &state, sizeof( state ));
+}
+
+/**
+Looks up the keys previously derived for a site.
+
+@param u The \p Sqrl_User
+@param host The site's host string, including any alternate identity
+@param host_len Length of \p host
+@param previous The first previous identity to try
+@param keys Receives the cached keys
+@return true if the keys were cached
+*/
+bool sqrl_user_site_cache_get( Sqrl_User u, const char *host, size_t host_len, int previous, Sqrl_Site_Keys *keys )
+{
+	uint8_t id[SQRL_KEY_SIZE];
+	bool found = false;
+	int i;
+	if( !host || !keys ) return false;
+	WITH_USER(user,u);
+	if( user == NULL ) return false;
+	sqrl_user_site_cache_id( id, host, host_len, previous );
+	uint32_t bucket = sqrl_user_hash_ptr( user );
+	sqrl_mutex_enter( USER_INDEX_STRIPE( bucket ));
+	if( user->siteCache ) {
+		for( i = 0; i < USER_SITE_CACHE_SIZE; i++ ) {
+			Sqrl_Site_Cache_Entry *entry = &user->siteCache->entries[i];
+			if( entry->lastUsed && 0 == sodium_memcmp( entry->id, id, SQRL_KEY_SIZE )) {
+				entry->lastUsed = ++user->siteCache->clock;
+				memcpy( keys, &entry->keys, sizeof( Sqrl_Site_Keys ));
+				found = true;
+				break;
+			}
+		}
+	}
+	sqrl_mutex_leave( USER_INDEX_STRIPE( bucket ));
+	END_WITH_USER(user);
+	return found;
+}
+
+/**
+Caches the keys derived for a site, replacing the least recently used entry
+if the cache is full.
+
+@param u The \p Sqrl_User
+@param host The site's host string, including any alternate identity
+@param host_len Length of \p host
+@param previous The first previous identity tried
+@param keys The derived keys
+*/
+void sqrl_user_site_cache_put( Sqrl_User u, const char *host, size_t host_len, int previous, const Sqrl_Site_Keys *keys )
+{
+	uint8_t id[SQRL_KEY_SIZE];
+	Sqrl_Site_Cache_Entry *entry, *victim = NULL;
+	int i;
+	if( !host || !keys ) return;
+	WITH_USER(user,u);
+	if( user == NULL ) return;
+	sqrl_user_site_cache_id( id, host, host_len, previous );
+	uint32_t bucket = sqrl_user_hash_ptr( user );
+	sqrl_mutex_enter( USER_INDEX_STRIPE( bucket ));
+	if( !user->siteCache ) {
+		user->siteCache = sodium_malloc( sizeof( struct Sqrl_Site_Cache ));
+		if( user->siteCache ) {
+			sodium_memzero( user->siteCache, sizeof( struct Sqrl_Site_Cache ));
+		}
+	}
+	if( user->siteCache ) {
+		for( i = 0; i < USER_SITE_CACHE_SIZE; i++ ) {
+			entry = &user->siteCache->entries[i];
+			if( entry->lastUsed && 0 == sodium_memcmp( entry->id, id, SQRL_KEY_SIZE )) {
+				victim = entry;
+				break;
+			}
+			if( !victim || entry->lastUsed < victim->lastUsed ) victim = entry;
+		}
+		memcpy( victim->id, id, SQRL_KEY_SIZE );
+		memcpy( &victim->keys, keys, sizeof( Sqrl_Site_Keys ));
+		victim->lastUsed = ++user->siteCache->clock;
+	}
+	sqrl_mutex_leave( USER_INDEX_STRIPE( bucket ));
+	END_WITH_USER(user);
+}
+
+/**
+Wipes a user's cached site keys.
+
+@param u The \p Sqrl_User
+*/
+void sqrl_user_site_cache_flush( Sqrl_User u )
+{
+	WITH_USER(user,u);
+	if( user == NULL ) return;
+	uint32_t bucket = sqrl_user_hash_ptr( user );
+	sqrl_mutex_enter( USER_INDEX_STRIPE( bucket ));
+	if( user->siteCache ) {
+		sodium_memzero( user->siteCache, sizeof( struct Sqrl_Site_Cache ));
+	}
+	sqrl_mutex_leave( USER_INDEX_STRIPE( bucket ));
+	END_WITH_USER(user);
+}
+
+/*
+The slowest part of saving an identity is the EnScrypt for each block's
+key, and the secret it needs is often known well before the save: a
+rescue code exists as soon as an identity is generated or rekeyed, and a
+new password as soon as it is entered.  So that EnScrypt starts in the
+background then, and the save picks up the result.  It depends only on
+the secret, a salt and the time budget, so the result is good for as long
+as those are.  There is one job per block, for blocks 1 and 2.
+*/
+struct Sqrl_Kdf_Job {
+	SqrlThread thread;
+	int done;
+	int cancelled;
+	int millis;
+	uint32_t count;
+	uint8_t salt[16];
+	uint8_t key[SQRL_KEY_SIZE];
+	size_t password_len;
+	char password[KEY_PASSWORD_MAX_LEN];
+};
+
+static int sqrl_user_kdf_slot( int block )
+{
+	switch( block ) {
+	case SQRL_BLOCK_USER:
+		return 0;
+	case SQRL_BLOCK_RESCUE:
+		return 1;
+	default:
+		return -1;
+	}
+}
+
+static int sqrl_user_kdf_progress( int percent, void *data )
+{
+	struct Sqrl_Kdf_Job *job = (struct Sqrl_Kdf_Job*)data;
+	return !SQRL_ATOMIC_LOAD( &job->cancelled );
+}
+
+static SQRL_THREAD_FUNCTION_RETURN_TYPE sqrl_user_kdf_thread( SQRL_THREAD_FUNCTION_INPUT_TYPE input )
+{
+	struct Sqrl_Kdf_Job *job = (struct Sqrl_Kdf_Job*)input;
+	Sqrl_Crypt_Context sctx;
+	memset( &sctx, 0, sizeof( Sqrl_Crypt_Context ));
+	sctx.salt = job->salt;
+	sctx.nFactor = SQRL_DEFAULT_N_FACTOR;
+	sctx.flags = SQRL_ENCRYPT | SQRL_MILLIS;
+	sctx.count = job->millis;
+	job->count = sqrl_crypt_enscrypt( &sctx, job->key, job->password,
+		job->password_len, sqrl_user_kdf_progress, job );
+	SQRL_ATOMIC_STORE( &job->done, 1 );
+	SQRL_THREAD_LEAVE;
+}
+
+// Takes a user's job for a block slot, leaving none.
+static struct Sqrl_Kdf_Job *sqrl_user_kdf_detach( struct Sqrl_User *user, int slot )
+{
+	struct Sqrl_Kdf_Job *job;
+	uint32_t bucket = sqrl_user_hash_ptr( user );
+	sqrl_mutex_enter( USER_INDEX_STRIPE( bucket ));
+	job = user->kdfJobs[slot];
+	user->kdfJobs[slot] = NULL;
+	sqrl_mutex_leave( USER_INDEX_STRIPE( bucket ));
+	return job;
+}
+
+static void sqrl_user_kdf_free( struct Sqrl_Kdf_Job *job )
+{
+	SQRL_ATOMIC_STORE( &job->cancelled, 1 );
+	sqrl_thread_join( job->thread );
+	sodium_free( job );
+}
+
+/**
+Starts the EnScrypt for a block's key in the background, replacing any
+that was running for that block.
+
+@param u The \p Sqrl_User
+@param block \p SQRL_BLOCK_USER or \p SQRL_BLOCK_RESCUE
+@param password The password or rescue code
+@param password_len Length of \p password
+@param millis How long the EnScrypt should run
+*/
+void sqrl_user_kdf_start( Sqrl_User u, int block, const char *password, size_t password_len, int millis )
+{
+	struct Sqrl_Kdf_Job *job;
+	int slot = sqrl_user_kdf_slot( block );
+	if( slot < 0 || !password || password_len > KEY_PASSWORD_MAX_LEN ) return;
+	WITH_USER(user,u);
+	if( user == NULL ) return;
+	sqrl_user_kdf_discard( u, block );
+	job = sodium_malloc( sizeof( struct Sqrl_Kdf_Job ));
+	if( job ) {
+		sodium_memzero( job, sizeof( struct Sqrl_Kdf_Job ));
+		memcpy( job->password, password, password_len );
+		job->password_len = password_len;
+		job->millis = millis;
+		sqrl_entropy_bytes( job->salt, 16 );
+		job->thread = sqrl_thread_create( sqrl_user_kdf_thread, (SQRL_THREAD_FUNCTION_INPUT_TYPE)job );
+		if( !job->thread ) {
+			// The block's save runs its EnScrypt inline instead
+			sodium_free( job );
+			job = NULL;
+		}
+	}
+	if( job ) {
+		uint32_t bucket = sqrl_user_hash_ptr( user );
+		sqrl_mutex_enter( USER_INDEX_STRIPE( bucket ));
+		user->kdfJobs[slot] = job;
+		sqrl_mutex_leave( USER_INDEX_STRIPE( bucket ));
+	}
+	END_WITH_USER(user);
+}
+
+/**
+Checks whether a background EnScrypt for a block is waiting to be used.
+
+@param u The \p Sqrl_User
+@param block \p SQRL_BLOCK_USER or \p SQRL_BLOCK_RESCUE
+@return true if there is one, finished or not
+*/
+bool sqrl_user_kdf_pending( Sqrl_User u, int block )
+{
+	SQRL_CAST_USER(user,u);
+	int slot = sqrl_user_kdf_slot( block );
+	if( user == NULL || slot < 0 ) return false;
+	uint32_t bucket = sqrl_user_hash_ptr( user );
+	sqrl_mutex_enter( USER_INDEX_STRIPE( bucket ));
+	bool retVal = user->kdfJobs[slot] != NULL;
+	sqrl_mutex_leave( USER_INDEX_STRIPE( bucket ));
+	return retVal;
+}
+
+/**
+Drops background EnScrypts that haven't finished yet.  On a single CPU a
+save calls this first, so its own timed chains don't share the CPU with
+them.
+
+@param u The \p Sqrl_User
+*/
+void sqrl_user_kdf_settle( Sqrl_User u )
+{
+	SQRL_CAST_USER(user,u);
+	if( user == NULL ) return;
+	struct Sqrl_Kdf_Job *job;
+	uint32_t bucket = sqrl_user_hash_ptr( user );
+	int slot;
+	for( slot = 0; slot < USER_KDF_JOBS; slot++ ) {
+		job = NULL;
+		sqrl_mutex_enter( USER_INDEX_STRIPE( bucket ));
+		if( user->kdfJobs[slot] && !SQRL_ATOMIC_LOAD( &user->kdfJobs[slot]->done )) {
+			job = user->kdfJobs[slot];
+			user->kdfJobs[slot] = NULL;
+		}
+		sqrl_mutex_leave( USER_INDEX_STRIPE( bucket ));
+		if( job ) sqrl_user_kdf_free( job );
+	}
+}
+
+/**
+Uses a block's background EnScrypt, waiting for it if need be.
+
+@param u The \p Sqrl_User
+@param block \p SQRL_BLOCK_USER or \p SQRL_BLOCK_RESCUE
+@param password The current password or rescue code
+@param password_len Length of \p password
+@param millis The current time budget for the block
+@param salt Receives the 16 byte salt
+@param key Receives the EnScrypt result
+@param count Receives the iteration count
+@return true if there was a result for \p password and \p millis
+*/
+bool sqrl_user_kdf_take( Sqrl_User u, int block, const char *password, size_t password_len, int millis, uint8_t *salt, uint8_t *key, uint32_t *count )
+{
+	SQRL_CAST_USER(user,u);
+	int slot = sqrl_user_kdf_slot( block );
+	if( user == NULL || slot < 0 || !password ) return false;
+	struct Sqrl_Kdf_Job *job = sqrl_user_kdf_detach( user, slot );
+	if( !job ) return false;
+	sqrl_thread_join( job->thread );
+	bool retVal = !job->cancelled && job->count > 0 && job->millis == millis &&
+		job->password_len == password_len &&
+		0 == sodium_memcmp( job->password, password, password_len );
+	if( retVal ) {
+		memcpy( salt, job->salt, 16 );
+		memcpy( key, job->key, SQRL_KEY_SIZE );
+		*count = job->count;
+	}
+	sodium_free( job );
+	return retVal;
+}
+
+/**
+Stops and wipes a block's background EnScrypt.
+
+@param u The \p Sqrl_User
+@param block \p SQRL_BLOCK_USER or \p SQRL_BLOCK_RESCUE, or 0 for both
+*/
+void sqrl_user_kdf_discard( Sqrl_User u, int block )
+{
+	SQRL_CAST_USER(user,u);
+	if( user == NULL ) return;
+	struct Sqrl_Kdf_Job *job;
+	int slot;
+	for( slot = 0; slot < USER_KDF_JOBS; slot++ ) {
+		if( block && slot != sqrl_user_kdf_slot( block )) continue;
+		job = sqrl_user_kdf_detach( user, slot );
+		if( job ) sqrl_user_kdf_free( job );
+	}
+}
+
+/*
+A rescue code's EnScrypt is long, so the user keeps a checkpoint of it:
+a decrypt or save of block 2 that is cancelled leaves its progress there,
+and the next one with the same rescue code carries on from it.  The app
+can seal the checkpoint under a local key to keep it across a restart.
+While an EnScrypt is using the checkpoint it is taken off the user, so
+only one runs against it at a time.
+*/
+
+/**
+Takes a user's rescue EnScrypt checkpoint for a run, leaving none.
+
+@param u The \p Sqrl_User
+@return The checkpoint, a new one if there was none, or NULL
+*/
+struct Sqrl_Enscrypt_State *sqrl_user_checkpoint_take( Sqrl_User u )
+{
+	SQRL_CAST_USER(user,u);
+	if( user == NULL ) return NULL;
+	struct Sqrl_Enscrypt_State *state;
+	uint32_t bucket = sqrl_user_hash_ptr( user );
+	sqrl_mutex_enter( USER_INDEX_STRIPE( bucket ));
+	state = user->checkpoint;
+	user->checkpoint = NULL;
+	sqrl_mutex_leave( USER_INDEX_STRIPE( bucket ));
+	if( !state ) state = sqrl_enscrypt_state_create();
+	return state;
+}
+
+/**
+Gives back a checkpoint from \p sqrl_user_checkpoint_take().
+
+@param u The \p Sqrl_User
+@param state The checkpoint; NULL is ignored
+*/
+void sqrl_user_checkpoint_put( Sqrl_User u, struct Sqrl_Enscrypt_State *state )
+{
+	SQRL_CAST_USER(user,u);
+	if( state == NULL ) return;
+	if( user == NULL ) {
+		sqrl_enscrypt_state_destroy( state );
+		return;
 	}
-	BIT_UNSET( user->flags, USER_FLAG_MEMLOCKED );
+	uint32_t bucket = sqrl_user_hash_ptr( user );
+	sqrl_mutex_enter( USER_INDEX_STRIPE( bucket ));
+	if( user->checkpoint == NULL ) {
+		user->checkpoint = state;
+		state = NULL;
+	}
+	sqrl_mutex_leave( USER_INDEX_STRIPE( bucket ));
+	// Another run put one back first
+	sqrl_enscrypt_state_destroy( state );
+}
+
+/**
+Wipes a user's rescue EnScrypt checkpoint.
+
+@param u The \p Sqrl_User
+*/
+void sqrl_user_checkpoint_discard( Sqrl_User u )
+{
+	SQRL_CAST_USER(user,u);
+	if( user == NULL ) return;
+	struct Sqrl_Enscrypt_State *state;
+	uint32_t bucket = sqrl_user_hash_ptr( user );
+	sqrl_mutex_enter( USER_INDEX_STRIPE( bucket ));
+	state = user->checkpoint;
+	user->checkpoint = NULL;
+	sqrl_mutex_leave( USER_INDEX_STRIPE( bucket ));
+	sqrl_enscrypt_state_destroy( state );
+}
+
+/**
+Seals the progress of an unfinished rescue code EnScrypt, so it can be
+stored and given back with \p sqrl_user_set_checkpoint() after a restart.
+
+@param u The \p Sqrl_User
+@param key A \p SQRL_LOCAL_KEY_LENGTH byte key, kept by the app
+@param checkpoint Receives \p SQRL_CHECKPOINT_LENGTH bytes
+@return true if there was unfinished progress to seal
+*/
+DLL_PUBLIC
+bool sqrl_user_get_checkpoint( Sqrl_User u, const uint8_t *key, uint8_t *checkpoint )
+{
+	SQRL_CAST_USER(user,u);
+	if( user == NULL || !key || !checkpoint ) return false;
+	bool retVal = false;
+	uint32_t bucket = sqrl_user_hash_ptr( user );
+	sqrl_mutex_enter( USER_INDEX_STRIPE( bucket ));
+	if( user->checkpoint ) {
+		retVal = sqrl_enscrypt_state_seal( user->checkpoint, key, checkpoint );
+	}
+	sqrl_mutex_leave( USER_INDEX_STRIPE( bucket ));
+	return retVal;
+}
+
+/**
+Restores a checkpoint sealed by \p sqrl_user_get_checkpoint().  The next
+rescue code EnScrypt for this user carries on from it, if it is for the
+same block.  A checkpoint does not record its rescue code, so if the key
+it leads to is wrong the EnScrypt is run again from the start.
+
+@param u The \p Sqrl_User
+@param key The key it was sealed with
+@param checkpoint \p SQRL_CHECKPOINT_LENGTH bytes
+@return true if \p checkpoint was intact and sealed under \p key
+*/
+DLL_PUBLIC
+bool sqrl_user_set_checkpoint( Sqrl_User u, const uint8_t *key, const uint8_t *checkpoint )
+{
+	SQRL_CAST_USER(user,u);
+	if( user == NULL || !key || !checkpoint ) return false;
+	struct Sqrl_Enscrypt_State *state = sqrl_enscrypt_state_create();
+	if( !state ) return false;
+	if( !sqrl_enscrypt_state_open( state, key, checkpoint )) {
+		sqrl_enscrypt_state_destroy( state );
+		return false;
+	}
+	sqrl_user_checkpoint_discard( u );
+	sqrl_user_checkpoint_put( u, state );
+	return true;
 }
 
 /**
@@ -393,7 +984,11 @@ void sqrl_user_hintlock( Sqrl_User u )
 	WITH_USER(user,u);
 	Sqrl_Transaction t = sqrl_transaction_create( SQRL_TRANSACTION_IDENTITY_LOCK );
 	SQRL_CAST_TRANSACTION(transaction,t);
-	transaction->user = u;
+	if( !transaction ) {
+		END_WITH_USER(user);
+		return;
+	}
+	sqrl_transaction_swap_user( transaction, u );
 	struct sqrl_user_callback_data cbdata;
 	cbdata.transaction = transaction;
 	cbdata.adder = 0;
@@ -437,9 +1032,12 @@ void sqrl_user_hintlock( Sqrl_User u )
 
 	sodium_memzero( sctx.plain_text, sctx.text_len );
 	sodium_memzero( key, SQRL_KEY_SIZE );
+	sqrl_user_site_cache_flush( u );
+	sqrl_user_kdf_discard( u, 0 );
+	sqrl_user_checkpoint_discard( u );
 
 DONE:
-	transaction->user = NULL;
+	sqrl_transaction_swap_user( transaction, NULL );
 	sqrl_transaction_release( transaction );
 	END_WITH_USER(user);
 }
@@ -495,6 +1093,7 @@ void sqrl_user_hintunlock( Sqrl_Transaction t,
 	sqrl_crypt_enscrypt( &sctx, key, hint, length, sqrl_user_enscrypt_callback, &cbdata );
 	if( !sqrl_crypt_gcm( &sctx, key )) {
 		sodium_memzero( sctx.plain_text, sctx.text_len );
+		sqrl_user_site_cache_flush( u );
 	}
 	user->hint_iterations = 0;
 	sodium_memzero( key, SQRL_KEY_SIZE );
@@ -545,8 +1144,7 @@ bool _su_keygen( Sqrl_Transaction t, int key_type, uint8_t *key )
 	case KEY_ILK:
 		temp[0] = sqrl_user_key( t, KEY_IUK );
 		if( temp[0] ) {
-			sqrl_gen_ilk( key, temp[0] );
-			retVal = true;
+			retVal = sqrl_gen_ilk( key, temp[0] );
 		}
 		break;
 	case KEY_LOCAL:
@@ -587,6 +1185,8 @@ bool sqrl_user_regen_keys( Sqrl_Transaction t )
 	uint8_t *key;
 	int keys[] = { KEY_MK, KEY_ILK, KEY_LOCAL };
 	int i;
+	// Rekeying comes through here; the old site keys are no longer ours
+	sqrl_user_site_cache_flush( transaction->user );
 	for( i = 0; i < 3; i++ ) {
 		key = sqrl_user_new_key( transaction->user, keys[i] );
 		_su_keygen( t, keys[i], key );
@@ -626,6 +1226,11 @@ bool sqrl_user_rekey( Sqrl_Transaction t )
 	}
 	user->flags |= (USER_FLAG_T1_CHANGED | USER_FLAG_T2_CHANGED);
 	user->edition = ed + 1;
+	// A cancelled save left its checkpoint for the old code
+	sqrl_user_checkpoint_discard( transaction->user );
+	sqrl_user_kdf_start( transaction->user, SQRL_BLOCK_RESCUE,
+		(char*)sqrl_user_key( t, KEY_RESCUE_CODE ), SQRL_RESCUE_CODE_LENGTH,
+		SQRL_RESCUE_ENSCRYPT_SECONDS * SQRL_MILLIS_PER_SECOND );
 	goto DONE;
 
 ERROR:
@@ -670,6 +1275,103 @@ uint8_t *sqrl_user_new_key( Sqrl_User u, int key_type )
 	return NULL;
 }
 
+/*
+Unlocking a key means an EnScrypt of several seconds, so when several
+transactions on one user need a missing key at once, the first one
+unlocks it and the rest wait for its result.  There is one unlock at a
+time per user: the password and rescue unlocks both decrypt through the
+user's scratch memory, and the password unlock falls back to the rescue
+block.  Keys are written in place, so none is trusted while another
+transaction is unlocking.
+
+If an unlock fails, the waiters for the same class of key fail with it,
+unless its transaction was cancelled; then a waiter takes it over.  A
+transaction which needs a key while it is unlocking, from one of its own
+callbacks, goes ahead rather than wait for itself.
+
+The following require the user's stripe mutex.
+*/
+static int sqrl_user_key_offset( struct Sqrl_User *user, int key_type )
+{
+	int i;
+	for( i = 0; i < USER_MAX_KEYS; i++ ) {
+		if( user->lookup[i] == key_type ) return i;
+	}
+	return -1;
+}
+
+static void sqrl_user_unlock_wait( struct Sqrl_User *user, struct Sqrl_Transaction *transaction, uint32_t bucket )
+{
+	while( user->unlocking && user->unlockLeader != transaction ) {
+		sqrl_cond_wait( USER_UNLOCK_STRIPE( bucket ), USER_INDEX_STRIPE( bucket ));
+	}
+}
+
+// Runs a key unlock in the calling thread.
+static bool sqrl_user_unlock_run( Sqrl_Transaction t, int unlockClass )
+{
+	if( unlockClass == USER_UNLOCK_RESCUE ) {
+		return sqrl_user_try_load_rescue( t, true );
+	}
+	return sqrl_user_try_load_password( t, true );
+}
+
+// Finds a key once no other transaction is unlocking the user's keys.
+static int sqrl_user_key_find( struct Sqrl_User *user, struct Sqrl_Transaction *transaction, int key_type )
+{
+	uint32_t bucket = sqrl_user_hash_ptr( user );
+	sqrl_mutex_enter( USER_INDEX_STRIPE( bucket ));
+	sqrl_user_unlock_wait( user, transaction, bucket );
+	int offset = sqrl_user_key_offset( user, key_type );
+	sqrl_mutex_leave( USER_INDEX_STRIPE( bucket ));
+	return offset;
+}
+
+static void sqrl_user_unlock( Sqrl_Transaction t, struct Sqrl_Transaction *transaction, struct Sqrl_User *user, int unlockClass, int key_type )
+{
+	uint8_t bit = (uint8_t)(1 << unlockClass);
+	uint32_t bucket = sqrl_user_hash_ptr( user );
+	bool retVal;
+
+	sqrl_mutex_enter( USER_INDEX_STRIPE( bucket ));
+	for( ;; ) {
+		if( user->unlocking ) {
+			if( user->unlockLeader == transaction ) {
+				sqrl_mutex_leave( USER_INDEX_STRIPE( bucket ));
+				sqrl_user_unlock_run( t, unlockClass );
+				return;
+			}
+			sqrl_user_unlock_wait( user, transaction, bucket );
+			if( user->unlockFailed & bit ) {
+				sqrl_mutex_leave( USER_INDEX_STRIPE( bucket ));
+				return;
+			}
+			continue;
+		}
+		if( sqrl_user_key_offset( user, key_type ) > -1 ) {
+			sqrl_mutex_leave( USER_INDEX_STRIPE( bucket ));
+			return;
+		}
+		break;
+	}
+	user->unlocking = true;
+	user->unlockLeader = transaction;
+	sqrl_mutex_leave( USER_INDEX_STRIPE( bucket ));
+
+	retVal = sqrl_user_unlock_run( t, unlockClass );
+
+	sqrl_mutex_enter( USER_INDEX_STRIPE( bucket ));
+	user->unlocking = false;
+	user->unlockLeader = NULL;
+	if( retVal || sqrl_client_transaction_cancelled( t )) {
+		user->unlockFailed = 0;
+	} else {
+		user->unlockFailed = bit;
+	}
+	sqrl_cond_broadcast( USER_UNLOCK_STRIPE( bucket ));
+	sqrl_mutex_leave( USER_INDEX_STRIPE( bucket ));
+}
+
 uint8_t *sqrl_user_key( Sqrl_Transaction t, int key_type )
 {
 	WITH_TRANSACTION(transaction,t);
@@ -679,61 +1381,38 @@ uint8_t *sqrl_user_key( Sqrl_Transaction t, int key_type )
 		END_WITH_TRANSACTION(transaction);
 		return NULL;
 	}
-	int offset, i;
-	int loop = -1;
-	uint8_t *key;
+	uint8_t *key = NULL;
+	int unlockClass = -1;
 
-	offset = -1;
-	for( i = 0; i < USER_MAX_KEYS; i++ ) {
-		if( user->lookup[i] == key_type ) {
-			offset = i;
-			break;
-		}
+	switch( key_type ) {
+	case KEY_IUK:
+		unlockClass = USER_UNLOCK_RESCUE;
+		break;
+	case KEY_MK:
+	case KEY_ILK:
+	case KEY_PIUK0:
+	case KEY_PIUK1:
+	case KEY_PIUK2:
+	case KEY_PIUK3:
+		unlockClass = USER_UNLOCK_PASSWORD;
+		break;
+	default:
+		// We cannot regenerate the rescue code
+		break;
+	}
+
+	int offset = sqrl_user_key_find( user, transaction, key_type );
+	if( offset < 0 && unlockClass > -1 ) {
+		// Not Found!
+		sqrl_user_unlock( t, transaction, user, unlockClass, key_type );
+		offset = sqrl_user_key_find( user, transaction, key_type );
 	}
 	if( offset > -1 ) {
 		key = user->keys->keys[offset];
-		END_WITH_USER(user);
-		END_WITH_TRANSACTION(transaction);
-		return key;
-	} else {
-		// Not Found!
-		switch( key_type ) {
-		case KEY_RESCUE_CODE:
-			// We cannot regenerate this key!
-			END_WITH_USER(user);
-			END_WITH_TRANSACTION(transaction);
-			return NULL;
-		case KEY_IUK:
-			sqrl_user_try_load_rescue( t, true );
-			break;
-		case KEY_MK:
-		case KEY_ILK:
-		case KEY_PIUK0:
-		case KEY_PIUK1:
-		case KEY_PIUK2:
-		case KEY_PIUK3:
-			sqrl_user_try_load_password( t, true );
-			break;
-		}
-		offset = -1;
-		for( i = 0; i < USER_MAX_KEYS; i++ ) {
-			if( user->lookup[i] == key_type ) {
-				offset = i;
-				break;
-			}
-		}
-		if( offset > -1 ) {
-			key = user->keys->keys[offset];
-			END_WITH_USER(user);
-			END_WITH_TRANSACTION(transaction);
-			return key;
-		}
 	}
-
-DONE:
 	END_WITH_USER(user);
 	END_WITH_TRANSACTION(transaction);
-	return NULL;
+	return key;
 }
 
 bool sqrl_user_has_key( Sqrl_User u, int key_type )
@@ -886,10 +1565,10 @@ DLL_PUBLIC
 uint8_t sqrl_user_get_hint_length( Sqrl_User u )
 {
 	uint8_t retVal = 0;
-	WITH_USER(user,u);
+	WITH_USER_INFO(user,u);
 	if( user == NULL ) return 0;
 	retVal = user->options.hintLength;
-	END_WITH_USER(user);
+	END_WITH_USER_INFO(user);
 	return retVal;
 }
 
@@ -903,10 +1582,10 @@ DLL_PUBLIC
 uint8_t sqrl_user_get_enscrypt_seconds( Sqrl_User u )
 {
 	uint8_t retVal = 0;
-	WITH_USER(user,u);
+	WITH_USER_INFO(user,u);
 	if( user == NULL ) return 0;
 	retVal = user->options.enscryptSeconds;
-	END_WITH_USER(user);
+	END_WITH_USER_INFO(user);
 	return retVal;
 }
 
@@ -920,10 +1599,10 @@ DLL_PUBLIC
 uint16_t sqrl_user_get_timeout_minutes( Sqrl_User u )
 {
 	uint16_t retVal = 0;
-	WITH_USER(user,u);
+	WITH_USER_INFO(user,u);
 	if( user == NULL ) return 0;
 	retVal = user->options.timeoutMinutes;
-	END_WITH_USER(user);
+	END_WITH_USER_INFO(user);
 	return retVal;
 }
 
@@ -936,11 +1615,11 @@ Sets \p Sqrl_User_Options for a \p Sqrl_User
 DLL_PUBLIC
 void sqrl_user_set_hint_length( Sqrl_User u, uint8_t length )
 {
-	WITH_USER(user,u);
+	WITH_USER_INFO(user,u);
 	if( user == NULL ) return;
 	user->options.hintLength = length;
 	BIT_SET( user->flags, USER_FLAG_T1_CHANGED );
-	END_WITH_USER(user);
+	END_WITH_USER_INFO(user);
 }
 
 /**
@@ -952,11 +1631,11 @@ Sets \p Sqrl_User_Options for a \p Sqrl_User
 DLL_PUBLIC
 void sqrl_user_set_enscrypt_seconds( Sqrl_User u, uint8_t seconds )
 {
-	WITH_USER(user,u);
+	WITH_USER_INFO(user,u);
 	if( user == NULL ) return;
 	user->options.enscryptSeconds = seconds;
 	BIT_SET( user->flags, USER_FLAG_T1_CHANGED );
-	END_WITH_USER(user);
+	END_WITH_USER_INFO(user);
 }
 
 /**
@@ -968,20 +1647,21 @@ Sets \p Sqrl_User_Options for a \p Sqrl_User
 DLL_PUBLIC
 void sqrl_user_set_timeout_minutes( Sqrl_User u, uint16_t minutes )
 {
-	WITH_USER(user,u);
+	WITH_USER_INFO(user,u);
 	if( user == NULL ) return;
 	user->options.timeoutMinutes = minutes;
 	BIT_SET( user->flags, USER_FLAG_T1_CHANGED );
-	END_WITH_USER(user);
+	END_WITH_USER_INFO(user);
 }
 
 DLL_PUBLIC
 uint16_t sqrl_user_get_flags( Sqrl_User u )
 {
 	uint16_t retVal = 0;
-	WITH_USER(user,u);
+	WITH_USER_INFO(user,u);
+	if( user == NULL ) return 0;
 	retVal = user->options.flags;
-	END_WITH_USER(user);
+	END_WITH_USER_INFO(user);
 	return retVal;
 }
 
@@ -989,9 +1669,10 @@ DLL_PUBLIC
 uint16_t   sqrl_user_get_edition( Sqrl_User u )
 {
 	uint16_t retVal = 0;
-	WITH_USER(user,u);
+	WITH_USER_INFO(user,u);
+	if( user == NULL ) return 0;
 	retVal = user->edition;
-	END_WITH_USER(user);
+	END_WITH_USER_INFO(user);
 	return retVal;
 }
 
@@ -1006,10 +1687,10 @@ DLL_PUBLIC
 uint16_t sqrl_user_check_flags( Sqrl_User u, uint16_t flags )
 {
 	uint16_t retVal = 0;
-	WITH_USER(user,u);
+	WITH_USER_INFO(user,u);
 	if( user == NULL ) return 0;
 	retVal = user->options.flags & flags;
-	END_WITH_USER(user);
+	END_WITH_USER_INFO(user);
 	return retVal;
 }
 
@@ -1022,13 +1703,13 @@ Helper to set a user's option flags
 DLL_PUBLIC
 void sqrl_user_set_flags( Sqrl_User u, uint16_t flags )
 {
-	WITH_USER(user,u);
+	WITH_USER_INFO(user,u);
 	if( user == NULL ) return;
 	if( (user->options.flags & flags) != flags ) {
 		user->options.flags |= flags;
 		BIT_SET( user->flags, USER_FLAG_T1_CHANGED );
 	}
-	END_WITH_USER(user);
+	END_WITH_USER_INFO(user);
 }
 
 /**
@@ -1040,13 +1721,13 @@ Helper to clear a user's option flags
 DLL_PUBLIC
 void sqrl_user_clear_flags( Sqrl_User u, uint16_t flags )
 {
-	WITH_USER(user,u);
+	WITH_USER_INFO(user,u);
 	if( user == NULL ) return;
-	if( (user->flags & flags) != 0 ) {
+	if( (user->options.flags & flags) != 0 ) {
 		user->options.flags &= ~flags;
 		BIT_SET( user->flags, USER_FLAG_T1_CHANGED );
 	}
-	END_WITH_USER(user);
+	END_WITH_USER_INFO(user);
 }
 
 /**
@@ -1077,10 +1758,10 @@ DLL_PUBLIC
 bool sqrl_user_unique_id( Sqrl_User u, char *buffer )
 {
 	if( !buffer ) return false;
-	WITH_USER(user,u);
+	WITH_USER_INFO(user,u);
 	if( user == NULL ) return false;
 	strncpy( buffer, user->unique_id, SQRL_UNIQUE_ID_LENGTH );
-	END_WITH_USER(user);
+	END_WITH_USER_INFO(user);
 	return true;
 }
 
@@ -1095,7 +1776,7 @@ DLL_PUBLIC
 bool sqrl_user_unique_id_match( Sqrl_User u, const char *unique_id )
 {
 	bool retVal = false;
-	WITH_USER(user,u);
+	WITH_USER_INFO(user,u);
 	if( user == NULL ) return false;
 	if( unique_id == NULL ) {
 		if( user->unique_id[0] == 0 ) {
@@ -1106,7 +1787,7 @@ bool sqrl_user_unique_id_match( Sqrl_User u, const char *unique_id )
 			retVal = true;
 		}
 	}
-	END_WITH_USER(user);
+	END_WITH_USER_INFO(user);
 	return retVal;
 }
 
@@ -68,19 +68,32 @@ bool sul_block_2( struct Sqrl_Transaction *transaction, Sqrl_Block *block, struc
 	sqrl_block_seek( block, 21 );
 	sctx.count = sqrl_block_read_int32( block );
 	sctx.flags = SQRL_DECRYPT | SQRL_ITERATIONS;
-	if( sqrl_crypt_enscrypt( 
+	// Carries on from a cancelled attempt at this block
+	struct Sqrl_Enscrypt_State *state = sqrl_user_checkpoint_take( transaction->user );
+	bool resumed = sqrl_enscrypt_state_continues( state, sctx.salt, 16,
+			sctx.nFactor, SQRL_ITERATIONS, sctx.count );
+	uint32_t count = sqrl_crypt_enscrypt_resume( 
 			&sctx, 
+			state,
 			key, 
 			rc, 
 			SQRL_RESCUE_CODE_LENGTH, 
 			sqrl_user_enscrypt_callback, 
-			&cbdata ) > 0 ) {
-		if( sqrl_crypt_gcm( &sctx, key )) {
-			uint8_t *iuk = sqrl_user_new_key( transaction->user, KEY_IUK );
-			memcpy( iuk, sctx.plain_text, SQRL_KEY_SIZE );
-			retVal = true;
-			goto DONE;
-		}
+			&cbdata );
+	bool opened = count > 0 && sqrl_crypt_gcm( &sctx, key );
+	if( !opened && count > 0 && resumed ) {
+		// That attempt may have been with another rescue code
+		sqrl_enscrypt_state_reset( state );
+		count = sqrl_crypt_enscrypt_resume( &sctx, state, key, rc, SQRL_RESCUE_CODE_LENGTH,
+				sqrl_user_enscrypt_callback, &cbdata );
+		opened = count > 0 && sqrl_crypt_gcm( &sctx, key );
+	}
+	sqrl_user_checkpoint_put( transaction->user, state );
+	if( opened ) {
+		uint8_t *iuk = sqrl_user_new_key( transaction->user, KEY_IUK );
+		memcpy( iuk, sctx.plain_text, SQRL_KEY_SIZE );
+		retVal = true;
+		goto DONE;
 	}
 
 ERROR:
@@ -92,46 +105,62 @@ DONE:
 
 }
 
-bool sus_block_2( struct Sqrl_Transaction *transaction, Sqrl_Storage storage, Sqrl_Block *block, struct sqrl_user_callback_data cbdata )
+// Checks that block 2 can be saved, and sets up its header and \p sctx.
+static bool sus_block_2_begin( struct Sqrl_Transaction *transaction, Sqrl_Crypt_Context *sctx, Sqrl_Block *block )
 {
-	SQRL_CAST_USER(user,transaction->user);
-	bool retVal = true;
-	Sqrl_Crypt_Context sctx;
 	if( ! sqrl_user_has_key( transaction->user, KEY_IUK )
 		|| ! sqrl_user_has_key( transaction->user, KEY_RESCUE_CODE )) {
 		return false;
 	}
-	
-	if( !su_init_t2( transaction, &sctx, block, true )) {
-		goto ERROR;
-	}
+	return su_init_t2( transaction, sctx, block, true );
+}
 
-	uint8_t *key = user->keys->scratch + sctx.text_len;
-	char *rc = (char*)sqrl_user_key( transaction, KEY_RESCUE_CODE );
-	sqrl_crypt_enscrypt( &sctx, key, rc, SQRL_RESCUE_CODE_LENGTH, sqrl_user_enscrypt_callback, &cbdata );
+// Encrypts the IUK into block 2 with the rescue code's EnScrypt \p key.
+static bool sus_block_2_finish( struct Sqrl_Transaction *transaction, Sqrl_Crypt_Context *sctx, Sqrl_Block *block, uint8_t *key )
+{
+	SQRL_CAST_USER(user,transaction->user);
 	sqrl_block_seek( block, 21 );
-	sqrl_block_write_int32( block, sctx.count );
+	sqrl_block_write_int32( block, sctx->count );
 
 	// Cipher Text
-	sctx.flags = SQRL_ENCRYPT | SQRL_ITERATIONS;
+	sctx->flags = SQRL_ENCRYPT | SQRL_ITERATIONS;
 	uint8_t *iuk = sqrl_user_key( transaction, KEY_IUK );
-	memcpy( sctx.plain_text, iuk, sctx.text_len );
-	if( !sqrl_crypt_gcm( &sctx, key )) {
-		goto ERROR;
+	memcpy( sctx->plain_text, iuk, sctx->text_len );
+	if( !sqrl_crypt_gcm( sctx, key )) {
+		return false;
 	}
 	// Save unique id
 	UT_string *str;
 	utstring_new( str );
-	sqrl_b64u_encode( str, sctx.cipher_text, SQRL_KEY_SIZE );
-	strcpy( user->unique_id, utstring_body(str));
+	sqrl_b64u_encode( str, sctx->cipher_text, SQRL_KEY_SIZE );
+	sqrl_user_set_unique_id( user, utstring_body(str));
 	utstring_free( str );
+	return true;
+}
 
-	goto DONE;
+bool sus_block_2( struct Sqrl_Transaction *transaction, Sqrl_Storage storage, Sqrl_Block *block, struct sqrl_user_callback_data cbdata )
+{
+	SQRL_CAST_USER(user,transaction->user);
+	bool retVal = true;
+	Sqrl_Crypt_Context sctx;
+	if( !sus_block_2_begin( transaction, &sctx, block )) {
+		return false;
+	}
 
-ERROR:
-	retVal = false;
+	uint8_t *key = user->keys->scratch + sctx.text_len;
+	char *rc = (char*)sqrl_user_key( transaction, KEY_RESCUE_CODE );
+	// Use the EnScrypt started when the rescue code was made, if there is one
+	if( sqrl_user_kdf_take( transaction->user, SQRL_BLOCK_RESCUE, rc, SQRL_RESCUE_CODE_LENGTH,
+			sctx.count, sctx.salt, key, &sctx.count )) {
+		sctx.flags = SQRL_ENCRYPT | SQRL_ITERATIONS;
+		sqrl_user_enscrypt_callback( 100, &cbdata );
+	} else {
+		struct Sqrl_Enscrypt_State *state = sqrl_user_checkpoint_take( transaction->user );
+		sqrl_crypt_enscrypt_resume( &sctx, state, key, rc, SQRL_RESCUE_CODE_LENGTH, sqrl_user_enscrypt_callback, &cbdata );
+		sqrl_user_checkpoint_put( transaction->user, state );
+	}
+	retVal = sus_block_2_finish( transaction, &sctx, block, key );
 
-DONE:
 	sodium_memzero( user->keys->scratch, sctx.text_len + SQRL_KEY_SIZE );
 	return retVal;
 }
@@ -310,13 +339,13 @@ DONE:
 	return retVal;
 }
 
-bool sus_block_1( struct Sqrl_Transaction *transaction, Sqrl_Block *block, struct sqrl_user_callback_data cbdata )
+bool sus_block_1( struct Sqrl_Transaction *transaction, Sqrl_Block *block, enscrypt_progress_fn cb_ptr, void *cb_data )
 {
 	WITH_USER(user,transaction->user);
 	if( !user ) return false;
 	bool retVal = true;
 	Sqrl_Crypt_Context sctx;
-	if( !sqrl_client_require_password( cbdata.transaction )) {
+	if( !sqrl_client_require_password( (Sqrl_Transaction)transaction )) {
 		END_WITH_USER(user);
 		return false;
 	}
@@ -368,7 +397,13 @@ bool sus_block_1( struct Sqrl_Transaction *transaction, Sqrl_Block *block, struc
 	uint8_t *key = sctx.plain_text + sctx.text_len;
 	sctx.flags = SQRL_ENCRYPT | SQRL_MILLIS;
 	sctx.count = user->options.enscryptSeconds * SQRL_MILLIS_PER_SECOND;
-	sqrl_crypt_enscrypt( &sctx, key, user->keys->password, user->keys->password_len, sqrl_user_enscrypt_callback, &cbdata );
+	// Use the EnScrypt started when the password was entered, if there is one
+	if( sqrl_user_kdf_take( transaction->user, SQRL_BLOCK_USER, user->keys->password,
+			user->keys->password_len, sctx.count, sctx.salt, key, &sctx.count )) {
+		if( cb_ptr ) (*cb_ptr)( 100, cb_data );
+	} else {
+		sqrl_crypt_enscrypt( &sctx, key, user->keys->password, user->keys->password_len, cb_ptr, cb_data );
+	}
 	sqrl_block_seek( block, 35 );
 	sqrl_block_write_int32( block, sctx.count );
 
@@ -416,6 +451,146 @@ void sqrl_user_save_callback_data( struct sqrl_user_callback_data *cbdata )
 	END_WITH_USER(user);
 }
 
+/*
+Saving a new or rekeyed identity runs two EnScrypt chains, one for the
+password (block 1) and one for the rescue code (block 2).  They don't
+depend on each other, so with more than one CPU the rescue code's chain
+runs on its own thread while this one does block 1, and the save takes
+as long as the longer chain rather than both.  Both chains are timed, so
+on a single CPU they still run one after the other; side by side, each
+would get only half its iterations.
+*/
+struct sus_parallel {
+	Sqrl_Crypt_Context sctx;
+	struct sqrl_user_callback_data cbdata;
+	uint8_t *key;
+	char *rc;
+	struct Sqrl_Enscrypt_State *checkpoint;
+	int millis[2];
+	int percent[2];
+	int lastProgress;
+	int cancelled;
+	int done;
+	uint32_t count;
+};
+
+// Reports progress over both chains.  Both started together, so the
+// further along in milliseconds is how far along the save is.
+static int sus_parallel_report( struct sus_parallel *job )
+{
+	double elapsed[2], total;
+	int i, progress;
+	if( SQRL_ATOMIC_LOAD( &job->cancelled )) return 0;
+	for( i = 0; i < 2; i++ ) {
+		elapsed[i] = SQRL_ATOMIC_LOAD( &job->percent[i] ) * (double)job->millis[i];
+	}
+	total = job->millis[0] > job->millis[1] ? job->millis[0] : job->millis[1];
+	progress = (int)((elapsed[0] > elapsed[1] ? elapsed[0] : elapsed[1]) / total);
+	if( progress != job->lastProgress ) {
+		job->lastProgress = progress;
+		if( 0 == sqrl_user_enscrypt_callback( progress, &job->cbdata )) {
+			SQRL_ATOMIC_STORE( &job->cancelled, 1 );
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int sus_password_progress( int percent, void *data )
+{
+	struct sus_parallel *job = (struct sus_parallel*)data;
+	SQRL_ATOMIC_STORE( &job->percent[0], percent );
+	return sus_parallel_report( job );
+}
+
+// Called on the rescue code's thread; only this thread talks to the client.
+static int sus_rescue_progress( int percent, void *data )
+{
+	struct sus_parallel *job = (struct sus_parallel*)data;
+	SQRL_ATOMIC_STORE( &job->percent[1], percent );
+	return !SQRL_ATOMIC_LOAD( &job->cancelled );
+}
+
+static SQRL_THREAD_FUNCTION_RETURN_TYPE sus_rescue_thread( SQRL_THREAD_FUNCTION_INPUT_TYPE input )
+{
+	struct sus_parallel *job = (struct sus_parallel*)input;
+	job->count = sqrl_crypt_enscrypt_resume( &job->sctx, job->checkpoint, job->key, job->rc, 
+		SQRL_RESCUE_CODE_LENGTH, sus_rescue_progress, job );
+	SQRL_ATOMIC_STORE( &job->done, 1 );
+	SQRL_THREAD_LEAVE;
+}
+
+// Saves blocks 1 and 2, with their EnScrypt chains running side by side.
+// Returns false if block 2 still needs saving, when its thread can't start.
+static bool sus_blocks_1_2( struct Sqrl_Transaction *transaction, struct Sqrl_User *user, struct sqrl_user_callback_data cbdata )
+{
+	struct sus_parallel job;
+	Sqrl_Block block;
+	SqrlThread thread;
+	bool rescue = false;
+
+	memset( &job, 0, sizeof( struct sus_parallel ));
+	job.cbdata = cbdata;
+	job.cbdata.adder = 0;
+	job.cbdata.multiplier = 1;
+	job.millis[0] = user->options.enscryptSeconds * SQRL_MILLIS_PER_SECOND;
+	job.millis[1] = SQRL_RESCUE_ENSCRYPT_SECONDS * SQRL_MILLIS_PER_SECOND;
+	if( job.millis[0] < 1 ) job.millis[0] = 1;
+	job.lastProgress = -1;
+
+	// The rescue thread gets its own copy of the code, and its own key
+	Sqrl_Block rescueBlock;
+	sqrl_block_clear( &rescueBlock );
+	// A rescue EnScrypt already started in the background does the same job
+	bool speculative = sqrl_user_kdf_pending( (Sqrl_User)user, SQRL_BLOCK_RESCUE );
+	uint8_t *mem = sqrl_scratch_push( SQRL_KEY_SIZE + SQRL_RESCUE_CODE_LENGTH );
+	if( !speculative && mem && sus_block_2_begin( transaction, &job.sctx, &rescueBlock )) {
+		job.key = mem;
+		job.rc = (char*)mem + SQRL_KEY_SIZE;
+		memcpy( job.rc, sqrl_user_key( (Sqrl_Transaction)transaction, KEY_RESCUE_CODE ), SQRL_RESCUE_CODE_LENGTH );
+		job.checkpoint = sqrl_user_checkpoint_take( (Sqrl_User)user );
+		thread = sqrl_thread_create( sus_rescue_thread, (SQRL_THREAD_FUNCTION_INPUT_TYPE)&job );
+		if( thread ) {
+			rescue = true;
+		} else {
+			sqrl_user_checkpoint_put( (Sqrl_User)user, job.checkpoint );
+			sqrl_block_free( &rescueBlock );
+		}
+	}
+	if( !rescue ) {
+		// Only block 1's chain is timed here
+		job.millis[1] = 0;
+	}
+
+	sqrl_block_clear( &block );
+	if( sus_block_1( transaction, &block, sus_password_progress, &job )) {
+		sqrl_storage_block_put( user->storage, &block );
+	}
+	sqrl_block_free( &block );
+
+	if( rescue ) {
+		while( !SQRL_ATOMIC_LOAD( &job.done )) {
+			sus_parallel_report( &job );
+			sqrl_sleep( 10 );
+		}
+		sus_parallel_report( &job );
+		sqrl_thread_join( thread );
+		sqrl_user_checkpoint_put( (Sqrl_User)user, job.checkpoint );
+		if( job.count > 0 && 
+			sus_block_2_finish( transaction, &job.sctx, &rescueBlock, job.key )) {
+			sqrl_storage_block_put( user->storage, &rescueBlock );
+		}
+		sodium_memzero( user->keys->scratch, job.sctx.text_len );
+	} else if( speculative ) {
+		if( sus_block_2( transaction, user->storage, &rescueBlock, job.cbdata )) {
+			sqrl_storage_block_put( user->storage, &rescueBlock );
+		}
+	}
+	sqrl_block_free( &rescueBlock );
+	sqrl_scratch_pop( mem );
+	return rescue || speculative;
+}
+
 bool sqrl_user_update_storage( Sqrl_Transaction t ) 
 {
 	WITH_TRANSACTION(transaction,t);
@@ -437,17 +612,28 @@ bool sqrl_user_update_storage( Sqrl_Transaction t )
 	sqrl_block_clear( &block );
 	bool retVal = true;
 
-	if( (user->flags & USER_FLAG_T1_CHANGED) == USER_FLAG_T1_CHANGED ||
-		! sqrl_storage_block_exists( user->storage, SQRL_BLOCK_USER )) 
+	bool saveT1 = (user->flags & USER_FLAG_T1_CHANGED) == USER_FLAG_T1_CHANGED ||
+		! sqrl_storage_block_exists( user->storage, SQRL_BLOCK_USER );
+	bool saveT2 = (user->flags & USER_FLAG_T2_CHANGED) == USER_FLAG_T2_CHANGED ||
+		! sqrl_storage_block_exists( user->storage, SQRL_BLOCK_RESCUE );
+
+	if( sqrl_cpu_count() < 2 ) {
+		sqrl_user_kdf_settle( (Sqrl_User)user );
+	}
+	if( saveT1 && saveT2 && sqrl_cpu_count() > 1 ) {
+		saveT2 = !sus_blocks_1_2( transaction, user, cbdata );
+		saveT1 = false;
+	}
+
+	if( saveT1 ) 
 	{
-		if( sus_block_1( transaction, &block, cbdata )) {
+		if( sus_block_1( transaction, &block, sqrl_user_enscrypt_callback, &cbdata )) {
 			sqrl_storage_block_put( user->storage, &block );
 		}
 		sqrl_block_free( &block );
 	}
 
-	if( (user->flags & USER_FLAG_T2_CHANGED) == USER_FLAG_T2_CHANGED ||
-		! sqrl_storage_block_exists( user->storage, SQRL_BLOCK_RESCUE ))
+	if( saveT2 )
 	{
 		cbdata.adder = cbdata.t1;
 		if( cbdata.total > cbdata.t2 ) {
@@ -479,7 +665,9 @@ bool sqrl_user_update_storage( Sqrl_Transaction t )
 static void _suc_load_unique_id( struct Sqrl_User *user )
 {
 	if( !user ) return;
-	sqrl_storage_unique_id( user->storage, user->unique_id );
+	char unique_id[SQRL_UNIQUE_ID_LENGTH+1];
+	sqrl_storage_unique_id( user->storage, unique_id );
+	sqrl_user_set_unique_id( user, unique_id );
 }
 
 Sqrl_User sqrl_user_create_from_file( const char *filename )
@@ -29,7 +29,11 @@ int sqrl_init()
 {
 	if( !sqrl_is_initialized ) {
 		sqrl_is_initialized = true;
-		SQRL_GLOBAL_MUTICES.user = sqrl_mutex_create();
+		int i;
+		for( i = 0; i < SQRL_USER_INDEX_STRIPES; i++ ) {
+			SQRL_GLOBAL_MUTICES.user[i] = sqrl_mutex_create();
+			SQRL_GLOBAL_MUTICES.unlock[i] = sqrl_cond_create();
+		}
 		SQRL_GLOBAL_MUTICES.site = sqrl_mutex_create();
 		SQRL_GLOBAL_MUTICES.transaction = sqrl_mutex_create();
 		#ifdef DEBUG